@@ -16,9 +16,9 @@ BuildRequires:  cmake
 BuildRequires:  gfal2-devel >= 2.9.1
 BuildRequires:  json-c-devel
 %if %{?fedora}%{!?fedora:0} >= 10 || %{?rhel}%{!?rhel:0} >= 6
-BuildRequires:  libcurl-devel
+BuildRequires:  libcurl-devel >= 7.61
 %else
-BuildRequires:  curl-devel
+BuildRequires:  curl-devel >= 7.61
 %endif
 BuildRequires:  openssl-devel
 
@@ -17,7 +17,15 @@
 // Plugin entry point
 
 #include "gfal_dropbox.h"
+#include "gfal_dropbox_batch.h"
+#include "gfal_dropbox_cache.h"
+#include "gfal_dropbox_hedge.h"
+#include "gfal_dropbox_index.h"
+#include "gfal_dropbox_metrics.h"
+#include "gfal_dropbox_staging.h"
+#include "gfal_dropbox_stream.h"
 #include <gfal_plugins_api.h>
+#include <logger/gfal_logger.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,6 +56,8 @@ static gboolean gfal2_dropbox_check_url(plugin_handle plugin_data,
         case GFAL_PLUGIN_OPENDIR:
         case GFAL_PLUGIN_OPEN:
         case GFAL_PLUGIN_UNLINK:
+        case GFAL_PLUGIN_GETXATTR:
+        case GFAL_PLUGIN_LISTXATTR:
             return strncmp(url, "dropbox:", 8) == 0;
         default:
             return FALSE;
@@ -59,36 +69,58 @@ static gboolean gfal2_dropbox_check_url(plugin_handle plugin_data,
 static void gfal2_dropbox_delete_data(plugin_handle plugin_data)
 {
     DropboxHandle* dropbox = (DropboxHandle*)(plugin_data);
-    curl_easy_cleanup(dropbox->curl_handle);
+    // Written one last time, before anything it reports on goes
+    gfal2_dropbox_metrics_free(dropbox->metrics);
+    gfal2_dropbox_engine_free(dropbox->engine);
+    gfal2_dropbox_share_release(dropbox->share);
+    gfal2_dropbox_trace_close(dropbox->trace);
+    gfal2_dropbox_buffer_pool_free(dropbox->buffers);
+    gfal2_dropbox_batch_free(dropbox->stat_batch);
+    gfal2_dropbox_index_close(dropbox->index);
+    gfal2_dropbox_cache_free(dropbox->cache);
+    gfal2_dropbox_hedge_free(dropbox->hedge);
+    g_free(dropbox->staging_dir);
+    g_free(dropbox->journal_dir);
+    g_free(dropbox->api_url);
+    g_free(dropbox->content_url);
     free(dropbox);
 }
 
 
+// Length of the line, without the trailing new line characters
+static int gfal2_dropbox_trim(const char *data, size_t size)
+{
+    while (size > 0 && (data[size - 1] == '\n' || data[size - 1] == '\r'))
+        --size;
+    return (int)size;
+}
+
+
 // Logging callback
+// Only installed when the debug level is enabled
 static int gfal2_dropbox_debug_callback(CURL *handle, curl_infotype type,
         char *data, size_t size, void *userptr)
 {
-    char msg_fmt[64];
+    DropboxHandle* dropbox = (DropboxHandle*)userptr;
     switch (type) {
         case CURLINFO_TEXT:
-            snprintf(msg_fmt, sizeof(msg_fmt), "INFO: %%.%zds", size - 1); // Mute \n
-            gfal2_log(G_LOG_LEVEL_DEBUG, msg_fmt, data);
+            gfal2_log(G_LOG_LEVEL_DEBUG, "INFO: %.*s", gfal2_dropbox_trim(data, size), data);
             break;
         case CURLINFO_HEADER_IN:
-            snprintf(msg_fmt, sizeof(msg_fmt), "HEADER IN: %%.%zds", size - 2); // Mute \n\r
-            gfal2_log(G_LOG_LEVEL_DEBUG, msg_fmt, data);
+            gfal2_log(G_LOG_LEVEL_DEBUG, "HEADER IN: %.*s", gfal2_dropbox_trim(data, size), data);
             break;
         case CURLINFO_HEADER_OUT:
-            snprintf(msg_fmt, sizeof(msg_fmt), "HEADER OUT: %%.%zds", size - 2); // Mute \n\r
-            gfal2_log(G_LOG_LEVEL_DEBUG, msg_fmt, data);
+            gfal2_log(G_LOG_LEVEL_DEBUG, "HEADER OUT: %.*s", gfal2_dropbox_trim(data, size), data);
             break;
         case CURLINFO_DATA_IN:
-            snprintf(msg_fmt, sizeof(msg_fmt), "DATA IN: %%.%zds", size);
-            gfal2_log(G_LOG_LEVEL_DEBUG, msg_fmt, data);
+            if (dropbox->log_payload_bytes == 0)
+                break;
+            gfal2_log(G_LOG_LEVEL_DEBUG, "DATA IN: %.*s", (int)MIN(size, dropbox->log_payload_bytes), data);
             break;
         case CURLINFO_DATA_OUT:
-            snprintf(msg_fmt, sizeof(msg_fmt), "DATA OUT: %%.%zds", size);
-            gfal2_log(G_LOG_LEVEL_DEBUG, msg_fmt, data);
+            if (dropbox->log_payload_bytes == 0)
+                break;
+            gfal2_log(G_LOG_LEVEL_DEBUG, "DATA OUT: %.*s", (int)MIN(size, dropbox->log_payload_bytes), data);
             break;
         default:
             break;
@@ -98,10 +130,17 @@ static int gfal2_dropbox_debug_callback(CURL *handle, curl_infotype type,
 
 
 // Set logging
-static void gfal2_dropbox_set_logging(DropboxHandle* dropbox)
+// Called for each handle used by the engine, so changes on the log level are picked up
+static void gfal2_dropbox_set_logging(CURL* curl_handle, void* user_data)
 {
-    curl_easy_setopt(dropbox->curl_handle, CURLOPT_VERBOSE, 1);
-    curl_easy_setopt(dropbox->curl_handle, CURLOPT_DEBUGFUNCTION, gfal2_dropbox_debug_callback);
+    DropboxHandle* dropbox = (DropboxHandle*)user_data;
+
+    if (gfal2_log_get_level() < G_LOG_LEVEL_DEBUG)
+        return;
+
+    curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1);
+    curl_easy_setopt(curl_handle, CURLOPT_DEBUGFUNCTION, gfal2_dropbox_debug_callback);
+    curl_easy_setopt(curl_handle, CURLOPT_DEBUGDATA, dropbox);
 }
 
 // GFAL2 will look for this symbol to register the plugin
@@ -111,10 +150,108 @@ gfal_plugin_interface gfal_plugin_init(gfal2_context_t handle, GError** err)
     memset(&dropbox_plugin, 0, sizeof(gfal_plugin_interface));
 
     DropboxHandle* dropbox = calloc(1, sizeof(DropboxHandle));
-    dropbox->curl_handle = curl_easy_init();
     dropbox->gfal2_context = handle;
+    // Request and response bodies are only logged if asked for, and up to this size per buffer
+    dropbox->log_payload_bytes = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "LOG_PAYLOAD_BYTES", 0);
+    // Downloads are paused when the reader is this much behind
+    dropbox->stream_buffer_size = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "STREAM_BUFFER_SIZE",
+        DROPBOX_DEFAULT_STREAM_BUFFER_SIZE);
+    // Uploads are sent in chunks of this size, staged locally until acknowledged. 0 disables staging
+    gint upload_chunk_size = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "UPLOAD_CHUNK_SIZE", 0);
+    dropbox->upload_chunk_size = upload_chunk_size > 0 ?
+        ((size_t)upload_chunk_size + DROPBOX_UPLOAD_CHUNK_ALIGNMENT - 1) / DROPBOX_UPLOAD_CHUNK_ALIGNMENT * DROPBOX_UPLOAD_CHUNK_ALIGNMENT : 0;
+    if (dropbox->upload_chunk_size > DROPBOX_UPLOAD_CHUNK_MAX) {
+        gfal2_log(G_LOG_LEVEL_WARNING, "UPLOAD_CHUNK_SIZE is above what Dropbox takes per request, using %d bytes",
+            DROPBOX_UPLOAD_CHUNK_MAX);
+        dropbox->upload_chunk_size = DROPBOX_UPLOAD_CHUNK_MAX;
+    }
+    dropbox->staging_memory = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "STAGING_MEMORY",
+        DROPBOX_DEFAULT_STAGING_MEMORY);
+    dropbox->staging_dir = gfal2_get_opt_string_with_default(handle, "DROPBOX", "STAGING_DIR", g_get_tmp_dir());
+    dropbox->upload_retries = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "UPLOAD_RETRIES", 3);
+    dropbox->journal_dir = gfal2_get_opt_string(handle, "DROPBOX", "JOURNAL_DIR", NULL);
+    dropbox->skip_identical = gfal2_get_opt_boolean_with_default(handle, "DROPBOX", "SKIP_IDENTICAL", FALSE);
+    // Stalled or broken downloads are resumed from where they stopped
+    dropbox->low_speed_limit = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "LOW_SPEED_LIMIT", 1024);
+    dropbox->low_speed_time = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "LOW_SPEED_TIME", 30);
+    dropbox->read_retries = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "READ_RETRIES", 3);
+    // Transfers report their progress this often, in seconds
+    dropbox->perf_marker_interval = (gint64)gfal2_get_opt_integer_with_default(handle, "DROPBOX",
+        "PERF_MARKER_INTERVAL", 5) * G_USEC_PER_SEC;
+    // Namespace requests get as long as gfal2 gives namespace operations, unless set otherwise
+    dropbox->connect_timeout = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "CONNECT_TIMEOUT", 30);
+    dropbox->operation_timeout = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "OPERATION_TIMEOUT",
+        gfal2_get_opt_integer_with_default(handle, CORE_CONFIG_GROUP, CORE_CONFIG_NAMESPACE_TIMEOUT, 300));
+    // Past this many stats in the same folder within the window, the folder is listed instead
+    // Off by default, as the listing answers for a while, missing what others change meanwhile
+    dropbox->stat_batch = gfal2_dropbox_batch_new(
+        gfal2_get_opt_integer_with_default(handle, "DROPBOX", "STAT_BATCH_THRESHOLD", 0),
+        gfal2_get_opt_integer_with_default(handle, "DROPBOX", "STAT_BATCH_WINDOW", 1000),
+        gfal2_get_opt_integer_with_default(handle, "DROPBOX", "STAT_BATCH_TTL", 5));
+    // Metadata requests slower than most are sent twice, within a budget
+    if (gfal2_get_opt_boolean_with_default(handle, "DROPBOX", "HEDGE", FALSE)) {
+        dropbox->hedge = gfal2_dropbox_hedge_new(
+            gfal2_get_opt_integer_with_default(handle, "DROPBOX", "HEDGE_PERCENTILE", 95),
+            gfal2_get_opt_integer_with_default(handle, "DROPBOX", "HEDGE_DELAY", 100),
+            gfal2_get_opt_integer_with_default(handle, "DROPBOX", "HEDGE_BUDGET", 5));
+    }
+    dropbox->api_url = gfal2_get_opt_string_with_default(handle, "DROPBOX", "API_URL", DROPBOX_DEFAULT_API_URL);
+    dropbox->content_url = gfal2_get_opt_string_with_default(handle, "DROPBOX", "CONTENT_URL", DROPBOX_DEFAULT_CONTENT_URL);
+
+    // Concurrent requests are multiplexed over this many connections per host
+    long max_host_connections = gfal2_get_opt_integer_with_default(handle, "DROPBOX", "MAX_HOST_CONNECTIONS", 2);
+    dropbox->share = gfal2_dropbox_share_acquire();
+    dropbox->engine = gfal2_dropbox_engine_new(max_host_connections, dropbox->share,
+        gfal2_dropbox_set_logging, dropbox);
+    dropbox->buffers = gfal2_dropbox_buffer_pool_new();
 
-    gfal2_dropbox_set_logging(dropbox);
+    // Resolve and connect to the hosts right away, so the first request does not wait for it
+    if (gfal2_get_opt_boolean_with_default(handle, "DROPBOX", "PRECONNECT", FALSE)) {
+        gfal2_dropbox_engine_preconnect(dropbox->engine, dropbox->api_url);
+        if (strcmp(dropbox->api_url, dropbox->content_url) != 0)
+            gfal2_dropbox_engine_preconnect(dropbox->engine, dropbox->content_url);
+    }
+
+    // Optional metadata index, kept across processes
+    gchar* index_file = gfal2_get_opt_string(handle, "DROPBOX", "INDEX_FILE", NULL);
+    if (index_file) {
+        GError* tmp_err = NULL;
+        dropbox->index = gfal2_dropbox_index_open(index_file,
+            gfal2_get_opt_integer_with_default(handle, "DROPBOX", "INDEX_SLOTS", DROPBOX_DEFAULT_INDEX_SLOTS),
+            gfal2_get_opt_integer_with_default(handle, "DROPBOX", "INDEX_MAX_AGE", 60),
+            &tmp_err);
+        if (tmp_err) {
+            gfal2_log(G_LOG_LEVEL_WARNING, "Metadata index disabled: %s", tmp_err->message);
+            g_error_free(tmp_err);
+        }
+        g_free(index_file);
+    }
+
+    // Optional download cache, shared with the other processes using the same directory
+    gchar* cache_dir = gfal2_get_opt_string(handle, "DROPBOX", "CACHE_DIR", NULL);
+    if (cache_dir && cache_dir[0] != '\0') {
+        dropbox->cache = gfal2_dropbox_cache_new(cache_dir,
+            gfal2_get_opt_integer_with_default(handle, "DROPBOX", "CACHE_SIZE", DROPBOX_DEFAULT_CACHE_SIZE));
+    }
+    g_free(cache_dir);
+
+    // Metrics, optionally written into a file every so often
+    gchar* metrics_file = gfal2_get_opt_string(handle, "DROPBOX", "METRICS_FILE", NULL);
+    dropbox->metrics = gfal2_dropbox_metrics_new(dropbox, metrics_file,
+        gfal2_get_opt_integer_with_default(handle, "DROPBOX", "METRICS_INTERVAL", 60));
+    g_free(metrics_file);
+
+    // Optional per request trace
+    gchar* trace_file = gfal2_get_opt_string(handle, "DROPBOX", "TRACE_FILE", NULL);
+    if (trace_file) {
+        GError* tmp_err = NULL;
+        dropbox->trace = gfal2_dropbox_trace_open(trace_file, &tmp_err);
+        if (tmp_err) {
+            gfal2_log(G_LOG_LEVEL_WARNING, "Tracing disabled: %s", tmp_err->message);
+            g_error_free(tmp_err);
+        }
+        g_free(trace_file);
+    }
 
     dropbox_plugin.plugin_data = dropbox;
     dropbox_plugin.plugin_delete = gfal2_dropbox_delete_data;
@@ -133,6 +270,8 @@ gfal_plugin_interface gfal_plugin_init(gfal2_context_t handle, GError** err)
     dropbox_plugin.rmdirG = gfal2_dropbox_rmdir;
     dropbox_plugin.unlinkG = gfal2_dropbox_unlink;
     dropbox_plugin.renameG = gfal2_dropbox_rename;
+    dropbox_plugin.getxattrG = gfal2_dropbox_getxattr;
+    dropbox_plugin.listxattrG = gfal2_dropbox_listxattr;
 
     dropbox_plugin.openG = gfal2_dropbox_fopen;
     dropbox_plugin.closeG = gfal2_dropbox_fclose;
@@ -140,5 +279,8 @@ gfal_plugin_interface gfal_plugin_init(gfal2_context_t handle, GError** err)
     dropbox_plugin.writeG = gfal2_dropbox_fwrite;
     dropbox_plugin.lseekG = gfal2_dropbox_fseek;
 
+    dropbox_plugin.check_plugin_url_transfer = gfal2_dropbox_check_url_transfer;
+    dropbox_plugin.copy_file = gfal2_dropbox_copy_file;
+
     return dropbox_plugin;
 }
@@ -20,17 +20,62 @@
 #include <curl/curl.h>
 #include <gfal_api.h>
 #include <gfal_plugins_api.h>
+#include "gfal_dropbox_buffer.h"
+#include "gfal_dropbox_engine.h"
+#include "gfal_dropbox_share.h"
+#include "gfal_dropbox_trace.h"
 
 
 /*
  * Internal plugin context
  */
 struct DropboxHandle {
-    CURL* curl_handle;
+    DropboxEngine* engine;
+    // DNS cache and TLS sessions, shared with the other handles in the process
+    CURLSH* share;
+    DropboxTrace* trace;
+    DropboxBufferPool* buffers;
     gfal2_context_t gfal2_context;
+    size_t log_payload_bytes;
+    size_t stream_buffer_size;
+    // Upload chunking and retries
+    size_t upload_chunk_size;
+    size_t staging_memory;
+    char* staging_dir;
+    int upload_retries;
+    // Transfers slower than low_speed_limit bytes/s for low_speed_time seconds are aborted,
+    // and restarted if they are downloads
+    long low_speed_limit, low_speed_time;
+    // In seconds, to connect, and for a namespace request to complete
+    long connect_timeout, operation_timeout;
+    int read_retries;
+    // Where open upload sessions are recorded, so they can be resumed. NULL if disabled
+    char* journal_dir;
+    // Copies from local files leave destinations with the same content alone
+    gboolean skip_identical;
+    // Bursts of stats in a folder are answered by listing it
+    struct DropboxStatBatch* stat_batch;
+    // Performance markers are sent this often, in microseconds. 0 disables them
+    gint64 perf_marker_interval;
+    // Files open for reading or writing, and copies in progress
+    gint active_transfers;
+    // Duplicates of slow metadata requests. NULL if disabled
+    struct DropboxHedge* hedge;
+    // Metadata shared with the other processes on the node. NULL if disabled
+    struct DropboxIndex* index;
+    // Files read, kept on disk by content. NULL if disabled
+    struct DropboxCache* cache;
+    // Counters of what the plugin did
+    struct DropboxMetrics* metrics;
+    // Base URLs for the API and content hosts
+    char* api_url;
+    char* content_url;
 };
 typedef struct DropboxHandle DropboxHandle;
 
+#define DROPBOX_DEFAULT_API_URL "https://api.dropboxapi.com"
+#define DROPBOX_DEFAULT_CONTENT_URL "https://content.dropboxapi.com"
+
 /*
  * Domain
  */
@@ -57,6 +102,39 @@ int gfal2_dropbox_mkdir(plugin_handle, const char*, mode_t, gboolean, GError**);
 int gfal2_dropbox_rmdir(plugin_handle, const char*, GError**);
 int gfal2_dropbox_unlink(plugin_handle, const char*, GError**);
 int gfal2_dropbox_rename(plugin_handle, const char*, const char*, GError**);
+ssize_t gfal2_dropbox_getxattr(plugin_handle, const char*, const char*, void*, size_t, GError**);
+ssize_t gfal2_dropbox_listxattr(plugin_handle, const char*, char*, size_t, GError**);
+
+// Forgets what is cached about path, its parent and its descendants
+// To be called whenever the namespace is modified
+void gfal2_dropbox_forget(DropboxHandle* dropbox, const char* path);
+
+// Most paths a single create_folder_batch takes
+#define DROPBOX_MKDIR_BATCH_SIZE 10000
+
+// Creates the folders of all urls, with their parents, in as few requests as possible
+// Folders already there are fine, anything else in the way is EEXIST
+// errors must have room for nbfiles entries, each is set if that url failed
+// Returns 0 if all of them succeeded, -1 otherwise
+int gfal2_dropbox_mkdir_bulk(plugin_handle plugin_data, int nbfiles, const char* const* urls, GError** errors);
+
+// What Dropbox tells about a file, beyond what fits into a struct stat
+typedef struct {
+    char rev[64];
+    char content_hash[65];
+} DropboxFileInfo;
+
+// Stat of a Dropbox path, rather than an url. If info is not NULL, it is filled for files
+int gfal2_dropbox_get_metadata(DropboxHandle*, const char*, struct stat*, DropboxFileInfo*, GError**);
+
+// Fills buf, and info if not NULL, from the metadata of an entry, as returned by Dropbox
+int gfal2_dropbox_parse_metadata(json_object*, struct stat*, DropboxFileInfo*, GError**);
+
+/*
+ * Copy
+ */
+int gfal2_dropbox_check_url_transfer(plugin_handle, gfal2_context_t, const char*, const char*, gfal_url2_check);
+int gfal2_dropbox_copy_file(plugin_handle, gfal2_context_t, gfalt_params_t, const char*, const char*, GError**);
 
 /*
  * IO operations
@@ -67,4 +145,10 @@ ssize_t gfal2_dropbox_fwrite(plugin_handle, gfal_file_handle, const void*, size_
 int gfal2_dropbox_fclose(plugin_handle, gfal_file_handle, GError **);
 off_t gfal2_dropbox_fseek(plugin_handle, gfal_file_handle, off_t, int, GError**);
 
+// Closes a file without committing what was written to it
+void gfal2_dropbox_fabort(plugin_handle, gfal_file_handle);
+
+// Sends the performance markers of the file to the monitor of params, as a copy from src to dst
+void gfal2_dropbox_fmonitor(plugin_handle, gfal_file_handle, gfalt_params_t, const char* src, const char* dst);
+
 #endif
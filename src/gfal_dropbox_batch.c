@@ -0,0 +1,287 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox.h"
+#include "gfal_dropbox_batch.h"
+#include "gfal_dropbox_requests.h"
+#include <logger/gfal_logger.h>
+#include <string.h>
+
+// Folders bigger than this are not listed in full, only what was seen answers stats
+#define DROPBOX_BATCH_MAX_ENTRIES 10000
+// Past this many folders tracked, the stale ones are dropped
+#define DROPBOX_BATCH_MAX_FOLDERS 64
+
+
+// What is known about a folder
+typedef struct {
+    // Stats of its entries, within the current window
+    gint64 window_start;
+    int count;
+
+    // Lowercased name => struct stat, from the last listing. NULL if there is none
+    GHashTable* entries;
+    gint64 listed_at;
+    // All the entries are in the listing, so a missing one does not exist
+    gboolean complete;
+
+    // Someone is listing it right now
+    gboolean listing;
+    // Bumped when the folder changes, so a listing running meanwhile is thrown away
+    guint generation;
+    // Stats holding on to it, so it is not pruned under them
+    int users;
+} DropboxBatchFolder;
+
+
+struct DropboxStatBatch {
+    int threshold;
+    gint64 window;
+    gint64 ttl;
+
+    // Protects everything below
+    GMutex lock;
+    GCond cond;
+    // Lowercased folder path => DropboxBatchFolder
+    GHashTable* folders;
+};
+
+
+static void gfal2_dropbox_batch_folder_free(gpointer data)
+{
+    DropboxBatchFolder* folder = (DropboxBatchFolder*)data;
+    if (folder->entries)
+        g_hash_table_destroy(folder->entries);
+    g_free(folder);
+}
+
+
+DropboxStatBatch* gfal2_dropbox_batch_new(int threshold, int window_ms, int ttl)
+{
+    DropboxStatBatch* batch = g_new0(DropboxStatBatch, 1);
+    batch->threshold = threshold;
+    batch->window = (gint64)window_ms * 1000;
+    batch->ttl = (gint64)ttl * G_USEC_PER_SEC;
+    g_mutex_init(&batch->lock);
+    g_cond_init(&batch->cond);
+    batch->folders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, gfal2_dropbox_batch_folder_free);
+    return batch;
+}
+
+
+void gfal2_dropbox_batch_free(DropboxStatBatch* batch)
+{
+    if (batch == NULL)
+        return;
+    g_hash_table_destroy(batch->folders);
+    g_cond_clear(&batch->cond);
+    g_mutex_clear(&batch->lock);
+    g_free(batch);
+}
+
+
+static void gfal2_dropbox_batch_forget(DropboxBatchFolder* folder)
+{
+    if (folder->entries) {
+        g_hash_table_destroy(folder->entries);
+        folder->entries = NULL;
+    }
+    folder->complete = FALSE;
+    folder->count = 0;
+    folder->generation++;
+}
+
+
+// Drops the folders with nothing worth keeping
+static void gfal2_dropbox_batch_prune(DropboxStatBatch* batch, gint64 now)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, batch->folders);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        DropboxBatchFolder* folder = (DropboxBatchFolder*)value;
+        if (folder->users == 0 && now - folder->window_start > batch->window &&
+            (folder->entries == NULL || now - folder->listed_at > batch->ttl)) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+}
+
+
+// What the listing of a folder gathers, page by page
+typedef struct {
+    GHashTable* entries;
+    int pages;
+} DropboxBatchListing;
+
+
+// Stops the listing once there are too many entries to keep
+static gboolean gfal2_dropbox_batch_page(json_object* list, void* user_data)
+{
+    DropboxBatchListing* listing = (DropboxBatchListing*)user_data;
+    int i, n = json_object_array_length(list);
+    for (i = 0; i < n; ++i) {
+        json_object* entry = json_object_array_get_idx(list, i);
+        json_object* name = NULL;
+        struct stat st;
+        if (!json_object_object_get_ex(entry, "name", &name) ||
+            gfal2_dropbox_parse_metadata(entry, &st, NULL, NULL) < 0) {
+            continue;
+        }
+        struct stat* copy = g_new(struct stat, 1);
+        *copy = st;
+        g_hash_table_replace(listing->entries, g_utf8_strdown(json_object_get_string(name), -1), copy);
+    }
+    ++listing->pages;
+    return g_hash_table_size(listing->entries) < DROPBOX_BATCH_MAX_ENTRIES;
+}
+
+
+// Lists folder into a new table of entries
+// Returns NULL on failure
+static GHashTable* gfal2_dropbox_batch_list(DropboxHandle* dropbox, const char* folder,
+    gboolean* complete, GError** error)
+{
+    DropboxBatchListing listing = {g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free), 0};
+    int ret = gfal2_dropbox_list_folder(dropbox, folder, NULL, gfal2_dropbox_batch_page, &listing, NULL, error);
+    if (ret < 0) {
+        g_hash_table_destroy(listing.entries);
+        return NULL;
+    }
+
+    gfal2_log(G_LOG_LEVEL_DEBUG, "Listed %s for a burst of stats: %u entries in %d pages",
+        folder, g_hash_table_size(listing.entries), listing.pages);
+    *complete = (ret == 1);
+    return listing.entries;
+}
+
+
+int gfal2_dropbox_batch_stat(DropboxHandle* dropbox, const char* path, struct stat* buf, GError** error)
+{
+    DropboxStatBatch* batch = dropbox->stat_batch;
+    if (batch == NULL || batch->threshold <= 0)
+        return 0;
+
+    char* lower = g_utf8_strdown(path, -1);
+    char* slash = strrchr(lower, '/');
+    if (slash == NULL || slash[1] == '\0') {
+        g_free(lower);
+        return 0;
+    }
+    char* parent = (slash == lower) ? g_strdup("/") : g_strndup(lower, slash - lower);
+    const char* name = slash + 1;
+    int answered = 0;
+
+    g_mutex_lock(&batch->lock);
+    DropboxBatchFolder* folder = g_hash_table_lookup(batch->folders, parent);
+    if (folder == NULL) {
+        if (g_hash_table_size(batch->folders) >= DROPBOX_BATCH_MAX_FOLDERS)
+            gfal2_dropbox_batch_prune(batch, g_get_monotonic_time());
+        folder = g_new0(DropboxBatchFolder, 1);
+        g_hash_table_insert(batch->folders, g_strdup(parent), folder);
+    }
+    folder->users++;
+
+    while (TRUE) {
+        // Wait for the listing running, rather than asking on the side
+        while (folder->listing)
+            g_cond_wait(&batch->cond, &batch->lock);
+
+        gint64 now = g_get_monotonic_time();
+        if (folder->entries && now - folder->listed_at <= batch->ttl) {
+            struct stat* st = g_hash_table_lookup(folder->entries, name);
+            if (st) {
+                memcpy(buf, st, sizeof(*buf));
+                answered = 1;
+            }
+            else if (folder->complete) {
+                gfal2_set_error(error, dropbox_domain(), ENOENT, __func__, "No such file or directory");
+                answered = 1;
+            }
+            break;
+        }
+
+        if (now - folder->window_start > batch->window) {
+            folder->window_start = now;
+            folder->count = 0;
+        }
+        if (++folder->count < batch->threshold)
+            break;
+
+        // A burst, so list the whole folder
+        gfal2_dropbox_batch_forget(folder);
+        guint generation = folder->generation;
+        folder->listing = TRUE;
+        g_mutex_unlock(&batch->lock);
+
+        GError* tmp_err = NULL;
+        gboolean complete = FALSE;
+        GHashTable* entries = gfal2_dropbox_batch_list(dropbox, parent, &complete, &tmp_err);
+
+        g_mutex_lock(&batch->lock);
+        folder->listing = FALSE;
+        g_cond_broadcast(&batch->cond);
+        if (entries == NULL) {
+            gfal2_log(G_LOG_LEVEL_DEBUG, "Could not list %s, stat'ing its entries one by one: %s",
+                parent, tmp_err->message);
+            g_error_free(tmp_err);
+            break;
+        }
+        if (folder->generation != generation) {
+            // Changed while being listed
+            g_hash_table_destroy(entries);
+            break;
+        }
+        folder->entries = entries;
+        folder->complete = complete;
+        folder->listed_at = g_get_monotonic_time();
+    }
+    folder->users--;
+    g_mutex_unlock(&batch->lock);
+
+    g_free(parent);
+    g_free(lower);
+    return answered;
+}
+
+
+void gfal2_dropbox_batch_invalidate(DropboxStatBatch* batch, const char* path)
+{
+    if (batch == NULL)
+        return;
+
+    char* lower = g_utf8_strdown(path, -1);
+    char* slash = strrchr(lower, '/');
+    char* parent = (slash == NULL || slash == lower) ? g_strdup("/") : g_strndup(lower, slash - lower);
+    size_t lower_len = strlen(lower);
+
+    g_mutex_lock(&batch->lock);
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, batch->folders);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char* folder_path = (const char*)key;
+        if (strcmp(folder_path, parent) == 0 ||
+            (strncmp(folder_path, lower, lower_len) == 0 &&
+             (folder_path[lower_len] == '\0' || folder_path[lower_len] == '/'))) {
+            gfal2_dropbox_batch_forget((DropboxBatchFolder*)value);
+        }
+    }
+    g_mutex_unlock(&batch->lock);
+
+    g_free(parent);
+    g_free(lower);
+}
@@ -0,0 +1,45 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Stat batching
+// When many entries of the same folder are stat'ed in a short time, the folder
+// is listed once, and the stats are answered from the listing for a while
+
+#pragma once
+#ifndef _GFAL_DROPBOX_BATCH_H
+#define _GFAL_DROPBOX_BATCH_H
+
+#include "gfal_dropbox.h"
+
+typedef struct DropboxStatBatch DropboxStatBatch;
+
+// A folder is listed once threshold of its entries are stat'ed within window_ms
+// milliseconds. The listing answers the stats for ttl seconds
+// A threshold of 0 disables the batching
+DropboxStatBatch* gfal2_dropbox_batch_new(int threshold, int window_ms, int ttl);
+
+void gfal2_dropbox_batch_free(DropboxStatBatch* batch);
+
+// Tries to answer the stat of path from a listing of its parent
+// Returns 1 if it did, in which case either buf is filled, or error set,
+// or 0 if the entry must be asked for on its own
+int gfal2_dropbox_batch_stat(DropboxHandle* dropbox, const char* path, struct stat* buf, GError** error);
+
+// Forgets what is known about path, its parent and its descendants
+// To be called whenever the namespace is modified
+void gfal2_dropbox_batch_invalidate(DropboxStatBatch* batch, const char* path);
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_buffer.h"
+#include <string.h>
+
+// Idle buffers kept in the pool
+#define DROPBOX_BUFFER_POOL_SIZE 16
+#define DROPBOX_BUFFER_INITIAL_CAPACITY 4096
+
+
+struct DropboxBufferPool {
+    GMutex lock;
+    GQueue idle;
+};
+
+
+DropboxBufferPool* gfal2_dropbox_buffer_pool_new(void)
+{
+    DropboxBufferPool* pool = g_new0(DropboxBufferPool, 1);
+    g_mutex_init(&pool->lock);
+    g_queue_init(&pool->idle);
+    return pool;
+}
+
+
+static void gfal2_dropbox_buffer_free(gpointer data, gpointer user_data)
+{
+    DropboxBuffer* buffer = (DropboxBuffer*)data;
+    g_free(buffer->data);
+    g_free(buffer);
+}
+
+
+void gfal2_dropbox_buffer_pool_free(DropboxBufferPool* pool)
+{
+    if (pool == NULL)
+        return;
+    g_queue_foreach(&pool->idle, gfal2_dropbox_buffer_free, NULL);
+    g_queue_clear(&pool->idle);
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+
+DropboxBuffer* gfal2_dropbox_buffer_acquire(DropboxBufferPool* pool)
+{
+    g_mutex_lock(&pool->lock);
+    DropboxBuffer* buffer = g_queue_pop_head(&pool->idle);
+    g_mutex_unlock(&pool->lock);
+
+    if (buffer == NULL) {
+        buffer = g_new0(DropboxBuffer, 1);
+        buffer->capacity = DROPBOX_BUFFER_INITIAL_CAPACITY;
+        buffer->data = g_malloc(buffer->capacity);
+    }
+    gfal2_dropbox_buffer_reset(buffer);
+    return buffer;
+}
+
+
+void gfal2_dropbox_buffer_release(DropboxBufferPool* pool, DropboxBuffer* buffer)
+{
+    if (buffer == NULL)
+        return;
+
+    if (buffer->capacity <= DROPBOX_BUFFER_MAX_RETAINED) {
+        g_mutex_lock(&pool->lock);
+        if (pool->idle.length < DROPBOX_BUFFER_POOL_SIZE) {
+            g_queue_push_head(&pool->idle, buffer);
+            buffer = NULL;
+        }
+        g_mutex_unlock(&pool->lock);
+    }
+
+    if (buffer) {
+        gfal2_dropbox_buffer_free(buffer, NULL);
+    }
+}
+
+
+void gfal2_dropbox_buffer_append(DropboxBuffer* buffer, const char* data, size_t size)
+{
+    // Leave room for the terminator
+    if (buffer->length + size + 1 > buffer->capacity) {
+        buffer->capacity = MAX(buffer->capacity, 64);
+        while (buffer->length + size + 1 > buffer->capacity)
+            buffer->capacity *= 2;
+        buffer->data = g_realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->length, data, size);
+    buffer->length += size;
+    buffer->data[buffer->length] = '\0';
+}
+
+
+void gfal2_dropbox_buffer_reset(DropboxBuffer* buffer)
+{
+    buffer->length = 0;
+    if (buffer->data)
+        buffer->data[0] = '\0';
+}
+
+
+json_object* gfal2_dropbox_buffer_json(const DropboxBuffer* buffer)
+{
+    json_tokener* tokener = json_tokener_new();
+    json_object* root = json_tokener_parse_ex(tokener, buffer->data, buffer->length);
+    json_tokener_free(tokener);
+    return root;
+}
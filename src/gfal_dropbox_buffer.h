@@ -0,0 +1,61 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Response buffers
+// They grow as needed, and are pooled per plugin handle, so once warmed up
+// requests do not allocate memory for their responses
+
+#pragma once
+#ifndef _GFAL_DROPBOX_BUFFER_H
+#define _GFAL_DROPBOX_BUFFER_H
+
+#include <glib.h>
+#include <json.h>
+
+// Buffers that grew past this are not kept in the pool
+#define DROPBOX_BUFFER_MAX_RETAINED (1024 * 1024)
+
+// A zero initialized buffer is valid, and empty
+// Its memory is allocated on the first append, and must be freed with g_free
+typedef struct {
+    // Always NUL terminated, once allocated
+    char* data;
+    size_t length;
+    size_t capacity;
+} DropboxBuffer;
+
+typedef struct DropboxBufferPool DropboxBufferPool;
+
+DropboxBufferPool* gfal2_dropbox_buffer_pool_new(void);
+
+void gfal2_dropbox_buffer_pool_free(DropboxBufferPool* pool);
+
+// Takes an empty buffer from the pool, or a new one if there is none
+DropboxBuffer* gfal2_dropbox_buffer_acquire(DropboxBufferPool* pool);
+
+// Gives the buffer back to the pool
+void gfal2_dropbox_buffer_release(DropboxBufferPool* pool, DropboxBuffer* buffer);
+
+// Appends data at the end, growing the buffer if needed
+void gfal2_dropbox_buffer_append(DropboxBuffer* buffer, const char* data, size_t size);
+
+// Empties the buffer, keeping its memory
+void gfal2_dropbox_buffer_reset(DropboxBuffer* buffer);
+
+// Parses the content as JSON. Returns NULL if it is not valid
+json_object* gfal2_dropbox_buffer_json(const DropboxBuffer* buffer);
+
+#endif
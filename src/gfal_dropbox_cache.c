@@ -0,0 +1,457 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_cache.h"
+#include "gfal_dropbox_hash.h"
+#include "gfal_dropbox_metrics.h"
+#include "gfal_dropbox_stream.h"
+#include <logger/gfal_logger.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Downloads in progress are named <hash>.part.XXXXXX, and those older than this, in seconds, were abandoned
+#define DROPBOX_CACHE_PART_TTL 3600
+// Small, so the reader gets the first bytes early
+#define DROPBOX_CACHE_COPY_SIZE (64 * 1024)
+
+
+struct DropboxCache {
+    char* dir;
+    guint64 max_size;
+};
+
+
+typedef struct {
+    char* path;
+    guint64 size;
+    struct timespec mtime;
+} DropboxCacheObject;
+
+
+DropboxCache* gfal2_dropbox_cache_new(const char* dir, guint64 max_size)
+{
+    DropboxCache* cache = g_new0(DropboxCache, 1);
+    cache->dir = g_strdup(dir);
+    cache->max_size = max_size;
+    return cache;
+}
+
+
+void gfal2_dropbox_cache_free(DropboxCache* cache)
+{
+    if (cache == NULL)
+        return;
+    g_free(cache->dir);
+    g_free(cache);
+}
+
+
+// Content hashes are spread over subdirectories named after their first two characters
+static gboolean gfal2_dropbox_cache_valid_hash(const char* content_hash)
+{
+    size_t len = strlen(content_hash);
+    size_t i;
+    if (len < 2 || len > 64)
+        return FALSE;
+    for (i = 0; i < len; ++i) {
+        if (!g_ascii_isxdigit(content_hash[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+// Opens the object if there, refreshing its time so it is the last to go
+static int gfal2_dropbox_cache_hit(const char* object_path)
+{
+    int fd = open(object_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && futimens(fd, NULL) < 0) {
+        gfal2_log(G_LOG_LEVEL_DEBUG, "Could not touch %s: %s", object_path, strerror(errno));
+    }
+    return fd;
+}
+
+
+static gint gfal2_dropbox_cache_older(gconstpointer a, gconstpointer b)
+{
+    const DropboxCacheObject* first = *(const DropboxCacheObject* const*)a;
+    const DropboxCacheObject* second = *(const DropboxCacheObject* const*)b;
+    // Reads touch them within the same second, so this needs the nanoseconds
+    if (first->mtime.tv_sec != second->mtime.tv_sec)
+        return first->mtime.tv_sec < second->mtime.tv_sec ? -1 : 1;
+    if (first->mtime.tv_nsec != second->mtime.tv_nsec)
+        return first->mtime.tv_nsec < second->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+
+static void gfal2_dropbox_cache_object_free(gpointer data)
+{
+    DropboxCacheObject* object = (DropboxCacheObject*)data;
+    g_free(object->path);
+    g_free(object);
+}
+
+
+// Removes the least recently used objects until the cache fits, sparing keep
+static void gfal2_dropbox_cache_evict(DropboxCache* cache, const char* keep)
+{
+    GPtrArray* objects = g_ptr_array_new_with_free_func(gfal2_dropbox_cache_object_free);
+    guint64 total = 0;
+    time_t now = time(NULL);
+
+    GDir* top = g_dir_open(cache->dir, 0, NULL);
+    const char* shard;
+    while (top && (shard = g_dir_read_name(top)) != NULL) {
+        char* shard_path = g_build_filename(cache->dir, shard, NULL);
+        GDir* dir = g_dir_open(shard_path, 0, NULL);
+        const char* name;
+        while (dir && (name = g_dir_read_name(dir)) != NULL) {
+            if (g_str_has_suffix(name, ".lock"))
+                continue;
+
+            char* path = g_build_filename(shard_path, name, NULL);
+            struct stat st;
+            if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+                g_free(path);
+                continue;
+            }
+            total += st.st_size;
+
+            // Someone may still be downloading into it
+            if ((strstr(name, ".part.") != NULL && now - st.st_mtime < DROPBOX_CACHE_PART_TTL) ||
+                strcmp(path, keep) == 0) {
+                g_free(path);
+                continue;
+            }
+
+            DropboxCacheObject* object = g_new(DropboxCacheObject, 1);
+            object->path = path;
+            object->size = st.st_size;
+            object->mtime = st.st_mtim;
+            g_ptr_array_add(objects, object);
+        }
+        if (dir)
+            g_dir_close(dir);
+        g_free(shard_path);
+    }
+    if (top)
+        g_dir_close(top);
+
+    g_ptr_array_sort(objects, gfal2_dropbox_cache_older);
+    guint i;
+    for (i = 0; i < objects->len && total > cache->max_size; ++i) {
+        DropboxCacheObject* object = g_ptr_array_index(objects, i);
+        // Anyone reading it keeps its copy until done
+        if (unlink(object->path) == 0 || errno == ENOENT) {
+            gfal2_log(G_LOG_LEVEL_DEBUG, "Evicted %s from the download cache", object->path);
+            total -= object->size;
+        }
+    }
+    g_ptr_array_free(objects, TRUE);
+}
+
+
+// Download of a missing object into its .part file, done in the background
+// while the reader is served from what arrived so far
+struct DropboxCacheFill {
+    DropboxHandle* dropbox;
+    char* source;
+    char* content_hash;
+    char* object_path;
+    char* part_path;
+    char* lock_path;
+    int part_fd, lock_fd;
+    off_t size;
+    GThread* thread;
+
+    GMutex lock;
+    GCond cond;
+    off_t received;
+    gboolean done, stop;
+    GError* error;
+};
+
+
+// Downloads the source into the .part file, checking its content hash
+static int gfal2_dropbox_cache_download(DropboxCacheFill* fill, GError** error)
+{
+    DropboxHandle* dropbox = fill->dropbox;
+    DropboxStream* stream = gfal2_dropbox_stream_open(dropbox, fill->source, 0, fill->size,
+        dropbox->stream_buffer_size, error);
+    if (stream == NULL)
+        return -1;
+
+    DropboxContentHash* hash = gfal2_dropbox_hash_new();
+    char* buffer = g_malloc(DROPBOX_CACHE_COPY_SIZE);
+    off_t received = 0;
+    int ret = 0;
+
+    while (received < fill->size) {
+        g_mutex_lock(&fill->lock);
+        gboolean stop = fill->stop;
+        g_mutex_unlock(&fill->lock);
+        if (stop) {
+            gfal2_set_error(error, dropbox_domain(), ECANCELED, __func__, "Closed before the download was done");
+            ret = -1;
+            break;
+        }
+
+        ssize_t n = gfal2_dropbox_stream_read(stream, buffer, DROPBOX_CACHE_COPY_SIZE, error);
+        if (n < 0) {
+            ret = -1;
+            break;
+        }
+        if (n == 0) {
+            gfal2_set_error(error, dropbox_domain(), EIO, __func__,
+                "The download ended after %lld bytes out of %lld", (long long)received, (long long)fill->size);
+            ret = -1;
+            break;
+        }
+        gfal2_dropbox_hash_update(hash, buffer, n);
+
+        ssize_t written = 0;
+        while (written < n) {
+            ssize_t w = write(fill->part_fd, buffer + written, n - written);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w < 0) {
+                gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not write into the download cache");
+                ret = -1;
+                break;
+            }
+            written += w;
+        }
+        if (ret < 0)
+            break;
+        received += n;
+
+        g_mutex_lock(&fill->lock);
+        fill->received = received;
+        g_cond_broadcast(&fill->cond);
+        g_mutex_unlock(&fill->lock);
+    }
+
+    if (ret == 0) {
+        char* received_hash = gfal2_dropbox_hash_get(hash);
+        if (g_ascii_strcasecmp(received_hash, fill->content_hash) != 0) {
+            gfal2_set_error(error, dropbox_domain(), EIO, __func__,
+                "The content hash of the download does not match: %s != %s", received_hash, fill->content_hash);
+            ret = -1;
+        }
+        g_free(received_hash);
+    }
+    // Never leave a truncated object behind a valid name
+    if (ret == 0 && fdatasync(fill->part_fd) < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not flush the download cache");
+        ret = -1;
+    }
+
+    g_free(buffer);
+    gfal2_dropbox_hash_free(hash);
+    gfal2_dropbox_stream_close(stream);
+    return ret;
+}
+
+
+// Whoever is still waiting on the lock finds the object there, or downloads it again
+static void gfal2_dropbox_cache_unlock(const char* lock_path, int lock_fd)
+{
+    unlink(lock_path);
+    close(lock_fd);
+}
+
+
+static gpointer gfal2_dropbox_cache_fill_thread(gpointer data)
+{
+    DropboxCacheFill* fill = (DropboxCacheFill*)data;
+    GError* error = NULL;
+
+    int ret = gfal2_dropbox_cache_download(fill, &error);
+    if (ret == 0 && rename(fill->part_path, fill->object_path) < 0) {
+        gfal2_set_error(&error, dropbox_domain(), errno, __func__, "Could not rename %s", fill->part_path);
+        ret = -1;
+    }
+    if (ret < 0) {
+        unlink(fill->part_path);
+    }
+    else {
+        gfal2_dropbox_cache_evict(fill->dropbox->cache, fill->object_path);
+    }
+    gfal2_dropbox_cache_unlock(fill->lock_path, fill->lock_fd);
+
+    g_mutex_lock(&fill->lock);
+    fill->done = TRUE;
+    fill->error = error;
+    g_cond_broadcast(&fill->cond);
+    g_mutex_unlock(&fill->lock);
+    return NULL;
+}
+
+
+int gfal2_dropbox_cache_open(DropboxHandle* dropbox, const char* source,
+    const char* content_hash, off_t size, DropboxCacheFill** fill, GError** error)
+{
+    *fill = NULL;
+    DropboxCache* cache = dropbox->cache;
+    if (cache == NULL || !gfal2_dropbox_cache_valid_hash(content_hash) || (guint64)size > cache->max_size)
+        return -1;
+
+    char shard[3] = {g_ascii_tolower(content_hash[0]), g_ascii_tolower(content_hash[1]), '\0'};
+    char* lower = g_ascii_strdown(content_hash, -1);
+    char* shard_path = g_build_filename(cache->dir, shard, NULL);
+    char* object_path = g_build_filename(shard_path, lower, NULL);
+    char* lock_path = g_strconcat(object_path, ".lock", NULL);
+    int fd = gfal2_dropbox_cache_hit(object_path);
+    int lock_fd = -1;
+
+    if (fd >= 0) {
+        gfal2_log(G_LOG_LEVEL_DEBUG, "Reading %s from the download cache", source);
+        gfal2_dropbox_metrics_cache(dropbox->metrics, TRUE);
+        goto out;
+    }
+
+    if (g_mkdir_with_parents(shard_path, 0700) < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not create %s", shard_path);
+        goto out;
+    }
+
+    // Whoever gets the lock downloads, the others wait for it to be done
+    // The lock file is removed once done, so a lock taken on a file already removed
+    // means a newcomer may be holding a new one, and is taken again on that one
+    while (TRUE) {
+        lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (lock_fd < 0 || flock(lock_fd, LOCK_EX) < 0) {
+            gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not lock %s", lock_path);
+            // Not ours to remove
+            if (lock_fd >= 0)
+                close(lock_fd);
+            lock_fd = -1;
+            goto out;
+        }
+        struct stat locked, current;
+        if (fstat(lock_fd, &locked) == 0 && stat(lock_path, &current) == 0 &&
+            locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+            break;
+        }
+        close(lock_fd);
+        lock_fd = -1;
+    }
+    fd = gfal2_dropbox_cache_hit(object_path);
+    if (fd >= 0) {
+        gfal2_log(G_LOG_LEVEL_DEBUG, "Reading %s from the download cache, once populated by someone else", source);
+        gfal2_dropbox_metrics_cache(dropbox->metrics, TRUE);
+        goto out;
+    }
+
+    char* part_path = g_strconcat(object_path, ".part.XXXXXX", NULL);
+    int part_fd = mkstemp(part_path);
+    if (part_fd < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not create %s", part_path);
+        g_free(part_path);
+        goto out;
+    }
+    // The reader gets its own descriptor, which keeps working once the file is renamed
+    fd = open(part_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not open %s", part_path);
+        unlink(part_path);
+        close(part_fd);
+        g_free(part_path);
+        goto out;
+    }
+
+    gfal2_log(G_LOG_LEVEL_DEBUG, "Populating the download cache with %s", source);
+    gfal2_dropbox_metrics_cache(dropbox->metrics, FALSE);
+
+    DropboxCacheFill* new_fill = g_new0(DropboxCacheFill, 1);
+    new_fill->dropbox = dropbox;
+    new_fill->source = g_strdup(source);
+    new_fill->content_hash = lower;
+    new_fill->object_path = object_path;
+    new_fill->part_path = part_path;
+    new_fill->lock_path = lock_path;
+    new_fill->part_fd = part_fd;
+    new_fill->lock_fd = lock_fd;
+    new_fill->size = size;
+    g_mutex_init(&new_fill->lock);
+    g_cond_init(&new_fill->cond);
+    new_fill->thread = g_thread_new("dropbox-cache", gfal2_dropbox_cache_fill_thread, new_fill);
+    *fill = new_fill;
+    g_free(shard_path);
+    return fd;
+
+out:
+    if (lock_fd >= 0)
+        gfal2_dropbox_cache_unlock(lock_path, lock_fd);
+    g_free(lock_path);
+    g_free(object_path);
+    g_free(shard_path);
+    g_free(lower);
+    return fd;
+}
+
+
+ssize_t gfal2_dropbox_cache_fill_read(DropboxCacheFill* fill, int fd, void* buffer, size_t count,
+    off_t offset, GError** error)
+{
+    g_mutex_lock(&fill->lock);
+    while (fill->received <= offset && !fill->done)
+        g_cond_wait(&fill->cond, &fill->lock);
+    off_t available = fill->received - offset;
+    GError* failure = (available <= 0 && fill->error) ? g_error_copy(fill->error) : NULL;
+    g_mutex_unlock(&fill->lock);
+
+    if (failure) {
+        g_propagate_error(error, failure);
+        return -1;
+    }
+    if (available <= 0)
+        return 0;
+
+    ssize_t ret = pread(fd, buffer, MIN((off_t)count, available), offset);
+    if (ret < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not read from the download cache");
+    }
+    return ret;
+}
+
+
+void gfal2_dropbox_cache_fill_free(DropboxCacheFill* fill)
+{
+    if (fill == NULL)
+        return;
+    g_mutex_lock(&fill->lock);
+    fill->stop = TRUE;
+    g_mutex_unlock(&fill->lock);
+    g_thread_join(fill->thread);
+
+    close(fill->part_fd);
+    g_clear_error(&fill->error);
+    g_mutex_clear(&fill->lock);
+    g_cond_clear(&fill->cond);
+    g_free(fill->source);
+    g_free(fill->content_hash);
+    g_free(fill->object_path);
+    g_free(fill->part_path);
+    g_free(fill->lock_path);
+    g_free(fill);
+}
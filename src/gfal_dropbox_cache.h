@@ -0,0 +1,57 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Download cache
+// Files read are kept on disk, named after their content hash, so the same content
+// is only downloaded once per node. The least recently used ones go past the size limit
+
+#pragma once
+#ifndef _GFAL_DROPBOX_CACHE_H
+#define _GFAL_DROPBOX_CACHE_H
+
+#include "gfal_dropbox.h"
+
+#define DROPBOX_DEFAULT_CACHE_SIZE (1024 * 1024 * 1024)
+
+typedef struct DropboxCache DropboxCache;
+
+// Cache under dir, holding at most max_size bytes
+DropboxCache* gfal2_dropbox_cache_new(const char* dir, guint64 max_size);
+
+void gfal2_dropbox_cache_free(DropboxCache* cache);
+
+// Download of a file into the cache, going on while it is read
+typedef struct DropboxCacheFill DropboxCacheFill;
+
+// Opens the cached copy of the file with the given content hash and size
+// Only one process downloads a given content, the others wait for it
+// If it is not there yet, and this one downloads it, fill is set, and the download goes on
+// in the background: the file descriptor is then read with gfal2_dropbox_cache_fill_read
+// Returns a file descriptor to read it from, or -1 if it can not be served from the cache,
+// in which case error is set if something went wrong
+int gfal2_dropbox_cache_open(DropboxHandle* dropbox, const char* source,
+    const char* content_hash, off_t size, DropboxCacheFill** fill, GError** error);
+
+// Reads up to count bytes at offset from fd, as returned with fill, once at least one is there
+// Returns how many were read, or -1 if the download failed before offset
+ssize_t gfal2_dropbox_cache_fill_read(DropboxCacheFill* fill, int fd, void* buffer, size_t count,
+    off_t offset, GError** error);
+
+// Waits for the download to be done, stopping it if not all the data has arrived yet
+// The file descriptor returned with fill stays open
+void gfal2_dropbox_cache_fill_free(DropboxCacheFill* fill);
+
+#endif
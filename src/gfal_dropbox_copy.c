@@ -0,0 +1,190 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Copies from local files, which are skipped if the destination already has the same content
+
+#include "gfal_dropbox.h"
+#include "gfal_dropbox_hash.h"
+#include "gfal_dropbox_url.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DROPBOX_COPY_BUFFER_SIZE DROPBOX_HASH_BLOCK_SIZE
+
+
+// Only local sources can be hashed before sending anything, anything else is left to gfal2
+int gfal2_dropbox_check_url_transfer(plugin_handle plugin_data, gfal2_context_t context,
+        const char* src, const char* dst, gfal_url2_check check)
+{
+    DropboxHandle* dropbox = (DropboxHandle*)plugin_data;
+    return dropbox->skip_identical && check == GFAL_FILE_COPY &&
+        strncmp(src, "file://", 7) == 0 && strncmp(dst, "dropbox:", 8) == 0;
+}
+
+
+// Reads up to size bytes, unless the file ends before
+static ssize_t gfal2_dropbox_copy_read(int fd, char* buffer, size_t size, const char* local_path, GError** error)
+{
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, buffer + total, size - total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not read %s", local_path);
+            return -1;
+        }
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+
+// Content hash of the whole local file
+static char* gfal2_dropbox_copy_hash(int fd, char* buffer, const char* local_path, GError** error)
+{
+    DropboxContentHash* hash = gfal2_dropbox_hash_new();
+    ssize_t n;
+    while ((n = gfal2_dropbox_copy_read(fd, buffer, DROPBOX_COPY_BUFFER_SIZE, local_path, error)) > 0) {
+        gfal2_dropbox_hash_update(hash, buffer, n);
+    }
+    char* content_hash = (n < 0) ? NULL : gfal2_dropbox_hash_get(hash);
+    gfal2_dropbox_hash_free(hash);
+    return content_hash;
+}
+
+
+// Uploads the local file from the start, reporting to the monitor of params
+// If replace is set, the file there is replaced only once the whole content is committed
+static int gfal2_dropbox_copy_upload(plugin_handle plugin_data, gfalt_params_t params, int fd, char* buffer,
+        const char* src, const char* local_path, const char* dst, gboolean replace, GError** error)
+{
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not rewind %s", local_path);
+        return -1;
+    }
+
+    gfal_file_handle handle = gfal2_dropbox_fopen(plugin_data, dst,
+        O_WRONLY | O_CREAT | (replace ? O_TRUNC : 0), 0644, error);
+    if (handle == NULL)
+        return -1;
+    gfal2_dropbox_fmonitor(plugin_data, handle, params, src, dst);
+
+    GError* tmp_err = NULL;
+    ssize_t n;
+    while ((n = gfal2_dropbox_copy_read(fd, buffer, DROPBOX_COPY_BUFFER_SIZE, local_path, &tmp_err)) > 0) {
+        if (gfal2_dropbox_fwrite(plugin_data, handle, buffer, n, &tmp_err) < 0)
+            break;
+    }
+
+    if (tmp_err) {
+        // Whatever was sent so far is not committed
+        gfal2_dropbox_fabort(plugin_data, handle);
+        gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+        return -1;
+    }
+    return gfal2_dropbox_fclose(plugin_data, handle, error);
+}
+
+
+int gfal2_dropbox_copy_file(plugin_handle plugin_data, gfal2_context_t context, gfalt_params_t params,
+        const char* src, const char* dst, GError** error)
+{
+    DropboxHandle* dropbox = (DropboxHandle*)plugin_data;
+    GError* tmp_err = NULL;
+    const char* local_path = src + 7;
+
+    char path[GFAL_URL_MAX_LEN];
+    if (gfal2_dropbox_extract_path(dst, path, sizeof(path)) == NULL) {
+        gfal2_set_error(error, dropbox_domain(), EINVAL, __func__, "Invalid Dropbox url");
+        return -1;
+    }
+
+    int fd = open(local_path, O_RDONLY | O_CLOEXEC);
+    struct stat local_st;
+    if (fd < 0 || fstat(fd, &local_st) < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not open %s", local_path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    // Straight from Dropbox, since a stale hash would skip a copy that was needed
+    struct stat remote_st;
+    DropboxFileInfo info;
+    int exists = (gfal2_dropbox_get_metadata(dropbox, path, &remote_st, &info, &tmp_err) == 0);
+    if (!exists && tmp_err->code != ENOENT) {
+        gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+        close(fd);
+        return -1;
+    }
+    g_clear_error(&tmp_err);
+
+    if (exists && S_ISDIR(remote_st.st_mode)) {
+        gfal2_set_error(error, dropbox_domain(), EISDIR, __func__, "The destination %s is a folder", dst);
+        close(fd);
+        return -1;
+    }
+
+    char* buffer = g_malloc(DROPBOX_COPY_BUFFER_SIZE);
+    int ret = 0;
+
+    // Only worth hashing if the sizes match
+    if (exists && remote_st.st_size == local_st.st_size && info.content_hash[0] != '\0') {
+        plugin_trigger_event(params, dropbox_domain(), GFAL_EVENT_SOURCE, GFAL_EVENT_CHECKSUM_ENTER, "");
+        char* content_hash = gfal2_dropbox_copy_hash(fd, buffer, local_path, error);
+        plugin_trigger_event(params, dropbox_domain(), GFAL_EVENT_SOURCE, GFAL_EVENT_CHECKSUM_EXIT,
+            "%s", content_hash ? content_hash : "");
+        if (content_hash == NULL) {
+            ret = -1;
+            goto out;
+        }
+        gboolean identical = (g_ascii_strcasecmp(content_hash, info.content_hash) == 0);
+        g_free(content_hash);
+        if (identical) {
+            gfal2_log(G_LOG_LEVEL_INFO, "%s already has the content of %s, skipping the copy", dst, src);
+            plugin_trigger_event(params, dropbox_domain(), GFAL_EVENT_NONE, GFAL_EVENT_TRANSFER_EXIT,
+                "Identical content, nothing transferred");
+            goto out;
+        }
+    }
+
+    if (exists) {
+        if (!gfalt_get_replace_existing_file(params, NULL)) {
+            gfal2_set_error(error, dropbox_domain(), EEXIST, __func__,
+                "The destination %s exists with another content", dst);
+            ret = -1;
+            goto out;
+        }
+        gfal2_log(G_LOG_LEVEL_DEBUG, "Replacing %s", dst);
+    }
+
+    plugin_trigger_event(params, dropbox_domain(), GFAL_EVENT_NONE, GFAL_EVENT_TRANSFER_ENTER,
+        "%s => %s, %d active transfers", src, dst, g_atomic_int_get(&dropbox->active_transfers));
+    ret = gfal2_dropbox_copy_upload(plugin_data, params, fd, buffer, src, local_path, dst, exists, error);
+    plugin_trigger_event(params, dropbox_domain(), GFAL_EVENT_NONE, GFAL_EVENT_TRANSFER_EXIT,
+        "%s => %s, %s", src, dst, ret == 0 ? "done" : "failed");
+
+out:
+    g_free(buffer);
+    close(fd);
+    return ret;
+}
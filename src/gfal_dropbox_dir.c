@@ -17,6 +17,8 @@
 // Directory listing functions
 
 #include "gfal_dropbox.h"
+#include "gfal_dropbox_entries.h"
+#include "gfal_dropbox_index.h"
 #include "gfal_dropbox_requests.h"
 #include "gfal_dropbox_url.h"
 #include <logger/gfal_logger.h>
@@ -25,18 +27,52 @@
 #include <time.h>
 
 
+// Only the page being read is kept, converted into entries
 struct DropboxDir {
-    struct json_object* root;
-    struct array_list* entries;
-    int entries_length;
-    int i;
+    DropboxEntries* entries;
+    guint i;
     struct dirent ent;
-    int has_more;
-    const char *cursor;
+    gboolean has_more;
+    char* cursor;
 };
 typedef struct DropboxDir DropboxDir;
 
 
+static void gfal2_dropbox_dir_free(DropboxDir* dir_handle)
+{
+    gfal2_dropbox_entries_free(dir_handle->entries);
+    g_free(dir_handle->cursor);
+    g_free(dir_handle);
+}
+
+
+// Replaces the entries with those of the page, and stops there
+static gboolean gfal2_dropbox_dir_load(json_object* list, void* user_data)
+{
+    DropboxDir* dir_handle = (DropboxDir*)user_data;
+    gfal2_dropbox_entries_clear(dir_handle->entries);
+    gfal2_dropbox_entries_add_json(dir_handle->entries, list);
+    dir_handle->i = 0;
+    return FALSE;
+}
+
+
+// Gets the next page, or the first one if there is no cursor yet
+static int gfal2_dropbox_dir_next(DropboxHandle* dropbox, DropboxDir* dir_handle, const char* path,
+    GError** error)
+{
+    char* cursor = NULL;
+    int ret = gfal2_dropbox_list_folder(dropbox, path, dir_handle->cursor, gfal2_dropbox_dir_load, dir_handle,
+        &cursor, error);
+    if (ret < 0)
+        return -1;
+    g_free(dir_handle->cursor);
+    dir_handle->cursor = cursor;
+    dir_handle->has_more = (ret == 0);
+    return 0;
+}
+
+
 gfal_file_handle gfal2_dropbox_opendir(plugin_handle plugin_data,
         const char* url, GError** error)
 {
@@ -49,50 +85,24 @@ gfal_file_handle gfal2_dropbox_opendir(plugin_handle plugin_data,
         return NULL;
     }
 
-    // Otherwise we get: Specify the root folder as an empty string rather than as "/".
-    if (g_strcmp0(path, "/") == 0) {
-        path[0] = '\0';
-    }
-
-    char output[102400];
+    DropboxDir* dir_handle = g_new0(DropboxDir, 1);
+    dir_handle->entries = gfal2_dropbox_entries_new();
 
-    ssize_t resp_size = gfal2_dropbox_post_json(dropbox, "https://api.dropbox.com/2/files/list_folder",
-        output, sizeof(output), &tmp_err, 1,
-        "path", path);
-    if (resp_size < 0) {
-        gfal2_propagate_prefixed_error(error, tmp_err, __func__);
-        return NULL;
+    // From the index if it knows the folder, or can catch up with what changed
+    // A folder too large for it comes with its first pages, and where to go on from
+    int listed = gfal2_dropbox_index_list(dropbox, path, dir_handle->entries, &dir_handle->cursor, &tmp_err);
+    if (listed == 0 && dir_handle->cursor) {
+        dir_handle->has_more = TRUE;
     }
-
-    json_object* root = json_tokener_parse(output);
-    if (root) {
-        DropboxDir* dir_handle = calloc(1, sizeof(DropboxDir));
-        dir_handle->root = root;
-
-        json_object *cursor = NULL, *has_more = NULL;
-        if (json_object_object_get_ex(root, "cursor", &cursor)) {
-            dir_handle->cursor = json_object_get_string(cursor);
-        }
-        if (json_object_object_get_ex(root, "has_more", &has_more)) {
-            dir_handle->has_more = json_object_get_boolean(has_more);
-        }
-
-        json_object* contents = NULL;
-        if (json_object_object_get_ex(root, "entries", &contents) && json_object_is_type(contents, json_type_array)) {
-            dir_handle->entries = json_object_get_array(contents);
-            dir_handle->entries_length = json_object_array_length(contents);
-            return gfal_file_handle_new2(gfal2_dropbox_getName(), dir_handle, NULL, url);
-        }
-        else {
-            json_object_put(root);
-            free(dir_handle);
-            gfal2_set_error(error, dropbox_domain(), EIO, __func__, "The response didn't include 'entries'");
-        }
+    else if (listed == 0) {
+        gfal2_dropbox_dir_next(dropbox, dir_handle, path, &tmp_err);
     }
-    else {
-        gfal2_set_error(error, dropbox_domain(), EIO, __func__, "Could not parse the response sent by Dropbox");
+    if (tmp_err) {
+        gfal2_dropbox_dir_free(dir_handle);
+        gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+        return NULL;
     }
-    return NULL;
+    return gfal_file_handle_new2(gfal2_dropbox_getName(), dir_handle, NULL, url);
 }
 
 
@@ -100,8 +110,7 @@ int gfal2_dropbox_closedir(plugin_handle plugin_data, gfal_file_handle dir_desc,
         GError** error)
 {
     DropboxDir* dir_handle = gfal_file_handle_get_fdesc(dir_desc);
-    json_object_put(dir_handle->root);
-    free(dir_handle);
+    gfal2_dropbox_dir_free(dir_handle);
     gfal_file_handle_delete(dir_desc);
     return 0;
 }
@@ -114,42 +123,27 @@ struct dirent* gfal2_dropbox_readdir(plugin_handle plugin_data,
     return gfal2_dropbox_readdirpp(plugin_data, dir_desc, &st, error);
 }
 
-// TODO: Continue listing if has_more is true
+
 struct dirent* gfal2_dropbox_readdirpp(plugin_handle plugin_data,
         gfal_file_handle dir_desc, struct stat* st, GError** error)
 {
+    DropboxHandle* dropbox = (DropboxHandle*)plugin_data;
     DropboxDir* dir_handle = gfal_file_handle_get_fdesc(dir_desc);
-    if (dir_handle->i >= dir_handle->entries_length) {
-        return NULL;
-    }
-
-    json_object* entry = (json_object*)array_list_get_idx(dir_handle->entries, dir_handle->i++);
-
-    json_object* name = NULL;
-    if (json_object_object_get_ex(entry, "name", &name)) {
-        const char* name_str = json_object_get_string(name);
-        g_strlcpy(dir_handle->ent.d_name, name_str, sizeof(dir_handle->ent.d_name));
-        dir_handle->ent.d_reclen = strlen(dir_handle->ent.d_name);
-    }
-
-    st->st_mode = 0700;
 
-    json_object *tag = NULL, *size = NULL, *modified = NULL;
+    // Once done with a page, on to the next one
+    while (dir_handle->i >= dir_handle->entries->length) {
+        if (!dir_handle->has_more)
+            return NULL;
 
-    if (json_object_object_get_ex(entry, ".tag", &tag)) {
-        const char *tag_str = json_object_get_string(tag);
-        if (g_strcmp0(tag_str, "folder") == 0) {
-            st->st_mode |= S_IFDIR;
+        GError* tmp_err = NULL;
+        if (gfal2_dropbox_dir_next(dropbox, dir_handle, NULL, &tmp_err) < 0) {
+            gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+            return NULL;
         }
     }
 
-    if (json_object_object_get_ex(entry, "size", &size)) {
-        st->st_size = json_object_get_int64(size);
-    }
-
-    if (json_object_object_get_ex(entry, "client_modified", &modified)) {
-        st->st_mtime = gfal2_dropbox_time(json_object_get_string(modified));
-    }
-
+    const char* name = gfal2_dropbox_entries_get(dir_handle->entries, dir_handle->i++, st);
+    g_strlcpy(dir_handle->ent.d_name, name, sizeof(dir_handle->ent.d_name));
+    dir_handle->ent.d_reclen = strlen(dir_handle->ent.d_name);
     return &dir_handle->ent;
 }
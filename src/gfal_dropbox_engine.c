@@ -0,0 +1,370 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox.h"
+#include "gfal_dropbox_engine.h"
+#include <logger/gfal_logger.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+// Keep this many easy handles around for reuse
+#define DROPBOX_ENGINE_IDLE_HANDLES 16
+
+// curl_multi_poll and curl_multi_wakeup appeared in libcurl 7.68
+// Before, the event loop is woken up through a pipe
+#ifndef DROPBOX_ENGINE_CURL_WAKEUP
+#define DROPBOX_ENGINE_CURL_WAKEUP (LIBCURL_VERSION_NUM >= 0x074400)
+#endif
+
+
+struct DropboxEngine {
+    CURLM* multi;
+    CURLSH* share;
+    GThread* thread;
+    gboolean stop;
+#if !DROPBOX_ENGINE_CURL_WAKEUP
+    int wakeup_pipe[2];
+#endif
+
+    // Protects everything below
+    GMutex lock;
+    GQueue pending;
+    GQueue commands;
+    GQueue idle;
+
+    DropboxEasySetup setup;
+    void* setup_data;
+
+    // Only used from the event loop: easy handle => DropboxJob
+    GHashTable* active;
+};
+
+
+// A transfer waiting to be completed by the event loop
+struct DropboxJob {
+    CURL* easy;
+    DropboxEasyDone done;
+    void* user_data;
+};
+typedef struct DropboxJob DropboxJob;
+
+
+// Operations on a running transfer, which must be done from the event loop thread
+enum DropboxCommandType {
+    DROPBOX_COMMAND_UNPAUSE,
+    DROPBOX_COMMAND_CANCEL
+};
+
+struct DropboxCommand {
+    enum DropboxCommandType type;
+    CURL* easy;
+    void* user_data;
+};
+typedef struct DropboxCommand DropboxCommand;
+
+
+static void gfal2_dropbox_engine_finish(DropboxEngine* engine, DropboxJob* job, CURLcode result)
+{
+    curl_multi_remove_handle(engine->multi, job->easy);
+    g_hash_table_remove(engine->active, job->easy);
+    job->done(job->easy, result, job->user_data);
+    g_free(job);
+}
+
+
+static void gfal2_dropbox_engine_run_command(DropboxEngine* engine, DropboxCommand* command)
+{
+    // The transfer may be over by now, and the easy handle reused for another one
+    DropboxJob* job = g_hash_table_lookup(engine->active, command->easy);
+    if (job == NULL || job->user_data != command->user_data)
+        return;
+
+    switch (command->type) {
+        case DROPBOX_COMMAND_UNPAUSE:
+            curl_easy_pause(job->easy, CURLPAUSE_CONT);
+            break;
+        case DROPBOX_COMMAND_CANCEL:
+            gfal2_dropbox_engine_finish(engine, job, CURLE_ABORTED_BY_CALLBACK);
+            break;
+    }
+}
+
+
+// Waits for activity on the transfers, or to be woken up
+static void gfal2_dropbox_engine_wait(DropboxEngine* engine, int timeout_ms)
+{
+#if DROPBOX_ENGINE_CURL_WAKEUP
+    curl_multi_poll(engine->multi, NULL, 0, timeout_ms, NULL);
+#else
+    struct curl_waitfd wakeup;
+    wakeup.fd = engine->wakeup_pipe[0];
+    wakeup.events = CURL_WAIT_POLLIN;
+    wakeup.revents = 0;
+    curl_multi_wait(engine->multi, &wakeup, wakeup.fd >= 0 ? 1 : 0, timeout_ms, NULL);
+    char drain[64];
+    while (wakeup.fd >= 0 && read(wakeup.fd, drain, sizeof(drain)) > 0)
+        ;
+#endif
+}
+
+
+// Can be called from any thread
+static void gfal2_dropbox_engine_wakeup(DropboxEngine* engine)
+{
+#if DROPBOX_ENGINE_CURL_WAKEUP
+    curl_multi_wakeup(engine->multi);
+#else
+    // If the pipe is full, the loop is about to wake up anyway
+    if (engine->wakeup_pipe[1] >= 0) {
+        ssize_t ret = write(engine->wakeup_pipe[1], "", 1);
+        (void)ret;
+    }
+#endif
+}
+
+
+static gpointer gfal2_dropbox_engine_loop(gpointer data)
+{
+    DropboxEngine* engine = (DropboxEngine*)data;
+    int running = 0;
+
+    g_mutex_lock(&engine->lock);
+    while (!engine->stop) {
+        DropboxJob* job;
+        while ((job = g_queue_pop_head(&engine->pending)) != NULL) {
+            curl_easy_setopt(job->easy, CURLOPT_PRIVATE, job);
+            curl_multi_add_handle(engine->multi, job->easy);
+            g_hash_table_insert(engine->active, job->easy, job);
+        }
+        GQueue commands = engine->commands;
+        g_queue_init(&engine->commands);
+        g_mutex_unlock(&engine->lock);
+
+        DropboxCommand* command;
+        while ((command = g_queue_pop_head(&commands)) != NULL) {
+            gfal2_dropbox_engine_run_command(engine, command);
+            g_free(command);
+        }
+
+        curl_multi_perform(engine->multi, &running);
+
+        CURLMsg* msg;
+        int msgs_left;
+        while ((msg = curl_multi_info_read(engine->multi, &msgs_left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            CURL* easy = msg->easy_handle;
+            CURLcode result = msg->data.result;
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char**)&job);
+            gfal2_dropbox_engine_finish(engine, job, result);
+        }
+
+        gfal2_dropbox_engine_wait(engine, 1000);
+        g_mutex_lock(&engine->lock);
+    }
+    g_mutex_unlock(&engine->lock);
+
+    return NULL;
+}
+
+
+DropboxEngine* gfal2_dropbox_engine_new(long max_host_connections, CURLSH* share,
+    DropboxEasySetup setup, void* setup_data)
+{
+    DropboxEngine* engine = g_new0(DropboxEngine, 1);
+    engine->share = share;
+
+    engine->multi = curl_multi_init();
+    curl_multi_setopt(engine->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    if (max_host_connections > 0) {
+        curl_multi_setopt(engine->multi, CURLMOPT_MAX_HOST_CONNECTIONS, max_host_connections);
+    }
+
+#if !DROPBOX_ENGINE_CURL_WAKEUP
+    // Without it, the event loop only notices new transfers on its next tick
+    if (pipe2(engine->wakeup_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        gfal2_log(G_LOG_LEVEL_WARNING, "Could not create the wake up pipe of the event loop: %s", strerror(errno));
+        engine->wakeup_pipe[0] = engine->wakeup_pipe[1] = -1;
+    }
+#endif
+
+    g_mutex_init(&engine->lock);
+    g_queue_init(&engine->pending);
+    g_queue_init(&engine->commands);
+    g_queue_init(&engine->idle);
+    engine->active = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    engine->setup = setup;
+    engine->setup_data = setup_data;
+    return engine;
+}
+
+
+void gfal2_dropbox_engine_free(DropboxEngine* engine)
+{
+    if (engine == NULL)
+        return;
+
+    g_mutex_lock(&engine->lock);
+    engine->stop = TRUE;
+    g_mutex_unlock(&engine->lock);
+
+    if (engine->thread) {
+        gfal2_dropbox_engine_wakeup(engine);
+        g_thread_join(engine->thread);
+    }
+
+    g_queue_foreach(&engine->commands, (GFunc)g_free, NULL);
+    g_queue_clear(&engine->commands);
+
+    // Only pre-connections may be left, which nobody waits for
+    DropboxJob* job;
+    while ((job = g_queue_pop_head(&engine->pending)) != NULL) {
+        job->done(job->easy, CURLE_ABORTED_BY_CALLBACK, job->user_data);
+        g_free(job);
+    }
+    GList* jobs = g_hash_table_get_values(engine->active);
+    GList* item;
+    for (item = jobs; item != NULL; item = item->next) {
+        gfal2_dropbox_engine_finish(engine, (DropboxJob*)item->data, CURLE_ABORTED_BY_CALLBACK);
+    }
+    g_list_free(jobs);
+
+    CURL* easy;
+    while ((easy = g_queue_pop_head(&engine->idle)) != NULL) {
+        curl_easy_cleanup(easy);
+    }
+    curl_multi_cleanup(engine->multi);
+    g_hash_table_destroy(engine->active);
+#if !DROPBOX_ENGINE_CURL_WAKEUP
+    if (engine->wakeup_pipe[0] >= 0) {
+        close(engine->wakeup_pipe[0]);
+        close(engine->wakeup_pipe[1]);
+    }
+#endif
+
+    g_mutex_clear(&engine->lock);
+    g_free(engine);
+}
+
+
+CURL* gfal2_dropbox_engine_acquire(DropboxEngine* engine)
+{
+    g_mutex_lock(&engine->lock);
+    CURL* easy = g_queue_pop_head(&engine->idle);
+    g_mutex_unlock(&engine->lock);
+
+    if (easy == NULL) {
+        easy = curl_easy_init();
+    }
+
+    // Prefer multiplexing over an existing connection rather than opening a new one
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    if (engine->share) {
+        curl_easy_setopt(easy, CURLOPT_SHARE, engine->share);
+    }
+    if (engine->setup) {
+        engine->setup(easy, engine->setup_data);
+    }
+    return easy;
+}
+
+
+void gfal2_dropbox_engine_release(DropboxEngine* engine, CURL* easy)
+{
+    curl_easy_reset(easy);
+
+    g_mutex_lock(&engine->lock);
+    if (engine->idle.length < DROPBOX_ENGINE_IDLE_HANDLES) {
+        g_queue_push_head(&engine->idle, easy);
+        easy = NULL;
+    }
+    g_mutex_unlock(&engine->lock);
+
+    if (easy) {
+        curl_easy_cleanup(easy);
+    }
+}
+
+
+void gfal2_dropbox_engine_submit(DropboxEngine* engine, CURL* easy,
+    DropboxEasyDone done, void* user_data)
+{
+    DropboxJob* job = g_new(DropboxJob, 1);
+    job->easy = easy;
+    job->done = done;
+    job->user_data = user_data;
+
+    g_mutex_lock(&engine->lock);
+    if (engine->thread == NULL) {
+        engine->thread = g_thread_new("dropbox_engine", gfal2_dropbox_engine_loop, engine);
+    }
+    g_queue_push_tail(&engine->pending, job);
+    g_mutex_unlock(&engine->lock);
+
+    gfal2_dropbox_engine_wakeup(engine);
+}
+
+
+static void gfal2_dropbox_engine_command(DropboxEngine* engine, enum DropboxCommandType type,
+    CURL* easy, void* user_data)
+{
+    DropboxCommand* command = g_new(DropboxCommand, 1);
+    command->type = type;
+    command->easy = easy;
+    command->user_data = user_data;
+
+    g_mutex_lock(&engine->lock);
+    g_queue_push_tail(&engine->commands, command);
+    g_mutex_unlock(&engine->lock);
+
+    gfal2_dropbox_engine_wakeup(engine);
+}
+
+
+void gfal2_dropbox_engine_unpause(DropboxEngine* engine, CURL* easy, void* user_data)
+{
+    gfal2_dropbox_engine_command(engine, DROPBOX_COMMAND_UNPAUSE, easy, user_data);
+}
+
+
+void gfal2_dropbox_engine_cancel(DropboxEngine* engine, CURL* easy, void* user_data)
+{
+    gfal2_dropbox_engine_command(engine, DROPBOX_COMMAND_CANCEL, easy, user_data);
+}
+
+
+static void gfal2_dropbox_engine_preconnected(CURL* easy, CURLcode result, void* user_data)
+{
+    DropboxEngine* engine = (DropboxEngine*)user_data;
+    if (result != CURLE_OK && result != CURLE_ABORTED_BY_CALLBACK) {
+        gfal2_log(G_LOG_LEVEL_DEBUG, "Could not pre-connect: %s", curl_easy_strerror(result));
+    }
+    gfal2_dropbox_engine_release(engine, easy);
+}
+
+
+void gfal2_dropbox_engine_preconnect(DropboxEngine* engine, const char* url)
+{
+    CURL* easy = gfal2_dropbox_engine_acquire(engine);
+    curl_easy_setopt(easy, CURLOPT_URL, url);
+    curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+    gfal2_dropbox_engine_submit(engine, easy, gfal2_dropbox_engine_preconnected, engine);
+}
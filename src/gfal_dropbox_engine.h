@@ -0,0 +1,71 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Request engine: runs all the transfers over a single curl multi handle,
+// so concurrent requests to the same host are multiplexed over a few HTTP/2 connections
+
+#pragma once
+#ifndef _GFAL_DROPBOX_ENGINE_H
+#define _GFAL_DROPBOX_ENGINE_H
+
+#include <curl/curl.h>
+#include <gfal_api.h>
+
+typedef struct DropboxEngine DropboxEngine;
+
+// Called for each easy handle handed out by the engine, after being reset
+typedef void (*DropboxEasySetup)(CURL* easy, void* user_data);
+
+// Called from the event loop thread when a transfer is done
+// It must not block, since that would delay all the other transfers
+typedef void (*DropboxEasyDone)(CURL* easy, CURLcode result, void* user_data);
+
+// Creates a new engine
+// The event loop thread is only started when the first request is submitted
+// If share is not NULL, all the easy handles use it. It must outlive the engine
+DropboxEngine* gfal2_dropbox_engine_new(long max_host_connections, CURLSH* share,
+    DropboxEasySetup setup, void* setup_data);
+
+// Stops the event loop and frees the engine
+// There must be no requests in flight, other than pre-connections, which are aborted
+void gfal2_dropbox_engine_free(DropboxEngine* engine);
+
+// Opens a connection to the host of url in the background, so it is ready for the
+// first request. It is done with a HEAD request, whose result is ignored
+void gfal2_dropbox_engine_preconnect(DropboxEngine* engine, const char* url);
+
+// Gets an easy handle, ready to be configured for a request
+CURL* gfal2_dropbox_engine_acquire(DropboxEngine* engine);
+
+// Gives back an easy handle obtained with gfal2_dropbox_engine_acquire
+void gfal2_dropbox_engine_release(DropboxEngine* engine, CURL* easy);
+
+// Queues the transfer configured in easy, and returns immediately
+// done is called once the transfer finishes, successfully or not
+void gfal2_dropbox_engine_submit(DropboxEngine* engine, CURL* easy,
+    DropboxEasyDone done, void* user_data);
+
+// Resumes a transfer paused by returning CURL_WRITEFUNC_PAUSE from its write callback
+// user_data must be the one given to gfal2_dropbox_engine_submit. If the transfer
+// is already over, this does nothing
+void gfal2_dropbox_engine_unpause(DropboxEngine* engine, CURL* easy, void* user_data);
+
+// Aborts a transfer. done is called with CURLE_ABORTED_BY_CALLBACK
+// user_data must be the one given to gfal2_dropbox_engine_submit. If the transfer
+// is already over, this does nothing
+void gfal2_dropbox_engine_cancel(DropboxEngine* engine, CURL* easy, void* user_data);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_entries.h"
+#include <string.h>
+
+
+DropboxEntries* gfal2_dropbox_entries_new(void)
+{
+    return g_new0(DropboxEntries, 1);
+}
+
+
+void gfal2_dropbox_entries_free(DropboxEntries* entries)
+{
+    if (entries == NULL)
+        return;
+    g_free(entries->names);
+    g_free(entries->name_offsets);
+    g_free(entries->sizes);
+    g_free(entries->mtimes);
+    g_free(entries->folders);
+    g_free(entries);
+}
+
+
+void gfal2_dropbox_entries_clear(DropboxEntries* entries)
+{
+    entries->names_length = 0;
+    entries->length = 0;
+}
+
+
+void gfal2_dropbox_entries_add(DropboxEntries* entries, const char* name, const struct stat* st)
+{
+    if (entries->length == entries->capacity) {
+        entries->capacity = MAX(entries->capacity * 2, 64);
+        entries->name_offsets = g_renew(guint32, entries->name_offsets, entries->capacity);
+        entries->sizes = g_renew(gint64, entries->sizes, entries->capacity);
+        entries->mtimes = g_renew(gint64, entries->mtimes, entries->capacity);
+        entries->folders = g_renew(guint8, entries->folders, entries->capacity);
+    }
+    size_t name_size = strlen(name) + 1;
+    if (entries->names_length + name_size > entries->names_capacity) {
+        entries->names_capacity = MAX(entries->names_capacity * 2, entries->names_length + name_size);
+        entries->names_capacity = MAX(entries->names_capacity, 4096);
+        entries->names = g_realloc(entries->names, entries->names_capacity);
+    }
+
+    guint i = entries->length++;
+    entries->name_offsets[i] = entries->names_length;
+    memcpy(entries->names + entries->names_length, name, name_size);
+    entries->names_length += name_size;
+    entries->sizes[i] = st->st_size;
+    entries->mtimes[i] = st->st_mtime;
+    entries->folders[i] = S_ISDIR(st->st_mode);
+}
+
+
+void gfal2_dropbox_entries_add_json(DropboxEntries* entries, json_object* list)
+{
+    int i, n = json_object_array_length(list);
+    for (i = 0; i < n; ++i) {
+        json_object* entry = json_object_array_get_idx(list, i);
+        json_object* name = NULL;
+        struct stat st;
+        if (!json_object_object_get_ex(entry, "name", &name) ||
+            gfal2_dropbox_parse_metadata(entry, &st, NULL, NULL) < 0) {
+            continue;
+        }
+        gfal2_dropbox_entries_add(entries, json_object_get_string(name), &st);
+    }
+}
+
+
+const char* gfal2_dropbox_entries_get(const DropboxEntries* entries, guint i, struct stat* st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode = 0700;
+    if (entries->folders[i])
+        st->st_mode |= S_IFDIR;
+    st->st_size = entries->sizes[i];
+    st->st_atime = st->st_mtime = st->st_ctime = entries->mtimes[i];
+    return entries->names + entries->name_offsets[i];
+}
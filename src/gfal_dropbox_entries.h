@@ -0,0 +1,56 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Directory entries
+// Listings are kept in columns: all the names in a single block, and the sizes,
+// times and kinds in arrays alongside, so an entry costs a few tens of bytes
+// on top of its name, instead of a parsed JSON object
+
+#pragma once
+#ifndef _GFAL_DROPBOX_ENTRIES_H
+#define _GFAL_DROPBOX_ENTRIES_H
+
+#include "gfal_dropbox.h"
+#include <json.h>
+
+typedef struct {
+    // Names, each NUL terminated, one after the other
+    char* names;
+    size_t names_length, names_capacity;
+    // Where the name of each entry starts in names
+    guint32* name_offsets;
+    gint64* sizes;
+    gint64* mtimes;
+    guint8* folders;
+    guint length, capacity;
+} DropboxEntries;
+
+DropboxEntries* gfal2_dropbox_entries_new(void);
+
+void gfal2_dropbox_entries_free(DropboxEntries* entries);
+
+// Removes all the entries, keeping the memory
+void gfal2_dropbox_entries_clear(DropboxEntries* entries);
+
+void gfal2_dropbox_entries_add(DropboxEntries* entries, const char* name, const struct stat* st);
+
+// Adds the entries of a list_folder page, skipping those deleted or of unknown kinds
+void gfal2_dropbox_entries_add_json(DropboxEntries* entries, json_object* list);
+
+// Name of entry i, with its metadata into st
+const char* gfal2_dropbox_entries_get(const DropboxEntries* entries, guint i, struct stat* st);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_hash.h"
+
+
+struct DropboxContentHash {
+    // Over the digests of the complete blocks
+    GChecksum* overall;
+    // Over the data of the current block
+    GChecksum* block;
+    size_t block_length;
+    guint64 length;
+};
+
+
+DropboxContentHash* gfal2_dropbox_hash_new(void)
+{
+    DropboxContentHash* hash = g_new0(DropboxContentHash, 1);
+    hash->overall = g_checksum_new(G_CHECKSUM_SHA256);
+    hash->block = g_checksum_new(G_CHECKSUM_SHA256);
+    return hash;
+}
+
+
+void gfal2_dropbox_hash_free(DropboxContentHash* hash)
+{
+    if (hash == NULL)
+        return;
+    g_checksum_free(hash->overall);
+    g_checksum_free(hash->block);
+    g_free(hash);
+}
+
+
+// Adds the digest of a block into the overall checksum
+static void gfal2_dropbox_hash_add_block(GChecksum* overall, GChecksum* block)
+{
+    guint8 digest[32];
+    gsize digest_len = sizeof(digest);
+    g_checksum_get_digest(block, digest, &digest_len);
+    g_checksum_update(overall, digest, digest_len);
+}
+
+
+void gfal2_dropbox_hash_update(DropboxContentHash* hash, const void* data, size_t size)
+{
+    const guint8* p = data;
+    while (size > 0) {
+        size_t n = MIN(size, DROPBOX_HASH_BLOCK_SIZE - hash->block_length);
+        g_checksum_update(hash->block, p, n);
+        hash->block_length += n;
+        hash->length += n;
+        p += n;
+        size -= n;
+
+        if (hash->block_length == DROPBOX_HASH_BLOCK_SIZE) {
+            gfal2_dropbox_hash_add_block(hash->overall, hash->block);
+            g_checksum_reset(hash->block);
+            hash->block_length = 0;
+        }
+    }
+}
+
+
+guint64 gfal2_dropbox_hash_length(DropboxContentHash* hash)
+{
+    return hash->length;
+}
+
+
+char* gfal2_dropbox_hash_get(DropboxContentHash* hash)
+{
+    // Getting a digest closes a checksum, so work on copies
+    GChecksum* overall = g_checksum_copy(hash->overall);
+    if (hash->block_length > 0) {
+        GChecksum* block = g_checksum_copy(hash->block);
+        gfal2_dropbox_hash_add_block(overall, block);
+        g_checksum_free(block);
+    }
+    char* result = g_strdup(g_checksum_get_string(overall));
+    g_checksum_free(overall);
+    return result;
+}
@@ -0,0 +1,45 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Dropbox content hash
+// SHA256 of the concatenation of the SHA256 of each 4 MiB block of the file
+// https://www.dropbox.com/developers/reference/content-hash
+
+#pragma once
+#ifndef _GFAL_DROPBOX_HASH_H
+#define _GFAL_DROPBOX_HASH_H
+
+#include <glib.h>
+
+#define DROPBOX_HASH_BLOCK_SIZE (4 * 1024 * 1024)
+
+typedef struct DropboxContentHash DropboxContentHash;
+
+DropboxContentHash* gfal2_dropbox_hash_new(void);
+
+void gfal2_dropbox_hash_free(DropboxContentHash* hash);
+
+// Feeds the next size bytes of the file
+void gfal2_dropbox_hash_update(DropboxContentHash* hash, const void* data, size_t size);
+
+// Number of bytes fed so far
+guint64 gfal2_dropbox_hash_length(DropboxContentHash* hash);
+
+// Content hash, as an hexadecimal string, of the data fed so far
+// More data can still be fed afterwards. The returned value must be freed with g_free
+char* gfal2_dropbox_hash_get(DropboxContentHash* hash);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_hedge.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Latencies the percentile is taken from
+#define DROPBOX_HEDGE_SAMPLES 128
+// The percentile is used once there are this many latencies, and recomputed as often
+#define DROPBOX_HEDGE_REFRESH 16
+// The budget is counted in hundredths of a duplicate, so each request earns budget of them
+#define DROPBOX_HEDGE_COST 100
+// Duplicates that can be saved up while there is no need for them
+#define DROPBOX_HEDGE_BURST (10 * DROPBOX_HEDGE_COST)
+
+
+struct DropboxHedge {
+    GMutex lock;
+    int percentile;
+    int budget;
+    int tokens;
+    gint64 delay;
+    gint64 samples[DROPBOX_HEDGE_SAMPLES];
+    unsigned recorded;
+};
+
+
+// Only reads, which do not change anything if sent twice
+static const char* idempotent_endpoints[] = {
+    "/2/files/get_metadata",
+    "/2/files/list_folder",
+    "/2/files/list_folder/continue",
+    NULL
+};
+
+
+DropboxHedge* gfal2_dropbox_hedge_new(int percentile, int initial_delay_ms, int budget)
+{
+    DropboxHedge* hedge = g_new0(DropboxHedge, 1);
+    g_mutex_init(&hedge->lock);
+    hedge->percentile = CLAMP(percentile, 1, 100);
+    hedge->delay = (gint64)initial_delay_ms * 1000;
+    hedge->budget = CLAMP(budget, 0, 100);
+    // Enough for the first slow request
+    hedge->tokens = DROPBOX_HEDGE_COST;
+    return hedge;
+}
+
+
+void gfal2_dropbox_hedge_free(DropboxHedge* hedge)
+{
+    if (hedge == NULL)
+        return;
+    g_mutex_clear(&hedge->lock);
+    g_free(hedge);
+}
+
+
+gboolean gfal2_dropbox_hedge_idempotent(const char* url)
+{
+    size_t url_len = strlen(url);
+    int i;
+    for (i = 0; idempotent_endpoints[i] != NULL; ++i) {
+        size_t len = strlen(idempotent_endpoints[i]);
+        if (url_len >= len && strcmp(url + url_len - len, idempotent_endpoints[i]) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+gint64 gfal2_dropbox_hedge_delay(DropboxHedge* hedge)
+{
+    g_mutex_lock(&hedge->lock);
+    gint64 delay = hedge->delay;
+    g_mutex_unlock(&hedge->lock);
+    return delay;
+}
+
+
+gboolean gfal2_dropbox_hedge_acquire(DropboxHedge* hedge)
+{
+    g_mutex_lock(&hedge->lock);
+    gboolean granted = (hedge->tokens >= DROPBOX_HEDGE_COST);
+    if (granted)
+        hedge->tokens -= DROPBOX_HEDGE_COST;
+    g_mutex_unlock(&hedge->lock);
+    return granted;
+}
+
+
+static int gfal2_dropbox_hedge_compare(const void* a, const void* b)
+{
+    gint64 first = *(const gint64*)a, second = *(const gint64*)b;
+    return (first > second) - (first < second);
+}
+
+
+void gfal2_dropbox_hedge_record(DropboxHedge* hedge, gint64 latency)
+{
+    g_mutex_lock(&hedge->lock);
+    hedge->samples[hedge->recorded % DROPBOX_HEDGE_SAMPLES] = latency;
+    ++hedge->recorded;
+    hedge->tokens = MIN(hedge->tokens + hedge->budget, DROPBOX_HEDGE_BURST);
+
+    if (hedge->recorded % DROPBOX_HEDGE_REFRESH == 0) {
+        gint64 sorted[DROPBOX_HEDGE_SAMPLES];
+        unsigned count = MIN(hedge->recorded, DROPBOX_HEDGE_SAMPLES);
+        memcpy(sorted, hedge->samples, count * sizeof(gint64));
+        qsort(sorted, count, sizeof(gint64), gfal2_dropbox_hedge_compare);
+        hedge->delay = sorted[(count * hedge->percentile - 1) / 100];
+    }
+    g_mutex_unlock(&hedge->lock);
+}
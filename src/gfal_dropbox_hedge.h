@@ -0,0 +1,49 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Hedged requests
+// A metadata request not answered within a percentile of the recent latencies
+// is sent once more, and whichever copy answers first is used
+// The duplicates are capped to a fraction of the requests
+
+#pragma once
+#ifndef _GFAL_DROPBOX_HEDGE_H
+#define _GFAL_DROPBOX_HEDGE_H
+
+#include <glib.h>
+
+typedef struct DropboxHedge DropboxHedge;
+
+// Duplicates are sent past the given percentile of the recent latencies, or past
+// initial_delay_ms until there are enough of them. At most budget percent
+// of the requests get a duplicate
+DropboxHedge* gfal2_dropbox_hedge_new(int percentile, int initial_delay_ms, int budget);
+
+void gfal2_dropbox_hedge_free(DropboxHedge* hedge);
+
+// Returns TRUE if requests to url can be sent twice without harm
+gboolean gfal2_dropbox_hedge_idempotent(const char* url);
+
+// How long to wait for an answer before sending a duplicate, in microseconds
+gint64 gfal2_dropbox_hedge_delay(DropboxHedge* hedge);
+
+// Takes a duplicate from the budget. Returns FALSE if there is none left
+gboolean gfal2_dropbox_hedge_acquire(DropboxHedge* hedge);
+
+// Records how long a request took to be answered, in microseconds
+void gfal2_dropbox_hedge_record(DropboxHedge* hedge, gint64 latency);
+
+#endif
@@ -0,0 +1,822 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_index.h"
+#include "gfal_dropbox_requests.h"
+#include <logger/gfal_logger.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Bump whenever the layout below changes
+#define DROPBOX_INDEX_MAGIC "GFALDBXI"
+#define DROPBOX_INDEX_VERSION 3
+
+// Paths longer than this are not indexed
+#define DROPBOX_INDEX_PATH_SIZE 512
+// Cursors longer than this are not kept, so those folders are listed again from scratch
+#define DROPBOX_INDEX_CURSOR_SIZE 1024
+// One folder cursor for this many entries
+#define DROPBOX_INDEX_CURSOR_RATIO 32
+// Past this many slots used, the index starts over
+#define DROPBOX_INDEX_LOAD(slots) ((slots) / 4 * 3)
+
+enum {
+    SLOT_EMPTY = 0,
+    SLOT_LIVE,
+    // Removed, but still part of a probe sequence
+    SLOT_DELETED
+};
+
+
+// All integers are in the byte order of the node, the index is not meant to be moved around
+typedef struct {
+    char magic[8];
+    guint32 version;
+    guint32 slot_count;
+    guint32 cursor_count;
+    // Slots not empty, either live or deleted
+    guint32 used;
+    // Set while being written, so what a crashed writer left behind is thrown away
+    guint32 dirty;
+    guint32 padding;
+    // Bumped on each invalidation, so what was fetched meanwhile is not stored
+    guint64 generation;
+} DropboxIndexHeader;
+
+
+// Entries, in an open addressing hash table keyed by their lowercased path
+// The folders above an entry are always there as well, so forgetting them reaches it
+typedef struct {
+    guint64 hash;
+    guint64 parent_hash;
+    guint32 state;
+    guint32 folder;
+    gint64 size;
+    gint64 mtime;
+    // Wall clock time when stored, in seconds
+    gint64 updated;
+    // The other entries of the same folder, as slot numbers plus one, 0 for none
+    guint32 previous;
+    guint32 next;
+    // Where the name starts in path
+    guint32 name_offset;
+    guint32 padding;
+    char rev[64];
+    char content_hash[72];
+    // As displayed
+    char path[DROPBOX_INDEX_PATH_SIZE];
+} DropboxIndexSlot;
+
+
+// Folders holding entries, in a table where a folder takes the place of any other with the same slot,
+// dropping its entries. Those listed in full also keep their cursor
+typedef struct {
+    guint64 folder_hash;
+    // Wall clock time of the last listing or refresh, in seconds. 0 once stale, or if never listed
+    gint64 listed_at;
+    // 0 if the cursor did not fit
+    guint32 length;
+    // First entry of the folder, as a slot number plus one, 0 for none
+    guint32 head;
+    char cursor[DROPBOX_INDEX_CURSOR_SIZE];
+} DropboxIndexCursor;
+
+
+struct DropboxIndex {
+    int fd;
+    size_t size;
+    gint64 max_age;
+    // Serializes the threads of this process, flock does it for the processes
+    // The flock is held by the open file, not the thread, so it can not tell threads apart
+    GMutex lock;
+    DropboxIndexHeader* header;
+    DropboxIndexSlot* slots;
+    DropboxIndexCursor* cursors;
+};
+
+
+static size_t gfal2_dropbox_index_size(guint32 slot_count, guint32 cursor_count)
+{
+    return sizeof(DropboxIndexHeader) + slot_count * sizeof(DropboxIndexSlot) +
+        cursor_count * sizeof(DropboxIndexCursor);
+}
+
+
+// As displayed, without the trailing slash. Must be freed with g_free
+static char* gfal2_dropbox_index_path(const char* path)
+{
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+        --len;
+    }
+    return len > 0 ? g_strndup(path, len) : g_strdup("/");
+}
+
+
+// Lowercased, without the trailing slash. Must be freed with g_free
+static char* gfal2_dropbox_index_key(const char* path)
+{
+    char* trimmed = gfal2_dropbox_index_path(path);
+    char* key = g_utf8_strdown(trimmed, -1);
+    g_free(trimmed);
+    return key;
+}
+
+
+// FNV-1a, never 0 so an empty cursor slot can not match
+static guint64 gfal2_dropbox_index_hash(const char* key, size_t len)
+{
+    guint64 hash = G_GUINT64_CONSTANT(14695981039346656037);
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        hash ^= (guchar)key[i];
+        hash *= G_GUINT64_CONSTANT(1099511628211);
+    }
+    return hash ? hash : 1;
+}
+
+
+static guint64 gfal2_dropbox_index_parent_hash(const char* key)
+{
+    const char* slash = strrchr(key, '/');
+    if (slash == NULL || slash == key)
+        return gfal2_dropbox_index_hash("/", 1);
+    return gfal2_dropbox_index_hash(key, slash - key);
+}
+
+
+DropboxIndex* gfal2_dropbox_index_open(const char* file_path, int slots, int max_age, GError** error)
+{
+    int fd = open(file_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__,
+            "Could not open the metadata index %s", file_path);
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX) < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__,
+            "Could not lock the metadata index %s", file_path);
+        close(fd);
+        return NULL;
+    }
+
+    DropboxIndexHeader header;
+    struct stat st;
+    ssize_t read_size = pread(fd, &header, sizeof(header), 0);
+    gboolean valid = (read_size == sizeof(header) && fstat(fd, &st) == 0 &&
+        memcmp(header.magic, DROPBOX_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == DROPBOX_INDEX_VERSION && header.slot_count > 0 && header.cursor_count > 0 &&
+        (size_t)st.st_size == gfal2_dropbox_index_size(header.slot_count, header.cursor_count));
+
+    if (!valid) {
+        if (read_size > 0) {
+            gfal2_log(G_LOG_LEVEL_WARNING, "The metadata index %s has another format, starting it over", file_path);
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DROPBOX_INDEX_MAGIC, sizeof(header.magic));
+        header.version = DROPBOX_INDEX_VERSION;
+        header.slot_count = slots > 0 ? slots : DROPBOX_DEFAULT_INDEX_SLOTS;
+        header.cursor_count = MAX(header.slot_count / DROPBOX_INDEX_CURSOR_RATIO, 16);
+        // Truncating first zeroes what was there
+        if (ftruncate(fd, 0) < 0 ||
+            ftruncate(fd, gfal2_dropbox_index_size(header.slot_count, header.cursor_count)) < 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            gfal2_set_error(error, dropbox_domain(), errno, __func__,
+                "Could not initialize the metadata index %s", file_path);
+            flock(fd, LOCK_UN);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    size_t size = gfal2_dropbox_index_size(header.slot_count, header.cursor_count);
+    char* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    flock(fd, LOCK_UN);
+    if (data == MAP_FAILED) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__,
+            "Could not map the metadata index %s", file_path);
+        close(fd);
+        return NULL;
+    }
+
+    DropboxIndex* index = g_new0(DropboxIndex, 1);
+    index->fd = fd;
+    index->size = size;
+    index->max_age = max_age;
+    g_mutex_init(&index->lock);
+    index->header = (DropboxIndexHeader*)data;
+    index->slots = (DropboxIndexSlot*)(data + sizeof(DropboxIndexHeader));
+    index->cursors = (DropboxIndexCursor*)(data + sizeof(DropboxIndexHeader) +
+        header.slot_count * sizeof(DropboxIndexSlot));
+
+    gfal2_log(G_LOG_LEVEL_DEBUG, "Metadata index %s open, with %u slots, %u in use",
+        file_path, header.slot_count, index->header->used);
+    return index;
+}
+
+
+void gfal2_dropbox_index_close(DropboxIndex* index)
+{
+    if (index == NULL)
+        return;
+    munmap(index->header, index->size);
+    close(index->fd);
+    g_mutex_clear(&index->lock);
+    g_free(index);
+}
+
+
+// Must be called with the write lock held
+static void gfal2_dropbox_index_wipe(DropboxIndex* index)
+{
+    DropboxIndexHeader* header = index->header;
+    memset(index->slots, 0, header->slot_count * sizeof(DropboxIndexSlot));
+    memset(index->cursors, 0, header->cursor_count * sizeof(DropboxIndexCursor));
+    header->used = 0;
+    header->generation++;
+}
+
+
+// Returns FALSE if the index can not be used right now
+static gboolean gfal2_dropbox_index_lock(DropboxIndex* index, gboolean write)
+{
+    g_mutex_lock(&index->lock);
+    if (flock(index->fd, write ? LOCK_EX : LOCK_SH) < 0) {
+        gfal2_log(G_LOG_LEVEL_WARNING, "Could not lock the metadata index: %s", strerror(errno));
+        g_mutex_unlock(&index->lock);
+        return FALSE;
+    }
+
+    if (index->header->dirty) {
+        // Whoever was writing died half way
+        if (!write) {
+            flock(index->fd, LOCK_UN);
+            g_mutex_unlock(&index->lock);
+            return FALSE;
+        }
+        gfal2_log(G_LOG_LEVEL_WARNING, "The metadata index was left half written, starting it over");
+        gfal2_dropbox_index_wipe(index);
+    }
+    if (write)
+        index->header->dirty = 1;
+    return TRUE;
+}
+
+
+static void gfal2_dropbox_index_unlock(DropboxIndex* index, gboolean write)
+{
+    if (write)
+        index->header->dirty = 0;
+    flock(index->fd, LOCK_UN);
+    g_mutex_unlock(&index->lock);
+}
+
+
+// Whether the slot is that of key, its path lowercased
+static gboolean gfal2_dropbox_index_matches(const DropboxIndexSlot* slot, const char* key)
+{
+    char* lower = g_utf8_strdown(slot->path, -1);
+    gboolean match = (strcmp(lower, key) == 0);
+    g_free(lower);
+    return match;
+}
+
+
+// Must be called with the lock held
+// Returns the slot of key, or if insert is set, where it would go. NULL if none
+static DropboxIndexSlot* gfal2_dropbox_index_find(DropboxIndex* index, const char* key, guint64 hash,
+    gboolean insert)
+{
+    guint32 count = index->header->slot_count;
+    guint32 i = hash % count, probes;
+    DropboxIndexSlot* free_slot = NULL;
+
+    for (probes = 0; probes < count; ++probes, i = (i + 1) % count) {
+        DropboxIndexSlot* slot = &index->slots[i];
+        if (slot->state == SLOT_EMPTY)
+            return insert ? (free_slot ? free_slot : slot) : NULL;
+        if (slot->state == SLOT_DELETED) {
+            if (free_slot == NULL)
+                free_slot = slot;
+        }
+        else if (slot->hash == hash && gfal2_dropbox_index_matches(slot, key)) {
+            return slot;
+        }
+    }
+    return insert ? free_slot : NULL;
+}
+
+
+// Must be called with the lock held
+// Returns the record of the folder, or NULL if it has none
+static DropboxIndexCursor* gfal2_dropbox_index_cursor(DropboxIndex* index, guint64 folder_hash)
+{
+    DropboxIndexCursor* cursor = &index->cursors[folder_hash % index->header->cursor_count];
+    return cursor->folder_hash == folder_hash ? cursor : NULL;
+}
+
+
+static void gfal2_dropbox_index_drop_entries(DropboxIndex* index, DropboxIndexCursor* record);
+
+
+// Must be called with the write lock held
+// Drops the slot, and whatever was below it
+static void gfal2_dropbox_index_delete(DropboxIndex* index, DropboxIndexSlot* slot)
+{
+    DropboxIndexCursor* parent = gfal2_dropbox_index_cursor(index, slot->parent_hash);
+    if (slot->previous)
+        index->slots[slot->previous - 1].next = slot->next;
+    else if (parent)
+        parent->head = slot->next;
+    if (slot->next)
+        index->slots[slot->next - 1].previous = slot->previous;
+    slot->previous = slot->next = 0;
+    slot->state = SLOT_DELETED;
+
+    DropboxIndexCursor* record = gfal2_dropbox_index_cursor(index, slot->hash);
+    if (record) {
+        gfal2_dropbox_index_drop_entries(index, record);
+        memset(record, 0, sizeof(*record));
+    }
+}
+
+
+// Must be called with the write lock held
+static void gfal2_dropbox_index_drop_entries(DropboxIndex* index, DropboxIndexCursor* record)
+{
+    while (record->head)
+        gfal2_dropbox_index_delete(index, &index->slots[record->head - 1]);
+}
+
+
+// Must be called with the write lock held
+// Returns the record of the folder, taking the place of the folder there, unless that one
+// is listed and replace_listed is not set. NULL if it can not be had
+static DropboxIndexCursor* gfal2_dropbox_index_record(DropboxIndex* index, guint64 folder_hash,
+    gboolean replace_listed, gint64 now)
+{
+    DropboxIndexCursor* record = &index->cursors[folder_hash % index->header->cursor_count];
+    if (record->folder_hash == folder_hash)
+        return record;
+    if (record->folder_hash != 0) {
+        if (!replace_listed && now - record->listed_at <= index->max_age)
+            return NULL;
+        // They could not be reached anymore
+        gfal2_dropbox_index_drop_entries(index, record);
+    }
+    memset(record, 0, sizeof(*record));
+    record->folder_hash = folder_hash;
+    return record;
+}
+
+
+static void gfal2_dropbox_index_fill(const DropboxIndexSlot* slot, struct stat* buf, DropboxFileInfo* info)
+{
+    memset(buf, 0, sizeof(*buf));
+    buf->st_mode = 0700;
+    if (slot->folder)
+        buf->st_mode |= S_IFDIR;
+    buf->st_size = slot->size;
+    buf->st_atime = buf->st_mtime = buf->st_ctime = slot->mtime;
+    if (info) {
+        g_strlcpy(info->rev, slot->rev, sizeof(info->rev));
+        g_strlcpy(info->content_hash, slot->content_hash, sizeof(info->content_hash));
+    }
+}
+
+
+int gfal2_dropbox_index_lookup(DropboxIndex* index, const char* path,
+    struct stat* buf, DropboxFileInfo* info, GError** error)
+{
+    if (index == NULL)
+        return 0;
+
+    char* key = gfal2_dropbox_index_key(path);
+    if (strcmp(key, "/") == 0 || strlen(key) >= DROPBOX_INDEX_PATH_SIZE || !gfal2_dropbox_index_lock(index, FALSE)) {
+        g_free(key);
+        return 0;
+    }
+
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+    int ret = 0;
+    DropboxIndexSlot* slot = gfal2_dropbox_index_find(index, key, gfal2_dropbox_index_hash(key, strlen(key)), FALSE);
+    if (slot) {
+        if (now - slot->updated <= index->max_age) {
+            gfal2_dropbox_index_fill(slot, buf, info);
+            ret = 1;
+        }
+    }
+    else {
+        DropboxIndexCursor* cursor = gfal2_dropbox_index_cursor(index, gfal2_dropbox_index_parent_hash(key));
+        if (cursor && now - cursor->listed_at <= index->max_age) {
+            gfal2_set_error(error, dropbox_domain(), ENOENT, __func__, "No such file or directory");
+            ret = -1;
+        }
+    }
+
+    gfal2_dropbox_index_unlock(index, FALSE);
+    g_free(key);
+    return ret;
+}
+
+
+// Must be called with the write lock held
+// Stores path, as displayed and without the trailing slash, and the folders above it if missing
+// Returns the slot, or NULL if it does not fit
+static DropboxIndexSlot* gfal2_dropbox_index_store(DropboxIndex* index, const char* path,
+    const struct stat* buf, const DropboxFileInfo* info, gint64 now)
+{
+    char* key = gfal2_dropbox_index_key(path);
+    guint64 hash = gfal2_dropbox_index_hash(key, strlen(key));
+    const char* slash = strrchr(path, '/');
+    DropboxIndexSlot* slot = NULL;
+    if (slash == NULL || strlen(path) >= DROPBOX_INDEX_PATH_SIZE || strlen(key) >= DROPBOX_INDEX_PATH_SIZE ||
+        strcmp(key, "/") == 0) {
+        goto out;
+    }
+
+    slot = gfal2_dropbox_index_find(index, key, hash, FALSE);
+    if (slot == NULL) {
+        // Linked from its folder, which has to be reachable as well
+        char* parent_path = (slash == path) ? NULL : g_strndup(path, slash - path);
+        char* parent_key = parent_path ? gfal2_dropbox_index_key(parent_path) : NULL;
+        guint64 parent_hash = gfal2_dropbox_index_parent_hash(key);
+        if (parent_key && gfal2_dropbox_index_find(index, parent_key, parent_hash, FALSE) == NULL) {
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_mode = 0700 | S_IFDIR;
+            gfal2_dropbox_index_store(index, parent_path, &st, NULL, now);
+        }
+        DropboxIndexCursor* parent = gfal2_dropbox_index_record(index, parent_hash, FALSE, now);
+        // Taking the record may have dropped the folder, if it was below the one replaced
+        if (parent && (parent_key == NULL || gfal2_dropbox_index_find(index, parent_key, parent_hash, FALSE))) {
+            slot = gfal2_dropbox_index_find(index, key, hash, TRUE);
+            if (slot && slot->state == SLOT_EMPTY && index->header->used >= DROPBOX_INDEX_LOAD(index->header->slot_count))
+                slot = NULL;
+        }
+        if (slot) {
+            if (slot->state == SLOT_EMPTY)
+                index->header->used++;
+            guint32 number = slot - index->slots + 1;
+            slot->previous = 0;
+            slot->next = parent->head;
+            if (parent->head)
+                index->slots[parent->head - 1].previous = number;
+            parent->head = number;
+            slot->hash = hash;
+            slot->parent_hash = parent_hash;
+            slot->state = SLOT_LIVE;
+        }
+        g_free(parent_key);
+        g_free(parent_path);
+        if (slot == NULL)
+            goto out;
+    }
+
+    slot->folder = S_ISDIR(buf->st_mode);
+    slot->size = buf->st_size;
+    slot->mtime = buf->st_mtime;
+    slot->updated = now;
+    g_strlcpy(slot->rev, info ? info->rev : "", sizeof(slot->rev));
+    g_strlcpy(slot->content_hash, info ? info->content_hash : "", sizeof(slot->content_hash));
+    g_strlcpy(slot->path, path, sizeof(slot->path));
+    slot->name_offset = slash + 1 - path;
+
+out:
+    g_free(key);
+    return slot;
+}
+
+
+// Must be called with the write lock held
+// Drops key and everything below
+static void gfal2_dropbox_index_forget(DropboxIndex* index, const char* key)
+{
+    if (strcmp(key, "/") == 0) {
+        gfal2_dropbox_index_wipe(index);
+        return;
+    }
+
+    guint64 hash = gfal2_dropbox_index_hash(key, strlen(key));
+    DropboxIndexSlot* slot = gfal2_dropbox_index_find(index, key, hash, FALSE);
+    if (slot)
+        gfal2_dropbox_index_delete(index, slot);
+
+    DropboxIndexCursor* cursor = gfal2_dropbox_index_cursor(index, hash);
+    if (cursor) {
+        gfal2_dropbox_index_drop_entries(index, cursor);
+        memset(cursor, 0, sizeof(*cursor));
+    }
+}
+
+
+guint64 gfal2_dropbox_index_generation(DropboxIndex* index)
+{
+    guint64 generation = 0;
+    if (index && gfal2_dropbox_index_lock(index, FALSE)) {
+        generation = index->header->generation;
+        gfal2_dropbox_index_unlock(index, FALSE);
+    }
+    return generation;
+}
+
+
+void gfal2_dropbox_index_put(DropboxIndex* index, const char* path,
+    const struct stat* buf, const DropboxFileInfo* info, guint64 generation)
+{
+    if (index == NULL)
+        return;
+
+    char* trimmed = gfal2_dropbox_index_path(path);
+    if (strcmp(trimmed, "/") != 0 && gfal2_dropbox_index_lock(index, TRUE)) {
+        // Otherwise, it may have changed since it was asked for
+        if (index->header->generation == generation) {
+            gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+            if (gfal2_dropbox_index_store(index, trimmed, buf, info, now) == NULL &&
+                index->header->used >= DROPBOX_INDEX_LOAD(index->header->slot_count)) {
+                gfal2_log(G_LOG_LEVEL_DEBUG, "The metadata index is full, starting it over");
+                gfal2_dropbox_index_wipe(index);
+                gfal2_dropbox_index_store(index, trimmed, buf, info, now);
+            }
+        }
+        gfal2_dropbox_index_unlock(index, TRUE);
+    }
+    g_free(trimmed);
+}
+
+
+void gfal2_dropbox_index_invalidate(DropboxIndex* index, const char* path)
+{
+    if (index == NULL)
+        return;
+
+    char* key = gfal2_dropbox_index_key(path);
+    if (gfal2_dropbox_index_lock(index, TRUE)) {
+        gfal2_dropbox_index_forget(index, key);
+        // The cursor of the parent is kept, the next listing picks the change up from there
+        DropboxIndexCursor* parent = gfal2_dropbox_index_cursor(index, gfal2_dropbox_index_parent_hash(key));
+        if (parent)
+            parent->listed_at = 0;
+        index->header->generation++;
+        gfal2_dropbox_index_unlock(index, TRUE);
+    }
+    g_free(key);
+}
+
+
+// Must be called with the lock held
+static void gfal2_dropbox_index_collect(DropboxIndex* index, const DropboxIndexCursor* record,
+    DropboxEntries* entries)
+{
+    guint32 number;
+    for (number = record->head; number; number = index->slots[number - 1].next) {
+        const DropboxIndexSlot* slot = &index->slots[number - 1];
+        struct stat st;
+        gfal2_dropbox_index_fill(slot, &st, NULL);
+        gfal2_dropbox_entries_add(entries, slot->path + slot->name_offset, &st);
+    }
+}
+
+
+// What the listing of a folder gathers, page by page
+typedef struct {
+    // Every entry received, to be indexed
+    json_object* all;
+    // Given the entries as they come when listing from scratch, NULL otherwise
+    DropboxEntries* entries;
+    size_t max_entries;
+} DropboxIndexListing;
+
+
+// Stops the listing once there are more entries than the index can take
+static gboolean gfal2_dropbox_index_page(json_object* list, void* user_data)
+{
+    DropboxIndexListing* listing = (DropboxIndexListing*)user_data;
+    if (listing->entries)
+        gfal2_dropbox_entries_add_json(listing->entries, list);
+
+    int i, n = json_object_array_length(list);
+    for (i = 0; i < n; ++i) {
+        json_object_array_add(listing->all, json_object_get(json_object_array_get_idx(list, i)));
+    }
+    return json_object_array_length(listing->all) <= listing->max_entries;
+}
+
+
+int gfal2_dropbox_index_list(DropboxHandle* dropbox, const char* folder,
+    DropboxEntries* entries, char** next_page, GError** error)
+{
+    *next_page = NULL;
+    DropboxIndex* index = dropbox->index;
+    if (index == NULL)
+        return 0;
+
+    char* key = gfal2_dropbox_index_key(folder);
+    guint64 folder_hash = gfal2_dropbox_index_hash(key, strlen(key));
+    int result = 0;
+    char* cursor = NULL;
+    guint64 generation = 0;
+    size_t max_entries = 0;
+
+    if (strlen(key) >= DROPBOX_INDEX_PATH_SIZE || !gfal2_dropbox_index_lock(index, FALSE)) {
+        g_free(key);
+        return 0;
+    }
+    DropboxIndexCursor* listed = gfal2_dropbox_index_cursor(index, folder_hash);
+    if (listed && g_get_real_time() / G_USEC_PER_SEC - listed->listed_at <= index->max_age) {
+        gfal2_dropbox_index_collect(index, listed, entries);
+        result = 1;
+    }
+    else if (listed && listed->length > 0) {
+        cursor = g_strndup(listed->cursor, listed->length);
+    }
+    generation = index->header->generation;
+    max_entries = DROPBOX_INDEX_LOAD(index->header->slot_count) / 2;
+    gfal2_dropbox_index_unlock(index, FALSE);
+
+    if (result) {
+        g_free(key);
+        return result;
+    }
+
+    // Bring it up to date, with only what changed if possible
+    GError* tmp_err = NULL;
+    char* next_cursor = NULL;
+    DropboxIndexListing listing = {json_object_new_array(), NULL, max_entries};
+    int ret = -1;
+    if (cursor) {
+        ret = gfal2_dropbox_list_folder(dropbox, folder, cursor, gfal2_dropbox_index_page, &listing,
+            &next_cursor, &tmp_err);
+        if (ret < 0) {
+            gfal2_log(G_LOG_LEVEL_DEBUG, "Could not continue the listing of %s, listing it again: %s",
+                folder, tmp_err->message);
+            g_clear_error(&tmp_err);
+        }
+        else if (ret == 0) {
+            gfal2_log(G_LOG_LEVEL_DEBUG, "Too many changes in %s, listing it again", folder);
+        }
+        if (ret <= 0) {
+            g_free(next_cursor);
+            next_cursor = NULL;
+            json_object_put(listing.all);
+            listing.all = json_object_new_array();
+            g_free(cursor);
+            cursor = NULL;
+        }
+    }
+    if (cursor == NULL) {
+        // The caller gets the entries even if they can not be indexed
+        listing.entries = entries;
+        ret = gfal2_dropbox_list_folder(dropbox, folder, NULL, gfal2_dropbox_index_page, &listing,
+            &next_cursor, &tmp_err);
+        result = (ret == 1);
+    }
+    if (ret <= 0) {
+        // Too many entries to be indexed, the caller goes on with the listing from where it stopped
+        if (ret == 0)
+            *next_page = next_cursor;
+        else
+            g_free(next_cursor);
+        json_object_put(listing.all);
+        g_free(key);
+        if (ret < 0) {
+            gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+            return -1;
+        }
+        return 0;
+    }
+
+    json_object* changes = listing.all;
+    if (gfal2_dropbox_index_lock(index, TRUE)) {
+        DropboxIndexHeader* header = index->header;
+        size_t n = json_object_array_length(changes);
+        gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+
+        // Along with the folders above
+        size_t depth = 0;
+        const char* c;
+        for (c = key; *c; ++c)
+            depth += (*c == '/');
+        gboolean room = (header->used + n + depth <= DROPBOX_INDEX_LOAD(header->slot_count));
+        if (header->generation != generation) {
+            // Changed while being listed, so what was received may be stale already
+            gfal2_log(G_LOG_LEVEL_DEBUG, "%s changed while being listed, not indexing it", folder);
+        }
+        else if (!room && cursor) {
+            // Starting over would lose what the changes apply to
+            gfal2_log(G_LOG_LEVEL_DEBUG, "No room in the metadata index for the changes of %s", folder);
+        }
+        else {
+            if (!room) {
+                gfal2_log(G_LOG_LEVEL_DEBUG, "No room in the metadata index for %s, starting it over", folder);
+                gfal2_dropbox_index_wipe(index);
+            }
+
+            // The folder itself first, so its entries are reached from above
+            char* path = gfal2_dropbox_index_path(folder);
+            gboolean root = (strcmp(key, "/") == 0);
+            DropboxIndexCursor* record = NULL;
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_mode = 0700 | S_IFDIR;
+            if (root || gfal2_dropbox_index_store(index, path, &st, NULL, now)) {
+                record = gfal2_dropbox_index_record(index, folder_hash, TRUE, now);
+                // Gone if it was below the folder whose place it took
+                if (!root && gfal2_dropbox_index_find(index, key, folder_hash, FALSE) == NULL)
+                    record = NULL;
+            }
+
+            if (record == NULL) {
+                gfal2_log(G_LOG_LEVEL_DEBUG, "%s does not fit in the metadata index, not indexing it", folder);
+            }
+            else {
+                // A listing from scratch replaces whatever was known, so what is not in it goes
+                guint32 number;
+                if (cursor == NULL) {
+                    for (number = record->head; number; number = index->slots[number - 1].next)
+                        index->slots[number - 1].updated = 0;
+                }
+
+                // Whether every entry made it in, otherwise the listing can not answer for the folder
+                gboolean stored_all = TRUE;
+                size_t i;
+                for (i = 0; i < n; ++i) {
+                    json_object* entry = json_object_array_get_idx(changes, i);
+                    json_object* name = NULL;
+                    if (!json_object_object_get_ex(entry, "name", &name))
+                        continue;
+
+                    char* entry_path = g_strconcat(root ? "" : path, "/", json_object_get_string(name), NULL);
+                    DropboxFileInfo info;
+                    if (gfal2_dropbox_parse_metadata(entry, &st, &info, NULL) == 0) {
+                        if (!gfal2_dropbox_index_store(index, entry_path, &st, &info, now))
+                            stored_all = FALSE;
+                    }
+                    else {
+                        // Deleted, or of a kind not supported
+                        char* entry_key = gfal2_dropbox_index_key(entry_path);
+                        gfal2_dropbox_index_forget(index, entry_key);
+                        g_free(entry_key);
+                    }
+                    g_free(entry_path);
+                }
+
+                if (cursor == NULL) {
+                    number = record->head;
+                    while (number) {
+                        DropboxIndexSlot* slot = &index->slots[number - 1];
+                        number = slot->next;
+                        if (slot->updated == 0)
+                            gfal2_dropbox_index_delete(index, slot);
+                    }
+                }
+
+                record->listed_at = 0;
+                record->length = 0;
+                if (!stored_all) {
+                    // It would answer ENOENT for what is missing, so it is listed from Dropbox instead
+                    gfal2_log(G_LOG_LEVEL_DEBUG, "Some entries of %s do not fit in the metadata index, not indexing it", folder);
+                }
+                else {
+                    record->listed_at = now;
+                    size_t cursor_len = next_cursor ? strlen(next_cursor) : 0;
+                    if (cursor_len <= sizeof(record->cursor)) {
+                        memcpy(record->cursor, next_cursor, cursor_len);
+                        record->length = cursor_len;
+                    }
+                    // Listed from scratch, the caller has the entries already
+                    if (cursor) {
+                        gfal2_dropbox_index_collect(index, record, entries);
+                        result = 1;
+                    }
+                    gfal2_log(G_LOG_LEVEL_DEBUG, "Indexed %s: %zu %s, %u entries",
+                        folder, n, cursor ? "changes" : "entries", entries->length);
+                }
+            }
+            g_free(path);
+        }
+        gfal2_dropbox_index_unlock(index, TRUE);
+    }
+
+    json_object_put(changes);
+    g_free(next_cursor);
+    g_free(cursor);
+    g_free(key);
+    return result;
+}
@@ -0,0 +1,66 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Metadata index
+// What is known about the namespace is kept in a memory mapped file, shared by all
+// the processes of the node, so a new process does not start from scratch
+// Folders listed in full keep their cursor, so they are refreshed with what changed since
+
+#pragma once
+#ifndef _GFAL_DROPBOX_INDEX_H
+#define _GFAL_DROPBOX_INDEX_H
+
+#include "gfal_dropbox.h"
+#include "gfal_dropbox_entries.h"
+
+#define DROPBOX_DEFAULT_INDEX_SLOTS 16384
+
+typedef struct DropboxIndex DropboxIndex;
+
+// An entry of a folder, as listed from the index
+// Opens, or creates, the index at file_path, with room for slots entries
+// An existing index keeps its own size. One with a different format is started over
+// Entries older than max_age seconds are not used
+DropboxIndex* gfal2_dropbox_index_open(const char* file_path, int slots, int max_age, GError** error);
+
+void gfal2_dropbox_index_close(DropboxIndex* index);
+
+// Looks path up. If it is not there, but its parent has been listed, it does not exist
+// Returns 1 if found, in which case buf, and info if not NULL, are filled,
+// -1 with ENOENT if known not to exist, 0 if it is not known
+int gfal2_dropbox_index_lookup(DropboxIndex* index, const char* path,
+    struct stat* buf, DropboxFileInfo* info, GError** error);
+
+// Current generation of the index, which changes with each invalidation
+guint64 gfal2_dropbox_index_generation(DropboxIndex* index);
+
+// Records the metadata of a path, as it was when the index was at generation
+// Nothing is recorded if the index has been invalidated since. info can be NULL
+void gfal2_dropbox_index_put(DropboxIndex* index, const char* path,
+    const struct stat* buf, const DropboxFileInfo* info, guint64 generation);
+
+// Lists folder into entries, from the index if it is fresh enough, bringing it up to date otherwise
+// Returns 1 if listed, 0 if the folder can not be listed through the index, -1 on error
+// For a folder with too many entries to be indexed, 0 is returned with its first pages in entries,
+// and next_page set to the cursor the listing goes on from
+int gfal2_dropbox_index_list(DropboxHandle* dropbox, const char* folder,
+    DropboxEntries* entries, char** next_page, GError** error);
+
+// Forgets path and its descendants, and marks its parent to be refreshed
+// To be called whenever the namespace is modified
+void gfal2_dropbox_index_invalidate(DropboxIndex* index, const char* path);
+
+#endif
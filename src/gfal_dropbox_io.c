@@ -17,38 +17,77 @@
 // Input/Output functions
 
 #include "gfal_dropbox.h"
+#include "gfal_dropbox_cache.h"
+#include "gfal_dropbox_hash.h"
+#include "gfal_dropbox_journal.h"
+#include "gfal_dropbox_json.h"
+#include "gfal_dropbox_metrics.h"
+#include "gfal_dropbox_progress.h"
 #include "gfal_dropbox_requests.h"
+#include "gfal_dropbox_staging.h"
+#include "gfal_dropbox_stream.h"
 #include "gfal_dropbox_url.h"
+#include <logger/gfal_logger.h>
 #include <json.h>
 #include <string.h>
+#include <unistd.h>
 
 
 struct DropboxIOHandler {
     int  flag;
+    // Opened with O_TRUNC, so the commit replaces whatever file is there
+    gboolean overwrite;
     char path[GFAL_URL_MAX_LEN];
     char session_id[128];
 
     off_t size;
     off_t offset;
+    // Reads are pinned to the revision seen on open
+    DropboxFileInfo info;
+
+    // Download kept open for sequential reads
+    DropboxStream* stream;
+    // Or the copy in the download cache, -1 if none
+    int cache_fd;
+    // Set while the copy is being downloaded
+    DropboxCacheFill* cache_fill;
+    gboolean cache_tried;
+    // Data written, but not yet sent
+    DropboxStaging* staging;
+
+    // Set if the upload is journaled, so it can be resumed
+    char* journal_path;
+    // Of the data acknowledged so far
+    DropboxContentHash* hash;
+    char first_block_hash[65];
+    // When resuming, what was uploaded before the interruption
+    // Data written up to there is only checked against the journal
+    DropboxJournal resume;
+    // The first block being checked, kept in case the upload has to start over
+    GByteArray* resume_prefix;
+
+    DropboxProgress progress;
 };
 typedef struct DropboxIOHandler DropboxIOHandler;
 
 
 static int gfal2_dropbox_open_write(DropboxHandle *dropbox, DropboxIOHandler *io_handler, GError **error)
 {
-    char output[512];
+    DropboxBuffer* output = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    char endpoint[GFAL_URL_MAX_LEN];
     ssize_t ret = gfal2_dropbox_perform(dropbox,
-        M_POST, "https://content.dropboxapi.com/2/files/upload_session/start",
+        M_POST, gfal2_dropbox_content_url(dropbox, "/2/files/upload_session/start", endpoint, sizeof(endpoint)),
         0, 0,
-        (char*)output, sizeof(output),
+        output,
         "application/octet-stream", NULL, 0,
         error,
         0);
+    json_object *resp = ret < 0 ? NULL : gfal2_dropbox_buffer_json(output);
+    gfal2_dropbox_buffer_release(dropbox->buffers, output);
     if (ret < 0) {
         return -1;
     }
 
-    json_object *resp = json_tokener_parse(output);
     json_object *session_id = NULL;
     if (!json_object_object_get_ex(resp, "session_id", &session_id)) {
         json_object_put(resp);
@@ -61,6 +100,103 @@ static int gfal2_dropbox_open_write(DropboxHandle *dropbox, DropboxIOHandler *io
 }
 
 
+// If the response says the upload session is somewhere else, get where
+static gboolean gfal2_dropbox_correct_offset(const DropboxBuffer* output, off_t* correct_offset)
+{
+    json_object *resp = gfal2_dropbox_buffer_json(output);
+    json_object *error_obj = NULL, *tag = NULL, *offset = NULL;
+    gboolean found = FALSE;
+
+    if (json_object_object_get_ex(resp, "error", &error_obj) &&
+        json_object_object_get_ex(error_obj, ".tag", &tag) &&
+        g_strcmp0(json_object_get_string(tag), "incorrect_offset") == 0 &&
+        json_object_object_get_ex(error_obj, "correct_offset", &offset)) {
+        *correct_offset = json_object_get_int64(offset);
+        found = TRUE;
+    }
+    json_object_put(resp);
+    return found;
+}
+
+
+// Writes into arg the Dropbox-API-Arg of an upload session request
+// With a commit_path, it finishes the session into that file, replacing it if overwrite is set
+static void gfal2_dropbox_upload_arg(DropboxBuffer* arg, const char* session_id, off_t offset,
+    const char* commit_path, gboolean overwrite)
+{
+    DropboxJsonWriter writer;
+    gfal2_dropbox_json_init(&writer, arg, TRUE);
+    gfal2_dropbox_json_begin(&writer, NULL);
+    gfal2_dropbox_json_begin(&writer, "cursor");
+    gfal2_dropbox_json_string(&writer, "session_id", session_id);
+    gfal2_dropbox_json_int64(&writer, "offset", offset);
+    gfal2_dropbox_json_end(&writer);
+    if (commit_path) {
+        gfal2_dropbox_json_begin(&writer, "commit");
+        gfal2_dropbox_json_string(&writer, "path", commit_path);
+        gfal2_dropbox_json_string(&writer, "mode", overwrite ? "overwrite" : "add");
+        gfal2_dropbox_json_end(&writer);
+    }
+    gfal2_dropbox_json_end(&writer);
+}
+
+
+// Gets where an upload session is, by appending nothing to it
+// Returns -1 if the session is gone
+static off_t gfal2_dropbox_session_offset(DropboxHandle *dropbox, const char* session_id, off_t offset,
+    GError **error)
+{
+    DropboxBuffer* arg = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    gfal2_dropbox_upload_arg(arg, session_id, offset, NULL, FALSE);
+
+    GError* tmp_err = NULL;
+    DropboxBuffer* output = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    char endpoint[GFAL_URL_MAX_LEN];
+    ssize_t ret = gfal2_dropbox_perform(dropbox,
+        M_POST, gfal2_dropbox_content_url(dropbox, "/2/files/upload_session/append_v2", endpoint, sizeof(endpoint)),
+        0, 0,
+        output,
+        "application/octet-stream", NULL, 0,
+        &tmp_err,
+        1, "Dropbox-API-Arg", arg->data);
+    gfal2_dropbox_buffer_release(dropbox->buffers, arg);
+
+    gboolean found = (ret >= 0 || gfal2_dropbox_correct_offset(output, &offset));
+    gfal2_dropbox_buffer_release(dropbox->buffers, output);
+    if (!found) {
+        gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+        return -1;
+    }
+    g_clear_error(&tmp_err);
+    return offset;
+}
+
+
+// Picks up the session of an interrupted upload to the same path, if there is one still open
+static void gfal2_dropbox_resume_write(DropboxHandle *dropbox, DropboxIOHandler *io_handler)
+{
+    DropboxJournal journal;
+    if (!gfal2_dropbox_journal_load(io_handler->journal_path, io_handler->path, &journal))
+        return;
+
+    GError* tmp_err = NULL;
+    off_t offset = gfal2_dropbox_session_offset(dropbox, journal.session_id, journal.offset, &tmp_err);
+    if (offset < journal.offset) {
+        gfal2_log(G_LOG_LEVEL_INFO, "Can not resume the upload to %s, starting over: %s",
+            io_handler->path, tmp_err ? tmp_err->message : "the session is behind the journal");
+        g_clear_error(&tmp_err);
+        gfal2_dropbox_journal_remove(io_handler->journal_path);
+        return;
+    }
+
+    gfal2_log(G_LOG_LEVEL_INFO, "Resuming the upload to %s after %lld bytes",
+        io_handler->path, (long long)journal.offset);
+    io_handler->resume = journal;
+    g_strlcpy(io_handler->session_id, journal.session_id, sizeof(io_handler->session_id));
+    io_handler->resume_prefix = g_byte_array_sized_new(MIN(journal.offset, DROPBOX_HASH_BLOCK_SIZE));
+}
+
+
 gfal_file_handle gfal2_dropbox_fopen(plugin_handle plugin_data, const char* url,
         int flag, mode_t mode, GError** error)
 {
@@ -69,15 +205,24 @@ gfal_file_handle gfal2_dropbox_fopen(plugin_handle plugin_data, const char* url,
     struct stat st;
     st.st_size = 0;
 
+    char path[GFAL_URL_MAX_LEN];
+    if (gfal2_dropbox_extract_path(url, path, sizeof(path)) == NULL) {
+        gfal2_set_error(error, dropbox_domain(), EINVAL, __func__, "Invalid Dropbox url");
+        return NULL;
+    }
+
+    int create = flag & O_CREAT;
+    int truncate = flag & O_TRUNC;
     flag &= O_ACCMODE;
     if (flag == O_RDWR) {
         gfal2_set_error(error, dropbox_domain(), EISDIR, __func__, "Only support read-only or write-only");
         return NULL;
     }
 
-    int ret = gfal2_dropbox_stat(plugin_data, url, &st, &tmp_err);
+    DropboxFileInfo info;
+    int ret = gfal2_dropbox_get_metadata(dropbox, path, &st, &info, &tmp_err);
     if (ret < 0) {
-        if (tmp_err->code == ENOENT && (mode & O_CREAT)) {
+        if (tmp_err->code == ENOENT && create) {
             g_error_free(tmp_err);
             tmp_err = NULL;
         }
@@ -92,18 +237,38 @@ gfal_file_handle gfal2_dropbox_fopen(plugin_handle plugin_data, const char* url,
     }
 
     DropboxIOHandler* io_handler = calloc(1, sizeof(DropboxIOHandler));
-    gfal2_dropbox_extract_path(url, io_handler->path, sizeof(io_handler->path));
+    g_strlcpy(io_handler->path, path, sizeof(io_handler->path));
     io_handler->flag = flag;
+    io_handler->overwrite = (flag == O_WRONLY && truncate);
+    io_handler->cache_fd = -1;
+    if (ret == 0) {
+        io_handler->info = info;
+    }
 
     if (flag == O_WRONLY) {
-        if (gfal2_dropbox_open_write(dropbox, io_handler, error) < 0) {
+        io_handler->journal_path = gfal2_dropbox_journal_path(dropbox, io_handler->path);
+        if (io_handler->journal_path) {
+            io_handler->hash = gfal2_dropbox_hash_new();
+            gfal2_dropbox_resume_write(dropbox, io_handler);
+        }
+        if (io_handler->session_id[0] == '\0' && gfal2_dropbox_open_write(dropbox, io_handler, error) < 0) {
+            gfal2_dropbox_hash_free(io_handler->hash);
+            g_free(io_handler->journal_path);
             free(io_handler);
             return NULL;
         }
+        if (dropbox->upload_chunk_size > 0) {
+            io_handler->staging = gfal2_dropbox_staging_new(dropbox->upload_chunk_size,
+                dropbox->staging_memory, dropbox->staging_dir);
+        }
     }
 
     io_handler->offset = 0;
     io_handler->size = st.st_size;
+    if (flag == O_WRONLY)
+        gfal2_dropbox_progress_start(&io_handler->progress, dropbox, NULL, io_handler->path);
+    else
+        gfal2_dropbox_progress_start(&io_handler->progress, dropbox, io_handler->path, NULL);
     return gfal_file_handle_new2(gfal2_dropbox_getName(), io_handler, NULL, url);
 }
 
@@ -122,29 +287,332 @@ ssize_t gfal2_dropbox_fread(plugin_handle plugin_data, gfal_file_handle fd, void
     if (io_handler->offset >= io_handler->size)
         return 0;
 
-    json_object *req = json_object_new_object();
-    json_object *path = json_object_new_string(io_handler->path);
-    json_object_object_add(req, "path", path);
-
-    const char *req_str = json_object_to_json_string(req);
+    char source[GFAL_URL_MAX_LEN];
+    if (io_handler->info.rev[0] != '\0') {
+        snprintf(source, sizeof(source), "rev:%s", io_handler->info.rev);
+    }
+    else {
+        g_strlcpy(source, io_handler->path, sizeof(source));
+    }
 
-    ssize_t ret = gfal2_dropbox_perform(dropbox, M_POST, "https://content.dropboxapi.com/2/files/download",
-        io_handler->offset, count,
-        (char*)buff, count,
-        "text/plain", NULL, 0,
-        error,
-        1, "Dropbox-API-Arg", req_str);
+    // The same content may be there already, or be worth keeping for the next ones
+    if (dropbox->cache && !io_handler->cache_tried && io_handler->info.content_hash[0] != '\0') {
+        GError* tmp_err = NULL;
+        io_handler->cache_tried = TRUE;
+        io_handler->cache_fd = gfal2_dropbox_cache_open(dropbox, source, io_handler->info.content_hash,
+            io_handler->size, &io_handler->cache_fill, &tmp_err);
+        if (tmp_err) {
+            gfal2_log(G_LOG_LEVEL_WARNING, "Reading %s without the download cache: %s",
+                io_handler->path, tmp_err->message);
+            g_error_free(tmp_err);
+        }
+    }
+    // While the copy is downloaded, what arrived so far is served from it
+    if (io_handler->cache_fill) {
+        GError* tmp_err = NULL;
+        ssize_t ret = gfal2_dropbox_cache_fill_read(io_handler->cache_fill, io_handler->cache_fd,
+            buff, count, io_handler->offset, &tmp_err);
+        if (ret >= 0) {
+            io_handler->offset += ret;
+            gfal2_dropbox_progress_update(&io_handler->progress, ret);
+            return ret;
+        }
+        gfal2_log(G_LOG_LEVEL_WARNING, "Reading %s without the download cache: %s",
+            io_handler->path, tmp_err->message);
+        g_error_free(tmp_err);
+        gfal2_dropbox_cache_fill_free(io_handler->cache_fill);
+        io_handler->cache_fill = NULL;
+        close(io_handler->cache_fd);
+        io_handler->cache_fd = -1;
+    }
+    if (io_handler->cache_fd >= 0) {
+        ssize_t ret = pread(io_handler->cache_fd, buff, count, io_handler->offset);
+        if (ret < 0) {
+            gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not read from the download cache");
+            return -1;
+        }
+        io_handler->offset += ret;
+        gfal2_dropbox_progress_update(&io_handler->progress, ret);
+        return ret;
+    }
 
-    json_object_put(req);
+    // Keep reading from the open download, unless the caller moved somewhere else
+    if (io_handler->stream && gfal2_dropbox_stream_offset(io_handler->stream) != io_handler->offset) {
+        gfal2_dropbox_stream_close(io_handler->stream);
+        io_handler->stream = NULL;
+    }
+    if (io_handler->stream == NULL) {
+        io_handler->stream = gfal2_dropbox_stream_open(dropbox, source, io_handler->offset,
+            io_handler->size, dropbox->stream_buffer_size, error);
+        if (io_handler->stream == NULL) {
+            return -1;
+        }
+    }
 
+    ssize_t ret = gfal2_dropbox_stream_read(io_handler->stream, buff, count, error);
     if (ret >= 0) {
         io_handler->offset += ret;
+        gfal2_dropbox_progress_update(&io_handler->progress, ret);
+    }
+    else {
+        // Start over on the next read
+        gfal2_dropbox_stream_close(io_handler->stream);
+        io_handler->stream = NULL;
     }
 
     return ret;
 }
 
 
+// Errors that may go away by sending again
+static gboolean gfal2_dropbox_is_transient(const GError* error)
+{
+    return error->code == EIO || error->code == EBUSY || error->code == ETIMEDOUT;
+}
+
+
+// Sends data at the current offset of the upload session, appending it or,
+// if commit is set, finishing the session with it
+// data must stay the same between attempts, so it can be sent again if something fails
+// On a commit, the metadata of the file is returned in metadata, if not NULL
+static int gfal2_dropbox_upload(DropboxHandle* dropbox, DropboxIOHandler* io_handler,
+    const char* data, size_t size, const char* commit_path, json_object** metadata, GError** error)
+{
+    char endpoint[GFAL_URL_MAX_LEN];
+    if (commit_path) {
+        gfal2_dropbox_content_url(dropbox, "/2/files/upload_session/finish", endpoint, sizeof(endpoint));
+    }
+    else {
+        gfal2_dropbox_content_url(dropbox, "/2/files/upload_session/append_v2", endpoint, sizeof(endpoint));
+    }
+
+    const off_t base = io_handler->offset;
+    int attempt = 0;
+    int result = -1;
+    DropboxBuffer* output = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    DropboxBuffer* arg = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+
+    while (TRUE) {
+        size_t skip = io_handler->offset - base;
+
+        gfal2_dropbox_buffer_reset(arg);
+        gfal2_dropbox_upload_arg(arg, io_handler->session_id, io_handler->offset, commit_path,
+            io_handler->overwrite);
+
+        DropboxRequest* request = gfal2_dropbox_request_new(M_POST, endpoint);
+        gfal2_dropbox_request_set_payload(request, "application/octet-stream", data + skip, size - skip);
+        gfal2_dropbox_request_add_header(request, "Dropbox-API-Arg", arg->data);
+        gfal2_dropbox_request_set_output(request, output);
+        gfal2_dropbox_request_set_low_speed(request, dropbox->low_speed_limit, dropbox->low_speed_time);
+        gfal2_dropbox_request_set_retries(request, attempt);
+
+        GError* tmp_err = NULL;
+        ssize_t ret = -1;
+        if (gfal2_dropbox_request_submit(dropbox, request, &tmp_err) == 0) {
+            ret = gfal2_dropbox_request_wait(request, &tmp_err);
+        }
+        gfal2_dropbox_request_free(request);
+
+        if (ret >= 0) {
+            io_handler->offset = base + size;
+            if (metadata)
+                *metadata = gfal2_dropbox_buffer_json(output);
+            result = 0;
+            break;
+        }
+
+        // Dropbox may have got part, or all, of the data before the failure
+        off_t correct_offset;
+        gboolean resync = gfal2_dropbox_correct_offset(output, &correct_offset) &&
+            correct_offset >= base && correct_offset <= (off_t)(base + size);
+
+        if (attempt >= dropbox->upload_retries || !(resync || gfal2_dropbox_is_transient(tmp_err))) {
+            gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+            break;
+        }
+        ++attempt;
+        gfal2_dropbox_metrics_retry(dropbox->metrics, DROPBOX_RETRY_UPLOAD);
+
+        if (resync) {
+            gfal2_log(G_LOG_LEVEL_INFO, "Upload session is at %lld, resending from there", (long long)correct_offset);
+            io_handler->offset = correct_offset;
+            // Nothing left to append, but a commit still has to go
+            if (correct_offset == (off_t)(base + size) && commit_path == NULL) {
+                g_error_free(tmp_err);
+                result = 0;
+                break;
+            }
+        }
+        else {
+            gulong backoff = MIN(500000UL << (attempt - 1), 8 * G_USEC_PER_SEC);
+            gfal2_log(G_LOG_LEVEL_WARNING, "Upload of %zu bytes at %lld failed (%s), retrying in %lu ms",
+                size - skip, (long long)io_handler->offset, tmp_err->message, backoff / 1000);
+            g_usleep(backoff);
+        }
+        g_error_free(tmp_err);
+    }
+
+    gfal2_dropbox_buffer_release(dropbox->buffers, arg);
+    gfal2_dropbox_buffer_release(dropbox->buffers, output);
+    return result;
+}
+
+
+// Feeds acknowledged data into the content hash
+static void gfal2_dropbox_hash_acknowledged(DropboxIOHandler* io_handler, const char* data, size_t size)
+{
+    guint64 length = gfal2_dropbox_hash_length(io_handler->hash);
+    if (length < DROPBOX_HASH_BLOCK_SIZE) {
+        size_t n = MIN(size, DROPBOX_HASH_BLOCK_SIZE - length);
+        gfal2_dropbox_hash_update(io_handler->hash, data, n);
+        char* first_block_hash = gfal2_dropbox_hash_get(io_handler->hash);
+        g_strlcpy(io_handler->first_block_hash, first_block_hash, sizeof(io_handler->first_block_hash));
+        g_free(first_block_hash);
+        data += n;
+        size -= n;
+    }
+    gfal2_dropbox_hash_update(io_handler->hash, data, size);
+}
+
+
+// Appends data to the upload session, and records it in the journal
+static int gfal2_dropbox_append(DropboxHandle* dropbox, DropboxIOHandler* io_handler,
+    const char* data, size_t size, GError** error)
+{
+    if (gfal2_dropbox_upload(dropbox, io_handler, data, size, NULL, NULL, error) < 0)
+        return -1;
+    if (io_handler->journal_path == NULL)
+        return 0;
+
+    gfal2_dropbox_hash_acknowledged(io_handler, data, size);
+
+    DropboxJournal journal;
+    g_strlcpy(journal.session_id, io_handler->session_id, sizeof(journal.session_id));
+    journal.offset = io_handler->offset;
+    char* content_hash = gfal2_dropbox_hash_get(io_handler->hash);
+    g_strlcpy(journal.content_hash, content_hash, sizeof(journal.content_hash));
+    g_free(content_hash);
+    g_strlcpy(journal.first_block_hash, io_handler->first_block_hash, sizeof(journal.first_block_hash));
+
+    // The upload can go on without it, it just could not be resumed
+    GError* tmp_err = NULL;
+    if (gfal2_dropbox_journal_save(io_handler->journal_path, io_handler->path, &journal, &tmp_err) < 0) {
+        gfal2_log(G_LOG_LEVEL_WARNING, "%s", tmp_err->message);
+        g_error_free(tmp_err);
+    }
+    return 0;
+}
+
+
+// Sends the data, directly or in chunks
+static int gfal2_dropbox_send(DropboxHandle* dropbox, DropboxIOHandler* io_handler,
+    const char* data, size_t size, GError** error)
+{
+    // Without staging, the buffer of the caller is sent as it is
+    if (io_handler->staging == NULL) {
+        if (size == 0)
+            return 0;
+        return gfal2_dropbox_append(dropbox, io_handler, data, size, error);
+    }
+
+    // Otherwise, it is sent in chunks
+    size_t consumed = 0;
+    while (consumed < size) {
+        ssize_t n = gfal2_dropbox_staging_append(io_handler->staging, data + consumed, size - consumed, error);
+        if (n < 0) {
+            return -1;
+        }
+        consumed += n;
+
+        if (gfal2_dropbox_staging_full(io_handler->staging)) {
+            if (gfal2_dropbox_append(dropbox, io_handler,
+                    gfal2_dropbox_staging_data(io_handler->staging),
+                    gfal2_dropbox_staging_length(io_handler->staging),
+                    error) < 0) {
+                return -1;
+            }
+            gfal2_dropbox_staging_reset(io_handler->staging);
+        }
+    }
+    return 0;
+}
+
+
+// Drops the interrupted upload, and starts a new one with what has been written so far
+static int gfal2_dropbox_restart_write(DropboxHandle* dropbox, DropboxIOHandler* io_handler, GError** error)
+{
+    GByteArray* prefix = io_handler->resume_prefix;
+    io_handler->resume_prefix = NULL;
+    gfal2_dropbox_journal_remove(io_handler->journal_path);
+    memset(&io_handler->resume, 0, sizeof(io_handler->resume));
+
+    gfal2_dropbox_hash_free(io_handler->hash);
+    io_handler->hash = gfal2_dropbox_hash_new();
+    io_handler->offset = 0;
+
+    int ret = gfal2_dropbox_open_write(dropbox, io_handler, error);
+    if (ret == 0)
+        ret = gfal2_dropbox_send(dropbox, io_handler, (const char*)prefix->data, prefix->len, error);
+    g_byte_array_free(prefix, TRUE);
+    return ret;
+}
+
+
+// Checks data written when resuming against what was uploaded before the interruption
+// Returns how much of data was consumed, or -1 on error
+static ssize_t gfal2_dropbox_verify_write(DropboxHandle* dropbox, DropboxIOHandler* io_handler,
+    const char* data, size_t size, GError** error)
+{
+    size_t consumed = 0;
+
+    while (consumed < size && io_handler->offset < io_handler->resume.offset) {
+        // The first block is checked on its own, so a different file is noticed early
+        off_t first_block_end = MIN(io_handler->resume.offset, DROPBOX_HASH_BLOCK_SIZE);
+        off_t checkpoint = io_handler->offset < first_block_end ? first_block_end : io_handler->resume.offset;
+
+        size_t n = MIN(size - consumed, (size_t)(checkpoint - io_handler->offset));
+        gfal2_dropbox_hash_acknowledged(io_handler, data + consumed, n);
+        if (io_handler->resume_prefix)
+            g_byte_array_append(io_handler->resume_prefix, (const guint8*)data + consumed, n);
+        io_handler->offset += n;
+        consumed += n;
+        if (io_handler->offset < checkpoint)
+            break;
+
+        char* content_hash = gfal2_dropbox_hash_get(io_handler->hash);
+        const char* expected = (checkpoint == io_handler->resume.offset) ?
+            io_handler->resume.content_hash : io_handler->resume.first_block_hash;
+        gboolean match = (strcmp(content_hash, expected) == 0);
+        g_free(content_hash);
+
+        if (match) {
+            if (io_handler->resume_prefix) {
+                g_byte_array_free(io_handler->resume_prefix, TRUE);
+                io_handler->resume_prefix = NULL;
+            }
+            if (checkpoint == io_handler->resume.offset) {
+                gfal2_log(G_LOG_LEVEL_DEBUG, "The %lld bytes uploaded before the interruption match",
+                    (long long)checkpoint);
+            }
+        }
+        else if (io_handler->resume_prefix) {
+            gfal2_log(G_LOG_LEVEL_INFO, "The upload to %s is not the one interrupted, starting over",
+                io_handler->path);
+            if (gfal2_dropbox_restart_write(dropbox, io_handler, error) < 0)
+                return -1;
+            return consumed;
+        }
+        else {
+            gfal2_dropbox_journal_remove(io_handler->journal_path);
+            gfal2_set_error(error, dropbox_domain(), EIO, __func__,
+                "The data written does not match what was uploaded before the interruption");
+            return -1;
+        }
+    }
+    return consumed;
+}
+
+
 ssize_t gfal2_dropbox_fwrite(plugin_handle plugin_data, gfal_file_handle fd,
         const void* buff, size_t count, GError** error)
 {
@@ -156,76 +624,101 @@ ssize_t gfal2_dropbox_fwrite(plugin_handle plugin_data, gfal_file_handle fd,
         return -1;
     }
 
-    json_object *req = json_object_new_object();
-    json_object *cursor = json_object_new_object();
-    json_object *session_id = json_object_new_string(io_handler->session_id);
-    json_object *offset = json_object_new_int64(io_handler->offset);
-
-    json_object_object_add(cursor, "session_id", session_id);
-    json_object_object_add(cursor, "offset", offset);
-    json_object_object_add(req, "cursor", cursor);
-
-    const char *req_str = json_object_to_json_string(req);
+    // What was already uploaded is not sent again
+    ssize_t verified = 0;
+    if (io_handler->offset < io_handler->resume.offset) {
+        verified = gfal2_dropbox_verify_write(dropbox, io_handler, buff, count, error);
+        if (verified < 0) {
+            return -1;
+        }
+    }
 
-    char output[1024];
-    ssize_t ret = gfal2_dropbox_perform(dropbox,
-        M_POST, "https://content.dropboxapi.com/2/files/upload_session/append_v2",
-        0, 0,
-        output, sizeof(output),
-        "application/octet-stream", buff, count,
-        error,
-        1, "Dropbox-API-Arg", req_str);
-    json_object_put(req);
-    if (ret < 0) {
+    if (gfal2_dropbox_send(dropbox, io_handler, (const char*)buff + verified, count - verified, error) < 0) {
         return -1;
     }
-
-    io_handler->offset += count;
+    gfal2_dropbox_progress_update(&io_handler->progress, count);
     return count;
 }
 
 
-int gfal2_dropbox_fclose(plugin_handle plugin_data, gfal_file_handle fd, GError **error)
+static void gfal2_dropbox_handler_free(gfal_file_handle fd)
 {
-    DropboxHandle* dropbox = (DropboxHandle*)plugin_data;
     DropboxIOHandler* io_handler = gfal_file_handle_get_fdesc(fd);
+    gfal2_dropbox_progress_end(&io_handler->progress);
+    gfal2_dropbox_stream_close(io_handler->stream);
+    gfal2_dropbox_cache_fill_free(io_handler->cache_fill);
+    if (io_handler->cache_fd >= 0)
+        close(io_handler->cache_fd);
+    gfal2_dropbox_staging_free(io_handler->staging);
+    gfal2_dropbox_hash_free(io_handler->hash);
+    if (io_handler->resume_prefix)
+        g_byte_array_free(io_handler->resume_prefix, TRUE);
+    g_free(io_handler->journal_path);
+    free(io_handler);
+    gfal_file_handle_delete(fd);
+}
 
-    if (io_handler->flag == O_WRONLY) {
-        json_object *req = json_object_new_object();
 
-        json_object *cursor = json_object_new_object();
-        json_object *session_id = json_object_new_string(io_handler->session_id);
-        json_object *offset = json_object_new_int64(io_handler->offset);
+int gfal2_dropbox_fclose(plugin_handle plugin_data, gfal_file_handle fd, GError **error)
+{
+    DropboxHandle* dropbox = (DropboxHandle*)plugin_data;
+    DropboxIOHandler* io_handler = gfal_file_handle_get_fdesc(fd);
 
-        json_object_object_add(cursor, "session_id", session_id);
-        json_object_object_add(cursor, "offset", offset);
+    if (io_handler->flag == O_WRONLY && io_handler->offset < io_handler->resume.offset) {
+        // Finishing would commit the data from the interrupted upload beyond what was written
+        gfal2_dropbox_journal_remove(io_handler->journal_path);
+        gfal2_set_error(error, dropbox_domain(), EIO, __func__,
+            "Less data written than what was uploaded before the interruption");
+    }
+    else if (io_handler->flag == O_WRONLY) {
+        // Whatever is still staged goes with the commit
+        const char* data = NULL;
+        size_t size = 0;
+        if (io_handler->staging) {
+            data = gfal2_dropbox_staging_data(io_handler->staging);
+            size = gfal2_dropbox_staging_length(io_handler->staging);
+        }
 
-        json_object *commit = json_object_new_object();
-        json_object *path = json_object_new_string(io_handler->path);
-        json_object *add = json_object_new_string("add");
+        json_object *metadata = NULL;
+        if (gfal2_dropbox_upload(dropbox, io_handler, data, size, io_handler->path,
+                io_handler->hash ? &metadata : NULL, error) == 0 && io_handler->hash) {
+            // A resumed upload is stitched together, so make sure the result is right
+            gfal2_dropbox_hash_acknowledged(io_handler, data, size);
+            char* content_hash = gfal2_dropbox_hash_get(io_handler->hash);
+            json_object *remote_hash = NULL;
+            if (json_object_object_get_ex(metadata, "content_hash", &remote_hash) &&
+                g_strcmp0(json_object_get_string(remote_hash), content_hash) != 0) {
+                gfal2_set_error(error, dropbox_domain(), EIO, __func__,
+                    "The content hash of the uploaded file does not match: %s != %s",
+                    json_object_get_string(remote_hash), content_hash);
+            }
+            g_free(content_hash);
+            gfal2_dropbox_journal_remove(io_handler->journal_path);
+        }
+        json_object_put(metadata);
+        gfal2_dropbox_forget(dropbox, io_handler->path);
+    }
 
-        json_object_object_add(commit, "path", path);
-        json_object_object_add(commit, "mode", add);
+    gfal2_dropbox_handler_free(fd);
+    return *error?-1:0;
+}
 
-        json_object_object_add(req, "cursor", cursor);
-        json_object_object_add(req, "commit", commit);
 
-        const char *req_str = json_object_to_json_string(req);
-        char output[1024];
+void gfal2_dropbox_fmonitor(plugin_handle plugin_data, gfal_file_handle fd, gfalt_params_t params,
+    const char* src, const char* dst)
+{
+    DropboxIOHandler* io_handler = gfal_file_handle_get_fdesc(fd);
+    gfal2_dropbox_progress_monitor(&io_handler->progress, params, src, dst);
+}
 
-        gfal2_dropbox_perform(dropbox,
-            M_POST, "https://content.dropboxapi.com/2/files/upload_session/finish",
-            0, 0,
-            output, sizeof(output),
-            "application/octet-stream", NULL, 0,
-            error,
-            1, "Dropbox-API-Arg", req_str);
-        json_object_put(req);
-    }
 
-    free(io_handler);
-    gfal_file_handle_delete(fd);
-    return *error?-1:0;
+void gfal2_dropbox_fabort(plugin_handle plugin_data, gfal_file_handle fd)
+{
+    DropboxIOHandler* io_handler = gfal_file_handle_get_fdesc(fd);
+    // The upload session is left to expire, and is not to be resumed
+    if (io_handler->journal_path)
+        gfal2_dropbox_journal_remove(io_handler->journal_path);
+    gfal2_dropbox_handler_free(fd);
 }
 
 
@@ -0,0 +1,114 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_journal.h"
+#include <logger/gfal_logger.h>
+#include <string.h>
+#include <unistd.h>
+
+#define JOURNAL_GROUP "upload"
+
+
+char* gfal2_dropbox_journal_path(DropboxHandle* dropbox, const char* path)
+{
+    if (dropbox->journal_dir == NULL || dropbox->journal_dir[0] == '\0')
+        return NULL;
+
+    // Dropbox paths are case insensitive
+    char* lower = g_utf8_strdown(path, -1);
+    char* key = g_compute_checksum_for_string(G_CHECKSUM_SHA1, lower, -1);
+    char* name = g_strconcat(key, ".journal", NULL);
+    char* journal_path = g_build_filename(dropbox->journal_dir, name, NULL);
+    g_free(name);
+    g_free(key);
+    g_free(lower);
+    return journal_path;
+}
+
+
+gboolean gfal2_dropbox_journal_load(const char* journal_path, const char* path, DropboxJournal* journal)
+{
+    GKeyFile* key_file = g_key_file_new();
+    gboolean found = FALSE;
+
+    if (g_key_file_load_from_file(key_file, journal_path, G_KEY_FILE_NONE, NULL)) {
+        char* journal_target = g_key_file_get_string(key_file, JOURNAL_GROUP, "path", NULL);
+        char* session_id = g_key_file_get_string(key_file, JOURNAL_GROUP, "session_id", NULL);
+        char* content_hash = g_key_file_get_string(key_file, JOURNAL_GROUP, "content_hash", NULL);
+        char* first_block_hash = g_key_file_get_string(key_file, JOURNAL_GROUP, "first_block_hash", NULL);
+        GError* tmp_err = NULL;
+        gint64 offset = g_key_file_get_int64(key_file, JOURNAL_GROUP, "offset", &tmp_err);
+
+        if (tmp_err == NULL && journal_target && session_id && content_hash && first_block_hash &&
+            g_ascii_strcasecmp(journal_target, path) == 0) {
+            g_strlcpy(journal->session_id, session_id, sizeof(journal->session_id));
+            g_strlcpy(journal->content_hash, content_hash, sizeof(journal->content_hash));
+            g_strlcpy(journal->first_block_hash, first_block_hash, sizeof(journal->first_block_hash));
+            journal->offset = offset;
+            found = TRUE;
+        }
+        else {
+            gfal2_log(G_LOG_LEVEL_WARNING, "Ignoring the invalid upload journal %s", journal_path);
+        }
+
+        g_clear_error(&tmp_err);
+        g_free(journal_target);
+        g_free(session_id);
+        g_free(content_hash);
+        g_free(first_block_hash);
+    }
+
+    g_key_file_free(key_file);
+    return found;
+}
+
+
+int gfal2_dropbox_journal_save(const char* journal_path, const char* path,
+    const DropboxJournal* journal, GError** error)
+{
+    char* dir = g_path_get_dirname(journal_path);
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+
+    GKeyFile* key_file = g_key_file_new();
+    g_key_file_set_string(key_file, JOURNAL_GROUP, "path", path);
+    g_key_file_set_string(key_file, JOURNAL_GROUP, "session_id", journal->session_id);
+    g_key_file_set_int64(key_file, JOURNAL_GROUP, "offset", journal->offset);
+    g_key_file_set_string(key_file, JOURNAL_GROUP, "content_hash", journal->content_hash);
+    g_key_file_set_string(key_file, JOURNAL_GROUP, "first_block_hash", journal->first_block_hash);
+
+    GError* tmp_err = NULL;
+    // Written into a temporary file, and renamed over the previous one
+    g_key_file_save_to_file(key_file, journal_path, &tmp_err);
+    g_key_file_free(key_file);
+
+    if (tmp_err) {
+        gfal2_set_error(error, dropbox_domain(), EIO, __func__,
+            "Could not write the upload journal %s: %s", journal_path, tmp_err->message);
+        g_error_free(tmp_err);
+        return -1;
+    }
+    return 0;
+}
+
+
+void gfal2_dropbox_journal_remove(const char* journal_path)
+{
+    if (unlink(journal_path) < 0 && errno != ENOENT) {
+        gfal2_log(G_LOG_LEVEL_WARNING, "Could not remove the upload journal %s: %s",
+            journal_path, strerror(errno));
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Upload journal
+// Keeps track on disk of the upload sessions still open, so an upload
+// interrupted with the process can be resumed by a later write to the same path
+
+#pragma once
+#ifndef _GFAL_DROPBOX_JOURNAL_H
+#define _GFAL_DROPBOX_JOURNAL_H
+
+#include "gfal_dropbox.h"
+
+typedef struct {
+    char session_id[128];
+    // Bytes acknowledged by Dropbox
+    off_t offset;
+    // Content hash of the acknowledged bytes
+    char content_hash[65];
+    // Content hash of the first block of the acknowledged bytes
+    char first_block_hash[65];
+} DropboxJournal;
+
+// Path of the journal for uploads to path
+// Returns NULL if journaling is disabled. Must be freed with g_free
+char* gfal2_dropbox_journal_path(DropboxHandle* dropbox, const char* path);
+
+// Loads the journal, returning FALSE if there is none, or it does not belong to path
+gboolean gfal2_dropbox_journal_load(const char* journal_path, const char* path, DropboxJournal* journal);
+
+// Replaces the journal atomically
+int gfal2_dropbox_journal_save(const char* journal_path, const char* path,
+    const DropboxJournal* journal, GError** error);
+
+// Removes the journal, once the upload is over
+void gfal2_dropbox_journal_remove(const char* journal_path);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_json.h"
+#include <stdio.h>
+#include <string.h>
+
+
+void gfal2_dropbox_json_init(DropboxJsonWriter* writer, DropboxBuffer* buffer, gboolean ascii)
+{
+    writer->buffer = buffer;
+    writer->ascii = ascii;
+    writer->comma = FALSE;
+}
+
+
+static void gfal2_dropbox_json_escape(DropboxJsonWriter* writer, const char* value)
+{
+    DropboxBuffer* buffer = writer->buffer;
+    // Bytes from here on are copied as they are, until something needs escaping
+    const char* run = value;
+    const char* p = value;
+    char escaped[16];
+
+    gfal2_dropbox_buffer_append(buffer, "\"", 1);
+    while (*p) {
+        unsigned char c = (unsigned char)*p;
+        const char* replacement = escaped;
+        size_t consumed = 1;
+
+        switch (c) {
+            case '"':
+                replacement = "\\\"";
+                break;
+            case '\\':
+                replacement = "\\\\";
+                break;
+            case '\b':
+                replacement = "\\b";
+                break;
+            case '\f':
+                replacement = "\\f";
+                break;
+            case '\n':
+                replacement = "\\n";
+                break;
+            case '\r':
+                replacement = "\\r";
+                break;
+            case '\t':
+                replacement = "\\t";
+                break;
+            default:
+                if (c < 0x20 || (writer->ascii && c == 0x7F)) {
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                }
+                else if (writer->ascii && c >= 0x80) {
+                    gunichar u = g_utf8_get_char_validated(p, -1);
+                    if (u == (gunichar)-1 || u == (gunichar)-2) {
+                        // Not UTF-8, so at least keep the header valid
+                        u = 0xFFFD;
+                    }
+                    else {
+                        consumed = g_utf8_next_char(p) - p;
+                    }
+                    // Outside of the BMP, as a surrogate pair
+                    if (u >= 0x10000) {
+                        u -= 0x10000;
+                        snprintf(escaped, sizeof(escaped), "\\u%04x\\u%04x",
+                            0xD800 + (u >> 10), 0xDC00 + (u & 0x3FF));
+                    }
+                    else {
+                        snprintf(escaped, sizeof(escaped), "\\u%04x", u);
+                    }
+                }
+                else {
+                    ++p;
+                    continue;
+                }
+        }
+
+        gfal2_dropbox_buffer_append(buffer, run, p - run);
+        gfal2_dropbox_buffer_append(buffer, replacement, strlen(replacement));
+        p += consumed;
+        run = p;
+    }
+    gfal2_dropbox_buffer_append(buffer, run, p - run);
+    gfal2_dropbox_buffer_append(buffer, "\"", 1);
+}
+
+
+static void gfal2_dropbox_json_key(DropboxJsonWriter* writer, const char* key)
+{
+    if (writer->comma)
+        gfal2_dropbox_buffer_append(writer->buffer, ",", 1);
+    if (key) {
+        gfal2_dropbox_json_escape(writer, key);
+        gfal2_dropbox_buffer_append(writer->buffer, ":", 1);
+    }
+    writer->comma = TRUE;
+}
+
+
+void gfal2_dropbox_json_begin(DropboxJsonWriter* writer, const char* key)
+{
+    gfal2_dropbox_json_key(writer, key);
+    gfal2_dropbox_buffer_append(writer->buffer, "{", 1);
+    writer->comma = FALSE;
+}
+
+
+void gfal2_dropbox_json_end(DropboxJsonWriter* writer)
+{
+    gfal2_dropbox_buffer_append(writer->buffer, "}", 1);
+    writer->comma = TRUE;
+}
+
+
+void gfal2_dropbox_json_begin_array(DropboxJsonWriter* writer, const char* key)
+{
+    gfal2_dropbox_json_key(writer, key);
+    gfal2_dropbox_buffer_append(writer->buffer, "[", 1);
+    writer->comma = FALSE;
+}
+
+
+void gfal2_dropbox_json_end_array(DropboxJsonWriter* writer)
+{
+    gfal2_dropbox_buffer_append(writer->buffer, "]", 1);
+    writer->comma = TRUE;
+}
+
+
+void gfal2_dropbox_json_string(DropboxJsonWriter* writer, const char* key, const char* value)
+{
+    gfal2_dropbox_json_key(writer, key);
+    gfal2_dropbox_json_escape(writer, value);
+}
+
+
+void gfal2_dropbox_json_int64(DropboxJsonWriter* writer, const char* key, gint64 value)
+{
+    char number[24];
+    int len = snprintf(number, sizeof(number), "%" G_GINT64_FORMAT, value);
+    gfal2_dropbox_json_key(writer, key);
+    gfal2_dropbox_buffer_append(writer->buffer, number, len);
+}
+
+
+void gfal2_dropbox_json_boolean(DropboxJsonWriter* writer, const char* key, gboolean value)
+{
+    gfal2_dropbox_json_key(writer, key);
+    if (value)
+        gfal2_dropbox_buffer_append(writer->buffer, "true", 4);
+    else
+        gfal2_dropbox_buffer_append(writer->buffer, "false", 5);
+}
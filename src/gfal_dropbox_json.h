@@ -0,0 +1,59 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// JSON encoder for the request arguments
+// Writes straight into a DropboxBuffer, without building a tree first
+
+#pragma once
+#ifndef _GFAL_DROPBOX_JSON_H
+#define _GFAL_DROPBOX_JSON_H
+
+#include "gfal_dropbox_buffer.h"
+
+typedef struct {
+    DropboxBuffer* buffer;
+    // Escape everything outside of printable ASCII, as required in HTTP headers
+    gboolean ascii;
+    // A member has already been written into the current object
+    gboolean comma;
+} DropboxJsonWriter;
+
+// Prepares writer to append to buffer
+// Set ascii if the result goes into a header (i.e. Dropbox-API-Arg)
+void gfal2_dropbox_json_init(DropboxJsonWriter* writer, DropboxBuffer* buffer, gboolean ascii);
+
+// Opens an object. key is the member name, or NULL for the top level object
+void gfal2_dropbox_json_begin(DropboxJsonWriter* writer, const char* key);
+
+// Closes the current object
+void gfal2_dropbox_json_end(DropboxJsonWriter* writer);
+
+// Opens an array. Its elements are written with a NULL key
+void gfal2_dropbox_json_begin_array(DropboxJsonWriter* writer, const char* key);
+
+// Closes the current array
+void gfal2_dropbox_json_end_array(DropboxJsonWriter* writer);
+
+// Writes a string member, or array element if key is NULL. value must be valid UTF-8
+void gfal2_dropbox_json_string(DropboxJsonWriter* writer, const char* key, const char* value);
+
+// Writes an integer member
+void gfal2_dropbox_json_int64(DropboxJsonWriter* writer, const char* key, gint64 value);
+
+// Writes a boolean member
+void gfal2_dropbox_json_boolean(DropboxJsonWriter* writer, const char* key, gboolean value);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_metrics.h"
+#include <logger/gfal_logger.h>
+#include <string.h>
+
+// Counters are only ever added to, and read one by one, so relaxed ordering is enough
+#define METRIC_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define METRIC_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// Outcomes of a request
+enum {
+    DROPBOX_OUTCOME_2XX,
+    DROPBOX_OUTCOME_409,
+    DROPBOX_OUTCOME_429,
+    DROPBOX_OUTCOME_5XX,
+    DROPBOX_OUTCOME_OTHER,
+    DROPBOX_OUTCOME_FAILED,
+    DROPBOX_OUTCOMES
+};
+
+static const char* outcome_labels[DROPBOX_OUTCOMES] = {
+    "2xx", "409", "429", "5xx", "other", "failed"
+};
+
+// Upper bounds of the latency buckets, in microseconds. The last one is +Inf
+static const gint64 latency_bounds[] = {
+    5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 30000000
+};
+#define DROPBOX_LATENCY_BUCKETS (G_N_ELEMENTS(latency_bounds) + 1)
+
+// Endpoints are counted apart, anything else goes to the last one
+static const char* endpoints[] = {
+    "/2/files/get_metadata",
+    "/2/files/list_folder",
+    "/2/files/list_folder/continue",
+    "/2/files/download",
+    "/2/files/upload_session/start",
+    "/2/files/upload_session/append_v2",
+    "/2/files/upload_session/finish",
+    "/2/files/create_folder_v2",
+    "/2/files/create_folder_batch",
+    "/2/files/create_folder_batch/check",
+    "/2/files/delete_v2",
+    "/2/files/move_v2",
+    "other"
+};
+#define DROPBOX_ENDPOINTS G_N_ELEMENTS(endpoints)
+
+static const char* retry_labels[DROPBOX_RETRY_KINDS] = {
+    "auth", "upload", "download"
+};
+
+static const char* stat_labels[DROPBOX_STAT_SOURCES] = {
+    "index", "listing", "request"
+};
+
+
+typedef struct {
+    guint64 outcomes[DROPBOX_OUTCOMES];
+    guint64 sent, received;
+    guint64 latency[DROPBOX_LATENCY_BUCKETS];
+    guint64 latency_sum;
+} DropboxEndpointMetrics;
+
+
+struct DropboxMetrics {
+    DropboxHandle* dropbox;
+    DropboxEndpointMetrics endpoints[DROPBOX_ENDPOINTS];
+    guint64 retries[DROPBOX_RETRY_KINDS];
+    guint64 stats[DROPBOX_STAT_SOURCES];
+    guint64 cache_hits, cache_misses;
+    guint64 hedges, hedges_won;
+
+    // Periodic dump
+    char* dump_file;
+    gint64 dump_interval;
+    GThread* dump_thread;
+    GMutex lock;
+    GCond cond;
+    gboolean stopping;
+};
+
+
+static void gfal2_dropbox_metrics_dump(DropboxMetrics* metrics)
+{
+    char* text = gfal2_dropbox_metrics_text(metrics);
+    GError* error = NULL;
+    // Written aside and renamed, so readers never see half of it
+    if (!g_file_set_contents(metrics->dump_file, text, -1, &error)) {
+        gfal2_log(G_LOG_LEVEL_WARNING, "Could not write the metrics into %s: %s",
+            metrics->dump_file, error->message);
+        g_error_free(error);
+    }
+    g_free(text);
+}
+
+
+static gpointer gfal2_dropbox_metrics_dump_loop(gpointer data)
+{
+    DropboxMetrics* metrics = (DropboxMetrics*)data;
+    g_mutex_lock(&metrics->lock);
+    while (!metrics->stopping) {
+        gint64 until = g_get_monotonic_time() + metrics->dump_interval;
+        while (!metrics->stopping && g_cond_wait_until(&metrics->cond, &metrics->lock, until))
+            ;
+        g_mutex_unlock(&metrics->lock);
+        gfal2_dropbox_metrics_dump(metrics);
+        g_mutex_lock(&metrics->lock);
+    }
+    g_mutex_unlock(&metrics->lock);
+    return NULL;
+}
+
+
+DropboxMetrics* gfal2_dropbox_metrics_new(DropboxHandle* dropbox, const char* dump_file, int dump_interval)
+{
+    DropboxMetrics* metrics = g_new0(DropboxMetrics, 1);
+    metrics->dropbox = dropbox;
+    g_mutex_init(&metrics->lock);
+    g_cond_init(&metrics->cond);
+    if (dump_file && dump_file[0] != '\0') {
+        metrics->dump_file = g_strdup(dump_file);
+        metrics->dump_interval = (gint64)MAX(dump_interval, 1) * G_USEC_PER_SEC;
+        metrics->dump_thread = g_thread_new("dropbox_metrics", gfal2_dropbox_metrics_dump_loop, metrics);
+    }
+    return metrics;
+}
+
+
+void gfal2_dropbox_metrics_free(DropboxMetrics* metrics)
+{
+    if (metrics == NULL)
+        return;
+    // The loop writes them one last time on its way out
+    if (metrics->dump_thread) {
+        g_mutex_lock(&metrics->lock);
+        metrics->stopping = TRUE;
+        g_cond_signal(&metrics->cond);
+        g_mutex_unlock(&metrics->lock);
+        g_thread_join(metrics->dump_thread);
+    }
+    g_free(metrics->dump_file);
+    g_cond_clear(&metrics->cond);
+    g_mutex_clear(&metrics->lock);
+    g_free(metrics);
+}
+
+
+static DropboxEndpointMetrics* gfal2_dropbox_metrics_endpoint(DropboxMetrics* metrics, const char* url)
+{
+    const char* path = strstr(url, "/2/");
+    size_t len = path ? strcspn(path, "?") : 0;
+    size_t i;
+    for (i = 0; path && i < DROPBOX_ENDPOINTS - 1; ++i) {
+        if (strlen(endpoints[i]) == len && strncmp(path, endpoints[i], len) == 0)
+            break;
+    }
+    return &metrics->endpoints[path ? i : DROPBOX_ENDPOINTS - 1];
+}
+
+
+void gfal2_dropbox_metrics_request(DropboxMetrics* metrics, const char* url, long status,
+    gint64 sent, gint64 received, gint64 duration)
+{
+    if (metrics == NULL)
+        return;
+    DropboxEndpointMetrics* endpoint = gfal2_dropbox_metrics_endpoint(metrics, url);
+
+    int outcome;
+    if (status == 0)
+        outcome = DROPBOX_OUTCOME_FAILED;
+    else if (status / 100 == 2)
+        outcome = DROPBOX_OUTCOME_2XX;
+    else if (status == 409)
+        outcome = DROPBOX_OUTCOME_409;
+    else if (status == 429)
+        outcome = DROPBOX_OUTCOME_429;
+    else if (status / 100 == 5)
+        outcome = DROPBOX_OUTCOME_5XX;
+    else
+        outcome = DROPBOX_OUTCOME_OTHER;
+
+    size_t bucket = 0;
+    while (bucket < G_N_ELEMENTS(latency_bounds) && duration > latency_bounds[bucket])
+        ++bucket;
+
+    METRIC_ADD(endpoint->outcomes[outcome], 1);
+    METRIC_ADD(endpoint->sent, sent);
+    METRIC_ADD(endpoint->received, received);
+    METRIC_ADD(endpoint->latency[bucket], 1);
+    METRIC_ADD(endpoint->latency_sum, duration);
+}
+
+
+void gfal2_dropbox_metrics_retry(DropboxMetrics* metrics, DropboxRetryKind kind)
+{
+    if (metrics)
+        METRIC_ADD(metrics->retries[kind], 1);
+}
+
+
+void gfal2_dropbox_metrics_stat(DropboxMetrics* metrics, DropboxStatSource source)
+{
+    if (metrics)
+        METRIC_ADD(metrics->stats[source], 1);
+}
+
+
+void gfal2_dropbox_metrics_cache(DropboxMetrics* metrics, gboolean hit)
+{
+    if (metrics == NULL)
+        return;
+    if (hit)
+        METRIC_ADD(metrics->cache_hits, 1);
+    else
+        METRIC_ADD(metrics->cache_misses, 1);
+}
+
+
+void gfal2_dropbox_metrics_hedge(DropboxMetrics* metrics, gboolean won)
+{
+    if (metrics == NULL)
+        return;
+    METRIC_ADD(metrics->hedges, 1);
+    if (won)
+        METRIC_ADD(metrics->hedges_won, 1);
+}
+
+
+static void gfal2_dropbox_metrics_header(GString* text, const char* name, const char* type, const char* help)
+{
+    g_string_append_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+char* gfal2_dropbox_metrics_text(DropboxMetrics* metrics)
+{
+    GString* text = g_string_sized_new(4096);
+    size_t i, j;
+
+    // Endpoints never used are left out
+    gboolean used[DROPBOX_ENDPOINTS];
+    guint64 counts[DROPBOX_ENDPOINTS];
+    for (i = 0; i < DROPBOX_ENDPOINTS; ++i) {
+        counts[i] = 0;
+        for (j = 0; j < DROPBOX_LATENCY_BUCKETS; ++j)
+            counts[i] += METRIC_GET(metrics->endpoints[i].latency[j]);
+        used[i] = counts[i] > 0;
+    }
+
+    gfal2_dropbox_metrics_header(text, "dropbox_requests_total", "counter", "Requests done, by endpoint and outcome");
+    for (i = 0; i < DROPBOX_ENDPOINTS; ++i) {
+        for (j = 0; used[i] && j < DROPBOX_OUTCOMES; ++j) {
+            g_string_append_printf(text, "dropbox_requests_total{endpoint=\"%s\",outcome=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                endpoints[i], outcome_labels[j], METRIC_GET(metrics->endpoints[i].outcomes[j]));
+        }
+    }
+
+    gfal2_dropbox_metrics_header(text, "dropbox_sent_bytes_total", "counter", "Bytes sent, by endpoint");
+    for (i = 0; i < DROPBOX_ENDPOINTS; ++i) {
+        if (used[i])
+            g_string_append_printf(text, "dropbox_sent_bytes_total{endpoint=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                endpoints[i], METRIC_GET(metrics->endpoints[i].sent));
+    }
+
+    gfal2_dropbox_metrics_header(text, "dropbox_received_bytes_total", "counter", "Bytes received, by endpoint");
+    for (i = 0; i < DROPBOX_ENDPOINTS; ++i) {
+        if (used[i])
+            g_string_append_printf(text, "dropbox_received_bytes_total{endpoint=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                endpoints[i], METRIC_GET(metrics->endpoints[i].received));
+    }
+
+    gfal2_dropbox_metrics_header(text, "dropbox_request_duration_seconds", "histogram", "Time taken by the requests, by endpoint");
+    for (i = 0; i < DROPBOX_ENDPOINTS; ++i) {
+        if (!used[i])
+            continue;
+        guint64 cumulative = 0;
+        for (j = 0; j < DROPBOX_LATENCY_BUCKETS; ++j) {
+            cumulative += METRIC_GET(metrics->endpoints[i].latency[j]);
+            if (j < G_N_ELEMENTS(latency_bounds))
+                g_string_append_printf(text, "dropbox_request_duration_seconds_bucket{endpoint=\"%s\",le=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                    endpoints[i], latency_bounds[j] / 1e6, cumulative);
+            else
+                g_string_append_printf(text, "dropbox_request_duration_seconds_bucket{endpoint=\"%s\",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                    endpoints[i], cumulative);
+        }
+        g_string_append_printf(text, "dropbox_request_duration_seconds_sum{endpoint=\"%s\"} %.6f\n",
+            endpoints[i], METRIC_GET(metrics->endpoints[i].latency_sum) / 1e6);
+        g_string_append_printf(text, "dropbox_request_duration_seconds_count{endpoint=\"%s\"} %" G_GUINT64_FORMAT "\n",
+            endpoints[i], cumulative);
+    }
+
+    gfal2_dropbox_metrics_header(text, "dropbox_retries_total", "counter", "Requests sent again after a failure");
+    for (i = 0; i < DROPBOX_RETRY_KINDS; ++i) {
+        g_string_append_printf(text, "dropbox_retries_total{kind=\"%s\"} %" G_GUINT64_FORMAT "\n",
+            retry_labels[i], METRIC_GET(metrics->retries[i]));
+    }
+
+    gfal2_dropbox_metrics_header(text, "dropbox_stats_total", "counter", "Stats, by where they were answered from");
+    for (i = 0; i < DROPBOX_STAT_SOURCES; ++i) {
+        g_string_append_printf(text, "dropbox_stats_total{source=\"%s\"} %" G_GUINT64_FORMAT "\n",
+            stat_labels[i], METRIC_GET(metrics->stats[i]));
+    }
+
+    gfal2_dropbox_metrics_header(text, "dropbox_download_cache_total", "counter", "Lookups in the download cache");
+    g_string_append_printf(text, "dropbox_download_cache_total{result=\"hit\"} %" G_GUINT64_FORMAT "\n",
+        METRIC_GET(metrics->cache_hits));
+    g_string_append_printf(text, "dropbox_download_cache_total{result=\"miss\"} %" G_GUINT64_FORMAT "\n",
+        METRIC_GET(metrics->cache_misses));
+
+    gfal2_dropbox_metrics_header(text, "dropbox_hedged_requests_total", "counter", "Duplicates sent for slow requests");
+    g_string_append_printf(text, "dropbox_hedged_requests_total{result=\"won\"} %" G_GUINT64_FORMAT "\n",
+        METRIC_GET(metrics->hedges_won));
+    g_string_append_printf(text, "dropbox_hedged_requests_total{result=\"lost\"} %" G_GUINT64_FORMAT "\n",
+        METRIC_GET(metrics->hedges) - METRIC_GET(metrics->hedges_won));
+
+    gfal2_dropbox_metrics_header(text, "dropbox_active_transfers", "gauge", "Files open for reading or writing");
+    g_string_append_printf(text, "dropbox_active_transfers %d\n",
+        g_atomic_int_get(&metrics->dropbox->active_transfers));
+
+    return g_string_free(text, FALSE);
+}
@@ -0,0 +1,72 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Metrics
+// Counters of the requests, per endpoint and outcome, with their latencies and
+// the bytes moved, plus the retries and how well the caches do
+// They are updated without locks, and exported in the Prometheus text format,
+// through the dropbox.metrics extended attribute, and optionally into a file
+
+#pragma once
+#ifndef _GFAL_DROPBOX_METRICS_H
+#define _GFAL_DROPBOX_METRICS_H
+
+#include "gfal_dropbox.h"
+
+#define DROPBOX_XATTR_METRICS "dropbox.metrics"
+
+typedef struct DropboxMetrics DropboxMetrics;
+
+typedef enum {
+    DROPBOX_RETRY_AUTH,
+    DROPBOX_RETRY_UPLOAD,
+    DROPBOX_RETRY_DOWNLOAD,
+    DROPBOX_RETRY_KINDS
+} DropboxRetryKind;
+
+// Where a stat got its answer from
+typedef enum {
+    DROPBOX_STAT_INDEX,
+    DROPBOX_STAT_LISTING,
+    DROPBOX_STAT_REQUEST,
+    DROPBOX_STAT_SOURCES
+} DropboxStatSource;
+
+// Metrics of the requests made through dropbox
+// If dump_file is not NULL, they are written into it every dump_interval seconds, and when freed
+DropboxMetrics* gfal2_dropbox_metrics_new(DropboxHandle* dropbox, const char* dump_file, int dump_interval);
+
+void gfal2_dropbox_metrics_free(DropboxMetrics* metrics);
+
+// Counts a finished request. status is 0 if there was no response
+// duration is in microseconds. All of them accept a NULL metrics
+void gfal2_dropbox_metrics_request(DropboxMetrics* metrics, const char* url, long status,
+    gint64 sent, gint64 received, gint64 duration);
+
+void gfal2_dropbox_metrics_retry(DropboxMetrics* metrics, DropboxRetryKind kind);
+
+void gfal2_dropbox_metrics_stat(DropboxMetrics* metrics, DropboxStatSource source);
+
+// Counts a lookup in the download cache
+void gfal2_dropbox_metrics_cache(DropboxMetrics* metrics, gboolean hit);
+
+// Counts a duplicate sent by hedging, and whether it answered first
+void gfal2_dropbox_metrics_hedge(DropboxMetrics* metrics, gboolean won);
+
+// Returns the metrics in the Prometheus text format, to be freed with g_free
+char* gfal2_dropbox_metrics_text(DropboxMetrics* metrics);
+
+#endif
@@ -17,6 +17,10 @@
 // Namespace operations, except listing dir
 
 #include "gfal_dropbox.h"
+#include "gfal_dropbox_batch.h"
+#include "gfal_dropbox_index.h"
+#include "gfal_dropbox_json.h"
+#include "gfal_dropbox_metrics.h"
 #include "gfal_dropbox_requests.h"
 #include "gfal_dropbox_url.h"
 #include <json.h>
@@ -27,7 +31,6 @@ int gfal2_dropbox_stat(plugin_handle plugin_data, const char* url,
         struct stat *buf, GError** error)
 {
     DropboxHandle* dropbox = (DropboxHandle*)plugin_data;
-    GError* tmp_err = NULL;
 
     char path[GFAL_URL_MAX_LEN];
     if (gfal2_dropbox_extract_path(url, path, sizeof(path)) == NULL) {
@@ -35,57 +38,70 @@ int gfal2_dropbox_stat(plugin_handle plugin_data, const char* url,
         return -1;
     }
 
+    // Known already, from the index or a listing of the parent
+    GError* tmp_err = NULL;
+    int known = 0;
+    if (gfal2_dropbox_index_lookup(dropbox->index, path, buf, NULL, &tmp_err)) {
+        gfal2_dropbox_metrics_stat(dropbox->metrics, DROPBOX_STAT_INDEX);
+        known = 1;
+    }
+    else if (gfal2_dropbox_batch_stat(dropbox, path, buf, &tmp_err)) {
+        gfal2_dropbox_metrics_stat(dropbox->metrics, DROPBOX_STAT_LISTING);
+        known = 1;
+    }
+    if (known) {
+        if (tmp_err) {
+            gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+            return -1;
+        }
+        return 0;
+    }
+    gfal2_dropbox_metrics_stat(dropbox->metrics, DROPBOX_STAT_REQUEST);
+    return gfal2_dropbox_get_metadata(dropbox, path, buf, NULL, error);
+}
+
+
+int gfal2_dropbox_get_metadata(DropboxHandle* dropbox, const char* path,
+        struct stat *buf, DropboxFileInfo* info, GError** error)
+{
+    GError* tmp_err = NULL;
+    if (info) {
+        memset(info, 0, sizeof(*info));
+    }
+
     // Handle root ourselves, since Dropbox will say it is not supported
     if (g_strcmp0(path, "/") == 0) {
         buf->st_mode = 0700 | S_IFDIR;
         return 0;
     }
 
-    char output[1024];
+    DropboxBuffer* output = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    char endpoint[GFAL_URL_MAX_LEN];
+    guint64 generation = gfal2_dropbox_index_generation(dropbox->index);
 
-    ssize_t resp_size = gfal2_dropbox_post_json(dropbox, "https://api.dropbox.com/2/files/get_metadata",
-        output, sizeof(output), &tmp_err, 1,
+    ssize_t resp_size = gfal2_dropbox_post_json(dropbox, gfal2_dropbox_api_url(dropbox, "/2/files/get_metadata", endpoint, sizeof(endpoint)),
+        output, &tmp_err, 1,
         "path", path);
     if (resp_size < 0) {
+        gfal2_dropbox_buffer_release(dropbox->buffers, output);
         gfal2_propagate_prefixed_error(error, tmp_err, __func__);
         return -1;
     }
 
-    json_object* stat = json_tokener_parse(output);
+    json_object* stat = gfal2_dropbox_buffer_json(output);
+    gfal2_dropbox_buffer_release(dropbox->buffers, output);
     if (stat) {
-        memset(buf, 0, sizeof(struct stat));
-        buf->st_mode = 0700;
-
-        json_object* tag = NULL;
-        if (json_object_object_get_ex(stat, ".tag", &tag)) {
-            const char *tag_str = json_object_get_string(tag);
-
-            if (g_strcmp0(tag_str, "folder") == 0) {
-                buf->st_mode |= S_IFDIR;
-            }
-            else if (g_strcmp0(tag_str, "file") == 0) {
-                json_object *size = NULL;
-                if (json_object_object_get_ex(stat, "size", &size)) {
-                    buf->st_size = json_object_get_int64(size);
-                }
-
-                json_object *modified = NULL;
-                if (json_object_object_get_ex(stat, "client_modified", &modified)) {
-                    const char *time_str = json_object_get_string(modified);
-                    buf->st_atime = buf->st_mtime = buf->st_ctime = gfal2_dropbox_time(time_str);
-                }
+        DropboxFileInfo stat_info;
+        if (gfal2_dropbox_parse_metadata(stat, buf, &stat_info, error) == 0) {
+            if (info) {
+                *info = stat_info;
             }
-            else if (g_strcmp0(tag_str, "deleted") == 0) {
-                gfal2_set_error(error, dropbox_domain(), ENOENT, __func__, "The entry has been deleted");
+            json_object* path_display = NULL;
+            if (path[0] == '/' && json_object_object_get_ex(stat, "path_display", &path_display)) {
+                gfal2_dropbox_index_put(dropbox->index, json_object_get_string(path_display),
+                    buf, &stat_info, generation);
             }
-            else {
-                gfal2_set_error(error, dropbox_domain(), EIO, __func__, "Unsupported .tag: %s", tag_str);
-            }
-        }
-        else {
-            gfal2_set_error(error, dropbox_domain(), EIO, __func__, "Could not find .tag");
         }
-
         json_object_put(stat);
     }
     else {
@@ -97,26 +113,88 @@ int gfal2_dropbox_stat(plugin_handle plugin_data, const char* url,
 }
 
 
-int gfal2_dropbox_mkdir(plugin_handle plugin_data, const char* url, mode_t mode,
-        gboolean rec_flag, GError** error)
+int gfal2_dropbox_parse_metadata(json_object* metadata, struct stat* buf, DropboxFileInfo* info, GError** error)
 {
-    DropboxHandle* dropbox = (DropboxHandle*)plugin_data;
-    GError* tmp_err = NULL;
+    memset(buf, 0, sizeof(struct stat));
+    buf->st_mode = 0700;
+    if (info) {
+        memset(info, 0, sizeof(*info));
+    }
 
-    struct stat st;
-    int ret = gfal2_dropbox_stat(plugin_data, url, &st, &tmp_err);
-    if (ret == 0) {
-        gfal2_set_error(error, dropbox_domain(), EEXIST, __func__, "The directory already exists");
+    json_object* tag = NULL;
+    if (!json_object_object_get_ex(metadata, ".tag", &tag)) {
+        gfal2_set_error(error, dropbox_domain(), EIO, __func__, "Could not find .tag");
         return -1;
     }
-    else if (tmp_err->code != ENOENT) {
-        gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+
+    const char *tag_str = json_object_get_string(tag);
+    if (g_strcmp0(tag_str, "folder") == 0) {
+        buf->st_mode |= S_IFDIR;
+    }
+    else if (g_strcmp0(tag_str, "file") == 0) {
+        json_object *size = NULL;
+        if (json_object_object_get_ex(metadata, "size", &size)) {
+            buf->st_size = json_object_get_int64(size);
+        }
+
+        json_object *modified = NULL;
+        if (json_object_object_get_ex(metadata, "client_modified", &modified)) {
+            const char *time_str = json_object_get_string(modified);
+            buf->st_atime = buf->st_mtime = buf->st_ctime = gfal2_dropbox_time(time_str);
+        }
+
+        if (info) {
+            json_object *rev = NULL, *content_hash = NULL;
+            if (json_object_object_get_ex(metadata, "rev", &rev)) {
+                g_strlcpy(info->rev, json_object_get_string(rev), sizeof(info->rev));
+            }
+            if (json_object_object_get_ex(metadata, "content_hash", &content_hash)) {
+                g_strlcpy(info->content_hash, json_object_get_string(content_hash), sizeof(info->content_hash));
+            }
+        }
+    }
+    else if (g_strcmp0(tag_str, "deleted") == 0) {
+        gfal2_set_error(error, dropbox_domain(), ENOENT, __func__, "The entry has been deleted");
         return -1;
     }
     else {
-        g_error_free(tmp_err);
-        tmp_err = NULL;
+        gfal2_set_error(error, dropbox_domain(), EIO, __func__, "Unsupported .tag: %s", tag_str);
+        return -1;
+    }
+    return 0;
+}
+
+
+void gfal2_dropbox_forget(DropboxHandle* dropbox, const char* path)
+{
+    gfal2_dropbox_batch_invalidate(dropbox->stat_batch, path);
+    gfal2_dropbox_index_invalidate(dropbox->index, path);
+}
+
+
+// Kind of entry ("file" or "folder") in the way of a folder creation, from its error
+// NULL if the error is not a conflict
+static const char* gfal2_dropbox_conflict_kind(json_object* error_obj)
+{
+    json_object *path = NULL, *tag = NULL, *conflict = NULL, *kind = NULL;
+    if (json_object_object_get_ex(error_obj, "path", &path) &&
+        json_object_object_get_ex(path, ".tag", &tag) &&
+        g_strcmp0(json_object_get_string(tag), "conflict") == 0 &&
+        json_object_object_get_ex(path, "conflict", &conflict) &&
+        json_object_object_get_ex(conflict, ".tag", &kind)) {
+        return json_object_get_string(kind);
     }
+    return NULL;
+}
+
+
+// Dropbox creates the missing parents by itself, so this is a single request either way
+// rec_flag only makes an existing folder fine
+int gfal2_dropbox_mkdir(plugin_handle plugin_data, const char* url, mode_t mode,
+        gboolean rec_flag, GError** error)
+{
+    DropboxHandle* dropbox = (DropboxHandle*)plugin_data;
+    GError* tmp_err = NULL;
 
     char path[GFAL_URL_MAX_LEN];
     if (gfal2_dropbox_extract_path(url, path, sizeof(path)) == NULL) {
@@ -124,11 +202,33 @@ int gfal2_dropbox_mkdir(plugin_handle plugin_data, const char* url, mode_t mode,
         return -1;
     }
 
-    char output[1024];
+    DropboxBuffer* output = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    char endpoint[GFAL_URL_MAX_LEN];
     ssize_t resp_size = gfal2_dropbox_post_json(dropbox,
-        "https://api.dropboxapi.com/2/files/create_folder_v2",
-        output, sizeof(output), &tmp_err,
+        gfal2_dropbox_api_url(dropbox, "/2/files/create_folder_v2", endpoint, sizeof(endpoint)),
+        output, &tmp_err,
         1, "path", path);
+    // Whether it worked or not, what was listed may be stale
+    gfal2_dropbox_forget(dropbox, path);
+
+    if (resp_size < 0 && tmp_err->code == EEXIST) {
+        json_object* response = gfal2_dropbox_buffer_json(output);
+        json_object* error_obj = NULL;
+        json_object_object_get_ex(response, "error", &error_obj);
+        const char* kind = gfal2_dropbox_conflict_kind(error_obj);
+        if (rec_flag && g_strcmp0(kind, "folder") == 0) {
+            g_clear_error(&tmp_err);
+            resp_size = 0;
+        }
+        else {
+            g_clear_error(&tmp_err);
+            gfal2_set_error(&tmp_err, dropbox_domain(), EEXIST, __func__,
+                g_strcmp0(kind, "folder") == 0 ? "The directory already exists" : "A file already exists");
+        }
+        json_object_put(response);
+    }
+    gfal2_dropbox_buffer_release(dropbox->buffers, output);
+
     if (resp_size < 0) {
         gfal2_propagate_prefixed_error(error, tmp_err, __func__);
         return -1;
@@ -137,6 +237,193 @@ int gfal2_dropbox_mkdir(plugin_handle plugin_data, const char* url, mode_t mode,
 }
 
 
+// Waits for a create_folder_batch job to be done, for up to the operation timeout
+// Returns its final status, to be freed by the caller, or NULL on error
+static json_object* gfal2_dropbox_mkdir_wait(DropboxHandle* dropbox, const char* job_id,
+    DropboxBuffer* output, GError** error)
+{
+    char endpoint[GFAL_URL_MAX_LEN];
+    gfal2_dropbox_api_url(dropbox, "/2/files/create_folder_batch/check", endpoint, sizeof(endpoint));
+    gulong delay = 50000;
+    gint64 deadline = 0;
+    if (dropbox->operation_timeout > 0)
+        deadline = g_get_monotonic_time() + (gint64)dropbox->operation_timeout * G_USEC_PER_SEC;
+
+    while (TRUE) {
+        if (deadline && g_get_monotonic_time() + (gint64)delay > deadline) {
+            gfal2_set_error(error, dropbox_domain(), ETIMEDOUT, __func__,
+                "The folder batch was not done within %ld seconds", dropbox->operation_timeout);
+            return NULL;
+        }
+        g_usleep(delay);
+        delay = MIN(delay * 2, G_USEC_PER_SEC);
+
+        if (gfal2_dropbox_post_json(dropbox, endpoint, output, error, 1, "async_job_id", job_id) < 0)
+            return NULL;
+
+        json_object* status = gfal2_dropbox_buffer_json(output);
+        json_object* tag = NULL;
+        if (!json_object_object_get_ex(status, ".tag", &tag)) {
+            json_object_put(status);
+            gfal2_set_error(error, dropbox_domain(), EIO, __func__, "Could not parse the status of the batch");
+            return NULL;
+        }
+        if (g_strcmp0(json_object_get_string(tag), "in_progress") != 0)
+            return status;
+        json_object_put(status);
+    }
+}
+
+
+// Creates the folders of the count paths picked by indexes, in a single batch
+// The error of paths[indexes[i]] goes into errors[indexes[i]]
+static void gfal2_dropbox_mkdir_batch(DropboxHandle* dropbox, char** paths, int* indexes, int count,
+    GError** errors)
+{
+    GError* tmp_err = NULL;
+    DropboxBuffer* body = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    DropboxBuffer* output = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    int i;
+
+    DropboxJsonWriter writer;
+    gfal2_dropbox_json_init(&writer, body, FALSE);
+    gfal2_dropbox_json_begin(&writer, NULL);
+    gfal2_dropbox_json_begin_array(&writer, "paths");
+    for (i = 0; i < count; ++i) {
+        gfal2_dropbox_json_string(&writer, NULL, paths[indexes[i]]);
+    }
+    gfal2_dropbox_json_end_array(&writer);
+    gfal2_dropbox_json_boolean(&writer, "autorename", FALSE);
+    gfal2_dropbox_json_boolean(&writer, "force_async", FALSE);
+    gfal2_dropbox_json_end(&writer);
+
+    char endpoint[GFAL_URL_MAX_LEN];
+    json_object* status = NULL;
+    if (gfal2_dropbox_perform(dropbox,
+            M_POST, gfal2_dropbox_api_url(dropbox, "/2/files/create_folder_batch", endpoint, sizeof(endpoint)),
+            0, 0,
+            output,
+            "application/json", body->data, body->length,
+            &tmp_err,
+            0) >= 0) {
+        status = gfal2_dropbox_buffer_json(output);
+    }
+
+    // Big batches are done in the background
+    json_object *tag = NULL, *job_id = NULL;
+    if (json_object_object_get_ex(status, ".tag", &tag) &&
+        g_strcmp0(json_object_get_string(tag), "async_job_id") == 0 &&
+        json_object_object_get_ex(status, "async_job_id", &job_id)) {
+        json_object* final_status = gfal2_dropbox_mkdir_wait(dropbox, json_object_get_string(job_id),
+            output, &tmp_err);
+        json_object_put(status);
+        status = final_status;
+    }
+
+    json_object* entries = NULL;
+    if (tmp_err == NULL &&
+        (!json_object_object_get_ex(status, ".tag", &tag) ||
+         g_strcmp0(json_object_get_string(tag), "complete") != 0 ||
+         !json_object_object_get_ex(status, "entries", &entries) ||
+         json_object_array_length(entries) != (size_t)count)) {
+        gfal2_set_error(&tmp_err, dropbox_domain(), EIO, __func__, "The folder batch failed: %s",
+            tag ? json_object_get_string(tag) : "unexpected response");
+    }
+
+    for (i = 0; i < count; ++i) {
+        GError** entry_error = &errors[indexes[i]];
+        if (tmp_err) {
+            *entry_error = g_error_copy(tmp_err);
+            continue;
+        }
+
+        json_object* entry = json_object_array_get_idx(entries, i);
+        json_object *entry_tag = NULL, *failure = NULL;
+        if (json_object_object_get_ex(entry, ".tag", &entry_tag) &&
+            g_strcmp0(json_object_get_string(entry_tag), "success") == 0) {
+            continue;
+        }
+        if (!json_object_object_get_ex(entry, "failure", &failure)) {
+            gfal2_set_error(entry_error, dropbox_domain(), EIO, __func__, "Could not create the folder");
+        }
+        // The folder being there already is what was asked for
+        else if (g_strcmp0(gfal2_dropbox_conflict_kind(failure), "folder") != 0) {
+            gfal2_dropbox_map_error_object(failure, entry_error);
+        }
+    }
+
+    json_object_put(status);
+    g_clear_error(&tmp_err);
+    gfal2_dropbox_buffer_release(dropbox->buffers, output);
+    gfal2_dropbox_buffer_release(dropbox->buffers, body);
+}
+
+
+int gfal2_dropbox_mkdir_bulk(plugin_handle plugin_data, int nbfiles, const char* const* urls, GError** errors)
+{
+    DropboxHandle* dropbox = (DropboxHandle*)plugin_data;
+    char** paths = g_new0(char*, nbfiles);
+    int* indexes = g_new(int, nbfiles);
+    // Lowercased path => index of its first appearance, over all the batches
+    // Each path is only sent once, so no batch holds the same path twice
+    GHashTable* seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    int i, count = 0;
+
+    for (i = 0; i < nbfiles; ++i) {
+        errors[i] = NULL;
+        char path[GFAL_URL_MAX_LEN];
+        if (gfal2_dropbox_extract_path(urls[i], path, sizeof(path)) == NULL) {
+            gfal2_set_error(&errors[i], dropbox_domain(), EINVAL, __func__, "Invalid Dropbox url");
+            continue;
+        }
+        paths[i] = g_strdup(path);
+
+        char* key = g_utf8_strdown(path, -1);
+        if (g_hash_table_lookup_extended(seen, key, NULL, NULL)) {
+            g_free(key);
+            continue;
+        }
+        g_hash_table_insert(seen, key, GINT_TO_POINTER(i));
+
+        indexes[count++] = i;
+        if (count == DROPBOX_MKDIR_BATCH_SIZE) {
+            gfal2_dropbox_mkdir_batch(dropbox, paths, indexes, count, errors);
+            count = 0;
+        }
+    }
+    if (count > 0) {
+        gfal2_dropbox_mkdir_batch(dropbox, paths, indexes, count, errors);
+    }
+
+    // Duplicates end up as their first appearance
+    int failures = 0;
+    for (i = 0; i < nbfiles; ++i) {
+        if (paths[i] == NULL) {
+            ++failures;
+            continue;
+        }
+        char* key = g_utf8_strdown(paths[i], -1);
+        gpointer first = NULL;
+        if (errors[i] == NULL && g_hash_table_lookup_extended(seen, key, NULL, &first) &&
+            GPOINTER_TO_INT(first) != i && errors[GPOINTER_TO_INT(first)]) {
+            errors[i] = g_error_copy(errors[GPOINTER_TO_INT(first)]);
+        }
+        g_free(key);
+        gfal2_dropbox_forget(dropbox, paths[i]);
+        if (errors[i])
+            ++failures;
+    }
+
+    g_hash_table_destroy(seen);
+    for (i = 0; i < nbfiles; ++i) {
+        g_free(paths[i]);
+    }
+    g_free(paths);
+    g_free(indexes);
+    return failures ? -1 : 0;
+}
+
+
 int gfal2_dropbox_rmdir(plugin_handle plugin_data, const char* url,
         GError** error)
 {
@@ -163,11 +450,13 @@ int gfal2_dropbox_unlink(plugin_handle plugin_data, const char* url,
         return -1;
     }
 
-    char output[1024];
+    char endpoint[GFAL_URL_MAX_LEN];
     ssize_t resp_size = gfal2_dropbox_post_json(dropbox,
-        "https://api.dropboxapi.com/2/files/delete_v2",
-        output, sizeof(output), &tmp_err,
+        gfal2_dropbox_api_url(dropbox, "/2/files/delete_v2", endpoint, sizeof(endpoint)),
+        NULL, &tmp_err,
         1, "path", path);
+    // Whether it worked or not, what was listed may be stale
+    gfal2_dropbox_forget(dropbox, path);
     if (resp_size < 0) {
         gfal2_propagate_prefixed_error(error, tmp_err, __func__);
         return -1;
@@ -201,14 +490,57 @@ int gfal2_dropbox_rename(plugin_handle plugin_data, const char * oldurl,
         return -1;
     }
 
-    char output[1024];
+    char endpoint[GFAL_URL_MAX_LEN];
     ssize_t resp_size = gfal2_dropbox_post_json(dropbox,
-        "https://api.dropboxapi.com/2/files/move_v2",
-        output, sizeof(output), &tmp_err,
+        gfal2_dropbox_api_url(dropbox, "/2/files/move_v2", endpoint, sizeof(endpoint)),
+        NULL, &tmp_err,
         2, "from_path", from_path, "to_path", to_path);
+    // Whether it worked or not, what was listed may be stale
+    gfal2_dropbox_forget(dropbox, from_path);
+    gfal2_dropbox_forget(dropbox, to_path);
     if (resp_size < 0) {
         gfal2_propagate_prefixed_error(error, tmp_err, __func__);
         return -1;
     }
     return 0;
 }
+
+
+// The only attribute is the plugin metrics, the same whatever the url
+ssize_t gfal2_dropbox_getxattr(plugin_handle plugin_data, const char* url, const char* name,
+        void* buffer, size_t size, GError** error)
+{
+    DropboxHandle* dropbox = (DropboxHandle*)plugin_data;
+    if (strcmp(name, DROPBOX_XATTR_METRICS) != 0) {
+        gfal2_set_error(error, dropbox_domain(), ENODATA, __func__, "Unknown attribute %s", name);
+        return -1;
+    }
+
+    char* text = gfal2_dropbox_metrics_text(dropbox->metrics);
+    ssize_t length = strlen(text);
+    // A size of 0 asks how large the buffer has to be
+    if (size > 0 && (size_t)length > size) {
+        gfal2_set_error(error, dropbox_domain(), ERANGE, __func__,
+            "The buffer is too small for %s, %zd bytes needed", name, length);
+        length = -1;
+    }
+    else if (size > 0) {
+        memcpy(buffer, text, length);
+    }
+    g_free(text);
+    return length;
+}
+
+
+ssize_t gfal2_dropbox_listxattr(plugin_handle plugin_data, const char* url,
+        char* list, size_t size, GError** error)
+{
+    static const char names[] = DROPBOX_XATTR_METRICS;
+    if (size > 0 && size < sizeof(names)) {
+        gfal2_set_error(error, dropbox_domain(), ERANGE, __func__, "The buffer is too small for the attribute names");
+        return -1;
+    }
+    if (size > 0)
+        memcpy(list, names, sizeof(names));
+    return sizeof(names);
+}
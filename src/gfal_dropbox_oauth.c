@@ -16,13 +16,19 @@
 
 #include "gfal_dropbox.h"
 #include "gfal_dropbox_oauth.h"
+#include "gfal_dropbox_token.h"
 #include "gfal_dropbox_url.h"
-#include <curl/curl.h>
-#include <openssl/bio.h>
-#include <openssl/buffer.h>
-#include <openssl/hmac.h>
+// The SHA1 context is copied by value to sign without allocating,
+// which OpenSSL 3 only offers through the deprecated low level interface
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 #include <string.h>
 
+// Pairs signed per request, the oauth ones included
+#define OAUTH_MAX_PARAMETERS 32
+#define OAUTH_MAX_BASESTRING 8192
+
 
 struct KeyValue {
     const char *key, *value;
@@ -39,6 +45,10 @@ int oauth_setup(gfal2_context_t context, OAuth* oauth, GError** error)
     oauth->access_token = gfal2_get_opt_string(context, "DROPBOX", "ACCESS_TOKEN", NULL);
     oauth->app_secret = gfal2_get_opt_string(context, "DROPBOX", "APP_SECRET", NULL);
     oauth->access_token_secret = gfal2_get_opt_string(context, "DROPBOX", "ACCESS_TOKEN_SECRET", NULL);
+    oauth->refresh_token = gfal2_get_opt_string(context, "DROPBOX", "REFRESH_TOKEN", NULL);
+    oauth->token_url = gfal2_get_opt_string_with_default(context, "DROPBOX", "TOKEN_URL", DROPBOX_DEFAULT_TOKEN_URL);
+    oauth->refresh_margin = gfal2_get_opt_integer_with_default(context, "DROPBOX", "TOKEN_REFRESH_MARGIN",
+        DROPBOX_DEFAULT_TOKEN_REFRESH_MARGIN);
 
     switch (oauth->version) {
         case 1:
@@ -50,13 +60,25 @@ int oauth_setup(gfal2_context_t context, OAuth* oauth, GError** error)
             }
             break;
         case 2:
-            if (!oauth->app_key || !oauth->access_token || !oauth->app_secret) {
+            if (!oauth->app_key || !(oauth->access_token || oauth->refresh_token) || !oauth->app_secret) {
                 gfal2_set_error(error, dropbox_domain(), EINVAL, __func__,
-                                "Missing OAuth values. Make sure you pass APP_KEY, APP_SECRET and ACCESS_TOKEN inside "
-                                "the group DROPBOX");
+                                "Missing OAuth values. Make sure you pass APP_KEY, APP_SECRET and ACCESS_TOKEN "
+                                "or REFRESH_TOKEN inside the group DROPBOX");
                 oauth_release(oauth);
                 return -1;
             }
+            if (oauth->refresh_token) {
+                DropboxTokenConfig token_config = {
+                    oauth->token_url, oauth->app_key, oauth->app_secret, oauth->refresh_token,
+                    oauth->refresh_margin
+                };
+                g_free(oauth->access_token);
+                oauth->access_token = gfal2_dropbox_token_get(&token_config, error);
+                if (oauth->access_token == NULL) {
+                    oauth_release(oauth);
+                    return -1;
+                }
+            }
             break;
         default:
             gfal2_set_error(error, dropbox_domain(), EINVAL, __func__,
@@ -83,6 +105,8 @@ void oauth_release(OAuth* oauth)
     g_free(oauth->access_token);
     g_free(oauth->app_secret);
     g_free(oauth->access_token_secret);
+    g_free(oauth->refresh_token);
+    g_free(oauth->token_url);
     g_free(oauth->timestamp);
     g_free(oauth->nonce);
 
@@ -90,6 +114,28 @@ void oauth_release(OAuth* oauth)
 }
 
 
+gboolean oauth_can_refresh(const OAuth* oauth)
+{
+    g_assert(oauth != NULL);
+    return oauth->version == 2 && oauth->refresh_token != NULL;
+}
+
+
+void oauth_invalidate(const OAuth* oauth)
+{
+    g_assert(oauth != NULL);
+
+    if (!oauth_can_refresh(oauth))
+        return;
+
+    DropboxTokenConfig token_config = {
+        oauth->token_url, oauth->app_key, oauth->app_secret, oauth->refresh_token,
+        oauth->refresh_margin
+    };
+    gfal2_dropbox_token_invalidate(&token_config, oauth->access_token);
+}
+
+
 static size_t oauth_populate_keyvalue_from_args(KeyValue* pairs, size_t start,
         size_t n_args, va_list args)
 {
@@ -131,55 +177,120 @@ static size_t oauth_populate_keyvalue_from_oauth(KeyValue* pairs,
 }
 
 
-static int oauth_compare_key(const void* a_ptr, const void* b_ptr)
+// Percent encodes input as OAuth wants it: everything but the unreserved characters, in uppercase
+// Returns the length written, or -1 if it does not fit
+static ssize_t oauth_escape(const char* input, size_t length, char* output, size_t outsize)
 {
-    g_assert(a_ptr != NULL && b_ptr != NULL);
+    static const char hex[] = "0123456789ABCDEF";
+    size_t i, written = 0;
+    for (i = 0; i < length; ++i) {
+        unsigned char c = input[i];
+        if (g_ascii_isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            if (written + 1 >= outsize)
+                return -1;
+            output[written++] = c;
+        }
+        else {
+            if (written + 3 >= outsize)
+                return -1;
+            output[written++] = '%';
+            output[written++] = hex[c >> 4];
+            output[written++] = hex[c & 0x0F];
+        }
+    }
+    output[written] = '\0';
+    return written;
+}
 
-    KeyValue *a, *b;
-    a = (KeyValue*)a_ptr;
-    b = (KeyValue*)b_ptr;
-    return strcmp(a->key, b->key);
+
+// Decodes a query string component in place
+static void oauth_unescape(char* str)
+{
+    char *in = str, *out = str;
+    while (*in) {
+        if (in[0] == '%' && g_ascii_isxdigit(in[1]) && g_ascii_isxdigit(in[2])) {
+            *out++ = (g_ascii_xdigit_value(in[1]) << 4) | g_ascii_xdigit_value(in[2]);
+            in += 3;
+        }
+        else if (*in == '+') {
+            *out++ = ' ';
+            ++in;
+        }
+        else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
 }
 
 
-static int oauth_normalized_parameters_v(char* output, size_t outsize,
-        const OAuth* oauth, size_t n_args, va_list args)
+// Sorted by key, then by value. There are only a handful, so an insertion sort does
+static void oauth_sort_pairs(KeyValue* pairs, size_t n)
 {
-    g_assert(output != NULL && oauth != NULL);
+    size_t i, j;
+    for (i = 1; i < n; ++i) {
+        KeyValue pair = pairs[i];
+        for (j = i; j > 0; --j) {
+            int cmp = strcmp(pairs[j - 1].key, pair.key);
+            if (cmp < 0 || (cmp == 0 && strcmp(pairs[j - 1].value, pair.value) <= 0))
+                break;
+            pairs[j] = pairs[j - 1];
+        }
+        pairs[j] = pair;
+    }
+}
 
-    // Account for oauth* headers
-    size_t n_parameters = n_args + 6;
-    KeyValue *pairs = g_malloc0(n_parameters * sizeof(KeyValue));
 
-    size_t next = oauth_populate_keyvalue_from_args(pairs, 0, n_args, args);
-    next = oauth_populate_keyvalue_from_oauth(pairs, oauth, next);
+static int oauth_normalize_pairs(char* output, size_t outsize, const KeyValue* pairs, size_t n_parameters)
+{
+    g_assert(output != NULL && outsize > 0);
 
-    // Sort
-    qsort(pairs, n_parameters, sizeof(KeyValue), oauth_compare_key);
+    // Sorting goes by the escaped forms
+    char scratch[OAUTH_MAX_BASESTRING];
+    KeyValue escaped[OAUTH_MAX_PARAMETERS];
+    size_t i, used = 0;
+    g_assert(n_parameters <= OAUTH_MAX_PARAMETERS);
+    for (i = 0; i < n_parameters; ++i) {
+        ssize_t n = oauth_escape(pairs[i].key, strlen(pairs[i].key), scratch + used, sizeof(scratch) - used);
+        if (n < 0)
+            return -1;
+        escaped[i].key = scratch + used;
+        used += n + 1;
+        n = oauth_escape(pairs[i].value, strlen(pairs[i].value), scratch + used, sizeof(scratch) - used);
+        if (n < 0)
+            return -1;
+        escaped[i].value = scratch + used;
+        used += n + 1;
+    }
+    oauth_sort_pairs(escaped, n_parameters);
 
-    // Concatenate using & and escaping
-    size_t i;
-    char *p = output;
-    size_t remaining = outsize;
+    // Concatenate using &
+    size_t written = 0;
+    output[0] = '\0';
     for (i = 0; i < n_parameters; ++i) {
-        char* escaped_key = curl_easy_escape(NULL, pairs[i].key, 0);
-        char* escaped_value = curl_easy_escape(NULL, pairs[i].value, 0);
+        int n = snprintf(output + written, outsize - written, "%s%s=%s",
+            i > 0 ? "&" : "", escaped[i].key, escaped[i].value);
+        if (n < 0 || written + n >= outsize)
+            return -1;
+        written += n;
+    }
+    return 0;
+}
 
-        size_t printed = snprintf(p, remaining, "%s=%s&", escaped_key, escaped_value);
-        remaining -= printed;
-        p += printed;
 
-        curl_free(escaped_key);
-        curl_free(escaped_value);
-    }
+static int oauth_normalized_parameters_v(char* output, size_t outsize,
+        const OAuth* oauth, size_t n_args, va_list args)
+{
+    g_assert(output != NULL && oauth != NULL);
 
-    // Truncate last &
-    --p;
-    if (*p == '&')
-        *p = '\0';
+    // Account for oauth* headers
+    KeyValue pairs[OAUTH_MAX_PARAMETERS];
+    if (n_args + 6 > OAUTH_MAX_PARAMETERS)
+        return -1;
 
-    g_free(pairs);
-    return 0;
+    size_t next = oauth_populate_keyvalue_from_args(pairs, 0, n_args, args);
+    next = oauth_populate_keyvalue_from_oauth(pairs, oauth, next);
+    return oauth_normalize_pairs(output, outsize, pairs, next);
 }
 
 
@@ -194,49 +305,87 @@ int oauth_normalized_parameters(char* output, size_t outsize,
 }
 
 
-static unsigned base64_encode(const char* input, unsigned length, char* output, size_t outsize)
+int oauth_get_basestring(const char* method, const char* url, const char* norm_params, char* output, size_t outsize)
 {
-    g_assert(input != NULL && output != NULL);
-
-    BIO *bmem, *b64;
-    BUF_MEM *bptr;
-    unsigned written;
+    g_assert(method != NULL && url != NULL && norm_params != NULL && output != NULL);
 
-    b64  = BIO_new(BIO_f_base64());
-    bmem = BIO_new(BIO_s_mem());
-    b64  = BIO_push(b64, bmem);
-    BIO_write(b64, input, length);
-    BIO_ctrl(b64, BIO_CTRL_FLUSH, 0, NULL);
-    BIO_get_mem_ptr(b64, &bptr);
+    char normalized_url[GFAL_URL_MAX_LEN];
+    if (gfal2_dropbox_normalize_url(url, normalized_url, sizeof(normalized_url)) < 0)
+        return -1;
 
-    written = bptr->length - 1;
-    memcpy(output, bptr->data, written>outsize?outsize:written);
-    output[written] = 0;
+    size_t method_len = strlen(method);
+    if (method_len + 2 >= outsize)
+        return -1;
+    memcpy(output, method, method_len);
+    size_t written = method_len;
+    output[written++] = '&';
 
-    BIO_free_all(b64);
+    ssize_t n = oauth_escape(normalized_url, strlen(normalized_url), output + written, outsize - written);
+    if (n < 0 || written + n + 1 >= outsize)
+        return -1;
+    written += n;
+    output[written++] = '&';
 
-    return written;
+    n = oauth_escape(norm_params, strlen(norm_params), output + written, outsize - written);
+    if (n < 0)
+        return -1;
+    return written + n;
 }
 
 
-int oauth_get_basestring(const char* method, const char* url, const char* norm_params, char* output, size_t outsize)
-{
-    g_assert(method != NULL && url != NULL && norm_params != NULL && output != NULL);
+// HMAC-SHA1 with the key already absorbed, so signing only hashes the message
+typedef struct {
+    SHA_CTX inner, outer;
+} OAuthSigningKey;
 
-    char normalized_url[GFAL_URL_MAX_LEN];
-    if (gfal2_dropbox_normalize_url(url, normalized_url, sizeof(normalized_url)) < 0)
-        return -1;
+G_LOCK_DEFINE_STATIC(signing_keys);
+static GHashTable* signing_keys = NULL;
 
-    gfal2_log(G_LOG_LEVEL_INFO, "%s", normalized_url);
 
-    char* escaped_url = curl_easy_escape(NULL, normalized_url, 0);
-    char* escaped_params = curl_easy_escape(NULL, norm_params, 0);
-
-    int basestring_len = snprintf(output, outsize, "%s&%s&%s", method, escaped_url, escaped_params);
+// Gets the precomputed HMAC state for the secrets of oauth
+// They are few, and kept for the life of the process
+static int oauth_get_signing_key(const OAuth* oauth, OAuthSigningKey* signing_key)
+{
+    char key_buffer[512];
+    ssize_t app_len = oauth_escape(oauth->app_secret, strlen(oauth->app_secret), key_buffer, sizeof(key_buffer));
+    if (app_len < 0 || app_len + 1 >= (ssize_t)sizeof(key_buffer))
+        return -1;
+    key_buffer[app_len] = '&';
+    ssize_t token_len = oauth_escape(oauth->access_token_secret, strlen(oauth->access_token_secret),
+        key_buffer + app_len + 1, sizeof(key_buffer) - app_len - 1);
+    if (token_len < 0)
+        return -1;
 
-    curl_free(escaped_url);
-    curl_free(escaped_params);
-    return basestring_len;
+    G_LOCK(signing_keys);
+    if (signing_keys == NULL) {
+        signing_keys = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    OAuthSigningKey* cached = g_hash_table_lookup(signing_keys, key_buffer);
+    if (cached == NULL) {
+        size_t key_len = app_len + 1 + token_len;
+        unsigned char block[SHA_CBLOCK], inner_pad[SHA_CBLOCK], outer_pad[SHA_CBLOCK];
+        memset(block, 0, sizeof(block));
+        // Longer keys are hashed first
+        if (key_len > SHA_CBLOCK)
+            SHA1((const unsigned char*)key_buffer, key_len, block);
+        else
+            memcpy(block, key_buffer, key_len);
+        int i;
+        for (i = 0; i < SHA_CBLOCK; ++i) {
+            inner_pad[i] = block[i] ^ 0x36;
+            outer_pad[i] = block[i] ^ 0x5c;
+        }
+
+        cached = g_new(OAuthSigningKey, 1);
+        SHA1_Init(&cached->inner);
+        SHA1_Update(&cached->inner, inner_pad, sizeof(inner_pad));
+        SHA1_Init(&cached->outer);
+        SHA1_Update(&cached->outer, outer_pad, sizeof(outer_pad));
+        g_hash_table_insert(signing_keys, g_strdup(key_buffer), cached);
+    }
+    *signing_key = *cached;
+    G_UNLOCK(signing_keys);
+    return 0;
 }
 
 
@@ -246,34 +395,109 @@ int oauth_get_signature(const char* method, const char* url, const char* norm_pa
 {
     g_assert(method != NULL && url != NULL && norm_params != NULL && oauth != NULL && output != NULL);
 
-    char payload[2048];
-    char key_buffer[512];
+    // Base64 of a SHA1 digest
+    if (outsize < 29)
+        return -1;
 
-    char *escaped_app_secret = curl_easy_escape(NULL, oauth->app_secret, 0);
-    char *escaped_token_secret = curl_easy_escape(NULL, oauth->access_token_secret, 0);
-    unsigned key_size = snprintf(key_buffer, sizeof(key_buffer), "%s&%s", escaped_app_secret, escaped_token_secret);
+    OAuthSigningKey signing_key;
+    if (oauth_get_signing_key(oauth, &signing_key) < 0)
+        return -1;
 
+    char payload[OAUTH_MAX_BASESTRING];
     int basestring_len = oauth_get_basestring(method, url, norm_params, payload, sizeof(payload));
     if (basestring_len < 0)
         return -1;
 
-    curl_free(escaped_app_secret);
-    curl_free(escaped_token_secret);
-
     gfal2_log(G_LOG_LEVEL_DEBUG, "Signing %s", payload);
 
-    char buffer[2048];
-    unsigned outl = 0;
-    HMAC(EVP_sha1(), key_buffer, key_size,
-            (const unsigned char*)payload, basestring_len,
-            (unsigned char*)buffer, &outl);
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1_Update(&signing_key.inner, payload, basestring_len);
+    SHA1_Final(digest, &signing_key.inner);
+    SHA1_Update(&signing_key.outer, digest, sizeof(digest));
+    SHA1_Final(digest, &signing_key.outer);
+
+    EVP_EncodeBlock((unsigned char*)output, digest, sizeof(digest));
+    return 0;
+}
 
-    base64_encode(buffer, outl, output, outsize);
 
+// Appends name="escaped value" to the header
+static int oauth_header_append(char* buffer, size_t buffer_size, size_t* written,
+    const char* name, const char* value)
+{
+    int n = snprintf(buffer + *written, buffer_size - *written, "%s%s=\"",
+        buffer[*written - 1] == ' ' ? "" : ", ", name);
+    if (n < 0 || *written + n >= buffer_size)
+        return -1;
+    *written += n;
+    ssize_t escaped = oauth_escape(value, strlen(value), buffer + *written, buffer_size - *written);
+    if (escaped < 0 || *written + escaped + 1 >= buffer_size)
+        return -1;
+    *written += escaped;
+    buffer[(*written)++] = '"';
+    buffer[*written] = '\0';
     return 0;
 }
 
 
+// The query parameters are signed along the oauth ones, the body is not, since it is never a form
+static int oauth1_get_header(char* buffer, size_t buffer_size, const OAuth* oauth,
+    const char* method, const char* url)
+{
+    g_assert(buffer != NULL && oauth != NULL && method != NULL && url != NULL);
+
+    char base_url[GFAL_URL_MAX_LEN];
+    char query[GFAL_URL_MAX_LEN];
+    const char* question = strchr(url, '?');
+    size_t base_len = question ? (size_t)(question - url) : strlen(url);
+    if (base_len >= sizeof(base_url) || g_strlcpy(query, question ? question + 1 : "", sizeof(query)) >= sizeof(query))
+        return -1;
+    memcpy(base_url, url, base_len);
+    base_url[base_len] = '\0';
+
+    KeyValue pairs[OAUTH_MAX_PARAMETERS];
+    size_t n_parameters = 0;
+    char* saveptr = NULL;
+    char* param;
+    for (param = strtok_r(query, "&", &saveptr); param; param = strtok_r(NULL, "&", &saveptr)) {
+        if (n_parameters + 6 >= OAUTH_MAX_PARAMETERS)
+            return -1;
+        char* eq = strchr(param, '=');
+        if (eq)
+            *eq = '\0';
+        oauth_unescape(param);
+        pairs[n_parameters].key = param;
+        if (eq) {
+            oauth_unescape(eq + 1);
+            pairs[n_parameters].value = eq + 1;
+        }
+        else {
+            pairs[n_parameters].value = "";
+        }
+        ++n_parameters;
+    }
+    n_parameters = oauth_populate_keyvalue_from_oauth(pairs, oauth, n_parameters);
+
+    char norm_params[OAUTH_MAX_BASESTRING];
+    char signature[32];
+    if (oauth_normalize_pairs(norm_params, sizeof(norm_params), pairs, n_parameters) < 0 ||
+        oauth_get_signature(method, base_url, norm_params, oauth, signature, sizeof(signature)) < 0)
+        return -1;
+
+    size_t written = g_strlcpy(buffer, "Authorization: OAuth ", buffer_size);
+    if (written >= buffer_size ||
+        oauth_header_append(buffer, buffer_size, &written, "oauth_consumer_key", oauth->app_key) < 0 ||
+        oauth_header_append(buffer, buffer_size, &written, "oauth_nonce", oauth->nonce) < 0 ||
+        oauth_header_append(buffer, buffer_size, &written, "oauth_signature", signature) < 0 ||
+        oauth_header_append(buffer, buffer_size, &written, "oauth_signature_method", "HMAC-SHA1") < 0 ||
+        oauth_header_append(buffer, buffer_size, &written, "oauth_timestamp", oauth->timestamp) < 0 ||
+        oauth_header_append(buffer, buffer_size, &written, "oauth_token", oauth->access_token) < 0 ||
+        oauth_header_append(buffer, buffer_size, &written, "oauth_version", "1.0") < 0)
+        return -1;
+    return written;
+}
+
+
 static int oauth2_get_header(char* buffer, size_t buffer_size, const OAuth* oauth,
     const char* method, const char* url)
 {
@@ -287,7 +511,8 @@ int oauth_get_header(char* buffer, size_t buffer_size, const OAuth* oauth,
         const char* method, const char* url)
 {
     g_assert(oauth != NULL);
-    g_assert(oauth->version == 2);
 
+    if (oauth->version == 1)
+        return oauth1_get_header(buffer, buffer_size, oauth, method, url);
     return oauth2_get_header(buffer, buffer_size, oauth, method, url);
 }
@@ -29,6 +29,9 @@ struct OAuth {
     char* access_token;
     char* app_secret;
     char* access_token_secret;
+    char* refresh_token; // OAuth2 only, if set access_token is obtained from TOKEN_URL
+    char* token_url;
+    int refresh_margin;
     char* timestamp; // For convenience, store serialized
     char* nonce;
 };
@@ -42,6 +45,13 @@ int oauth_setup(gfal2_context_t context, OAuth* oauth, GError** error);
 // Note: It does NOT free Oauth
 void oauth_release(OAuth* oauth);
 
+// Tells if the access token can be replaced with a fresh one
+gboolean oauth_can_refresh(const OAuth* oauth);
+
+// Marks the access token held by oauth as rejected by the server,
+// so the next oauth_setup gets a new one
+void oauth_invalidate(const OAuth* oauth);
+
 // Builds the normalized parameters string used for the final OAuth base string
 // See http://oauth.net/core/1.0/#signing_process
 // url must be the full final Drobox URL
@@ -60,6 +70,8 @@ int oauth_get_signature(const char* method, const char* url, const char* norm_pa
         char* output, size_t outsize);
 
 // Writes into buffer the OAuth HTTP Header
+// With version 1, the request is signed along with the parameters in the query of url
+// Returns the length of the header, or -1 if it does not fit
 int oauth_get_header(char* buffer, size_t buffer_size, const OAuth* oauth,
         const char* method, const char* url);
 
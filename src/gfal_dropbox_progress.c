@@ -0,0 +1,92 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_progress.h"
+#include <logger/gfal_logger.h>
+#include <string.h>
+
+
+void gfal2_dropbox_progress_start(DropboxProgress* progress, DropboxHandle* dropbox,
+    const char* src, const char* dst)
+{
+    memset(progress, 0, sizeof(*progress));
+    progress->dropbox = dropbox;
+    progress->src = src;
+    progress->dst = dst;
+    progress->start = progress->last_report = g_get_monotonic_time();
+    g_atomic_int_inc(&dropbox->active_transfers);
+}
+
+
+void gfal2_dropbox_progress_monitor(DropboxProgress* progress, gfalt_params_t params,
+    const char* src, const char* dst)
+{
+    progress->params = params;
+    progress->src = src;
+    progress->dst = dst;
+}
+
+
+static void gfal2_dropbox_progress_report(DropboxProgress* progress, gint64 now)
+{
+    gint64 elapsed = now - progress->start;
+    gint64 interval = now - progress->last_report;
+
+    struct _gfalt_transfer_status status;
+    memset(&status, 0, sizeof(status));
+    status.bytes_transfered = progress->bytes;
+    status.transfer_time = elapsed / G_USEC_PER_SEC;
+    status.average_baudrate = elapsed > 0 ? progress->bytes * G_USEC_PER_SEC / elapsed : 0;
+    status.instant_baudrate = interval > 0 ?
+        (progress->bytes - progress->last_bytes) * G_USEC_PER_SEC / interval : status.average_baudrate;
+
+    if (progress->params) {
+        plugin_trigger_monitor(progress->params, &status, progress->src, progress->dst);
+    }
+    else {
+        gfal2_log(G_LOG_LEVEL_INFO,
+            "Performance marker for %s %s: %zu bytes in %lld s, average %zu B/s, instant %zu B/s, %d active transfers",
+            progress->dst ? "the write of" : "the read of", progress->dst ? progress->dst : progress->src,
+            status.bytes_transfered, (long long)status.transfer_time,
+            status.average_baudrate, status.instant_baudrate,
+            g_atomic_int_get(&progress->dropbox->active_transfers));
+    }
+
+    progress->last_report = now;
+    progress->last_bytes = progress->bytes;
+}
+
+
+void gfal2_dropbox_progress_update(DropboxProgress* progress, size_t bytes)
+{
+    progress->bytes += bytes;
+    gint64 now = g_get_monotonic_time();
+    if (progress->dropbox->perf_marker_interval > 0 &&
+        now - progress->last_report >= progress->dropbox->perf_marker_interval) {
+        gfal2_dropbox_progress_report(progress, now);
+    }
+}
+
+
+void gfal2_dropbox_progress_end(DropboxProgress* progress)
+{
+    if (progress->dropbox == NULL)
+        return;
+    if (progress->bytes > 0 && progress->dropbox->perf_marker_interval > 0)
+        gfal2_dropbox_progress_report(progress, g_get_monotonic_time());
+    g_atomic_int_add(&progress->dropbox->active_transfers, -1);
+    progress->dropbox = NULL;
+}
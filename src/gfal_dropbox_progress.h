@@ -0,0 +1,52 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Performance markers
+// Transfers periodically report how much they moved so far and how fast, to the
+// gfal2 transfer monitor when they are part of a copy, or to the log otherwise
+
+#pragma once
+#ifndef _GFAL_DROPBOX_PROGRESS_H
+#define _GFAL_DROPBOX_PROGRESS_H
+
+#include "gfal_dropbox.h"
+
+typedef struct {
+    DropboxHandle* dropbox;
+    // Where markers go. NULL for the log
+    gfalt_params_t params;
+    const char* src;
+    const char* dst;
+    gint64 start, last_report;
+    guint64 bytes, last_bytes;
+} DropboxProgress;
+
+// Starts following a transfer from src to dst, either of which can be NULL
+// They must remain valid until the transfer ends
+void gfal2_dropbox_progress_start(DropboxProgress* progress, DropboxHandle* dropbox,
+    const char* src, const char* dst);
+
+// Sends the markers to the monitor of params from now on
+void gfal2_dropbox_progress_monitor(DropboxProgress* progress, gfalt_params_t params,
+    const char* src, const char* dst);
+
+// Counts bytes more transferred, reporting them if a marker is due
+void gfal2_dropbox_progress_update(DropboxProgress* progress, size_t bytes);
+
+// Reports the totals, if anything was transferred
+void gfal2_dropbox_progress_end(DropboxProgress* progress);
+
+#endif
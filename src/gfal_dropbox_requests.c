@@ -15,8 +15,11 @@
 **/
 
 #include "gfal_dropbox_requests.h"
+#include "gfal_dropbox_hedge.h"
+#include "gfal_dropbox_metrics.h"
 #include "gfal_dropbox_url.h"
 #include "gfal_dropbox_oauth.h"
+#include "gfal_dropbox_json.h"
 #include <stdarg.h>
 #include <string.h>
 #include <json.h>
@@ -29,6 +32,9 @@ struct ErrorMapEntry {
 
 static const struct ErrorMapEntry ErrorMap[] = {
     {"not_found", ENOENT},
+    {"conflict", EEXIST},
+    {"no_write_permission", EACCES},
+    {"insufficient_space", ENOSPC},
     {NULL, 0}
 };
 
@@ -76,15 +82,29 @@ static void gfal2_dropbox_map_path_error(json_object *error_obj, GError **error)
 }
 
 
-static void gfal2_dropbox_map_error(const char *output, size_t total_size, GError **error)
+static void gfal2_dropbox_map_error(const DropboxBuffer *output, GError **error)
 {
-    json_object *response = json_tokener_parse(output);
+    json_object *response = NULL;
+    if (output) {
+        response = gfal2_dropbox_buffer_json(output);
+    }
 
     json_object *error_obj = NULL;
-    json_object* tag = NULL;
+    if (json_object_object_get_ex(response, "error", &error_obj)) {
+        gfal2_dropbox_map_error_object(error_obj, error);
+    }
+    else {
+        gfal2_set_error(error, dropbox_domain(), EINVAL, __func__,
+            "An error happened, and couldn't parse the response");
+    }
+    json_object_put(response);
+}
 
-    if (json_object_object_get_ex(response, "error", &error_obj) &&
-        json_object_object_get_ex(error_obj, ".tag", &tag)) {
+
+void gfal2_dropbox_map_error_object(json_object* error_obj, GError** error)
+{
+    json_object* tag = NULL;
+    if (json_object_object_get_ex(error_obj, ".tag", &tag)) {
         const char *tag_str = json_object_get_string(tag);
         if (g_strcmp0(tag_str, "path") == 0) {
             gfal2_dropbox_map_path_error(error_obj, error);
@@ -97,154 +117,561 @@ static void gfal2_dropbox_map_error(const char *output, size_t total_size, GErro
         gfal2_set_error(error, dropbox_domain(), EINVAL, __func__,
             "An error happened, and couldn't parse the response");
     }
-    json_object_put(response);
 }
 
 
-static ssize_t gfal2_dropbox_perform_v(DropboxHandle* dropbox,
-        Method method, const char* url,
-        off_t offset, off_t size,
-        char* output, size_t output_size,
-        const char *payload_mimetype,
-        const char* payload, size_t payload_size,
-        size_t headers_count, va_list headers_args,
-        GError** error)
+char* gfal2_dropbox_api_url(DropboxHandle* dropbox, const char* endpoint, char* buffer, size_t buffer_size)
 {
-    g_assert(dropbox != NULL && url != NULL && output != NULL && error != NULL);
+    snprintf(buffer, buffer_size, "%s%s", dropbox->api_url, endpoint);
+    return buffer;
+}
 
-    GError* tmp_err = NULL;
+
+char* gfal2_dropbox_content_url(DropboxHandle* dropbox, const char* endpoint, char* buffer, size_t buffer_size)
+{
+    snprintf(buffer, buffer_size, "%s%s", dropbox->content_url, endpoint);
+    return buffer;
+}
+
+
+// Headers added with gfal2_dropbox_request_add_header
+#define DROPBOX_MAX_HEADERS 8
+
+
+struct DropboxRequest {
+    DropboxHandle* dropbox;
+
+    // Description
+    Method method;
+    char* url;
+    off_t offset, size;
+    const char* payload;
+    size_t payload_size;
+    // Additional header lines, NUL separated
+    DropboxBuffer header_lines;
+    size_t header_offsets[DROPBOX_MAX_HEADERS];
+    size_t header_count;
+    DropboxBuffer* output;
+    DropboxRequestSink sink;
+    void* sink_data;
+    DropboxRequestCallback callback;
+    void* user_data;
+    long low_speed_limit, low_speed_time;
+    long timeout;
+    gboolean fresh_connection;
+    // Requests the caller already sent for the same operation
+    int retries;
+
+    // Transfer
     OAuth oauth;
-    struct curl_slist* headers = NULL;
+    CURL* easy;
+    // The header list passed to curl is linked here, so it is not allocated on each submission
+    struct curl_slist header_nodes[DROPBOX_MAX_HEADERS + 2];
+    char authorization[1024];
+    char range[64];
+    size_t payload_offset;
+    char err_buffer[CURL_ERROR_SIZE];
+    int attempts;
+
+    // Completion
+    GMutex lock;
+    GCond cond;
+    gboolean submitted, done;
+    long status;
+    ssize_t result;
+    GError* error;
+};
+
+
+static size_t gfal2_dropbox_request_write(char* data, size_t size, size_t nmemb, void* user_data)
+{
+    DropboxRequest* request = (DropboxRequest*)user_data;
+    size_t total = size * nmemb;
+
+    // Successful responses go to the sink, if any. Errors still go to output, to be parsed
+    if (request->sink) {
+        long status = 0;
+        curl_easy_getinfo(request->easy, CURLINFO_RESPONSE_CODE, &status);
+        if (status / 100 == 2)
+            return request->sink(data, total, request->sink_data);
+    }
+
+    if (request->output)
+        gfal2_dropbox_buffer_append(request->output, data, total);
+    return total;
+}
+
+
+static size_t gfal2_dropbox_request_read(char* data, size_t size, size_t nmemb, void* user_data)
+{
+    DropboxRequest* request = (DropboxRequest*)user_data;
+    size_t remaining = request->payload_size - request->payload_offset;
+    size_t to_copy = MIN(size * nmemb, remaining);
+
+    if (to_copy) {
+        memcpy(data, request->payload + request->payload_offset, to_copy);
+        request->payload_offset += to_copy;
+    }
+    return to_copy;
+}
+
+
+// Called by curl at least once per second while the transfer goes on
+static int gfal2_dropbox_request_progress(void* user_data, curl_off_t dltotal, curl_off_t dlnow,
+    curl_off_t ultotal, curl_off_t ulnow)
+{
+    DropboxRequest* request = (DropboxRequest*)user_data;
+    return gfal2_is_canceled(request->dropbox->gfal2_context) ? 1 : 0;
+}
+
+
+// Called from the event loop once curl is done with the transfer
+static void gfal2_dropbox_request_done(CURL* easy, CURLcode perform_result, void* user_data)
+{
+    DropboxRequest* request = (DropboxRequest*)user_data;
+    GError* error = NULL;
+    ssize_t result = -1;
+
+    if (perform_result == CURLE_ABORTED_BY_CALLBACK) {
+        gfal2_set_error(&error, dropbox_domain(), ECANCELED, __func__, "The request has been canceled");
+    }
+    else if (perform_result == CURLE_OPERATION_TIMEDOUT) {
+        gfal2_set_error(&error, dropbox_domain(), ETIMEDOUT, __func__, "%s",
+            request->err_buffer[0] ? request->err_buffer : curl_easy_strerror(perform_result));
+    }
+    else if (perform_result != CURLE_OK) {
+        gfal2_set_error(&error, dropbox_domain(), EIO, __func__, "%s",
+            request->err_buffer[0] ? request->err_buffer : curl_easy_strerror(perform_result));
+    }
+    else {
+        curl_off_t total_size;
+        curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &total_size);
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &request->status);
+
+        switch (request->status) {
+            case 400:
+                gfal2_set_error(&error, dropbox_domain(), EINVAL, __func__, "Dropbox plugin made an invalid request");
+                break;
+            case 401:
+                gfal2_set_error(&error, dropbox_domain(), EACCES, __func__, "Token invalid, expired or revoked");
+                break;
+            case 409:
+                gfal2_dropbox_map_error(request->output, &error);
+                break;
+            case 429:
+                gfal2_set_error(&error, dropbox_domain(), EBUSY, __func__, "Too many request or write operations");
+                break;
+            default:
+                if (request->status / 100 == 2) {
+                    result = (ssize_t)(total_size);
+                }
+                else {
+                    gfal2_set_error(&error, dropbox_domain(), EIO, __func__, "Dropbox internal error");
+                }
+                break;
+        }
+    }
+
+    curl_off_t sent = 0, received = 0, duration = 0;
+    curl_easy_getinfo(easy, CURLINFO_SIZE_UPLOAD_T, &sent);
+    curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &received);
+    curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &duration);
+    gfal2_dropbox_metrics_request(request->dropbox->metrics, request->url,
+        perform_result == CURLE_OK ? request->status : 0, sent, received, duration);
+
+    gfal2_dropbox_trace_request(request->dropbox->trace, easy, method_str(request->method),
+        request->retries + request->attempts - 1, error ? error->code : 0);
+
+    gfal2_dropbox_engine_release(request->dropbox->engine, easy);
+    g_mutex_lock(&request->lock);
+    request->easy = NULL;
+    g_mutex_unlock(&request->lock);
+
+    if (request->callback) {
+        request->callback(request, result, error, request->user_data);
+    }
+
+    g_mutex_lock(&request->lock);
+    request->result = result;
+    request->error = error;
+    request->done = TRUE;
+    g_cond_broadcast(&request->cond);
+    g_mutex_unlock(&request->lock);
+}
+
+
+DropboxRequest* gfal2_dropbox_request_new(Method method, const char* url)
+{
+    g_assert(url != NULL);
+
+    DropboxRequest* request = g_new0(DropboxRequest, 1);
+    request->method = method;
+    request->url = g_strdup(url);
+    g_mutex_init(&request->lock);
+    g_cond_init(&request->cond);
+    return request;
+}
+
+
+void gfal2_dropbox_request_free(DropboxRequest* request)
+{
+    if (request == NULL)
+        return;
+
+    g_assert(!request->submitted || request->done);
+
+    g_free(request->header_lines.data);
+    oauth_release(&request->oauth);
+    g_clear_error(&request->error);
+    g_cond_clear(&request->cond);
+    g_mutex_clear(&request->lock);
+    g_free(request->url);
+    g_free(request);
+}
+
+
+void gfal2_dropbox_request_set_range(DropboxRequest* request, off_t offset, off_t size)
+{
+    request->offset = offset;
+    request->size = size;
+}
+
+
+void gfal2_dropbox_request_set_low_speed(DropboxRequest* request, long limit, long time)
+{
+    request->low_speed_limit = limit;
+    request->low_speed_time = time;
+}
+
+
+void gfal2_dropbox_request_set_timeout(DropboxRequest* request, long timeout)
+{
+    request->timeout = timeout;
+}
+
+
+void gfal2_dropbox_request_set_retries(DropboxRequest* request, int retries)
+{
+    request->retries = retries;
+}
+
+
+void gfal2_dropbox_request_set_fresh_connection(DropboxRequest* request)
+{
+    request->fresh_connection = TRUE;
+}
+
+
+void gfal2_dropbox_request_set_payload(DropboxRequest* request,
+    const char* mimetype, const char* payload, size_t payload_size)
+{
+    if (mimetype) {
+        gfal2_dropbox_request_add_header(request, "Content-Type", mimetype);
+    }
+    request->payload = payload;
+    request->payload_size = payload ? payload_size : 0;
+}
+
+
+void gfal2_dropbox_request_add_header(DropboxRequest* request, const char* key, const char* value)
+{
+    g_assert(request->header_count < DROPBOX_MAX_HEADERS);
+
+    DropboxBuffer* lines = &request->header_lines;
+    request->header_offsets[request->header_count++] = lines->length;
+    gfal2_dropbox_buffer_append(lines, key, strlen(key));
+    gfal2_dropbox_buffer_append(lines, ": ", 2);
+    // Keep the terminator, so the line can be passed as it is
+    gfal2_dropbox_buffer_append(lines, value, strlen(value) + 1);
+}
+
+
+// Appends line to the header list ending at node
+static struct curl_slist* gfal2_dropbox_request_link_header(DropboxRequest* request,
+    struct curl_slist* node, char* line)
+{
+    struct curl_slist* next = node ? node + 1 : request->header_nodes;
+    next->data = line;
+    next->next = NULL;
+    if (node)
+        node->next = next;
+    return next;
+}
+
+
+void gfal2_dropbox_request_set_output(DropboxRequest* request, DropboxBuffer* output)
+{
+    request->output = output;
+}
+
+
+void gfal2_dropbox_request_set_sink(DropboxRequest* request,
+    DropboxRequestSink sink, void* user_data)
+{
+    request->sink = sink;
+    request->sink_data = user_data;
+}
+
+
+void gfal2_dropbox_request_set_callback(DropboxRequest* request,
+    DropboxRequestCallback callback, void* user_data)
+{
+    request->callback = callback;
+    request->user_data = user_data;
+}
+
+
+int gfal2_dropbox_request_submit(DropboxHandle* dropbox, DropboxRequest* request, GError** error)
+{
+    g_assert(dropbox != NULL && request != NULL && error != NULL);
+    g_assert(!request->submitted || request->done);
+
+    GError* tmp_err = NULL;
+
+    if (gfal2_is_canceled(dropbox->gfal2_context)) {
+        gfal2_set_error(error, dropbox_domain(), ECANCELED, __func__, "The operation has been canceled");
+        return -1;
+    }
 
     // OAuth
-    if (oauth_setup(dropbox->gfal2_context, &oauth, &tmp_err) < 0) {
+    oauth_release(&request->oauth);
+    if (oauth_setup(dropbox->gfal2_context, &request->oauth, &tmp_err) < 0) {
         gfal2_propagate_prefixed_error(error, tmp_err, __func__);
-        goto fail;
+        return -1;
     }
 
-    char authorization_buffer[1024];
-    int r = oauth_get_header(authorization_buffer, sizeof(authorization_buffer), &oauth, method_str(method), url);
+    int r = oauth_get_header(request->authorization, sizeof(request->authorization),
+        &request->oauth, method_str(request->method), request->url);
     if (r < 0) {
         gfal2_set_error(error, dropbox_domain(), ENOBUFS, __func__, "Could not generate the OAuth header");
-        goto fail;
+        return -1;
     }
 
-    headers = curl_slist_append(headers, authorization_buffer);
-
-    // Payload type
-    if (payload_mimetype) {
-        char type_buffer[512];
-        snprintf(type_buffer, sizeof(type_buffer), "Content-Type: %s", payload_mimetype);
-        headers = curl_slist_append(headers, type_buffer);
-    }
+    struct curl_slist* last = gfal2_dropbox_request_link_header(request, NULL, request->authorization);
 
     // Additional headers
     size_t i;
-    for (i = 0; i < headers_count; ++i) {
-        char header_buffer[512];
-        const char *key = va_arg(headers_args, const char*);
-        const char *value = va_arg(headers_args, const char*);
-        snprintf(header_buffer, sizeof(header_buffer), "%s: %s", key, value);
-        headers = curl_slist_append(headers, header_buffer);
+    for (i = 0; i < request->header_count; ++i) {
+        last = gfal2_dropbox_request_link_header(request, last,
+            request->header_lines.data + request->header_offsets[i]);
     }
 
-    // Follow redirection
-    curl_easy_setopt(dropbox->curl_handle, CURLOPT_FOLLOWLOCATION, 1);
-
-    // Range, if needed
-    if (offset || size) {
-        char range_buffer[512];
-        snprintf(range_buffer, sizeof(range_buffer), "Range: bytes=%ld-%ld", offset, offset + size - 1);
-        headers = curl_slist_append(headers, range_buffer);
+    // Range, if needed. Without a size, up to the end
+    if (request->size) {
+        snprintf(request->range, sizeof(request->range), "Range: bytes=%lld-%lld",
+            (long long)request->offset, (long long)(request->offset + request->size - 1));
+        gfal2_dropbox_request_link_header(request, last, request->range);
+    }
+    else if (request->offset) {
+        snprintf(request->range, sizeof(request->range), "Range: bytes=%lld-", (long long)request->offset);
+        gfal2_dropbox_request_link_header(request, last, request->range);
     }
 
+    request->dropbox = dropbox;
+    request->payload_offset = 0;
+    if (request->output)
+        gfal2_dropbox_buffer_reset(request->output);
+    request->err_buffer[0] = '\0';
+    request->status = 0;
+    request->result = -1;
+    g_clear_error(&request->error);
+    request->done = FALSE;
+    request->submitted = TRUE;
+    request->attempts++;
+
+    CURL* curl = gfal2_dropbox_engine_acquire(dropbox->engine);
+    g_mutex_lock(&request->lock);
+    request->easy = curl;
+    g_mutex_unlock(&request->lock);
+
+    // Follow redirection
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+
     // Where to write
-    // Note, the b is important, or the last byte will be lost!
-    FILE* fd = fmemopen(output, output_size, "wb");
-    curl_easy_setopt(dropbox->curl_handle, CURLOPT_WRITEDATA, fd);
-    curl_easy_setopt(dropbox->curl_handle, CURLOPT_WRITEFUNCTION, fwrite);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, gfal2_dropbox_request_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, request);
 
     // Error buffer
-    char err_buffer[CURL_ERROR_SIZE];
-    curl_easy_setopt(dropbox->curl_handle, CURLOPT_ERRORBUFFER, err_buffer);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, request->err_buffer);
 
-    // What and where (need to concat the arguments)
-    switch (method) {
+    // Give up on stalled transfers, unreachable hosts, and requests taking too long
+    if (request->low_speed_time > 0) {
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, request->low_speed_limit);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, request->low_speed_time);
+    }
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, dropbox->connect_timeout);
+    if (request->timeout > 0) {
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, request->timeout);
+    }
+
+    // Abort as soon as gfal2 cancels the operation
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, gfal2_dropbox_request_progress);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, request);
+
+    // Neither wait for a busy connection, nor share it
+    if (request->fresh_connection) {
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 0L);
+        curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+    }
+
+    // What and where
+    switch (request->method) {
         case M_PUT:
-            curl_easy_setopt(dropbox->curl_handle, CURLOPT_UPLOAD, 1);
+            curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
+            curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)request->payload_size);
             break;
         case M_POST:
-            curl_easy_setopt(dropbox->curl_handle, CURLOPT_POST, 1);
-            curl_easy_setopt(dropbox->curl_handle, CURLOPT_POSTFIELDSIZE, payload_size);
+            curl_easy_setopt(curl, CURLOPT_POST, 1);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)request->payload_size);
             break;
         case M_GET:
-            curl_easy_setopt(dropbox->curl_handle, CURLOPT_UPLOAD, 0);
+            curl_easy_setopt(curl, CURLOPT_UPLOAD, 0);
             break;
     }
-    curl_easy_setopt(dropbox->curl_handle, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_URL, request->url);
 
     // Payload
-    FILE* payload_fd = NULL;
-    if (payload) {
-        payload_fd = fmemopen((char*)payload, payload_size, "rb");
-        curl_easy_setopt(dropbox->curl_handle, CURLOPT_READFUNCTION, fread);
-        curl_easy_setopt(dropbox->curl_handle, CURLOPT_READDATA, payload_fd);
-    }
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, gfal2_dropbox_request_read);
+    curl_easy_setopt(curl, CURLOPT_READDATA, request);
 
     // Do!
-    gfal2_log(G_LOG_LEVEL_INFO, "%s %s", method_str(method), url);
-    curl_easy_setopt(dropbox->curl_handle, CURLOPT_HTTPHEADER, headers);
-    int perform_result = curl_easy_perform(dropbox->curl_handle);
+    gfal2_log(G_LOG_LEVEL_INFO, "%s %s", method_str(request->method), request->url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request->header_nodes);
+    gfal2_dropbox_engine_submit(dropbox->engine, curl, gfal2_dropbox_request_done, request);
+    return 0;
+}
 
-    // Release resources
-    fclose(fd);
-    if (payload_fd)
-        fclose(payload_fd);
-    curl_slist_free_all(headers);
 
-    if (perform_result != 0) {
-        gfal2_set_error(error, dropbox_domain(), EIO, __func__, "%s", err_buffer);
-        goto fail;
+gboolean gfal2_dropbox_request_is_done(DropboxRequest* request)
+{
+    g_mutex_lock(&request->lock);
+    gboolean done = request->done;
+    g_mutex_unlock(&request->lock);
+    return done;
+}
+
+
+void gfal2_dropbox_request_resume(DropboxRequest* request)
+{
+    g_mutex_lock(&request->lock);
+    if (request->easy) {
+        gfal2_dropbox_engine_unpause(request->dropbox->engine, request->easy, request);
     }
+    g_mutex_unlock(&request->lock);
+}
 
-    double total_size;
-    curl_easy_getinfo(dropbox->curl_handle, CURLINFO_SIZE_DOWNLOAD, &total_size);
-    oauth_release(&oauth);
 
-    long response;
-    curl_easy_getinfo(dropbox->curl_handle, CURLINFO_RESPONSE_CODE, &response);
-    if (response / 100 != 2) {
-        switch (response) {
-            case 400:
-                gfal2_set_error(error, dropbox_domain(), EINVAL, __func__, "Dropbox plugin made an invalid request");
-                return -1;
-            case 401:
-                gfal2_set_error(error, dropbox_domain(), EACCES, __func__, "Token invalid, expired or revoked");
-                return -1;
-            case 409:
-                gfal2_dropbox_map_error(output, total_size, error);
-                return -1;
-            case 429:
-                gfal2_set_error(error, dropbox_domain(), EBUSY, __func__, "Too many request or write operations");
-                return -1;
-            default:
-                gfal2_set_error(error, dropbox_domain(), EIO, __func__, "Dropbox internal error");
-                return -1;
+static void gfal2_dropbox_request_wait_done(DropboxRequest* request)
+{
+    g_mutex_lock(&request->lock);
+    while (!request->done) {
+        g_cond_wait(&request->cond, &request->lock);
+    }
+    g_mutex_unlock(&request->lock);
+}
+
+
+void gfal2_dropbox_request_cancel(DropboxRequest* request)
+{
+    g_assert(request != NULL && request->submitted);
+
+    g_mutex_lock(&request->lock);
+    if (request->easy) {
+        gfal2_dropbox_engine_cancel(request->dropbox->engine, request->easy, request);
+    }
+    g_mutex_unlock(&request->lock);
+
+    gfal2_dropbox_request_wait_done(request);
+}
+
+
+int gfal2_dropbox_request_retry_auth(DropboxRequest* request, GError** error)
+{
+    gfal2_dropbox_request_wait_done(request);
+
+    // The token may have expired or been revoked between the setup and the request,
+    // so if we can get a new one, try once more
+    if (request->status == 401 && request->attempts == 1 && oauth_can_refresh(&request->oauth)) {
+        gfal2_log(G_LOG_LEVEL_INFO, "Access token rejected, retrying with a fresh one");
+        gfal2_dropbox_metrics_retry(request->dropbox->metrics, DROPBOX_RETRY_AUTH);
+        oauth_invalidate(&request->oauth);
+        if (gfal2_dropbox_request_submit(request->dropbox, request, error) < 0) {
+            return -1;
         }
+        return 1;
+    }
+    return 0;
+}
+
+
+ssize_t gfal2_dropbox_request_wait(DropboxRequest* request, GError** error)
+{
+    g_assert(request != NULL && request->submitted && error != NULL);
+
+    int retry;
+    do {
+        gfal2_dropbox_request_wait_done(request);
+        retry = gfal2_dropbox_request_retry_auth(request, error);
+        if (retry < 0) {
+            return -1;
+        }
+    } while (retry);
+
+    if (request->result < 0) {
+        g_propagate_error(error, g_error_copy(request->error));
+    }
+    return request->result;
+}
+
+
+static ssize_t gfal2_dropbox_perform_v(DropboxHandle* dropbox,
+        Method method, const char* url,
+        off_t offset, off_t size,
+        DropboxBuffer* output,
+        const char *payload_mimetype,
+        const char* payload, size_t payload_size,
+        size_t headers_count, va_list headers_args,
+        GError** error)
+{
+    g_assert(dropbox != NULL && url != NULL && error != NULL);
+
+    // Error responses still need to be parsed
+    DropboxBuffer* scratch = NULL;
+    if (output == NULL) {
+        output = scratch = gfal2_dropbox_buffer_acquire(dropbox->buffers);
     }
 
-    return (ssize_t)(total_size);
+    DropboxRequest* request = gfal2_dropbox_request_new(method, url);
+    gfal2_dropbox_request_set_range(request, offset, size);
+    gfal2_dropbox_request_set_payload(request, payload_mimetype, payload, payload_size);
+    gfal2_dropbox_request_set_output(request, output);
+    gfal2_dropbox_request_set_low_speed(request, dropbox->low_speed_limit, dropbox->low_speed_time);
+    // Unless file data is sent, there is little to transfer either way
+    if (payload_size == 0 || g_strcmp0(payload_mimetype, "application/json") == 0)
+        gfal2_dropbox_request_set_timeout(request, dropbox->operation_timeout);
+
+    size_t i;
+    for (i = 0; i < headers_count; ++i) {
+        const char *key = va_arg(headers_args, const char*);
+        const char *value = va_arg(headers_args, const char*);
+        gfal2_dropbox_request_add_header(request, key, value);
+    }
 
-fail:
-    oauth_release(&oauth);
-    return -1;
+    ssize_t ret = -1;
+    if (gfal2_dropbox_request_submit(dropbox, request, error) == 0) {
+        ret = gfal2_dropbox_request_wait(request, error);
+    }
+    gfal2_dropbox_request_free(request);
+    gfal2_dropbox_buffer_release(dropbox->buffers, scratch);
+    return ret;
 }
 
 
 ssize_t gfal2_dropbox_perform(DropboxHandle* dropbox,
     Method method, const char* url,
     off_t offset, off_t size,
-    char* output, size_t output_size,
+    DropboxBuffer* output,
     const char *payload_mimetype,
     const char* payload, size_t payload_size,
     GError** error,
@@ -253,7 +680,7 @@ ssize_t gfal2_dropbox_perform(DropboxHandle* dropbox,
     va_list args;
     va_start(args, headers_count);
     ssize_t ret = gfal2_dropbox_perform_v(dropbox, method, url,
-        offset, size, output, output_size,
+        offset, size, output,
         payload_mimetype, payload, payload_size,
         headers_count, args,
         error);
@@ -262,35 +689,241 @@ ssize_t gfal2_dropbox_perform(DropboxHandle* dropbox,
 }
 
 
+// Copies of the same request, racing for the first answer
+typedef struct {
+    GMutex lock;
+    GCond cond;
+    int submitted, finished;
+    DropboxRequest* winner;
+} DropboxHedgeRace;
+
+
+static void gfal2_dropbox_hedge_done(DropboxRequest* request, ssize_t result,
+    const GError* error, void* user_data)
+{
+    DropboxHedgeRace* race = (DropboxHedgeRace*)user_data;
+    g_mutex_lock(&race->lock);
+    ++race->finished;
+    // A connection failure is no answer, the other copy may still get one
+    if (race->winner == NULL && (result >= 0 || request->status != 0))
+        race->winner = request;
+    g_cond_broadcast(&race->cond);
+    g_mutex_unlock(&race->lock);
+}
+
+
+// Metadata requests are bound by the operation timeout
+static DropboxRequest* gfal2_dropbox_json_request(DropboxHandle* dropbox, const char* url,
+    DropboxBuffer* payload, DropboxBuffer* output)
+{
+    DropboxRequest* request = gfal2_dropbox_request_new(M_POST, url);
+    gfal2_dropbox_request_set_payload(request, "application/json", payload->data, payload->length);
+    gfal2_dropbox_request_set_output(request, output);
+    gfal2_dropbox_request_set_low_speed(request, dropbox->low_speed_limit, dropbox->low_speed_time);
+    gfal2_dropbox_request_set_timeout(request, dropbox->operation_timeout);
+    return request;
+}
+
+
+// Posts payload, and posts it once more if there is no answer in time
+static ssize_t gfal2_dropbox_post_hedged(DropboxHandle* dropbox, const char* url,
+    DropboxBuffer* payload, DropboxBuffer* output, GError** error)
+{
+    DropboxBuffer* scratch = NULL;
+    if (output == NULL) {
+        output = scratch = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    }
+    DropboxBuffer* hedge_output = NULL;
+
+    DropboxHedgeRace race;
+    memset(&race, 0, sizeof(race));
+    g_mutex_init(&race.lock);
+    g_cond_init(&race.cond);
+
+    DropboxRequest* requests[2] = {NULL, NULL};
+    ssize_t ret = -1;
+    gint64 start = g_get_monotonic_time();
+
+    requests[0] = gfal2_dropbox_json_request(dropbox, url, payload, output);
+    gfal2_dropbox_request_set_callback(requests[0], gfal2_dropbox_hedge_done, &race);
+    if (gfal2_dropbox_request_submit(dropbox, requests[0], error) < 0) {
+        gfal2_dropbox_request_free(requests[0]);
+        goto out;
+    }
+
+    g_mutex_lock(&race.lock);
+    race.submitted = 1;
+    gint64 deadline = start + gfal2_dropbox_hedge_delay(dropbox->hedge);
+    while (race.finished < race.submitted && g_cond_wait_until(&race.cond, &race.lock, deadline))
+        ;
+    gboolean late = (race.finished == 0);
+    g_mutex_unlock(&race.lock);
+
+    if (late && gfal2_dropbox_hedge_acquire(dropbox->hedge)) {
+        gfal2_log(G_LOG_LEVEL_DEBUG, "No answer from %s after %lld us, sending the request again",
+            url, (long long)(g_get_monotonic_time() - start));
+        hedge_output = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+        requests[1] = gfal2_dropbox_json_request(dropbox, url, payload, hedge_output);
+        gfal2_dropbox_request_set_callback(requests[1], gfal2_dropbox_hedge_done, &race);
+        // Whatever holds up the first copy may be its connection
+        gfal2_dropbox_request_set_fresh_connection(requests[1]);
+        GError* tmp_err = NULL;
+        if (gfal2_dropbox_request_submit(dropbox, requests[1], &tmp_err) < 0) {
+            gfal2_log(G_LOG_LEVEL_DEBUG, "Could not send the duplicate: %s", tmp_err->message);
+            g_error_free(tmp_err);
+            gfal2_dropbox_request_free(requests[1]);
+            requests[1] = NULL;
+        }
+        else {
+            g_mutex_lock(&race.lock);
+            race.submitted = 2;
+            g_mutex_unlock(&race.lock);
+        }
+    }
+
+    g_mutex_lock(&race.lock);
+    while (race.winner == NULL && race.finished < race.submitted)
+        g_cond_wait(&race.cond, &race.lock);
+    DropboxRequest* winner = race.winner ? race.winner : requests[0];
+    if (race.winner)
+        gfal2_dropbox_hedge_record(dropbox->hedge, g_get_monotonic_time() - start);
+    g_mutex_unlock(&race.lock);
+
+    // The loser is not needed anymore
+    int i;
+    for (i = 0; i < 2; ++i) {
+        if (requests[i] && requests[i] != winner)
+            gfal2_dropbox_request_cancel(requests[i]);
+    }
+
+    ret = gfal2_dropbox_request_wait(winner, error);
+    if (requests[1])
+        gfal2_dropbox_metrics_hedge(dropbox->metrics, winner == requests[1]);
+    if (winner == requests[1]) {
+        gfal2_log(G_LOG_LEVEL_DEBUG, "The duplicate request to %s answered first", url);
+        gfal2_dropbox_buffer_reset(output);
+        gfal2_dropbox_buffer_append(output, hedge_output->data, hedge_output->length);
+    }
+
+    gfal2_dropbox_request_free(requests[0]);
+    gfal2_dropbox_request_free(requests[1]);
+
+out:
+    gfal2_dropbox_buffer_release(dropbox->buffers, hedge_output);
+    gfal2_dropbox_buffer_release(dropbox->buffers, scratch);
+    g_cond_clear(&race.cond);
+    g_mutex_clear(&race.lock);
+    return ret;
+}
+
+
 ssize_t gfal2_dropbox_post_json(DropboxHandle *dropbox,
-    const char *url, char *output, size_t output_size, GError **error,
+    const char *url, DropboxBuffer *output, GError **error,
     size_t n_args, ...)
 {
+    DropboxBuffer* payload = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    DropboxJsonWriter writer;
+    gfal2_dropbox_json_init(&writer, payload, FALSE);
+
     va_list args;
     va_start(args, n_args);
     size_t i;
-    json_object *request = json_object_new_object();
+    gfal2_dropbox_json_begin(&writer, NULL);
     for (i = 0; i < n_args; ++i) {
         const char *key = va_arg(args, const char*);
         const char *value = va_arg(args, const char*);
-        json_object *value_obj = json_object_new_string(value);
-        json_object_object_add(request, key, value_obj);
+        gfal2_dropbox_json_string(&writer, key, value);
     }
+    gfal2_dropbox_json_end(&writer);
     va_end(args);
 
-    const char *payload = json_object_to_json_string(request);
-
     GError* tmp_err = NULL;
-    ssize_t r = gfal2_dropbox_perform_v(dropbox,
-        M_POST, url,
-        0, 0,
-        output, output_size,
-        "application/json", payload, strlen(payload),
-        0, NULL,
-        &tmp_err);
-    json_object_put(request);
+    ssize_t r;
+    if (dropbox->hedge && gfal2_dropbox_hedge_idempotent(url)) {
+        r = gfal2_dropbox_post_hedged(dropbox, url, payload, output, &tmp_err);
+    }
+    else {
+        DropboxBuffer* scratch = output ? NULL : gfal2_dropbox_buffer_acquire(dropbox->buffers);
+        DropboxRequest* request = gfal2_dropbox_json_request(dropbox, url, payload, output ? output : scratch);
+        r = -1;
+        if (gfal2_dropbox_request_submit(dropbox, request, &tmp_err) == 0) {
+            r = gfal2_dropbox_request_wait(request, &tmp_err);
+        }
+        gfal2_dropbox_request_free(request);
+        gfal2_dropbox_buffer_release(dropbox->buffers, scratch);
+    }
+    gfal2_dropbox_buffer_release(dropbox->buffers, payload);
     if (r < 0) {
         gfal2_propagate_prefixed_error(error, tmp_err, __func__);
     }
     return r;
 }
+
+
+int gfal2_dropbox_list_folder(DropboxHandle* dropbox, const char* folder, const char* cursor,
+    DropboxListCallback callback, void* user_data, char** next_cursor, GError** error)
+{
+    DropboxBuffer* output = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    char endpoint[GFAL_URL_MAX_LEN];
+    char* current = g_strdup(cursor);
+    GError* tmp_err = NULL;
+    int result = -1;
+
+    while (TRUE) {
+        ssize_t ret;
+        if (current == NULL) {
+            // The root is an empty string for list_folder
+            ret = gfal2_dropbox_post_json(dropbox,
+                gfal2_dropbox_api_url(dropbox, "/2/files/list_folder", endpoint, sizeof(endpoint)),
+                output, &tmp_err, 1, "path", strcmp(folder, "/") == 0 ? "" : folder);
+        }
+        else {
+            ret = gfal2_dropbox_post_json(dropbox,
+                gfal2_dropbox_api_url(dropbox, "/2/files/list_folder/continue", endpoint, sizeof(endpoint)),
+                output, &tmp_err, 1, "cursor", current);
+        }
+        if (ret < 0)
+            break;
+
+        json_object* root = gfal2_dropbox_buffer_json(output);
+        json_object *list = NULL, *more = NULL, *next = NULL;
+        if (!json_object_object_get_ex(root, "entries", &list) || !json_object_is_type(list, json_type_array)) {
+            json_object_put(root);
+            gfal2_set_error(&tmp_err, dropbox_domain(), EIO, __func__, "The response didn't include 'entries'");
+            break;
+        }
+
+        g_free(current);
+        current = NULL;
+        if (json_object_object_get_ex(root, "cursor", &next)) {
+            current = g_strdup(json_object_get_string(next));
+        }
+        // Without a cursor to go on from, this page is the last one
+        gboolean has_more = json_object_object_get_ex(root, "has_more", &more) &&
+            json_object_get_boolean(more) && current != NULL;
+        gboolean go_on = callback(list, user_data);
+        json_object_put(root);
+
+        if (!has_more) {
+            result = 1;
+            break;
+        }
+        if (!go_on) {
+            result = 0;
+            break;
+        }
+    }
+
+    gfal2_dropbox_buffer_release(dropbox->buffers, output);
+    if (result < 0) {
+        g_free(current);
+        gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+    }
+    else if (next_cursor) {
+        *next_cursor = current;
+    }
+    else {
+        g_free(current);
+    }
+    return result;
+}
@@ -21,6 +21,7 @@
 #define _GFAL_DROPBOX_REQUESTS_H
 
 #include "gfal_dropbox.h"
+#include "gfal_dropbox_buffer.h"
 
 enum Method {
     M_GET,
@@ -29,25 +30,135 @@ enum Method {
 };
 typedef enum Method Method;
 
+typedef struct DropboxRequest DropboxRequest;
+
+// Build into buffer the full URL of an endpoint served by the API host (i.e. /2/files/get_metadata)
+// Returns buffer
+char* gfal2_dropbox_api_url(DropboxHandle* dropbox, const char* endpoint, char* buffer, size_t buffer_size);
+
+// Build into buffer the full URL of an endpoint served by the content host (i.e. /2/files/download)
+// Returns buffer
+char* gfal2_dropbox_content_url(DropboxHandle* dropbox, const char* endpoint, char* buffer, size_t buffer_size);
+
+// Called from the engine event loop thread once the request is done
+// result is the response size, or -1 on failure, in which case error is set
+// It must not block, nor free the request
+typedef void (*DropboxRequestCallback)(DropboxRequest* request, ssize_t result,
+    const GError* error, void* user_data);
+
+// Called from the engine event loop thread with each piece of a successful response body
+// Must return size, or CURL_WRITEFUNC_PAUSE to hold the transfer until
+// gfal2_dropbox_request_resume is called, in which case the same data is passed again
+typedef size_t (*DropboxRequestSink)(const char* data, size_t size, void* user_data);
+
+/// Asynchronous interface
+/// A DropboxRequest describes the request, and doubles as the handle to wait for its completion
+
+// Creates a new request description
+DropboxRequest* gfal2_dropbox_request_new(Method method, const char* url);
+
+// Frees the request. If it has been submitted, it must be done
+void gfal2_dropbox_request_free(DropboxRequest* request);
+
+// Ask only for the given range of the resource
+// If size is 0, up to the end
+void gfal2_dropbox_request_set_range(DropboxRequest* request, off_t offset, off_t size);
+
+// Abort the transfer if it goes slower than limit bytes per second for time seconds
+// The time spent paused does not count
+void gfal2_dropbox_request_set_low_speed(DropboxRequest* request, long limit, long time);
+
+// Abort the request if it is not done within timeout seconds, with ETIMEDOUT
+void gfal2_dropbox_request_set_timeout(DropboxRequest* request, long timeout);
+
+// The caller already sent retries requests for the same operation, which failed
+// Only used to trace the request
+void gfal2_dropbox_request_set_retries(DropboxRequest* request, int retries);
+
+// Send the request over a new connection, rather than one already open to the host
+void gfal2_dropbox_request_set_fresh_connection(DropboxRequest* request);
+
+// Send payload as the body of the request
+// payload must remain valid until the request is done
+void gfal2_dropbox_request_set_payload(DropboxRequest* request,
+    const char* mimetype, const char* payload, size_t payload_size);
+
+// Add an additional header
+void gfal2_dropbox_request_add_header(DropboxRequest* request, const char* key, const char* value);
+
+// The response body is written into output, which is emptied on submission
+// output must remain valid until the request is done
+void gfal2_dropbox_request_set_output(DropboxRequest* request, DropboxBuffer* output);
+
+// Successful response bodies are passed to sink instead of being written into output
+// Error responses still go to output, so they can be parsed
+void gfal2_dropbox_request_set_sink(DropboxRequest* request,
+    DropboxRequestSink sink, void* user_data);
+
+// Register a function to be called on completion
+void gfal2_dropbox_request_set_callback(DropboxRequest* request,
+    DropboxRequestCallback callback, void* user_data);
+
+// Queue the request, and return immediately
+// The OAuth headers are set here. If the gfal2 operation is canceled, it fails with ECANCELED
+int gfal2_dropbox_request_submit(DropboxHandle* dropbox, DropboxRequest* request, GError** error);
+
+// Returns TRUE if the submitted request is done
+gboolean gfal2_dropbox_request_is_done(DropboxRequest* request);
+
+// Block until the submitted request is done
+// If the access token was rejected and it can be refreshed, the request is sent once more
+// Returns the response size, or -1 on error
+ssize_t gfal2_dropbox_request_wait(DropboxRequest* request, GError** error);
+
+// Once the submitted request is done: if it failed because the access token was rejected,
+// and a new one can be obtained, submit it once more and return 1
+// Returns 0 if it should not be retried, -1 if it could not be submitted again
+int gfal2_dropbox_request_retry_auth(DropboxRequest* request, GError** error);
+
+// Resume a request paused by its sink
+void gfal2_dropbox_request_resume(DropboxRequest* request);
+
+// Abort the submitted request, and block until it is done
+void gfal2_dropbox_request_cancel(DropboxRequest* request);
+
+/// Synchronous interface
 /// These methods take care of setting the OAuth headers!
 
 // Perform the request method (GET, POST, PUT), building it with the provided headers,
 // offset, etc.
+// The response goes into output, which can be NULL if it is not needed
+// Requests without a payload, or with a JSON one, are bound by the operation timeout
 ssize_t gfal2_dropbox_perform(DropboxHandle* dropbox,
     Method method, const char* url,
     off_t offset, off_t size,
-    char* output, size_t output_size,
+    DropboxBuffer* output,
     const char *payload_mimetype,
     const char* payload, size_t payload_size,
     GError** error,
     size_t headers_count, ...);
 
 
+// Sets error from the error object of a Dropbox response (the "error" member of the body)
+void gfal2_dropbox_map_error_object(json_object* error_obj, GError** error);
+
+
 // Post a JSON body
 // Returns the response size
 ssize_t gfal2_dropbox_post_json(DropboxHandle *dropbox,
-    const char *url, char *output, size_t output_size, GError **error,
+    const char *url, DropboxBuffer *output, GError **error,
     size_t n_args, ...);
 
 
+// Called with the entries of each page of a folder listing, as a json array
+// Returns FALSE to stop the listing after this page
+typedef gboolean (*DropboxListCallback)(json_object* entries, void* user_data);
+
+// Lists folder page by page, going on from cursor instead if it is not NULL
+// next_cursor, if not NULL, is set to where the listing goes on from, to be freed with g_free
+// Returns 1 once there are no more pages, 0 if the callback stopped it before, -1 on error
+int gfal2_dropbox_list_folder(DropboxHandle* dropbox, const char* folder, const char* cursor,
+    DropboxListCallback callback, void* user_data, char** next_cursor, GError** error);
+
+
 #endif
@@ -0,0 +1,72 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox_share.h"
+#include <glib.h>
+
+// Protects the share object and its reference count
+static GMutex share_lock;
+static CURLSH* share = NULL;
+static int share_refs = 0;
+
+// One lock per kind of shared data, so resolving does not wait for a TLS session lookup
+static GMutex share_data_locks[CURL_LOCK_DATA_LAST];
+
+
+static void gfal2_dropbox_share_lock(CURL* easy, curl_lock_data data, curl_lock_access access, void* user_data)
+{
+    g_mutex_lock(&share_data_locks[data]);
+}
+
+
+static void gfal2_dropbox_share_unlock(CURL* easy, curl_lock_data data, void* user_data)
+{
+    g_mutex_unlock(&share_data_locks[data]);
+}
+
+
+CURLSH* gfal2_dropbox_share_acquire(void)
+{
+    g_mutex_lock(&share_lock);
+    if (share == NULL) {
+        share = curl_share_init();
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, gfal2_dropbox_share_lock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, gfal2_dropbox_share_unlock);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        // Connections are not shared: each handle multiplexes over its own from its event
+        // loop thread, and curl does not support using a connection from several threads
+    }
+    ++share_refs;
+    CURLSH* result = share;
+    g_mutex_unlock(&share_lock);
+    return result;
+}
+
+
+void gfal2_dropbox_share_release(CURLSH* released)
+{
+    if (released == NULL)
+        return;
+
+    g_mutex_lock(&share_lock);
+    g_assert(released == share && share_refs > 0);
+    if (--share_refs == 0) {
+        curl_share_cleanup(share);
+        share = NULL;
+    }
+    g_mutex_unlock(&share_lock);
+}
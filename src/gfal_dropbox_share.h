@@ -0,0 +1,35 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Process wide curl share object
+// All the plugin handles in the process use the same DNS cache and TLS sessions,
+// so a new gfal2 context does not need to resolve the hosts nor go through
+// a full TLS handshake again
+
+#pragma once
+#ifndef _GFAL_DROPBOX_SHARE_H
+#define _GFAL_DROPBOX_SHARE_H
+
+#include <curl/curl.h>
+
+// Gets a reference to the share object, creating it if needed
+CURLSH* gfal2_dropbox_share_acquire(void);
+
+// Drops a reference obtained with gfal2_dropbox_share_acquire
+// The share object is freed with the last one. No easy handle may be using it by then
+void gfal2_dropbox_share_release(CURLSH* share);
+
+#endif
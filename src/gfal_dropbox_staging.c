@@ -0,0 +1,151 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox.h"
+#include "gfal_dropbox_staging.h"
+#include <logger/gfal_logger.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+struct DropboxStaging {
+    size_t capacity;
+    size_t memory_limit;
+    char* spill_dir;
+
+    // Either on the heap, or mapped from fd
+    char* data;
+    size_t allocated;
+    size_t length;
+    int fd;
+};
+
+
+DropboxStaging* gfal2_dropbox_staging_new(size_t capacity, size_t memory_limit, const char* spill_dir)
+{
+    DropboxStaging* staging = g_new0(DropboxStaging, 1);
+    staging->capacity = capacity;
+    staging->memory_limit = MIN(memory_limit, capacity);
+    staging->spill_dir = g_strdup(spill_dir ? spill_dir : g_get_tmp_dir());
+    staging->fd = -1;
+    return staging;
+}
+
+
+void gfal2_dropbox_staging_free(DropboxStaging* staging)
+{
+    if (staging == NULL)
+        return;
+    if (staging->fd >= 0) {
+        munmap(staging->data, staging->capacity);
+        close(staging->fd);
+    }
+    else {
+        g_free(staging->data);
+    }
+    g_free(staging->spill_dir);
+    g_free(staging);
+}
+
+
+// Moves the chunk into a memory mapped file big enough for the whole capacity
+static int gfal2_dropbox_staging_spill(DropboxStaging* staging, GError** error)
+{
+    char* path = g_build_filename(staging->spill_dir, "gfal2_dropbox_staging_XXXXXX", NULL);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__,
+            "Could not create a staging file in %s", staging->spill_dir);
+        g_free(path);
+        return -1;
+    }
+    // Nobody else needs to see it, and this way it goes away with the process
+    unlink(path);
+    g_free(path);
+
+    if (ftruncate(fd, staging->capacity) < 0) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not size the staging file");
+        close(fd);
+        return -1;
+    }
+    char* data = mmap(NULL, staging->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        gfal2_set_error(error, dropbox_domain(), errno, __func__, "Could not map the staging file");
+        close(fd);
+        return -1;
+    }
+
+    gfal2_log(G_LOG_LEVEL_DEBUG, "Upload chunk spilled to disk past %zu bytes", staging->length);
+    memcpy(data, staging->data, staging->length);
+    g_free(staging->data);
+    staging->data = data;
+    staging->allocated = staging->capacity;
+    staging->fd = fd;
+    return 0;
+}
+
+
+ssize_t gfal2_dropbox_staging_append(DropboxStaging* staging, const void* data, size_t size, GError** error)
+{
+    size_t n = MIN(size, staging->capacity - staging->length);
+    size_t needed = staging->length + n;
+
+    if (needed > staging->allocated) {
+        if (needed > staging->memory_limit) {
+            if (gfal2_dropbox_staging_spill(staging, error) < 0)
+                return -1;
+        }
+        else {
+            staging->allocated = MIN(MAX(needed, staging->allocated * 2), staging->memory_limit);
+            staging->data = g_realloc(staging->data, staging->allocated);
+        }
+    }
+
+    memcpy(staging->data + staging->length, data, n);
+    staging->length += n;
+    return n;
+}
+
+
+const char* gfal2_dropbox_staging_data(DropboxStaging* staging)
+{
+    return staging->data;
+}
+
+
+size_t gfal2_dropbox_staging_length(DropboxStaging* staging)
+{
+    return staging->length;
+}
+
+
+gboolean gfal2_dropbox_staging_full(DropboxStaging* staging)
+{
+    return staging->length == staging->capacity;
+}
+
+
+void gfal2_dropbox_staging_reset(DropboxStaging* staging)
+{
+    // Throw away the content of the file, so it is not written back for nothing
+    if (staging->fd >= 0 && staging->length > 0) {
+        if (ftruncate(staging->fd, 0) < 0 || ftruncate(staging->fd, staging->capacity) < 0) {
+            gfal2_log(G_LOG_LEVEL_WARNING, "Could not truncate the staging file: %s", strerror(errno));
+        }
+    }
+    staging->length = 0;
+}
@@ -0,0 +1,58 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Upload staging
+// Holds a chunk of an upload until Dropbox acknowledges it, so it can be sent again
+// The chunk is kept in memory up to a limit, and past that in a memory mapped file
+
+#pragma once
+#ifndef _GFAL_DROPBOX_STAGING_H
+#define _GFAL_DROPBOX_STAGING_H
+
+#include <gfal_api.h>
+
+// Dropbox recommends appending in multiples of 4 MiB
+#define DROPBOX_UPLOAD_CHUNK_ALIGNMENT (4 * 1024 * 1024)
+// Dropbox takes at most 150 MiB per request, so the largest aligned chunk is 148 MiB
+#define DROPBOX_UPLOAD_CHUNK_MAX (148 * 1024 * 1024)
+#define DROPBOX_DEFAULT_STAGING_MEMORY (8 * 1024 * 1024)
+
+typedef struct DropboxStaging DropboxStaging;
+
+// Creates a staging area for chunks of up to capacity bytes
+// Past memory_limit bytes, the chunk goes into an unlinked file created inside spill_dir
+DropboxStaging* gfal2_dropbox_staging_new(size_t capacity, size_t memory_limit, const char* spill_dir);
+
+// Frees the staging area, and its file, if any
+void gfal2_dropbox_staging_free(DropboxStaging* staging);
+
+// Copies as much of data as it fits
+// Returns how much was copied, or -1 on error
+ssize_t gfal2_dropbox_staging_append(DropboxStaging* staging, const void* data, size_t size, GError** error);
+
+// The staged chunk
+const char* gfal2_dropbox_staging_data(DropboxStaging* staging);
+
+// Size of the staged chunk
+size_t gfal2_dropbox_staging_length(DropboxStaging* staging);
+
+// Returns TRUE if the chunk has reached its capacity
+gboolean gfal2_dropbox_staging_full(DropboxStaging* staging);
+
+// Drops the chunk, once it has been acknowledged
+void gfal2_dropbox_staging_reset(DropboxStaging* staging);
+
+#endif
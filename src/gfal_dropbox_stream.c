@@ -0,0 +1,304 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox.h"
+#include "gfal_dropbox_json.h"
+#include "gfal_dropbox_metrics.h"
+#include "gfal_dropbox_requests.h"
+#include "gfal_dropbox_stream.h"
+#include <string.h>
+
+
+struct DropboxStream {
+    DropboxHandle* dropbox;
+    char* path;
+    off_t size;
+
+    DropboxRequest* request;
+    // Error responses are parsed from here
+    DropboxBuffer* error_output;
+
+    // Protects everything below
+    GMutex lock;
+    GCond cond;
+
+    // Received, but not yet read, data is at buffer + start
+    char* buffer;
+    size_t capacity, start, length;
+    // Offset in the file of buffer + start
+    off_t offset;
+
+    gboolean paused;
+    gboolean finished;
+    GError* error;
+    // Restarts since data last arrived
+    int failures;
+    // Restarts since the stream was opened. Only touched by the reader
+    int restarts;
+};
+
+
+// Called from the event loop thread with the data as it arrives
+static size_t gfal2_dropbox_stream_sink(const char* data, size_t size, void* user_data)
+{
+    DropboxStream* stream = (DropboxStream*)user_data;
+
+    g_mutex_lock(&stream->lock);
+    if (stream->length + size > stream->capacity) {
+        // Hold the transfer until the reader catches up
+        if (stream->length > 0) {
+            stream->paused = TRUE;
+            g_mutex_unlock(&stream->lock);
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        // A single piece bigger than the buffer, which must be accepted as a whole
+        stream->capacity = size;
+        stream->buffer = g_realloc(stream->buffer, stream->capacity);
+        stream->start = 0;
+    }
+    if (stream->start + stream->length + size > stream->capacity) {
+        memmove(stream->buffer, stream->buffer + stream->start, stream->length);
+        stream->start = 0;
+    }
+    memcpy(stream->buffer + stream->start + stream->length, data, size);
+    stream->length += size;
+    stream->failures = 0;
+    g_cond_broadcast(&stream->cond);
+    g_mutex_unlock(&stream->lock);
+
+    return size;
+}
+
+
+static void gfal2_dropbox_stream_done(DropboxRequest* request, ssize_t result,
+    const GError* error, void* user_data)
+{
+    DropboxStream* stream = (DropboxStream*)user_data;
+
+    g_mutex_lock(&stream->lock);
+    stream->finished = TRUE;
+    if (result < 0) {
+        stream->error = g_error_copy(error);
+    }
+    g_cond_broadcast(&stream->cond);
+    g_mutex_unlock(&stream->lock);
+}
+
+
+// Requests the file from offset up to the end
+static DropboxRequest* gfal2_dropbox_stream_submit(DropboxStream* stream, off_t offset, GError** error)
+{
+    DropboxHandle* dropbox = stream->dropbox;
+
+    DropboxBuffer* arg = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+    DropboxJsonWriter writer;
+    gfal2_dropbox_json_init(&writer, arg, TRUE);
+    gfal2_dropbox_json_begin(&writer, NULL);
+    gfal2_dropbox_json_string(&writer, "path", stream->path);
+    gfal2_dropbox_json_end(&writer);
+
+    char endpoint[GFAL_URL_MAX_LEN];
+    DropboxRequest* request = gfal2_dropbox_request_new(M_POST,
+        gfal2_dropbox_content_url(dropbox, "/2/files/download", endpoint, sizeof(endpoint)));
+    gfal2_dropbox_request_set_range(request, offset, 0);
+    gfal2_dropbox_request_set_payload(request, "text/plain", NULL, 0);
+    gfal2_dropbox_request_add_header(request, "Dropbox-API-Arg", arg->data);
+    gfal2_dropbox_request_set_output(request, stream->error_output);
+    gfal2_dropbox_request_set_sink(request, gfal2_dropbox_stream_sink, stream);
+    gfal2_dropbox_request_set_callback(request, gfal2_dropbox_stream_done, stream);
+    gfal2_dropbox_request_set_low_speed(request, dropbox->low_speed_limit, dropbox->low_speed_time);
+    gfal2_dropbox_request_set_retries(request, stream->restarts);
+    gfal2_dropbox_buffer_release(dropbox->buffers, arg);
+
+    if (gfal2_dropbox_request_submit(dropbox, request, error) < 0) {
+        gfal2_dropbox_request_free(request);
+        return NULL;
+    }
+    return request;
+}
+
+
+DropboxStream* gfal2_dropbox_stream_open(DropboxHandle* dropbox, const char* path,
+    off_t offset, off_t size, size_t buffer_size, GError** error)
+{
+    DropboxStream* stream = g_new0(DropboxStream, 1);
+    g_mutex_init(&stream->lock);
+    g_cond_init(&stream->cond);
+    stream->dropbox = dropbox;
+    stream->path = g_strdup(path);
+    stream->size = size;
+    stream->capacity = MAX(buffer_size, CURL_MAX_WRITE_SIZE);
+    stream->buffer = g_malloc(stream->capacity);
+    stream->offset = offset;
+    stream->error_output = gfal2_dropbox_buffer_acquire(dropbox->buffers);
+
+    stream->request = gfal2_dropbox_stream_submit(stream, offset, error);
+    if (stream->request == NULL) {
+        gfal2_dropbox_stream_close(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+
+// Errors that may go away by asking again
+static gboolean gfal2_dropbox_stream_is_transient(const GError* error)
+{
+    return error->code == EIO || error->code == EBUSY || error->code == ETIMEDOUT;
+}
+
+
+// Once the download failed half way, starts another one from the first byte not received
+// Returns 1 if it was restarted, 0 if it is not worth it, -1 if it could not be restarted
+static int gfal2_dropbox_stream_restart(DropboxStream* stream, const GError* failure, GError** error)
+{
+    g_mutex_lock(&stream->lock);
+    off_t received = stream->offset + stream->length;
+    int failures = stream->failures;
+    g_mutex_unlock(&stream->lock);
+
+    if (!gfal2_dropbox_stream_is_transient(failure) || failures >= stream->dropbox->read_retries)
+        return 0;
+
+    // Everything arrived, only the end of the transfer went wrong
+    if (received >= stream->size)
+        return 1;
+
+    gulong backoff = MIN(100000UL << failures, 5 * G_USEC_PER_SEC);
+    gfal2_log(G_LOG_LEVEL_WARNING, "Download of %s interrupted at %lld (%s), resuming in %lu ms",
+        stream->path, (long long)received, failure->message, backoff / 1000);
+    g_usleep(backoff);
+    gfal2_dropbox_metrics_retry(stream->dropbox->metrics, DROPBOX_RETRY_DOWNLOAD);
+
+    g_mutex_lock(&stream->lock);
+    stream->failures = failures + 1;
+    g_mutex_unlock(&stream->lock);
+    ++stream->restarts;
+
+    DropboxRequest* request = gfal2_dropbox_stream_submit(stream, received, error);
+    if (request == NULL)
+        return -1;
+
+    // The previous request is done, so nothing else refers to it
+    gfal2_dropbox_request_free(stream->request);
+    stream->request = request;
+    return 1;
+}
+
+
+ssize_t gfal2_dropbox_stream_read(DropboxStream* stream, void* buffer, size_t count, GError** error)
+{
+    size_t copied = 0;
+
+    g_mutex_lock(&stream->lock);
+    while (copied < count) {
+        if (stream->length > 0) {
+            size_t n = MIN(count - copied, stream->length);
+            memcpy((char*)buffer + copied, stream->buffer + stream->start, n);
+            copied += n;
+            stream->start += n;
+            stream->length -= n;
+            stream->offset += n;
+            if (stream->length == 0)
+                stream->start = 0;
+        }
+        else if (stream->finished) {
+            if (stream->error == NULL)
+                break;
+
+            // Nothing goes into the buffer on a rejected token, so the stream can just be restarted
+            GError* stream_error = stream->error;
+            stream->error = NULL;
+            stream->finished = FALSE;
+            g_mutex_unlock(&stream->lock);
+
+            GError* tmp_err = NULL;
+            int retry = gfal2_dropbox_request_retry_auth(stream->request, &tmp_err);
+            // Otherwise, carry on from where it stopped
+            if (retry == 0)
+                retry = gfal2_dropbox_stream_restart(stream, stream_error, &tmp_err);
+
+            g_mutex_lock(&stream->lock);
+            if (retry > 0) {
+                g_error_free(stream_error);
+                // Nothing more to wait for
+                if (stream->offset + stream->length >= stream->size)
+                    stream->finished = TRUE;
+                continue;
+            }
+            stream->finished = TRUE;
+            if (tmp_err) {
+                g_error_free(stream_error);
+                stream_error = tmp_err;
+            }
+            stream->error = stream_error;
+            break;
+        }
+        else if (stream->paused) {
+            stream->paused = FALSE;
+            g_mutex_unlock(&stream->lock);
+            gfal2_dropbox_request_resume(stream->request);
+            g_mutex_lock(&stream->lock);
+        }
+        else {
+            g_cond_wait(&stream->cond, &stream->lock);
+        }
+    }
+
+    // Let the transfer go on while the caller deals with this data
+    gboolean resume = stream->paused && stream->length <= stream->capacity / 2;
+    if (resume)
+        stream->paused = FALSE;
+
+    ssize_t ret = copied;
+    if (copied == 0 && stream->error) {
+        g_propagate_error(error, g_error_copy(stream->error));
+        ret = -1;
+    }
+    g_mutex_unlock(&stream->lock);
+
+    if (resume)
+        gfal2_dropbox_request_resume(stream->request);
+    return ret;
+}
+
+
+off_t gfal2_dropbox_stream_offset(DropboxStream* stream)
+{
+    g_mutex_lock(&stream->lock);
+    off_t offset = stream->offset;
+    g_mutex_unlock(&stream->lock);
+    return offset;
+}
+
+
+void gfal2_dropbox_stream_close(DropboxStream* stream)
+{
+    if (stream == NULL)
+        return;
+
+    if (stream->request) {
+        gfal2_dropbox_request_cancel(stream->request);
+        gfal2_dropbox_request_free(stream->request);
+    }
+    g_clear_error(&stream->error);
+    gfal2_dropbox_buffer_release(stream->dropbox->buffers, stream->error_output);
+    g_free(stream->path);
+    g_cond_clear(&stream->cond);
+    g_mutex_clear(&stream->lock);
+    g_free(stream->buffer);
+    g_free(stream);
+}
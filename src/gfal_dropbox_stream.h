@@ -0,0 +1,47 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Download streams
+// A single download request is kept open, and read sequentially from
+
+#pragma once
+#ifndef _GFAL_DROPBOX_STREAM_H
+#define _GFAL_DROPBOX_STREAM_H
+
+#include "gfal_dropbox.h"
+
+#define DROPBOX_DEFAULT_STREAM_BUFFER_SIZE (1024 * 1024)
+
+typedef struct DropboxStream DropboxStream;
+
+// Starts downloading path, of the given size, from offset until the end
+// At most buffer_size bytes are held in memory, the transfer is paused while the buffer is full
+// If the transfer stalls or fails, it is resumed from the first byte not received
+// path should address a revision ("rev:..."), so the data stays consistent across restarts
+DropboxStream* gfal2_dropbox_stream_open(DropboxHandle* dropbox, const char* path,
+    off_t offset, off_t size, size_t buffer_size, GError** error);
+
+// Reads count bytes from the stream, blocking until they are there
+// Returns less than count only at the end of the file, or -1 on error
+ssize_t gfal2_dropbox_stream_read(DropboxStream* stream, void* buffer, size_t count, GError** error);
+
+// Offset of the next byte gfal2_dropbox_stream_read will return
+off_t gfal2_dropbox_stream_offset(DropboxStream* stream);
+
+// Aborts the transfer if still running, and frees the stream
+void gfal2_dropbox_stream_close(DropboxStream* stream);
+
+#endif
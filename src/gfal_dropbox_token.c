@@ -0,0 +1,240 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox.h"
+#include "gfal_dropbox_token.h"
+#include <curl/curl.h>
+#include <json.h>
+#include <string.h>
+
+// After a failed refresh, the next callers get the same error for this many seconds,
+// instead of each trying again
+#define DROPBOX_TOKEN_FAILURE_TTL 5
+
+
+struct DropboxToken {
+    char* access_token;
+    time_t expires_at;
+    gboolean refreshing;
+    // Why the last refresh failed, and when. NULL if it did not
+    GError* last_error;
+    time_t failed_at;
+};
+typedef struct DropboxToken DropboxToken;
+
+
+// Tokens are shared by all the handles of the process
+G_LOCK_DEFINE_STATIC(token_cache);
+static GHashTable* token_cache = NULL;
+static GCond token_refreshed;
+
+
+static void gfal2_dropbox_token_free(gpointer data)
+{
+    DropboxToken* token = (DropboxToken*)data;
+    g_free(token->access_token);
+    if (token->last_error)
+        g_error_free(token->last_error);
+    g_free(token);
+}
+
+
+// Must be called with the lock held
+static DropboxToken* gfal2_dropbox_token_lookup(const DropboxTokenConfig* config)
+{
+    if (token_cache == NULL) {
+        token_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, gfal2_dropbox_token_free);
+        g_cond_init(&token_refreshed);
+    }
+
+    char* key = g_strdup_printf("%s\n%s\n%s", config->token_url, config->app_key, config->refresh_token);
+    DropboxToken* token = g_hash_table_lookup(token_cache, key);
+    if (token == NULL) {
+        token = g_new0(DropboxToken, 1);
+        g_hash_table_insert(token_cache, key, token);
+    }
+    else {
+        g_free(key);
+    }
+    return token;
+}
+
+
+static size_t gfal2_dropbox_token_write(char* data, size_t size, size_t nmemb, void* userdata)
+{
+    g_string_append_len((GString*)userdata, data, size * nmemb);
+    return size * nmemb;
+}
+
+
+// Exchange the refresh token for a new access token
+// Called without the lock held
+static int gfal2_dropbox_token_request(const DropboxTokenConfig* config,
+    char** access_token, time_t* expires_at, GError** error)
+{
+    CURL* curl = curl_easy_init();
+    GString* response = g_string_sized_new(512);
+    json_object* json = NULL;
+    int ret = -1;
+
+    char* refresh_token = curl_easy_escape(curl, config->refresh_token, 0);
+    char* app_key = curl_easy_escape(curl, config->app_key, 0);
+    char* app_secret = curl_easy_escape(curl, config->app_secret, 0);
+    char* body = g_strdup_printf("grant_type=refresh_token&refresh_token=%s&client_id=%s&client_secret=%s",
+        refresh_token, app_key, app_secret);
+    curl_free(refresh_token);
+    curl_free(app_key);
+    curl_free(app_secret);
+
+    char err_buffer[CURL_ERROR_SIZE] = {0};
+    curl_easy_setopt(curl, CURLOPT_URL, config->token_url);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, gfal2_dropbox_token_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, err_buffer);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 60L);
+
+    gfal2_log(G_LOG_LEVEL_INFO, "Refreshing Dropbox access token from %s", config->token_url);
+    time_t requested_at = time(NULL);
+    CURLcode perform_result = curl_easy_perform(curl);
+    if (perform_result != CURLE_OK) {
+        gfal2_set_error(error, dropbox_domain(), EIO, __func__,
+            "Failed to refresh the access token: %s",
+            err_buffer[0] ? err_buffer : curl_easy_strerror(perform_result));
+        goto out;
+    }
+
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    if (status / 100 != 2) {
+        gfal2_set_error(error, dropbox_domain(), (status == 400 || status == 401)?EACCES:EIO, __func__,
+            "Failed to refresh the access token (HTTP %ld): %s", status, response->str);
+        goto out;
+    }
+
+    json = json_tokener_parse(response->str);
+    json_object *token_obj = NULL, *expires_obj = NULL;
+    if (!json_object_object_get_ex(json, "access_token", &token_obj)) {
+        gfal2_set_error(error, dropbox_domain(), EIO, __func__,
+            "The token endpoint did not return an access token");
+        goto out;
+    }
+
+    *access_token = g_strdup(json_object_get_string(token_obj));
+    // Tokens without an expiration are treated as long lived
+    if (json_object_object_get_ex(json, "expires_in", &expires_obj)) {
+        *expires_at = requested_at + json_object_get_int64(expires_obj);
+    }
+    else {
+        *expires_at = G_MAXINT32;
+    }
+    ret = 0;
+
+out:
+    json_object_put(json);
+    g_string_free(response, TRUE);
+    g_free(body);
+    curl_easy_cleanup(curl);
+    return ret;
+}
+
+
+char* gfal2_dropbox_token_get(const DropboxTokenConfig* config, GError** error)
+{
+    g_assert(config != NULL && error != NULL);
+
+    char* result = NULL;
+
+    G_LOCK(token_cache);
+    DropboxToken* token = gfal2_dropbox_token_lookup(config);
+
+    while (result == NULL && *error == NULL) {
+        time_t now = time(NULL);
+        gboolean valid = (token->access_token != NULL && now < token->expires_at);
+        gboolean failed_recently = (token->last_error != NULL && now - token->failed_at < DROPBOX_TOKEN_FAILURE_TTL);
+
+        if (valid && (now < token->expires_at - config->refresh_margin || failed_recently)) {
+            result = g_strdup(token->access_token);
+        }
+        else if (failed_recently && !token->refreshing) {
+            gfal2_propagate_prefixed_error(error, g_error_copy(token->last_error), __func__);
+        }
+        else if (token->refreshing) {
+            // Someone else is refreshing. Do not stall if the current one is still good.
+            if (valid) {
+                result = g_strdup(token->access_token);
+            }
+            else {
+                g_cond_wait(&token_refreshed, &G_LOCK_NAME(token_cache));
+            }
+        }
+        else {
+            token->refreshing = TRUE;
+            G_UNLOCK(token_cache);
+
+            GError* tmp_err = NULL;
+            char* access_token = NULL;
+            time_t expires_at = 0;
+            int ret = gfal2_dropbox_token_request(config, &access_token, &expires_at, &tmp_err);
+
+            G_LOCK(token_cache);
+            token->refreshing = FALSE;
+            if (token->last_error) {
+                g_error_free(token->last_error);
+                token->last_error = NULL;
+            }
+            if (ret < 0) {
+                // Shared with those waiting, and those coming shortly after
+                token->last_error = g_error_copy(tmp_err);
+                token->failed_at = time(NULL);
+            }
+            if (ret == 0) {
+                g_free(token->access_token);
+                token->access_token = access_token;
+                token->expires_at = expires_at;
+                result = g_strdup(access_token);
+            }
+            else if (valid) {
+                // Keep going with the current token, and try again next time
+                gfal2_log(G_LOG_LEVEL_WARNING, "%s", tmp_err->message);
+                g_error_free(tmp_err);
+                result = g_strdup(token->access_token);
+            }
+            else {
+                gfal2_propagate_prefixed_error(error, tmp_err, __func__);
+            }
+            g_cond_broadcast(&token_refreshed);
+        }
+    }
+
+    G_UNLOCK(token_cache);
+    return result;
+}
+
+
+void gfal2_dropbox_token_invalidate(const DropboxTokenConfig* config, const char* access_token)
+{
+    g_assert(config != NULL);
+
+    G_LOCK(token_cache);
+    DropboxToken* token = gfal2_dropbox_token_lookup(config);
+    if (g_strcmp0(token->access_token, access_token) == 0) {
+        token->expires_at = 0;
+    }
+    G_UNLOCK(token_cache);
+}
@@ -0,0 +1,51 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// OAuth2 access token refresh
+
+#pragma once
+#ifndef _GFAL_DROPBOX_TOKEN_H
+#define _GFAL_DROPBOX_TOKEN_H
+
+#include <gfal_api.h>
+
+#define DROPBOX_DEFAULT_TOKEN_URL "https://api.dropboxapi.com/oauth2/token"
+#define DROPBOX_DEFAULT_TOKEN_REFRESH_MARGIN 300
+
+// Identifies a credential set able to mint access tokens
+struct DropboxTokenConfig {
+    const char* token_url;
+    const char* app_key;
+    const char* app_secret;
+    const char* refresh_token;
+    // Seconds before expiration when a new token is requested
+    int refresh_margin;
+};
+typedef struct DropboxTokenConfig DropboxTokenConfig;
+
+// Returns a valid access token for the credential set, refreshing it if needed
+// Tokens are cached process wide, and only one refresh per credential set is in flight
+// at any time. While a token close to its expiration is being refreshed, other
+// callers keep using the current one. If a refresh fails, the callers that need a new
+// token get the same error for a few seconds, rather than trying again one after another.
+// The returned string must be freed with g_free
+char* gfal2_dropbox_token_get(const DropboxTokenConfig* config, GError** error);
+
+// Marks the given access token as rejected, so the next call to gfal2_dropbox_token_get
+// refreshes it. It does nothing if the cached token has been refreshed already.
+void gfal2_dropbox_token_invalidate(const DropboxTokenConfig* config, const char* access_token);
+
+#endif
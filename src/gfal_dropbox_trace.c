@@ -0,0 +1,141 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "gfal_dropbox.h"
+#include "gfal_dropbox_trace.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+
+struct DropboxTrace {
+    int fd;
+};
+
+
+DropboxTrace* gfal2_dropbox_trace_open(const char* path, GError** error)
+{
+    g_assert(path != NULL);
+
+    int fd;
+    if (g_strcmp0(path, "stderr") == 0) {
+        fd = STDERR_FILENO;
+    }
+    else {
+        // Each record goes in a single write, so processes can share the file
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            gfal2_set_error(error, dropbox_domain(), errno, __func__,
+                "Could not open the trace file %s", path);
+            return NULL;
+        }
+    }
+
+    DropboxTrace* trace = g_new0(DropboxTrace, 1);
+    trace->fd = fd;
+    return trace;
+}
+
+
+void gfal2_dropbox_trace_close(DropboxTrace* trace)
+{
+    if (trace == NULL)
+        return;
+    if (trace->fd != STDERR_FILENO)
+        close(trace->fd);
+    g_free(trace);
+}
+
+
+// Copy the url without the query, escaping what would break the JSON string
+static void gfal2_dropbox_trace_endpoint(const char* url, char* output, size_t output_size)
+{
+    size_t i = 0;
+    const char* p;
+    for (p = url; p && *p && *p != '?' && i + 2 < output_size; ++p) {
+        if (*p == '"' || *p == '\\')
+            output[i++] = '\\';
+        if ((unsigned char)*p >= 0x20)
+            output[i++] = *p;
+    }
+    output[i] = '\0';
+}
+
+
+static const char* gfal2_dropbox_trace_http_version(long version)
+{
+    switch (version) {
+        case CURL_HTTP_VERSION_1_0:
+            return "1.0";
+        case CURL_HTTP_VERSION_1_1:
+            return "1.1";
+        case CURL_HTTP_VERSION_2_0:
+            return "2";
+        default:
+            return "";
+    }
+}
+
+
+void gfal2_dropbox_trace_request(DropboxTrace* trace, CURL* easy,
+    const char* method, int retries, int errcode)
+{
+    if (trace == NULL)
+        return;
+
+    char* url = NULL;
+    long status = 0, http_version = 0, connects = 0;
+    curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+    curl_off_t uploaded = 0, downloaded = 0;
+
+    curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url);
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(easy, CURLINFO_HTTP_VERSION, &http_version);
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+    curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+    curl_easy_getinfo(easy, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+    curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(easy, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+    curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+
+    char endpoint[GFAL_URL_MAX_LEN];
+    gfal2_dropbox_trace_endpoint(url, endpoint, sizeof(endpoint));
+
+    // Times are in microseconds, and cumulative since the start of the request
+    char record[GFAL_URL_MAX_LEN + 512];
+    int len = snprintf(record, sizeof(record),
+        "{\"time\": %" G_GINT64_FORMAT ", \"method\": \"%s\", \"endpoint\": \"%s\", "
+        "\"status\": %ld, \"errno\": %d, \"retries\": %d, \"http_version\": \"%s\", \"new_connections\": %ld, "
+        "\"bytes_up\": %" CURL_FORMAT_CURL_OFF_T ", \"bytes_down\": %" CURL_FORMAT_CURL_OFF_T ", "
+        "\"namelookup\": %" CURL_FORMAT_CURL_OFF_T ", \"connect\": %" CURL_FORMAT_CURL_OFF_T ", "
+        "\"appconnect\": %" CURL_FORMAT_CURL_OFF_T ", \"pretransfer\": %" CURL_FORMAT_CURL_OFF_T ", "
+        "\"starttransfer\": %" CURL_FORMAT_CURL_OFF_T ", \"total\": %" CURL_FORMAT_CURL_OFF_T "}\n",
+        g_get_real_time(), method, endpoint,
+        status, errcode, retries, gfal2_dropbox_trace_http_version(http_version), connects,
+        uploaded, downloaded,
+        namelookup, connect, appconnect, pretransfer, starttransfer, total);
+    if (len >= (int)sizeof(record)) {
+        len = sizeof(record) - 1;
+        record[len - 1] = '\n';
+    }
+
+    if (write(trace->fd, record, len) < 0) {
+        gfal2_log(G_LOG_LEVEL_DEBUG, "Failed to write the trace record: %s", strerror(errno));
+    }
+}
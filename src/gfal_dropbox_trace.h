@@ -0,0 +1,41 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Request tracing
+// Each request is written as a single JSON line with its timing breakdown
+
+#pragma once
+#ifndef _GFAL_DROPBOX_TRACE_H
+#define _GFAL_DROPBOX_TRACE_H
+
+#include <curl/curl.h>
+#include <gfal_api.h>
+
+typedef struct DropboxTrace DropboxTrace;
+
+// Opens the trace sink
+// path can be a file, which is appended to, or "stderr"
+DropboxTrace* gfal2_dropbox_trace_open(const char* path, GError** error);
+
+// Closes the trace sink
+void gfal2_dropbox_trace_close(DropboxTrace* trace);
+
+// Writes a record for the transfer done by easy
+// errcode is the errno the request resolved to, 0 on success
+void gfal2_dropbox_trace_request(DropboxTrace* trace, CURL* easy,
+    const char* method, int retries, int errcode);
+
+#endif
@@ -0,0 +1,390 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Micro benchmark of the CPU work done for every request, without any network
+// Reports ns/op and allocations per op for signing, url handling, building
+// the JSON arguments and parsing listing pages
+
+#include <glib.h>
+#include <json.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "../gfal_dropbox.h"
+#include "../gfal_dropbox_buffer.h"
+#include "../gfal_dropbox_entries.h"
+#include "../gfal_dropbox_json.h"
+#include "../gfal_dropbox_oauth.h"
+#include "../gfal_dropbox_url.h"
+
+
+static gdouble duration = 1;
+static gint list_entries = 2000;
+static gchar* only = NULL;
+static gboolean quick = FALSE;
+
+static GOptionEntry bench_options[] = {
+    {"duration", 0, 0, G_OPTION_ARG_DOUBLE, &duration, "Seconds per measurement", "S"},
+    {"entries", 0, 0, G_OPTION_ARG_INT, &list_entries, "Entries per listing page", "N"},
+    {"only", 0, 0, G_OPTION_ARG_STRING, &only, "Only run the benchmarks whose name contains this", "NAME"},
+    {"quick", 0, 0, G_OPTION_ARG_NONE, &quick, "Short run, to check everything works", NULL},
+    {NULL}
+};
+
+
+// Allocations are counted by wrapping the glibc allocator
+// Sanitizers bring their own, so nothing is counted then
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define BENCH_COUNT_ALLOCATIONS 1
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static guint64 allocations = 0;
+
+void* malloc(size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+static guint64 bench_allocations(void)
+{
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+#else
+#define BENCH_COUNT_ALLOCATIONS 0
+
+static guint64 bench_allocations(void)
+{
+    return 0;
+}
+#endif
+
+
+static gint64 bench_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (gint64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+// Inputs, built once
+static char long_path[512];
+static char long_url[1024];
+static char api_url[2048];
+static OAuth oauth;
+static char norm_params[4096];
+static DropboxBufferPool* buffers;
+static DropboxBuffer* list_page;
+static DropboxEntries* list_entries_store;
+
+// Results go here, so the work is not optimized away
+static volatile size_t sink;
+
+
+// A deep path with multi-byte characters, spaces and reserved characters, as users name them
+static void bench_setup_path(void)
+{
+    static const char* segments[] = {
+        "Données expérimentales", "実験データ", "2014 run #3", "Ünïcödé & friends",
+        "raw (copy)", "Ελληνικά", "detector=ATLAS", "calibration+100%"
+    };
+    char* p = long_path;
+    char* end = long_path + sizeof(long_path);
+    size_t i = 0;
+    while (p - long_path < 200) {
+        p += snprintf(p, end - p, "/%s", segments[i++ % G_N_ELEMENTS(segments)]);
+    }
+    snprintf(p, end - p, "/file-0001.root");
+    snprintf(long_url, sizeof(long_url), "dropbox://dropbox.com%s", long_path);
+
+    // An API url as normalized for the signature, with doubled slashes and lowercase escapes
+    p = api_url + snprintf(api_url, sizeof(api_url), "HTTPS://Content.DropboxAPI.com//2/files/download?arg=");
+    const unsigned char* c;
+    for (c = (const unsigned char*)long_path; *c && p < api_url + sizeof(api_url) - 4; ++c) {
+        if (g_ascii_isalnum(*c))
+            *p++ = *c;
+        else if (*c == '/')
+            p += sprintf(p, "%s", c == (const unsigned char*)long_path ? "//" : "/");
+        else
+            p += sprintf(p, "%%%02x", *c);
+    }
+    *p = '\0';
+}
+
+
+static void bench_setup_oauth(void)
+{
+    oauth.version = 1;
+    oauth.app_key = "xvz1evFS4wEEPTGEFPHBog";
+    oauth.app_secret = "kAcSOqF21Fu85e7zjz7ZN2U4ZRhfV3WpwPAoE3Z7kBw";
+    oauth.access_token = "370773112-GmHxMAgYyLbNEtIKZeRNFsMKPR9EyMZeS9weJAEb";
+    oauth.access_token_secret = "LswwdoUaIvS8ltyTt5jkRh4J50vUPVVHtR2YPi5kE";
+    oauth.timestamp = "1318622958";
+    oauth.nonce = "1318622958*1804289383";
+    oauth_normalized_parameters(norm_params, sizeof(norm_params), &oauth, 2,
+        "path", long_path, "include_media_info", "false");
+}
+
+
+// A list_folder page as Dropbox sends it
+static void bench_setup_list_page(void)
+{
+    list_page = gfal2_dropbox_buffer_acquire(buffers);
+    DropboxJsonWriter writer;
+    gfal2_dropbox_json_init(&writer, list_page, FALSE);
+    gfal2_dropbox_json_begin(&writer, NULL);
+    gfal2_dropbox_json_begin_array(&writer, "entries");
+    int i;
+    for (i = 0; i < list_entries; ++i) {
+        char name[64], path[640], id[40], rev[32], hash[65];
+        gboolean folder = (i % 10 == 0);
+        snprintf(name, sizeof(name), "%s %05d%s", folder ? "Répertoire" : "fichier_données", i, folder ? "" : ".root");
+        snprintf(path, sizeof(path), "%s/%s", long_path, name);
+        snprintf(id, sizeof(id), "id:a4ayc_80_OEAAAAAAAA%05d", i);
+        snprintf(rev, sizeof(rev), "a1c10ce0dd78%08x", i);
+        snprintf(hash, sizeof(hash), "%064x", i);
+
+        gfal2_dropbox_json_begin(&writer, NULL);
+        gfal2_dropbox_json_string(&writer, ".tag", folder ? "folder" : "file");
+        gfal2_dropbox_json_string(&writer, "name", name);
+        gfal2_dropbox_json_string(&writer, "path_lower", path);
+        gfal2_dropbox_json_string(&writer, "path_display", path);
+        gfal2_dropbox_json_string(&writer, "id", id);
+        if (!folder) {
+            gfal2_dropbox_json_string(&writer, "client_modified", "2015-05-12T15:50:38Z");
+            gfal2_dropbox_json_string(&writer, "server_modified", "2015-05-12T15:50:38Z");
+            gfal2_dropbox_json_string(&writer, "rev", rev);
+            gfal2_dropbox_json_int64(&writer, "size", 7212 + (gint64)i * 4096);
+            gfal2_dropbox_json_boolean(&writer, "is_downloadable", TRUE);
+            gfal2_dropbox_json_string(&writer, "content_hash", hash);
+        }
+        gfal2_dropbox_json_end(&writer);
+    }
+    gfal2_dropbox_json_end_array(&writer);
+    gfal2_dropbox_json_string(&writer, "cursor", "ZtkX9_EHj3x7PMkVuFIhwKYXEpwpLwyxp9vMKomUhllil9q7eWiAu");
+    gfal2_dropbox_json_boolean(&writer, "has_more", TRUE);
+    gfal2_dropbox_json_end(&writer);
+}
+
+
+static void bench_oauth_params(void)
+{
+    char output[4096];
+    oauth_normalized_parameters(output, sizeof(output), &oauth, 2,
+        "path", long_path, "include_media_info", "false");
+    sink += output[0];
+}
+
+
+static void bench_oauth_signature(void)
+{
+    char output[128];
+    oauth_get_signature("POST", "https://api.dropboxapi.com/2/files/get_metadata", norm_params,
+        &oauth, output, sizeof(output));
+    sink += output[0];
+}
+
+
+// The whole OAuth1 Authorization header of a content request
+static void bench_oauth_header(void)
+{
+    char output[1024];
+    oauth_get_header(output, sizeof(output), &oauth, "POST", api_url);
+    sink += output[0];
+}
+
+
+static void bench_normalize_url(void)
+{
+    char output[4096];
+    gfal2_dropbox_normalize_url(api_url, output, sizeof(output));
+    sink += output[0];
+}
+
+
+static void bench_extract_path(void)
+{
+    char output[GFAL_URL_MAX_LEN];
+    sink += (size_t)gfal2_dropbox_extract_path(long_url, output, sizeof(output));
+}
+
+
+// What gfal2_dropbox_post_json builds for each request
+static void bench_json_args(void)
+{
+    DropboxBuffer* payload = gfal2_dropbox_buffer_acquire(buffers);
+    DropboxJsonWriter writer;
+    gfal2_dropbox_json_init(&writer, payload, FALSE);
+    gfal2_dropbox_json_begin(&writer, NULL);
+    gfal2_dropbox_json_string(&writer, "path", long_path);
+    gfal2_dropbox_json_string(&writer, "to_path", long_path);
+    gfal2_dropbox_json_end(&writer);
+    sink += payload->length;
+    gfal2_dropbox_buffer_release(buffers, payload);
+}
+
+
+// The Dropbox-API-Arg header of the content requests, escaped to ASCII
+static void bench_json_header(void)
+{
+    DropboxBuffer* payload = gfal2_dropbox_buffer_acquire(buffers);
+    DropboxJsonWriter writer;
+    gfal2_dropbox_json_init(&writer, payload, TRUE);
+    gfal2_dropbox_json_begin(&writer, NULL);
+    gfal2_dropbox_json_begin(&writer, "commit");
+    gfal2_dropbox_json_string(&writer, "path", long_path);
+    gfal2_dropbox_json_string(&writer, "mode", "overwrite");
+    gfal2_dropbox_json_end(&writer);
+    gfal2_dropbox_json_end(&writer);
+    sink += payload->length;
+    gfal2_dropbox_buffer_release(buffers, payload);
+}
+
+
+// Parses a page into the entries of a listing, and goes through them
+static void bench_list_parse(void)
+{
+    json_object* root = gfal2_dropbox_buffer_json(list_page);
+    json_object* list = NULL;
+    g_assert(json_object_object_get_ex(root, "entries", &list));
+    gfal2_dropbox_entries_clear(list_entries_store);
+    gfal2_dropbox_entries_add_json(list_entries_store, list);
+    json_object_put(root);
+
+    guint i;
+    for (i = 0; i < list_entries_store->length; ++i) {
+        struct stat st;
+        const char* name = gfal2_dropbox_entries_get(list_entries_store, i, &st);
+        sink += name[0] + st.st_size;
+    }
+}
+
+
+// Only going through the entries of a page already parsed, as readdirpp does
+static void bench_list_read(void)
+{
+    guint i;
+    char d_name[256];
+    for (i = 0; i < list_entries_store->length; ++i) {
+        struct stat st;
+        g_strlcpy(d_name, gfal2_dropbox_entries_get(list_entries_store, i, &st), sizeof(d_name));
+        sink += d_name[0] + st.st_size;
+    }
+}
+
+
+typedef struct {
+    const char* name;
+    void (*run)(void);
+} CpuBenchmark;
+
+static const CpuBenchmark benchmarks[] = {
+    {"oauth_params", bench_oauth_params},
+    {"oauth_signature", bench_oauth_signature},
+    {"oauth_header", bench_oauth_header},
+    {"normalize_url", bench_normalize_url},
+    {"extract_path", bench_extract_path},
+    {"json_args", bench_json_args},
+    {"json_header", bench_json_header},
+    {"list_parse", bench_list_parse},
+    {"list_read", bench_list_read},
+};
+
+
+static void bench_run(const CpuBenchmark* benchmark)
+{
+    // Once first, so lazy initializations are not counted
+    benchmark->run();
+
+    gint64 budget = (gint64)(duration * 1e9);
+    guint64 ops = 0;
+    guint64 allocs_start = bench_allocations();
+    gint64 start = bench_now_ns(), elapsed = 0;
+    do {
+        int i;
+        for (i = 0; i < 16; ++i)
+            benchmark->run();
+        ops += 16;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < budget);
+    guint64 allocs = bench_allocations() - allocs_start;
+
+    if (BENCH_COUNT_ALLOCATIONS)
+        printf("%-16s ops=%-10" G_GUINT64_FORMAT " ns/op=%-12.1f allocs/op=%.1f\n",
+            benchmark->name, ops, (double)elapsed / ops, (double)allocs / ops);
+    else
+        printf("%-16s ops=%-10" G_GUINT64_FORMAT " ns/op=%-12.1f allocs/op=n/a\n",
+            benchmark->name, ops, (double)elapsed / ops);
+}
+
+
+int main(int argc, char** argv)
+{
+    GError* error = NULL;
+    GOptionContext* options = g_option_context_new("- CPU cost of the per request work");
+    g_option_context_add_main_entries(options, bench_options, NULL);
+    if (!g_option_context_parse(options, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(options);
+    if (quick) {
+        duration = 0.01;
+    }
+
+    buffers = gfal2_dropbox_buffer_pool_new();
+    bench_setup_path();
+    bench_setup_oauth();
+    bench_setup_list_page();
+
+    // What a listing keeps per entry, once the page is parsed
+    list_entries_store = gfal2_dropbox_entries_new();
+    bench_list_parse();
+    size_t per_entry = sizeof(guint32) + 2 * sizeof(gint64) + sizeof(guint8);
+    printf("# path=%zu bytes, url=%zu bytes, page=%d entries (%zu bytes), kept %.1f bytes/entry\n",
+        strlen(long_path), strlen(api_url), list_entries, list_page->length,
+        per_entry + (double)list_entries_store->names_length / MAX(list_entries_store->length, 1));
+
+    size_t i;
+    for (i = 0; i < G_N_ELEMENTS(benchmarks); ++i) {
+        if (only == NULL || strstr(benchmarks[i].name, only) != NULL)
+            bench_run(&benchmarks[i]);
+    }
+
+    gfal2_dropbox_entries_free(list_entries_store);
+    gfal2_dropbox_buffer_release(buffers, list_page);
+    gfal2_dropbox_buffer_pool_free(buffers);
+    g_free(only);
+    return 0;
+}
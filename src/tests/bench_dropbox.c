@@ -0,0 +1,361 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// End to end benchmark of the plugin against the in-process mock server
+// Reports ops/s and MB/s for stat, list, read and write at different thread counts
+
+#include <fcntl.h>
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock_dropbox.h"
+
+
+static gint rtt_ms = 0;
+static gint bandwidth_kb = 0;
+static gdouble rate_limit_ratio = 0;
+static gdouble error_ratio = 0;
+static gint fixed_threads = 0;
+static gdouble duration = 2;
+static gint file_size_kb = 1024;
+static gint block_size_kb = 256;
+static gint list_entries = 200;
+static gint n_files = 32;
+static gchar* operations = NULL;
+static gboolean quick = FALSE;
+
+static GOptionEntry bench_options[] = {
+    {"rtt", 0, 0, G_OPTION_ARG_INT, &rtt_ms, "Delay added by the server to each request, in ms", "MS"},
+    {"bandwidth", 0, 0, G_OPTION_ARG_INT, &bandwidth_kb, "Per response bandwidth limit, in KiB/s", "KIB"},
+    {"429", 0, 0, G_OPTION_ARG_DOUBLE, &rate_limit_ratio, "Fraction of requests answered with 429", "RATIO"},
+    {"errors", 0, 0, G_OPTION_ARG_DOUBLE, &error_ratio, "Fraction of requests answered with 500", "RATIO"},
+    {"threads", 0, 0, G_OPTION_ARG_INT, &fixed_threads, "Only run with this many threads", "N"},
+    {"duration", 0, 0, G_OPTION_ARG_DOUBLE, &duration, "Seconds per measurement", "S"},
+    {"file-size", 0, 0, G_OPTION_ARG_INT, &file_size_kb, "Size of the files read and written, in KiB", "KIB"},
+    {"block-size", 0, 0, G_OPTION_ARG_INT, &block_size_kb, "Size of each read and write call, in KiB", "KIB"},
+    {"entries", 0, 0, G_OPTION_ARG_INT, &list_entries, "Entries in the listed directory", "N"},
+    {"ops", 0, 0, G_OPTION_ARG_STRING, &operations, "Comma separated operations to run (stat,list,read,write)", "OPS"},
+    {"quick", 0, 0, G_OPTION_ARG_NONE, &quick, "Short run, to check everything works", NULL},
+    {NULL}
+};
+
+
+typedef struct {
+    const char* name;
+    // Runs one operation, returning the bytes transferred, or -1 on error
+    gssize (*run)(int thread_id, int iteration, GError** error);
+} BenchOperation;
+
+
+typedef struct {
+    const BenchOperation* operation;
+    int thread_id;
+    gint64 deadline;
+    guint64 ops;
+    guint64 bytes;
+    guint64 errors;
+} BenchWorker;
+
+
+static MockDropbox* mock = NULL;
+static gfal2_context_t context = NULL;
+static gfal_plugin_interface plugin;
+
+
+// Content is a function of the position, so reads can be validated
+static guint8 bench_pattern(size_t offset)
+{
+    return (guint8)((offset * 31) ^ (offset >> 12));
+}
+
+
+static void bench_fill(guint8* buffer, size_t offset, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; ++i) {
+        buffer[i] = bench_pattern(offset + i);
+    }
+}
+
+
+static gssize bench_stat(int thread_id, int iteration, GError** error)
+{
+    char url[256];
+    struct stat st;
+    snprintf(url, sizeof(url), "dropbox://dropbox.com/bench/files/file-%d", (thread_id + iteration) % n_files);
+    if (plugin.statG(plugin.plugin_data, url, &st, error) < 0)
+        return -1;
+    g_assert(st.st_size == (off_t)file_size_kb * 1024);
+    return 0;
+}
+
+
+static gssize bench_list(int thread_id, int iteration, GError** error)
+{
+    struct stat st;
+    gfal_file_handle dir = plugin.opendirG(plugin.plugin_data, "dropbox://dropbox.com/bench/list", error);
+    if (dir == NULL)
+        return -1;
+    int count = 0;
+    while (plugin.readdirppG(plugin.plugin_data, dir, &st, error) != NULL) {
+        ++count;
+    }
+    plugin.closedirG(plugin.plugin_data, dir, NULL);
+    if (*error)
+        return -1;
+    g_assert(count == list_entries);
+    return 0;
+}
+
+
+static gssize bench_read(int thread_id, int iteration, GError** error)
+{
+    char url[256];
+    snprintf(url, sizeof(url), "dropbox://dropbox.com/bench/files/file-%d", (thread_id + iteration) % n_files);
+
+    gfal_file_handle fd = plugin.openG(plugin.plugin_data, url, O_RDONLY, 0, error);
+    if (fd == NULL)
+        return -1;
+
+    size_t block_size = (size_t)block_size_kb * 1024;
+    guint8* buffer = g_malloc(block_size);
+    size_t total = 0;
+    ssize_t ret;
+    while ((ret = plugin.readG(plugin.plugin_data, fd, buffer, block_size, error)) > 0) {
+        size_t i;
+        for (i = 0; i < (size_t)ret; ++i) {
+            if (buffer[i] != bench_pattern(total + i)) {
+                fprintf(stderr, "Content mismatch at offset %zu of %s\n", total + i, url);
+                abort();
+            }
+        }
+        total += ret;
+    }
+    g_free(buffer);
+
+    GError* close_error = NULL;
+    plugin.closeG(plugin.plugin_data, fd, &close_error);
+    g_clear_error(&close_error);
+    if (ret < 0)
+        return -1;
+
+    g_assert(total == (size_t)file_size_kb * 1024);
+    return total;
+}
+
+
+static gssize bench_write(int thread_id, int iteration, GError** error)
+{
+    char url[256];
+    snprintf(url, sizeof(url), "dropbox://dropbox.com/bench/upload/file-%d", thread_id);
+
+    gfal_file_handle fd = plugin.openG(plugin.plugin_data, url, O_WRONLY | O_CREAT, 0644, error);
+    if (fd == NULL)
+        return -1;
+
+    size_t block_size = (size_t)block_size_kb * 1024;
+    size_t file_size = (size_t)file_size_kb * 1024;
+    guint8* buffer = g_malloc(block_size);
+    size_t total = 0;
+    while (total < file_size) {
+        size_t count = MIN(block_size, file_size - total);
+        bench_fill(buffer, total, count);
+        if (plugin.writeG(plugin.plugin_data, fd, buffer, count, error) < 0)
+            break;
+        total += count;
+    }
+    g_free(buffer);
+
+    if (*error) {
+        plugin.closeG(plugin.plugin_data, fd, NULL);
+        return -1;
+    }
+    if (plugin.closeG(plugin.plugin_data, fd, error) < 0)
+        return -1;
+    return total;
+}
+
+
+static const BenchOperation bench_operations[] = {
+    {"stat", bench_stat},
+    {"list", bench_list},
+    {"read", bench_read},
+    {"write", bench_write},
+    {NULL, NULL}
+};
+
+
+static gpointer bench_worker(gpointer data)
+{
+    BenchWorker* worker = (BenchWorker*)data;
+    int iteration = 0;
+    while (g_get_monotonic_time() < worker->deadline) {
+        GError* error = NULL;
+        gssize ret = worker->operation->run(worker->thread_id, iteration++, &error);
+        if (ret < 0) {
+            if (worker->errors == 0 && error)
+                fprintf(stderr, "%s: %s\n", worker->operation->name, error->message);
+            ++worker->errors;
+            g_clear_error(&error);
+        }
+        else {
+            ++worker->ops;
+            worker->bytes += ret;
+        }
+    }
+    return NULL;
+}
+
+
+// Runs the operation with n_threads for the configured duration, and prints the results
+// Returns the number of errors
+static guint64 bench_run(const BenchOperation* operation, int n_threads)
+{
+    BenchWorker* workers = g_new0(BenchWorker, n_threads);
+    GThread** threads = g_new0(GThread*, n_threads);
+
+    unsigned requests_before = mock_dropbox_request_count(mock);
+    gint64 start = g_get_monotonic_time();
+    int i;
+    for (i = 0; i < n_threads; ++i) {
+        workers[i].operation = operation;
+        workers[i].thread_id = i;
+        workers[i].deadline = start + (gint64)(duration * G_USEC_PER_SEC);
+        threads[i] = g_thread_new("bench", bench_worker, &workers[i]);
+    }
+
+    guint64 ops = 0, bytes = 0, errors = 0;
+    for (i = 0; i < n_threads; ++i) {
+        g_thread_join(threads[i]);
+        ops += workers[i].ops;
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+    }
+    double elapsed = (double)(g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+    unsigned requests = mock_dropbox_request_count(mock) - requests_before;
+
+    printf("%-6s threads=%-3d ops=%-7" G_GUINT64_FORMAT " ops/s=%-10.1f MB/s=%-9.2f requests=%-7u errors=%" G_GUINT64_FORMAT "\n",
+        operation->name, n_threads, ops, ops / elapsed, bytes / elapsed / (1024 * 1024), requests, errors);
+    fflush(stdout);
+
+    g_free(threads);
+    g_free(workers);
+    return errors;
+}
+
+
+static void bench_populate(int max_threads)
+{
+    size_t file_size = (size_t)file_size_kb * 1024;
+    guint8* content = g_malloc(file_size);
+    bench_fill(content, 0, file_size);
+
+    char path[256];
+    int i;
+    for (i = 0; i < n_files; ++i) {
+        snprintf(path, sizeof(path), "/bench/files/file-%d", i);
+        mock_dropbox_put_file(mock, path, content, file_size);
+    }
+    // Written files already exist with the same content, so committing them is not a conflict
+    for (i = 0; i < max_threads; ++i) {
+        snprintf(path, sizeof(path), "/bench/upload/file-%d", i);
+        mock_dropbox_put_file(mock, path, content, file_size);
+    }
+    for (i = 0; i < list_entries; ++i) {
+        snprintf(path, sizeof(path), "/bench/list/entry-%05d", i);
+        mock_dropbox_put_file(mock, path, content, i % 2 ? 0 : 1);
+    }
+    g_free(content);
+}
+
+
+static void bench_setup_plugin()
+{
+    GError* error = NULL;
+    context = gfal2_context_new(&error);
+    g_assert(context != NULL);
+
+    plugin = mock_dropbox_plugin_new(mock, context);
+}
+
+
+int main(int argc, char** argv)
+{
+    GError* error = NULL;
+    GOptionContext* option_context = g_option_context_new("- Dropbox plugin benchmark");
+    g_option_context_add_main_entries(option_context, bench_options, NULL);
+    if (!g_option_context_parse(option_context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(option_context);
+
+    int thread_counts[] = {1, 2, 4, 8, 16};
+    int n_thread_counts = G_N_ELEMENTS(thread_counts);
+    if (quick) {
+        duration = 0.2;
+        file_size_kb = MIN(file_size_kb, 256);
+        block_size_kb = MIN(block_size_kb, 64);
+        n_thread_counts = 3;
+    }
+    if (fixed_threads > 0) {
+        thread_counts[0] = fixed_threads;
+        n_thread_counts = 1;
+    }
+    int max_threads = 0, i;
+    for (i = 0; i < n_thread_counts; ++i) {
+        max_threads = MAX(max_threads, thread_counts[i]);
+    }
+
+    MockDropboxConfig config = {0};
+    config.rtt_ms = rtt_ms;
+    config.bandwidth = (size_t)bandwidth_kb * 1024;
+    config.rate_limit_ratio = rate_limit_ratio;
+    config.error_ratio = error_ratio;
+    mock = mock_dropbox_start(&config);
+
+    bench_populate(max_threads);
+    bench_setup_plugin();
+
+    printf("# rtt=%dms bandwidth=%dKiB/s 429=%.3f errors=%.3f file=%dKiB block=%dKiB entries=%d\n",
+        rtt_ms, bandwidth_kb, rate_limit_ratio, error_ratio, file_size_kb, block_size_kb, list_entries);
+
+    guint64 errors = 0;
+    const BenchOperation* operation;
+    for (operation = bench_operations; operation->name != NULL; ++operation) {
+        if (operations && !strstr(operations, operation->name))
+            continue;
+        for (i = 0; i < n_thread_counts; ++i) {
+            errors += bench_run(operation, thread_counts[i]);
+        }
+    }
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    mock_dropbox_stop(mock);
+    g_free(operations);
+
+    // Without injected failures, any error is a bug
+    if (errors > 0 && rate_limit_ratio == 0 && error_ratio == 0) {
+        fprintf(stderr, "%" G_GUINT64_FORMAT " unexpected errors\n", errors);
+        return 1;
+    }
+    return 0;
+}
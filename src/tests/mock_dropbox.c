@@ -0,0 +1,1463 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+#include "mock_dropbox.h"
+#include <gfal_plugins_api.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <json.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+gfal_plugin_interface gfal_plugin_init(gfal2_context_t handle, GError** err);
+
+#define MOCK_DEFAULT_PAGE_SIZE 500
+#define MOCK_HASH_BLOCK_SIZE (4 * 1024 * 1024)
+#define MOCK_MAX_HEADER_SIZE 16384
+
+
+typedef struct {
+    char* path;
+    gboolean folder;
+    GByteArray* data;
+    guint64 rev;
+    guint64 id;
+    char content_hash[65];
+} MockEntry;
+
+
+struct MockDropbox {
+    MockDropboxConfig config;
+    int fd;
+    char url[64];
+    GThread* acceptor;
+
+    // Protects the namespace, the upload sessions and the batch jobs
+    GMutex lock;
+    // Lower case path => MockEntry
+    GHashTable* entries;
+    // Session id => GByteArray
+    GHashTable* sessions;
+    // Job id => MockJob
+    GHashTable* jobs;
+    guint64 next_job;
+    guint64 next_rev;
+    guint64 next_id;
+    // Paths changed, in order, so a finished listing can be continued with what changed since
+    GPtrArray* changes;
+    // Endpoint => MockFault
+    GHashTable* faults;
+
+    // Open connections, so they can be shut down on stop
+    GMutex conn_lock;
+    GCond conn_cond;
+    GHashTable* connections;
+
+    gint requests;
+    gint stopping;
+};
+
+
+typedef struct {
+    int status;
+    int count;
+    // If set, the response is cut after this many bytes of body, and the connection
+    // is left silent for stall_ms before being closed
+    gboolean cut;
+    size_t cut_after;
+    int stall_ms;
+    // If set, the response is only sent after this many milliseconds
+    int delay_ms;
+} MockFault;
+
+
+// A create_folder_batch done in the background
+// It is reported in progress on the first checks, and complete after
+typedef struct {
+    json_object* result;
+    int checks;
+} MockJob;
+
+
+static void mock_job_free(MockJob* job)
+{
+    json_object_put(job->result);
+    g_free(job);
+}
+
+
+typedef struct {
+    MockDropbox* mock;
+    int fd;
+    GByteArray* in;
+} MockConnection;
+
+
+typedef struct {
+    char method[16];
+    char target[1024];
+    char* api_arg;
+    char* range;
+    gboolean keep_alive;
+    gboolean expect_continue;
+    GByteArray* body;
+} MockRequest;
+
+
+typedef struct {
+    int status;
+    const char* content_type;
+    GString* headers;
+    GByteArray* body;
+} MockResponse;
+
+
+/*
+ * Namespace
+ */
+
+static char* mock_key(const char* path)
+{
+    char* key = g_utf8_strdown(path, -1);
+    size_t len = strlen(key);
+    while (len > 0 && key[len - 1] == '/') {
+        key[--len] = '\0';
+    }
+    return key;
+}
+
+
+static char* mock_parent_key(const char* key)
+{
+    const char* slash = strrchr(key, '/');
+    if (slash == NULL)
+        return g_strdup("");
+    return g_strndup(key, slash - key);
+}
+
+
+static void mock_entry_free(gpointer data)
+{
+    MockEntry* entry = (MockEntry*)data;
+    g_free(entry->path);
+    if (entry->data)
+        g_byte_array_unref(entry->data);
+    g_free(entry);
+}
+
+
+// SHA256 of the concatenation of the SHA256 of each 4 MiB block
+static void mock_content_hash(const guint8* data, size_t size, char* output)
+{
+    GChecksum* overall = g_checksum_new(G_CHECKSUM_SHA256);
+    size_t offset = 0;
+    while (offset < size) {
+        size_t block = MIN(size - offset, MOCK_HASH_BLOCK_SIZE);
+        guint8 digest[32];
+        gsize digest_len = sizeof(digest);
+        GChecksum* block_hash = g_checksum_new(G_CHECKSUM_SHA256);
+        g_checksum_update(block_hash, data + offset, block);
+        g_checksum_get_digest(block_hash, digest, &digest_len);
+        g_checksum_free(block_hash);
+        g_checksum_update(overall, digest, digest_len);
+        offset += block;
+    }
+    g_strlcpy(output, g_checksum_get_string(overall), 65);
+    g_checksum_free(overall);
+}
+
+
+// Must be called with the lock held
+static MockEntry* mock_lookup(MockDropbox* mock, const char* path)
+{
+    if (path == NULL)
+        return NULL;
+
+    if (g_str_has_prefix(path, "rev:") || g_str_has_prefix(path, "id:")) {
+        gboolean by_rev = (path[0] == 'r');
+        guint64 value = g_ascii_strtoull(strchr(path, ':') + 1, NULL, by_rev ? 16 : 10);
+        GHashTableIter iter;
+        gpointer key, data;
+        g_hash_table_iter_init(&iter, mock->entries);
+        while (g_hash_table_iter_next(&iter, &key, &data)) {
+            MockEntry* entry = (MockEntry*)data;
+            if ((by_rev && !entry->folder && entry->rev == value) || (!by_rev && entry->id == value))
+                return entry;
+        }
+        return NULL;
+    }
+
+    char* key = mock_key(path);
+    MockEntry* entry = g_hash_table_lookup(mock->entries, key);
+    g_free(key);
+    return entry;
+}
+
+
+// Must be called with the lock held, before the entry at path goes away
+static void mock_changed(MockDropbox* mock, const char* path)
+{
+    g_ptr_array_add(mock->changes, g_strdup(path));
+}
+
+
+// Must be called with the lock held
+static MockEntry* mock_insert(MockDropbox* mock, const char* path, gboolean folder)
+{
+    char* key = mock_key(path);
+
+    // Make sure the parents are there
+    char* parent = mock_parent_key(key);
+    if (parent[0] != '\0' && g_hash_table_lookup(mock->entries, parent) == NULL) {
+        char* parent_path = g_strndup(path, strlen(parent));
+        mock_insert(mock, parent_path, TRUE);
+        g_free(parent_path);
+    }
+    g_free(parent);
+
+    MockEntry* entry = g_new0(MockEntry, 1);
+    entry->path = g_strndup(path, strlen(key));
+    entry->folder = folder;
+    entry->id = ++mock->next_id;
+    if (!folder) {
+        entry->data = g_byte_array_new();
+        entry->rev = ++mock->next_rev;
+        mock_content_hash(NULL, 0, entry->content_hash);
+    }
+    g_hash_table_replace(mock->entries, key, entry);
+    mock_changed(mock, entry->path);
+    return entry;
+}
+
+
+// Must be called with the lock held
+static void mock_set_content(MockDropbox* mock, MockEntry* entry, GByteArray* data)
+{
+    g_byte_array_unref(entry->data);
+    entry->data = g_byte_array_ref(data);
+    entry->rev = ++mock->next_rev;
+    mock_content_hash(data->data, data->len, entry->content_hash);
+    mock_changed(mock, entry->path);
+}
+
+
+static gint mock_compare_entries(gconstpointer a, gconstpointer b)
+{
+    return g_ascii_strcasecmp(((const MockEntry*)a)->path, ((const MockEntry*)b)->path);
+}
+
+
+// Must be called with the lock held
+// Returns the entries under key (excluded), sorted by path, so parents go before their children
+static GList* mock_descendants(MockDropbox* mock, const char* key, gboolean direct_only)
+{
+    GList* result = NULL;
+    size_t key_len = strlen(key);
+    GHashTableIter iter;
+    gpointer entry_key, data;
+    g_hash_table_iter_init(&iter, mock->entries);
+    while (g_hash_table_iter_next(&iter, &entry_key, &data)) {
+        const char* k = (const char*)entry_key;
+        if (strncmp(k, key, key_len) != 0 || k[key_len] != '/')
+            continue;
+        if (direct_only && strchr(k + key_len + 1, '/') != NULL)
+            continue;
+        result = g_list_prepend(result, data);
+    }
+    return g_list_sort(result, mock_compare_entries);
+}
+
+
+static const char* mock_basename(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+
+static json_object* mock_metadata(MockEntry* entry)
+{
+    json_object* meta = json_object_new_object();
+    char* lower = g_utf8_strdown(entry->path, -1);
+    char id[32];
+    snprintf(id, sizeof(id), "id:%" G_GUINT64_FORMAT, entry->id);
+
+    json_object_object_add(meta, ".tag", json_object_new_string(entry->folder ? "folder" : "file"));
+    json_object_object_add(meta, "name", json_object_new_string(mock_basename(entry->path)));
+    json_object_object_add(meta, "path_lower", json_object_new_string(lower));
+    json_object_object_add(meta, "path_display", json_object_new_string(entry->path));
+    json_object_object_add(meta, "id", json_object_new_string(id));
+    if (!entry->folder) {
+        char rev[32];
+        snprintf(rev, sizeof(rev), "%09" G_GINT64_MODIFIER "x", entry->rev);
+        json_object_object_add(meta, "client_modified", json_object_new_string("2015-05-12T15:50:38Z"));
+        json_object_object_add(meta, "server_modified", json_object_new_string("2015-05-12T15:50:38Z"));
+        json_object_object_add(meta, "rev", json_object_new_string(rev));
+        json_object_object_add(meta, "size", json_object_new_int64(entry->data->len));
+        json_object_object_add(meta, "content_hash", json_object_new_string(entry->content_hash));
+    }
+    g_free(lower);
+    return meta;
+}
+
+
+/*
+ * Responses
+ */
+
+static void mock_response_json(MockResponse* response, int status, json_object* body)
+{
+    const char* str = json_object_to_json_string_ext(body, JSON_C_TO_STRING_PLAIN);
+    response->status = status;
+    response->content_type = "application/json";
+    g_byte_array_append(response->body, (const guint8*)str, strlen(str));
+    json_object_put(body);
+}
+
+
+// Dropbox errors are a 409 with an error summary, and a tagged union
+static void mock_response_error(MockResponse* response, const char* summary, const char* error_json)
+{
+    char body[1024];
+    snprintf(body, sizeof(body), "{\"error_summary\": \"%s\", \"error\": %s}", summary, error_json);
+    response->status = 409;
+    response->content_type = "application/json";
+    g_byte_array_append(response->body, (const guint8*)body, strlen(body));
+}
+
+
+static void mock_response_text(MockResponse* response, int status, const char* text)
+{
+    response->status = status;
+    response->content_type = "text/plain";
+    g_byte_array_append(response->body, (const guint8*)text, strlen(text));
+}
+
+
+static void mock_not_found(MockResponse* response, const char* tag)
+{
+    char summary[64], error[256];
+    snprintf(summary, sizeof(summary), "%s/not_found/", tag);
+    snprintf(error, sizeof(error), "{\".tag\": \"%s\", \"%s\": {\".tag\": \"not_found\"}}", tag, tag);
+    mock_response_error(response, summary, error);
+}
+
+
+static void mock_conflict(MockResponse* response, const char* tag, gboolean folder)
+{
+    char summary[64], error[256];
+    const char* kind = folder ? "folder" : "file";
+    snprintf(summary, sizeof(summary), "%s/conflict/%s/", tag, kind);
+    snprintf(error, sizeof(error),
+        "{\".tag\": \"%s\", \"%s\": {\".tag\": \"conflict\", \"conflict\": {\".tag\": \"%s\"}}}",
+        tag, tag, kind);
+    mock_response_error(response, summary, error);
+}
+
+
+/*
+ * Endpoints
+ */
+
+static const char* mock_get_string(json_object* obj, const char* field)
+{
+    json_object* value = NULL;
+    if (obj && json_object_object_get_ex(obj, field, &value))
+        return json_object_get_string(value);
+    return NULL;
+}
+
+
+static void mock_get_metadata(MockDropbox* mock, json_object* arg, MockResponse* response)
+{
+    g_mutex_lock(&mock->lock);
+    MockEntry* entry = mock_lookup(mock, mock_get_string(arg, "path"));
+    if (entry)
+        mock_response_json(response, 200, mock_metadata(entry));
+    else
+        mock_not_found(response, "path");
+    g_mutex_unlock(&mock->lock);
+}
+
+
+static void mock_list_cursor(MockResponse* response, json_object* entries, const char* path,
+    int offset, int limit, guint since, gboolean has_more)
+{
+    char* raw_cursor = g_strdup_printf("%d:%d:%u:%s", offset, limit, since, path);
+    char* cursor = g_base64_encode((const guchar*)raw_cursor, strlen(raw_cursor));
+    g_free(raw_cursor);
+
+    json_object* body = json_object_new_object();
+    json_object_object_add(body, "entries", entries);
+    json_object_object_add(body, "cursor", json_object_new_string(cursor));
+    json_object_object_add(body, "has_more", json_object_new_boolean(has_more));
+    mock_response_json(response, 200, body);
+    g_free(cursor);
+}
+
+
+// Must be called with the lock held
+// Lists the direct children of path changed after the change since
+static void mock_list_changes(MockDropbox* mock, const char* path, guint since, int limit, MockResponse* response)
+{
+    char* key = mock_key(path);
+    GHashTable* seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    json_object* entries = json_object_new_array();
+    guint i;
+
+    for (i = since; i < mock->changes->len; ++i) {
+        const char* changed = g_ptr_array_index(mock->changes, i);
+        char* changed_key = mock_key(changed);
+        char* parent = mock_parent_key(changed_key);
+        if (strcmp(parent, key) != 0 || g_hash_table_contains(seen, changed_key)) {
+            g_free(parent);
+            g_free(changed_key);
+            continue;
+        }
+        g_free(parent);
+
+        MockEntry* entry = g_hash_table_lookup(mock->entries, changed_key);
+        if (entry) {
+            json_object_array_add(entries, mock_metadata(entry));
+        }
+        else {
+            json_object* deleted = json_object_new_object();
+            json_object_object_add(deleted, ".tag", json_object_new_string("deleted"));
+            json_object_object_add(deleted, "name", json_object_new_string(mock_basename(changed)));
+            json_object_object_add(deleted, "path_lower", json_object_new_string(changed_key));
+            json_object_object_add(deleted, "path_display", json_object_new_string(changed));
+            json_object_array_add(entries, deleted);
+        }
+        g_hash_table_add(seen, changed_key);
+    }
+
+    mock_list_cursor(response, entries, path, -1, limit, mock->changes->len, FALSE);
+    g_hash_table_destroy(seen);
+    g_free(key);
+}
+
+
+// Must be called with the lock held
+// since is where the change log was at when the listing started
+static void mock_list_page(MockDropbox* mock, const char* path, int offset, int limit, guint since,
+    MockResponse* response)
+{
+    char* key = mock_key(path);
+    if (key[0] != '\0') {
+        MockEntry* folder = g_hash_table_lookup(mock->entries, key);
+        if (folder == NULL) {
+            mock_not_found(response, "path");
+            g_free(key);
+            return;
+        }
+        if (!folder->folder) {
+            mock_response_error(response, "path/not_folder/", "{\".tag\": \"path\", \"path\": {\".tag\": \"not_folder\"}}");
+            g_free(key);
+            return;
+        }
+    }
+
+    GList* children = mock_descendants(mock, key, TRUE);
+    json_object* entries = json_object_new_array();
+    int count = 0;
+    GList* i;
+    for (i = g_list_nth(children, offset); i != NULL && count < limit; i = i->next, ++count) {
+        json_object_array_add(entries, mock_metadata((MockEntry*)i->data));
+    }
+    gboolean has_more = (i != NULL);
+    g_list_free(children);
+
+    // The cursor encodes where the listing is at. Once done, it follows the changes instead
+    mock_list_cursor(response, entries, path, has_more ? offset + count : -1, limit, since, has_more);
+    g_free(key);
+}
+
+
+static void mock_list_folder(MockDropbox* mock, json_object* arg, MockResponse* response)
+{
+    int limit = mock->config.list_page_size;
+    json_object* limit_obj = NULL;
+    if (json_object_object_get_ex(arg, "limit", &limit_obj))
+        limit = MIN(limit, json_object_get_int(limit_obj));
+
+    const char* path = mock_get_string(arg, "path");
+    if (path == NULL) {
+        mock_response_text(response, 400, "Error in call to API function \"files/list_folder\": missing path");
+        return;
+    }
+    if (strcmp(path, "/") == 0) {
+        mock_response_text(response, 400, "Specify the root folder as an empty string rather than as \"/\".");
+        return;
+    }
+
+    g_mutex_lock(&mock->lock);
+    mock_list_page(mock, path, 0, limit, mock->changes->len, response);
+    g_mutex_unlock(&mock->lock);
+}
+
+
+static void mock_list_folder_continue(MockDropbox* mock, json_object* arg, MockResponse* response)
+{
+    const char* cursor = mock_get_string(arg, "cursor");
+    gsize raw_len = 0;
+    char* raw = cursor ? (char*)g_base64_decode(cursor, &raw_len) : NULL;
+    char* raw_str = raw ? g_strndup(raw, raw_len) : NULL;
+    g_free(raw);
+
+    int offset = 0, limit = 0, path_start = 0;
+    guint since = 0;
+    if (raw_str == NULL || sscanf(raw_str, "%d:%d:%u:%n", &offset, &limit, &since, &path_start) < 3 ||
+        path_start == 0) {
+        mock_response_error(response, "reset/", "{\".tag\": \"reset\"}");
+    }
+    else {
+        g_mutex_lock(&mock->lock);
+        if (offset < 0)
+            mock_list_changes(mock, raw_str + path_start, since, limit, response);
+        else
+            mock_list_page(mock, raw_str + path_start, offset, limit, since, response);
+        g_mutex_unlock(&mock->lock);
+    }
+    g_free(raw_str);
+}
+
+
+// Parses a single range, clamping it to the size of the file
+// Returns FALSE if it can not be satisfied
+static gboolean mock_parse_range(const char* range, size_t size, size_t* first, size_t* last)
+{
+    *first = 0;
+    *last = size ? size - 1 : 0;
+    if (range == NULL)
+        return TRUE;
+
+    const char* spec = range;
+    if (g_ascii_strncasecmp(spec, "bytes=", 6) == 0)
+        spec += 6;
+
+    char* end;
+    if (*spec == '-') {
+        guint64 suffix = g_ascii_strtoull(spec + 1, &end, 10);
+        if (suffix == 0 || size == 0)
+            return FALSE;
+        *first = suffix >= size ? 0 : size - suffix;
+        return TRUE;
+    }
+
+    *first = g_ascii_strtoull(spec, &end, 10);
+    if (*first >= size)
+        return FALSE;
+    if (*end == '-' && end[1] != '\0') {
+        guint64 value = g_ascii_strtoull(end + 1, NULL, 10);
+        if (value < *first)
+            return FALSE;
+        *last = MIN(value, size - 1);
+    }
+    return TRUE;
+}
+
+
+static void mock_download(MockDropbox* mock, json_object* arg, const char* range, MockResponse* response)
+{
+    g_mutex_lock(&mock->lock);
+    MockEntry* entry = mock_lookup(mock, mock_get_string(arg, "path"));
+    if (entry == NULL) {
+        mock_not_found(response, "path");
+    }
+    else if (entry->folder) {
+        mock_response_error(response, "path/not_file/", "{\".tag\": \"path\", \"path\": {\".tag\": \"not_file\"}}");
+    }
+    else {
+        size_t size = entry->data->len, first, last;
+        json_object* meta = mock_metadata(entry);
+        g_string_append_printf(response->headers, "Dropbox-API-Result: %s\r\n",
+            json_object_to_json_string_ext(meta, JSON_C_TO_STRING_PLAIN));
+        json_object_put(meta);
+
+        if (!mock_parse_range(range, size, &first, &last)) {
+            g_string_append_printf(response->headers, "Content-Range: bytes */%zu\r\n", size);
+            mock_response_text(response, 416, "");
+        }
+        else {
+            response->status = range ? 206 : 200;
+            response->content_type = "application/octet-stream";
+            if (size > 0)
+                g_byte_array_append(response->body, entry->data->data + first, last - first + 1);
+            if (range)
+                g_string_append_printf(response->headers, "Content-Range: bytes %zu-%zu/%zu\r\n", first, last, size);
+        }
+    }
+    g_mutex_unlock(&mock->lock);
+}
+
+
+// Must be called with the lock held
+// Validates the cursor of an upload session, setting the error if it is wrong
+static GByteArray* mock_session_lookup(MockDropbox* mock, json_object* arg, MockResponse* response)
+{
+    json_object* cursor = NULL, *offset = NULL;
+    if (!json_object_object_get_ex(arg, "cursor", &cursor) ||
+        !json_object_object_get_ex(cursor, "offset", &offset)) {
+        mock_response_text(response, 400, "Error in call to API function: missing cursor");
+        return NULL;
+    }
+
+    GByteArray* session = g_hash_table_lookup(mock->sessions, mock_get_string(cursor, "session_id"));
+    if (session == NULL) {
+        mock_response_error(response, "not_found/", "{\".tag\": \"not_found\"}");
+        return NULL;
+    }
+
+    guint64 expected = json_object_get_int64(offset);
+    if (expected != session->len) {
+        char error[128];
+        snprintf(error, sizeof(error), "{\".tag\": \"incorrect_offset\", \"correct_offset\": %u}", session->len);
+        mock_response_error(response, "incorrect_offset/", error);
+        return NULL;
+    }
+    return session;
+}
+
+
+static void mock_upload_start(MockDropbox* mock, GByteArray* body, MockResponse* response)
+{
+    g_mutex_lock(&mock->lock);
+    char* session_id = g_strdup_printf("session-%" G_GUINT64_FORMAT, ++mock->next_id);
+    GByteArray* session = g_byte_array_new();
+    g_byte_array_append(session, body->data, body->len);
+    g_hash_table_insert(mock->sessions, session_id, session);
+    g_mutex_unlock(&mock->lock);
+
+    json_object* resp = json_object_new_object();
+    json_object_object_add(resp, "session_id", json_object_new_string(session_id));
+    mock_response_json(response, 200, resp);
+}
+
+
+static void mock_upload_append(MockDropbox* mock, json_object* arg, GByteArray* body, MockResponse* response)
+{
+    g_mutex_lock(&mock->lock);
+    GByteArray* session = mock_session_lookup(mock, arg, response);
+    if (session) {
+        g_byte_array_append(session, body->data, body->len);
+        mock_response_json(response, 200, NULL);
+    }
+    g_mutex_unlock(&mock->lock);
+}
+
+
+static void mock_upload_finish(MockDropbox* mock, json_object* arg, GByteArray* body, MockResponse* response)
+{
+    json_object* commit = NULL, *cursor = NULL;
+    json_object_object_get_ex(arg, "commit", &commit);
+    json_object_object_get_ex(arg, "cursor", &cursor);
+    const char* path = mock_get_string(commit, "path");
+    const char* mode = mock_get_string(commit, "mode");
+    if (path == NULL) {
+        mock_response_text(response, 400, "Error in call to API function: missing commit path");
+        return;
+    }
+
+    g_mutex_lock(&mock->lock);
+    GByteArray* session = mock_session_lookup(mock, arg, response);
+    if (session) {
+        g_byte_array_append(session, body->data, body->len);
+
+        MockEntry* entry = mock_lookup(mock, path);
+        if (entry && entry->folder) {
+            mock_conflict(response, "path", TRUE);
+        }
+        else if (entry && g_strcmp0(mode, "overwrite") != 0 &&
+                 (entry->data->len != session->len || memcmp(entry->data->data, session->data, session->len) != 0)) {
+            // Adding over an identical file is not a conflict
+            mock_conflict(response, "path", FALSE);
+        }
+        else {
+            if (entry == NULL)
+                entry = mock_insert(mock, path, FALSE);
+            mock_set_content(mock, entry, session);
+            mock_response_json(response, 200, mock_metadata(entry));
+        }
+        g_hash_table_remove(mock->sessions, mock_get_string(cursor, "session_id"));
+    }
+    g_mutex_unlock(&mock->lock);
+}
+
+
+static void mock_create_folder(MockDropbox* mock, json_object* arg, MockResponse* response)
+{
+    const char* path = mock_get_string(arg, "path");
+    if (path == NULL || path[0] != '/') {
+        mock_response_error(response, "path/malformed_path/", "{\".tag\": \"path\", \"path\": {\".tag\": \"malformed_path\"}}");
+        return;
+    }
+
+    g_mutex_lock(&mock->lock);
+    MockEntry* entry = mock_lookup(mock, path);
+    if (entry) {
+        mock_conflict(response, "path", entry->folder);
+    }
+    else {
+        entry = mock_insert(mock, path, TRUE);
+        json_object* resp = json_object_new_object();
+        json_object_object_add(resp, "metadata", mock_metadata(entry));
+        mock_response_json(response, 200, resp);
+    }
+    g_mutex_unlock(&mock->lock);
+}
+
+
+// Batches bigger than this are done in the background, as Dropbox may
+#define MOCK_SYNC_BATCH_SIZE 4
+
+static void mock_create_folder_batch(MockDropbox* mock, json_object* arg, MockResponse* response)
+{
+    json_object* paths = NULL;
+    if (arg == NULL || !json_object_object_get_ex(arg, "paths", &paths) ||
+        !json_object_is_type(paths, json_type_array)) {
+        mock_response_text(response, 400, "Missing paths");
+        return;
+    }
+
+    json_object* entries = json_object_new_array();
+    size_t i, count = json_object_array_length(paths);
+
+    g_mutex_lock(&mock->lock);
+    for (i = 0; i < count; ++i) {
+        const char* path = json_object_get_string(json_object_array_get_idx(paths, i));
+        json_object* result = json_object_new_object();
+        MockEntry* entry = NULL;
+        if (path == NULL || path[0] != '/') {
+            json_object* failure = json_object_new_object();
+            json_object* write_error = json_object_new_object();
+            json_object_object_add(write_error, ".tag", json_object_new_string("malformed_path"));
+            json_object_object_add(failure, ".tag", json_object_new_string("path"));
+            json_object_object_add(failure, "path", write_error);
+            json_object_object_add(result, ".tag", json_object_new_string("failure"));
+            json_object_object_add(result, "failure", failure);
+        }
+        else if ((entry = mock_lookup(mock, path)) != NULL) {
+            json_object* failure = json_object_new_object();
+            json_object* write_error = json_object_new_object();
+            json_object* conflict = json_object_new_object();
+            json_object_object_add(conflict, ".tag", json_object_new_string(entry->folder ? "folder" : "file"));
+            json_object_object_add(write_error, ".tag", json_object_new_string("conflict"));
+            json_object_object_add(write_error, "conflict", conflict);
+            json_object_object_add(failure, ".tag", json_object_new_string("path"));
+            json_object_object_add(failure, "path", write_error);
+            json_object_object_add(result, ".tag", json_object_new_string("failure"));
+            json_object_object_add(result, "failure", failure);
+        }
+        else {
+            entry = mock_insert(mock, path, TRUE);
+            json_object_object_add(result, ".tag", json_object_new_string("success"));
+            json_object_object_add(result, "metadata", mock_metadata(entry));
+        }
+        json_object_array_add(entries, result);
+    }
+
+    json_object* complete = json_object_new_object();
+    json_object_object_add(complete, ".tag", json_object_new_string("complete"));
+    json_object_object_add(complete, "entries", entries);
+
+    if (count <= MOCK_SYNC_BATCH_SIZE) {
+        g_mutex_unlock(&mock->lock);
+        mock_response_json(response, 200, complete);
+        return;
+    }
+
+    MockJob* job = g_new0(MockJob, 1);
+    job->result = complete;
+    char* job_id = g_strdup_printf("dbjid:%" G_GUINT64_FORMAT, ++mock->next_job);
+    g_hash_table_insert(mock->jobs, job_id, job);
+
+    json_object* resp = json_object_new_object();
+    json_object_object_add(resp, ".tag", json_object_new_string("async_job_id"));
+    json_object_object_add(resp, "async_job_id", json_object_new_string(job_id));
+    g_mutex_unlock(&mock->lock);
+    mock_response_json(response, 200, resp);
+}
+
+
+static void mock_create_folder_batch_check(MockDropbox* mock, json_object* arg, MockResponse* response)
+{
+    g_mutex_lock(&mock->lock);
+    const char* job_id = mock_get_string(arg, "async_job_id");
+    MockJob* job = job_id ? g_hash_table_lookup(mock->jobs, job_id) : NULL;
+    if (job == NULL) {
+        g_mutex_unlock(&mock->lock);
+        mock_response_error(response, "invalid_async_job_id/", "{\".tag\": \"invalid_async_job_id\"}");
+        return;
+    }
+
+    json_object* resp;
+    if (job->checks++ < mock->config.job_checks) {
+        resp = json_object_new_object();
+        json_object_object_add(resp, ".tag", json_object_new_string("in_progress"));
+    }
+    else {
+        resp = json_object_get(job->result);
+        g_hash_table_remove(mock->jobs, job_id);
+    }
+    g_mutex_unlock(&mock->lock);
+    mock_response_json(response, 200, resp);
+}
+
+
+static void mock_delete(MockDropbox* mock, json_object* arg, MockResponse* response)
+{
+    g_mutex_lock(&mock->lock);
+    MockEntry* entry = mock_lookup(mock, mock_get_string(arg, "path"));
+    if (entry == NULL) {
+        mock_not_found(response, "path_lookup");
+    }
+    else {
+        json_object* resp = json_object_new_object();
+        json_object_object_add(resp, "metadata", mock_metadata(entry));
+        mock_response_json(response, 200, resp);
+
+        char* key = mock_key(entry->path);
+        GList* descendants = mock_descendants(mock, key, FALSE);
+        GList* i;
+        for (i = descendants; i != NULL; i = i->next) {
+            char* child_key = mock_key(((MockEntry*)i->data)->path);
+            mock_changed(mock, ((MockEntry*)i->data)->path);
+            g_hash_table_remove(mock->entries, child_key);
+            g_free(child_key);
+        }
+        g_list_free(descendants);
+        mock_changed(mock, entry->path);
+        g_hash_table_remove(mock->entries, key);
+        g_free(key);
+    }
+    g_mutex_unlock(&mock->lock);
+}
+
+
+// Must be called with the lock held
+static MockEntry* mock_relocate_entry(MockDropbox* mock, MockEntry* entry, const char* to_path, gboolean copy)
+{
+    MockEntry* target = mock_insert(mock, to_path, entry->folder);
+    if (!entry->folder)
+        mock_set_content(mock, target, entry->data);
+    if (!copy) {
+        // Moving keeps the identity of the file. Older revisions are not kept, though
+        char* key = mock_key(entry->path);
+        target->id = entry->id;
+        target->rev = entry->rev;
+        mock_changed(mock, entry->path);
+        g_hash_table_remove(mock->entries, key);
+        g_free(key);
+    }
+    return target;
+}
+
+
+static void mock_relocate(MockDropbox* mock, json_object* arg, gboolean copy, MockResponse* response)
+{
+    const char* from_path = mock_get_string(arg, "from_path");
+    const char* to_path = mock_get_string(arg, "to_path");
+
+    g_mutex_lock(&mock->lock);
+    MockEntry* from = mock_lookup(mock, from_path);
+    MockEntry* to = mock_lookup(mock, to_path);
+    if (from == NULL) {
+        mock_not_found(response, "from_lookup");
+    }
+    else if (to_path == NULL || to_path[0] != '/') {
+        mock_response_error(response, "to/malformed_path/", "{\".tag\": \"to\", \"to\": {\".tag\": \"malformed_path\"}}");
+    }
+    else if (to != NULL) {
+        mock_conflict(response, "to", to->folder);
+    }
+    else {
+        char* from_key = mock_key(from->path);
+        size_t from_len = strlen(from->path);
+        GList* descendants = mock_descendants(mock, from_key, FALSE);
+        GList* i;
+
+        MockEntry* moved = mock_relocate_entry(mock, from, to_path, copy);
+        for (i = descendants; i != NULL; i = i->next) {
+            MockEntry* child = (MockEntry*)i->data;
+            char* child_to = g_strconcat(to_path, child->path + from_len, NULL);
+            mock_relocate_entry(mock, child, child_to, copy);
+            g_free(child_to);
+        }
+        g_list_free(descendants);
+        g_free(from_key);
+
+        json_object* resp = json_object_new_object();
+        json_object_object_add(resp, "metadata", mock_metadata(moved));
+        mock_response_json(response, 200, resp);
+    }
+    g_mutex_unlock(&mock->lock);
+}
+
+
+static void mock_token(MockDropbox* mock, MockResponse* response)
+{
+    char body[256];
+    snprintf(body, sizeof(body),
+        "{\"access_token\": \"mock-token-%d\", \"token_type\": \"bearer\", \"expires_in\": 14400}",
+        g_atomic_int_get(&mock->requests));
+    response->status = 200;
+    response->content_type = "application/json";
+    g_byte_array_append(response->body, (const guint8*)body, strlen(body));
+}
+
+
+// Returns TRUE if the request must fail, with fault set to how
+static gboolean mock_take_fault(MockDropbox* mock, const char* endpoint, MockFault* fault)
+{
+    gboolean fail = FALSE;
+    g_mutex_lock(&mock->lock);
+    MockFault* pending = g_hash_table_lookup(mock->faults, endpoint);
+    if (pending && pending->count > 0) {
+        --pending->count;
+        *fault = *pending;
+        fail = TRUE;
+    }
+    g_mutex_unlock(&mock->lock);
+    return fail;
+}
+
+
+static void mock_dispatch(MockDropbox* mock, MockRequest* request, MockResponse* response)
+{
+    const char* endpoint = request->target;
+
+    if (strcmp(endpoint, "/oauth2/token") == 0) {
+        mock_token(mock, response);
+        return;
+    }
+
+    // Content endpoints get their argument in a header, RPC endpoints in the body
+    json_object* arg = NULL;
+    gboolean content_endpoint = (request->api_arg != NULL);
+    if (content_endpoint) {
+        arg = json_tokener_parse(request->api_arg);
+    }
+    else if (request->body->len > 0) {
+        json_tokener* tokener = json_tokener_new();
+        arg = json_tokener_parse_ex(tokener, (const char*)request->body->data, request->body->len);
+        json_tokener_free(tokener);
+    }
+
+    if (strcmp(endpoint, "/2/files/get_metadata") == 0)
+        mock_get_metadata(mock, arg, response);
+    else if (strcmp(endpoint, "/2/files/list_folder") == 0)
+        mock_list_folder(mock, arg, response);
+    else if (strcmp(endpoint, "/2/files/list_folder/continue") == 0)
+        mock_list_folder_continue(mock, arg, response);
+    else if (strcmp(endpoint, "/2/files/download") == 0)
+        mock_download(mock, arg, request->range, response);
+    else if (strcmp(endpoint, "/2/files/upload_session/start") == 0)
+        mock_upload_start(mock, request->body, response);
+    else if (strcmp(endpoint, "/2/files/upload_session/append_v2") == 0)
+        mock_upload_append(mock, arg, request->body, response);
+    else if (strcmp(endpoint, "/2/files/upload_session/finish") == 0)
+        mock_upload_finish(mock, arg, request->body, response);
+    else if (strcmp(endpoint, "/2/files/create_folder_v2") == 0)
+        mock_create_folder(mock, arg, response);
+    else if (strcmp(endpoint, "/2/files/create_folder_batch") == 0)
+        mock_create_folder_batch(mock, arg, response);
+    else if (strcmp(endpoint, "/2/files/create_folder_batch/check") == 0)
+        mock_create_folder_batch_check(mock, arg, response);
+    else if (strcmp(endpoint, "/2/files/delete_v2") == 0)
+        mock_delete(mock, arg, response);
+    else if (strcmp(endpoint, "/2/files/move_v2") == 0)
+        mock_relocate(mock, arg, FALSE, response);
+    else if (strcmp(endpoint, "/2/files/copy_v2") == 0)
+        mock_relocate(mock, arg, TRUE, response);
+    else
+        mock_response_text(response, 404, "Unknown endpoint");
+
+    json_object_put(arg);
+}
+
+
+/*
+ * HTTP
+ */
+
+static gboolean mock_send_all(int fd, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        p += sent;
+        size -= sent;
+    }
+    return TRUE;
+}
+
+
+// Sends the body no faster than the configured bandwidth
+static gboolean mock_send_body(MockDropbox* mock, int fd, const guint8* data, size_t size)
+{
+    if (mock->config.bandwidth == 0)
+        return mock_send_all(fd, data, size);
+
+    size_t slice = MAX(mock->config.bandwidth / 50, 1);
+    gint64 start = g_get_monotonic_time();
+    size_t sent = 0;
+    while (sent < size) {
+        size_t n = MIN(slice, size - sent);
+        if (!mock_send_all(fd, data + sent, n))
+            return FALSE;
+        sent += n;
+        gint64 due = start + (gint64)((double)sent * G_USEC_PER_SEC / mock->config.bandwidth);
+        gint64 now = g_get_monotonic_time();
+        if (due > now)
+            g_usleep(due - now);
+    }
+    return TRUE;
+}
+
+
+static const char* mock_reason(int status)
+{
+    switch (status) {
+        case 200: return "OK";
+        case 206: return "Partial Content";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 409: return "Conflict";
+        case 416: return "Range Not Satisfiable";
+        case 429: return "Too Many Requests";
+        default: return "Internal Server Error";
+    }
+}
+
+
+// Only the first body_limit bytes of the body are sent
+static gboolean mock_send_response(MockDropbox* mock, int fd, MockResponse* response, gboolean keep_alive,
+    size_t body_limit)
+{
+    GString* head = g_string_new(NULL);
+    g_string_append_printf(head, "HTTP/1.1 %d %s\r\n", response->status, mock_reason(response->status));
+    g_string_append_printf(head, "Content-Type: %s\r\n", response->content_type ? response->content_type : "text/plain");
+    g_string_append_printf(head, "Content-Length: %u\r\n", response->body->len);
+    g_string_append(head, response->headers->str);
+    if (!keep_alive)
+        g_string_append(head, "Connection: close\r\n");
+    g_string_append(head, "\r\n");
+
+    gboolean ok = mock_send_all(fd, head->str, head->len) &&
+        mock_send_body(mock, fd, response->body->data, MIN(response->body->len, body_limit));
+    g_string_free(head, TRUE);
+    return ok;
+}
+
+
+// Reads more data from the connection
+static gboolean mock_fill(MockConnection* conn)
+{
+    guint8 buffer[65536];
+    ssize_t received;
+    do {
+        received = recv(conn->fd, buffer, sizeof(buffer), 0);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0)
+        return FALSE;
+    g_byte_array_append(conn->in, buffer, received);
+    return TRUE;
+}
+
+
+static char* mock_header_value(char* line, const char* name)
+{
+    size_t len = strlen(name);
+    if (g_ascii_strncasecmp(line, name, len) != 0 || line[len] != ':')
+        return NULL;
+    return g_strstrip(line + len + 1);
+}
+
+
+// Reads a full request from the connection
+static gboolean mock_read_request(MockConnection* conn, MockRequest* request)
+{
+    guint8* end;
+    while ((end = memmem(conn->in->data, conn->in->len, "\r\n\r\n", 4)) == NULL) {
+        if (conn->in->len > MOCK_MAX_HEADER_SIZE || !mock_fill(conn))
+            return FALSE;
+    }
+    size_t head_size = end - conn->in->data + 4;
+    char* head = g_strndup((const char*)conn->in->data, head_size - 4);
+    g_byte_array_remove_range(conn->in, 0, head_size);
+
+    gchar** lines = g_strsplit(head, "\r\n", -1);
+    g_free(head);
+
+    char version[16] = {0};
+    gboolean ok = (sscanf(lines[0], "%15s %1023s %15s", request->method, request->target, version) == 3);
+    request->keep_alive = (strcmp(version, "HTTP/1.1") == 0);
+
+    size_t content_length = 0;
+    int i;
+    for (i = 1; ok && lines[i] != NULL; ++i) {
+        char* value;
+        if ((value = mock_header_value(lines[i], "Content-Length")) != NULL)
+            content_length = g_ascii_strtoull(value, NULL, 10);
+        else if ((value = mock_header_value(lines[i], "Dropbox-API-Arg")) != NULL)
+            request->api_arg = g_strdup(value);
+        else if ((value = mock_header_value(lines[i], "Range")) != NULL)
+            request->range = g_strdup(value);
+        else if ((value = mock_header_value(lines[i], "Expect")) != NULL)
+            request->expect_continue = (g_ascii_strcasecmp(value, "100-continue") == 0);
+        else if ((value = mock_header_value(lines[i], "Connection")) != NULL)
+            request->keep_alive = (g_ascii_strcasecmp(value, "close") != 0);
+    }
+    g_strfreev(lines);
+    if (!ok)
+        return FALSE;
+
+    if (request->expect_continue && conn->in->len < content_length) {
+        static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (!mock_send_all(conn->fd, continue_line, sizeof(continue_line) - 1))
+            return FALSE;
+    }
+
+    while (conn->in->len < content_length) {
+        if (!mock_fill(conn))
+            return FALSE;
+    }
+    g_byte_array_append(request->body, conn->in->data, content_length);
+    g_byte_array_remove_range(conn->in, 0, content_length);
+    return TRUE;
+}
+
+
+static gpointer mock_connection_loop(gpointer data)
+{
+    MockConnection* conn = (MockConnection*)data;
+    MockDropbox* mock = conn->mock;
+
+    gboolean keep_alive = TRUE;
+    while (keep_alive && !g_atomic_int_get(&mock->stopping)) {
+        MockRequest request;
+        memset(&request, 0, sizeof(request));
+        request.body = g_byte_array_new();
+
+        if (!mock_read_request(conn, &request)) {
+            g_byte_array_unref(request.body);
+            break;
+        }
+        keep_alive = request.keep_alive;
+        g_atomic_int_inc(&mock->requests);
+
+        MockResponse response;
+        memset(&response, 0, sizeof(response));
+        response.headers = g_string_new(NULL);
+        response.body = g_byte_array_new();
+
+        if (mock->config.rtt_ms > 0)
+            g_usleep(mock->config.rtt_ms * 1000);
+
+        char* query = strchr(request.target, '?');
+        if (query)
+            *query = '\0';
+
+        MockFault fault = { 0 };
+        size_t body_limit = G_MAXSIZE;
+        double roll = g_random_double();
+        if (mock_take_fault(mock, request.target, &fault)) {
+            if (fault.delay_ms > 0) {
+                gint64 until = g_get_monotonic_time() + (gint64)fault.delay_ms * 1000;
+                while (g_get_monotonic_time() < until && !g_atomic_int_get(&mock->stopping))
+                    g_usleep(10000);
+                mock_dispatch(mock, &request, &response);
+            }
+            else if (fault.cut) {
+                mock_dispatch(mock, &request, &response);
+                keep_alive = FALSE;
+                body_limit = fault.cut_after;
+            }
+            else if (fault.status > 0) {
+                mock_response_text(&response, fault.status, "Injected failure");
+            }
+            else {
+                mock_dispatch(mock, &request, &response);
+                keep_alive = FALSE;
+                response.status = 0;
+            }
+        }
+        else if (roll < mock->config.rate_limit_ratio) {
+            g_string_append(response.headers, "Retry-After: 1\r\n");
+            mock_response_json(&response, 429,
+                json_tokener_parse("{\"error_summary\": \"too_many_requests/\", "
+                    "\"error\": {\"reason\": {\".tag\": \"too_many_requests\"}, \"retry_after\": 1}}"));
+        }
+        else if (roll < mock->config.rate_limit_ratio + mock->config.error_ratio) {
+            mock_response_text(&response, 500, "Injected error");
+        }
+        else {
+            mock_dispatch(mock, &request, &response);
+        }
+
+        // Same headers as a GET, without the body
+        if (strcmp(request.method, "HEAD") == 0)
+            body_limit = 0;
+
+        if (response.status == 0 || !mock_send_response(mock, conn->fd, &response, keep_alive, body_limit))
+            keep_alive = FALSE;
+
+        // Hold the connection without sending anything
+        if (body_limit < response.body->len) {
+            gint64 until = g_get_monotonic_time() + (gint64)fault.stall_ms * 1000;
+            while (g_get_monotonic_time() < until && !g_atomic_int_get(&mock->stopping))
+                g_usleep(10000);
+        }
+
+        g_string_free(response.headers, TRUE);
+        g_byte_array_unref(response.body);
+        g_byte_array_unref(request.body);
+        g_free(request.api_arg);
+        g_free(request.range);
+    }
+
+    g_mutex_lock(&mock->conn_lock);
+    g_hash_table_remove(mock->connections, GINT_TO_POINTER(conn->fd));
+    g_cond_broadcast(&mock->conn_cond);
+    g_mutex_unlock(&mock->conn_lock);
+
+    close(conn->fd);
+    g_byte_array_unref(conn->in);
+    g_free(conn);
+    return NULL;
+}
+
+
+static gpointer mock_accept_loop(gpointer data)
+{
+    MockDropbox* mock = (MockDropbox*)data;
+    while (!g_atomic_int_get(&mock->stopping)) {
+        int fd = accept(mock->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        MockConnection* conn = g_new0(MockConnection, 1);
+        conn->mock = mock;
+        conn->fd = fd;
+        conn->in = g_byte_array_new();
+
+        g_mutex_lock(&mock->conn_lock);
+        g_hash_table_add(mock->connections, GINT_TO_POINTER(fd));
+        g_mutex_unlock(&mock->conn_lock);
+
+        g_thread_unref(g_thread_new("mock_connection", mock_connection_loop, conn));
+    }
+    return NULL;
+}
+
+
+/*
+ * Public
+ */
+
+MockDropbox* mock_dropbox_start(const MockDropboxConfig* config)
+{
+    MockDropbox* mock = g_new0(MockDropbox, 1);
+    if (config)
+        mock->config = *config;
+    if (mock->config.list_page_size <= 0)
+        mock->config.list_page_size = MOCK_DEFAULT_PAGE_SIZE;
+    if (mock->config.job_checks <= 0)
+        mock->config.job_checks = 1;
+
+    g_mutex_init(&mock->lock);
+    g_mutex_init(&mock->conn_lock);
+    g_cond_init(&mock->conn_cond);
+    mock->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, mock_entry_free);
+    mock->sessions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_byte_array_unref);
+    mock->jobs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)mock_job_free);
+    mock->changes = g_ptr_array_new_with_free_func(g_free);
+    mock->connections = g_hash_table_new(g_direct_hash, g_direct_equal);
+    mock->faults = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    mock->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (mock->fd < 0 || bind(mock->fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(mock->fd, 512) != 0) {
+        fprintf(stderr, "Could not start the mock server: %s\n", strerror(errno));
+        abort();
+    }
+    getsockname(mock->fd, (struct sockaddr*)&addr, &addr_len);
+    snprintf(mock->url, sizeof(mock->url), "http://127.0.0.1:%d", ntohs(addr.sin_port));
+
+    mock->acceptor = g_thread_new("mock_acceptor", mock_accept_loop, mock);
+    return mock;
+}
+
+
+void mock_dropbox_stop(MockDropbox* mock)
+{
+    g_atomic_int_set(&mock->stopping, 1);
+    shutdown(mock->fd, SHUT_RDWR);
+    g_thread_join(mock->acceptor);
+    close(mock->fd);
+
+    // Wake up the connections blocked on a read, and wait for them to go
+    g_mutex_lock(&mock->conn_lock);
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, mock->connections);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        shutdown(GPOINTER_TO_INT(key), SHUT_RDWR);
+    }
+    while (g_hash_table_size(mock->connections) > 0) {
+        g_cond_wait(&mock->conn_cond, &mock->conn_lock);
+    }
+    g_mutex_unlock(&mock->conn_lock);
+
+    g_hash_table_destroy(mock->connections);
+    g_hash_table_destroy(mock->faults);
+    g_hash_table_destroy(mock->sessions);
+    g_hash_table_destroy(mock->jobs);
+    g_ptr_array_free(mock->changes, TRUE);
+    g_hash_table_destroy(mock->entries);
+    g_cond_clear(&mock->conn_cond);
+    g_mutex_clear(&mock->conn_lock);
+    g_mutex_clear(&mock->lock);
+    g_free(mock);
+}
+
+
+const char* mock_dropbox_url(MockDropbox* mock)
+{
+    return mock->url;
+}
+
+
+void mock_dropbox_configure(gfal2_context_t context, MockDropbox* mock)
+{
+    gfal2_set_opt_string(context, "DROPBOX", "OAUTH", "2", NULL);
+    gfal2_set_opt_string(context, "DROPBOX", "APP_KEY", "key", NULL);
+    gfal2_set_opt_string(context, "DROPBOX", "APP_SECRET", "secret", NULL);
+    gfal2_set_opt_string(context, "DROPBOX", "ACCESS_TOKEN", "token", NULL);
+    gfal2_set_opt_string(context, "DROPBOX", "API_URL", mock_dropbox_url(mock), NULL);
+    gfal2_set_opt_string(context, "DROPBOX", "CONTENT_URL", mock_dropbox_url(mock), NULL);
+}
+
+
+gfal_plugin_interface mock_dropbox_plugin_new(MockDropbox* mock, gfal2_context_t context)
+{
+    GError* error = NULL;
+    mock_dropbox_configure(context, mock);
+    gfal_plugin_interface plugin = gfal_plugin_init(context, &error);
+    g_assert(error == NULL);
+    return plugin;
+}
+
+
+void mock_dropbox_put_file(MockDropbox* mock, const char* path, const void* data, size_t size)
+{
+    g_mutex_lock(&mock->lock);
+    MockEntry* entry = mock_lookup(mock, path);
+    if (entry == NULL)
+        entry = mock_insert(mock, path, FALSE);
+    GByteArray* content = g_byte_array_sized_new(size);
+    g_byte_array_append(content, data, size);
+    mock_set_content(mock, entry, content);
+    g_byte_array_unref(content);
+    g_mutex_unlock(&mock->lock);
+}
+
+
+void mock_dropbox_put_folder(MockDropbox* mock, const char* path)
+{
+    g_mutex_lock(&mock->lock);
+    if (mock_lookup(mock, path) == NULL)
+        mock_insert(mock, path, TRUE);
+    g_mutex_unlock(&mock->lock);
+}
+
+
+gboolean mock_dropbox_get_file(MockDropbox* mock, const char* path, void** data, size_t* size)
+{
+    g_mutex_lock(&mock->lock);
+    MockEntry* entry = mock_lookup(mock, path);
+    gboolean found = (entry != NULL && !entry->folder);
+    if (found) {
+        *size = entry->data->len;
+        *data = g_malloc(entry->data->len);
+        memcpy(*data, entry->data->data, entry->data->len);
+    }
+    g_mutex_unlock(&mock->lock);
+    return found;
+}
+
+
+void mock_dropbox_fail(MockDropbox* mock, const char* endpoint, int status, int count)
+{
+    MockFault* fault = g_new0(MockFault, 1);
+    fault->status = status;
+    fault->count = count;
+    g_mutex_lock(&mock->lock);
+    g_hash_table_replace(mock->faults, g_strdup(endpoint), fault);
+    g_mutex_unlock(&mock->lock);
+}
+
+
+void mock_dropbox_cut(MockDropbox* mock, const char* endpoint, size_t after, int stall_ms, int count)
+{
+    MockFault* fault = g_new0(MockFault, 1);
+    fault->count = count;
+    fault->cut = TRUE;
+    fault->cut_after = after;
+    fault->stall_ms = stall_ms;
+    g_mutex_lock(&mock->lock);
+    g_hash_table_replace(mock->faults, g_strdup(endpoint), fault);
+    g_mutex_unlock(&mock->lock);
+}
+
+
+void mock_dropbox_delay(MockDropbox* mock, const char* endpoint, int delay_ms, int count)
+{
+    MockFault* fault = g_new0(MockFault, 1);
+    fault->count = count;
+    fault->delay_ms = delay_ms;
+    g_mutex_lock(&mock->lock);
+    g_hash_table_replace(mock->faults, g_strdup(endpoint), fault);
+    g_mutex_unlock(&mock->lock);
+}
+
+
+unsigned mock_dropbox_request_count(MockDropbox* mock)
+{
+    return g_atomic_int_get(&mock->requests);
+}
@@ -0,0 +1,88 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// In-process mock of the Dropbox API v2, serving plain HTTP/1.1 on the loopback
+// Both the API and content endpoints are served from the same address
+// The namespace is kept in memory
+
+#pragma once
+#ifndef MOCK_DROPBOX_H
+#define MOCK_DROPBOX_H
+
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stddef.h>
+
+typedef struct MockDropbox MockDropbox;
+
+typedef struct {
+    // Delay added before answering each request, in milliseconds
+    int rtt_ms;
+    // Response bodies are sent at most at this rate, in bytes per second. 0 for no limit
+    size_t bandwidth;
+    // Fraction of requests answered with a 429 Too Many Requests
+    double rate_limit_ratio;
+    // Fraction of requests answered with a 500 Internal Server Error
+    double error_ratio;
+    // Entries returned per list_folder page. 0 for the default (500)
+    int list_page_size;
+    // Checks of a background folder batch answered in progress before it is done. 0 for the default (1)
+    int job_checks;
+} MockDropboxConfig;
+
+// Starts the server on an ephemeral port. config can be NULL
+MockDropbox* mock_dropbox_start(const MockDropboxConfig* config);
+
+// Stops the server and frees the namespace
+void mock_dropbox_stop(MockDropbox* mock);
+
+// Base url of the server, to be used as API_URL and CONTENT_URL
+const char* mock_dropbox_url(MockDropbox* mock);
+
+// Points the plugin created from context at the server, with a fixed OAuth2 access token
+void mock_dropbox_configure(gfal2_context_t context, MockDropbox* mock);
+
+// Creates the plugin from context, once pointed at the server
+// The options specific to a test are set on context beforehand
+gfal_plugin_interface mock_dropbox_plugin_new(MockDropbox* mock, gfal2_context_t context);
+
+// Creates or replaces a file. Parent folders are created as needed
+void mock_dropbox_put_file(MockDropbox* mock, const char* path, const void* data, size_t size);
+
+// Creates a folder. Parent folders are created as needed
+void mock_dropbox_put_folder(MockDropbox* mock, const char* path);
+
+// Copies the content of a file into a newly allocated buffer, to be freed with g_free
+// Returns FALSE if there is no such file
+gboolean mock_dropbox_get_file(MockDropbox* mock, const char* path, void** data, size_t* size);
+
+// The next count requests to endpoint (i.e. /2/files/download) fail with the given HTTP status
+// If status is 0, the request is processed, but the connection is closed instead of answering,
+// as if the response got lost
+void mock_dropbox_fail(MockDropbox* mock, const char* endpoint, int status, int count);
+
+// The next count responses from endpoint are cut after sending after bytes of their body
+// The connection is then left silent for stall_ms milliseconds before being closed
+void mock_dropbox_cut(MockDropbox* mock, const char* endpoint, size_t after, int stall_ms, int count);
+
+// The next count requests to endpoint are answered after delay_ms milliseconds
+void mock_dropbox_delay(MockDropbox* mock, const char* endpoint, int delay_ms, int count);
+
+// Number of requests received so far, including the injected failures
+unsigned mock_dropbox_request_count(MockDropbox* mock);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the stat batching, against the mock server
+
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mock_dropbox.h"
+
+#define FILE_COUNT 20
+
+static MockDropbox* mock;
+
+
+static gfal2_context_t batch_context(int threshold)
+{
+    gfal2_context_t context = gfal2_context_new(NULL);
+    gfal2_set_opt_integer(context, "DROPBOX", "STAT_BATCH_THRESHOLD", threshold, NULL);
+    // Long enough not to be hit by a slow run
+    gfal2_set_opt_integer(context, "DROPBOX", "STAT_BATCH_WINDOW", 60000, NULL);
+    gfal2_set_opt_integer(context, "DROPBOX", "STAT_BATCH_TTL", 60, NULL);
+    return context;
+}
+
+
+static void free_plugin(gfal2_context_t context, gfal_plugin_interface* plugin)
+{
+    plugin->plugin_delete(plugin->plugin_data);
+    gfal2_context_free(context);
+}
+
+
+static int stat_entry(gfal_plugin_interface* plugin, const char* folder, int i, struct stat* st, GError** error)
+{
+    char url[256];
+    snprintf(url, sizeof(url), "dropbox://dropbox.com/%s/file%d", folder, i);
+    return plugin->statG(plugin->plugin_data, url, st, error);
+}
+
+
+void test_batch_burst()
+{
+    gfal2_context_t context = batch_context(8);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    GError* error = NULL;
+    struct stat st;
+    int i;
+
+    // The first ones go on their own, until the burst is noticed and the folder listed
+    // Pages are 5 entries long, so the listing of the 21 entries takes 5 requests
+    unsigned requests = mock_dropbox_request_count(mock);
+    for (i = 0; i < FILE_COUNT; ++i) {
+        g_assert(stat_entry(&plugin, "burst", i, &st, &error) == 0);
+        g_assert(st.st_size == i && !S_ISDIR(st.st_mode));
+    }
+    g_assert(mock_dropbox_request_count(mock) == requests + 7 + 5);
+
+    // Not in the listing, so it does not exist
+    requests = mock_dropbox_request_count(mock);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/burst/missing", &st, &error) < 0);
+    g_assert(error->code == ENOENT);
+    g_clear_error(&error);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/burst/sub", &st, &error) == 0);
+    g_assert(S_ISDIR(st.st_mode));
+    g_assert(mock_dropbox_request_count(mock) == requests);
+
+    // Other folders are not affected
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/burst/sub/file", &st, &error) == 0);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    free_plugin(context, &plugin);
+    printf("Batch burst OK\n");
+}
+
+
+void test_batch_invalidate()
+{
+    gfal2_context_t context = batch_context(1);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    GError* error = NULL;
+    struct stat st;
+
+    g_assert(stat_entry(&plugin, "burst", 0, &st, &error) == 0);
+
+    // Once changed, what was listed is not used anymore
+    g_assert(plugin.unlinkG(plugin.plugin_data, "dropbox://dropbox.com/burst/file0", &error) == 0);
+    g_assert(stat_entry(&plugin, "burst", 0, &st, &error) < 0);
+    g_assert(error->code == ENOENT);
+    g_clear_error(&error);
+
+    g_assert(plugin.renameG(plugin.plugin_data, "dropbox://dropbox.com/burst/file1",
+        "dropbox://dropbox.com/burst/file0", &error) == 0);
+    g_assert(stat_entry(&plugin, "burst", 0, &st, &error) == 0);
+    g_assert(st.st_size == 1);
+    g_assert(stat_entry(&plugin, "burst", 1, &st, &error) < 0);
+    g_assert(error->code == ENOENT);
+    g_clear_error(&error);
+
+    free_plugin(context, &plugin);
+    printf("Batch invalidate OK\n");
+}
+
+
+typedef struct {
+    gfal_plugin_interface* plugin;
+    int index;
+} StatArgs;
+
+
+static gpointer stat_thread(gpointer data)
+{
+    StatArgs* args = (StatArgs*)data;
+    GError* error = NULL;
+    struct stat st;
+    g_assert(stat_entry(args->plugin, "coalesce", args->index % 4, &st, &error) == 0);
+    g_assert(st.st_size == args->index % 4);
+    return NULL;
+}
+
+
+void test_batch_coalesce()
+{
+    gfal2_context_t context = batch_context(1);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    GThread* threads[8];
+    StatArgs args[8];
+    int i;
+
+    // All of them wait for the single listing
+    unsigned requests = mock_dropbox_request_count(mock);
+    for (i = 0; i < 8; ++i) {
+        args[i].plugin = &plugin;
+        args[i].index = i;
+        threads[i] = g_thread_new("stat", stat_thread, &args[i]);
+    }
+    for (i = 0; i < 8; ++i) {
+        g_thread_join(threads[i]);
+    }
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    free_plugin(context, &plugin);
+    printf("Batch coalesce OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    MockDropboxConfig config;
+    memset(&config, 0, sizeof(config));
+    config.list_page_size = 5;
+    // Slow enough for the stats to pile up on the listing
+    config.rtt_ms = 20;
+    mock = mock_dropbox_start(&config);
+
+    char* data = g_malloc0(FILE_COUNT);
+    int i;
+    for (i = 0; i < FILE_COUNT; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "/burst/file%d", i);
+        mock_dropbox_put_file(mock, path, data, i);
+        if (i < 4) {
+            snprintf(path, sizeof(path), "/coalesce/file%d", i);
+            mock_dropbox_put_file(mock, path, data, i);
+        }
+    }
+    mock_dropbox_put_file(mock, "/burst/sub/file", data, 1);
+    g_free(data);
+
+    test_batch_burst();
+    test_batch_invalidate();
+    test_batch_coalesce();
+
+    mock_dropbox_stop(mock);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the pooled response buffers
+
+#include "../gfal_dropbox_buffer.h"
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "test_help.h"
+
+
+void test_buffer_growth()
+{
+    DropboxBufferPool* pool = gfal2_dropbox_buffer_pool_new();
+    DropboxBuffer* buffer = gfal2_dropbox_buffer_acquire(pool);
+
+    char chunk[1000];
+    memset(chunk, 'x', sizeof(chunk));
+    int i;
+    for (i = 0; i < 100; ++i) {
+        gfal2_dropbox_buffer_append(buffer, chunk, sizeof(chunk));
+    }
+    g_assert(buffer->length == 100 * sizeof(chunk));
+    g_assert(buffer->capacity > buffer->length);
+    g_assert(buffer->data[buffer->length] == '\0');
+
+    gfal2_dropbox_buffer_release(pool, buffer);
+    gfal2_dropbox_buffer_pool_free(pool);
+    printf("Buffer growth OK\n");
+}
+
+
+void test_buffer_reuse()
+{
+    DropboxBufferPool* pool = gfal2_dropbox_buffer_pool_new();
+
+    // Once grown, the same memory is handed out again, empty
+    DropboxBuffer* buffer = gfal2_dropbox_buffer_acquire(pool);
+    char chunk[10000];
+    memset(chunk, 'x', sizeof(chunk));
+    gfal2_dropbox_buffer_append(buffer, chunk, sizeof(chunk));
+    char* data = buffer->data;
+    size_t capacity = buffer->capacity;
+    gfal2_dropbox_buffer_release(pool, buffer);
+
+    DropboxBuffer* again = gfal2_dropbox_buffer_acquire(pool);
+    g_assert(again == buffer && again->data == data && again->capacity == capacity);
+    g_assert(again->length == 0 && again->data[0] == '\0');
+    gfal2_dropbox_buffer_append(again, chunk, sizeof(chunk));
+    g_assert(again->data == data);
+
+    // Too big to be kept
+    while (again->capacity <= DROPBOX_BUFFER_MAX_RETAINED) {
+        gfal2_dropbox_buffer_append(again, chunk, sizeof(chunk));
+    }
+    gfal2_dropbox_buffer_release(pool, again);
+    DropboxBuffer* fresh = gfal2_dropbox_buffer_acquire(pool);
+    g_assert(fresh->capacity <= DROPBOX_BUFFER_MAX_RETAINED);
+    gfal2_dropbox_buffer_release(pool, fresh);
+
+    gfal2_dropbox_buffer_pool_free(pool);
+    printf("Buffer reuse OK\n");
+}
+
+
+void test_buffer_json()
+{
+    DropboxBufferPool* pool = gfal2_dropbox_buffer_pool_new();
+    DropboxBuffer* buffer = gfal2_dropbox_buffer_acquire(pool);
+
+    const char* response = "{\"name\": \"file\"}";
+    gfal2_dropbox_buffer_append(buffer, response, strlen(response));
+    json_object* root = gfal2_dropbox_buffer_json(buffer);
+    json_object* name = NULL;
+    g_assert(root != NULL && json_object_object_get_ex(root, "name", &name));
+    ASSERT_STR_EQ("file", json_object_get_string(name));
+    json_object_put(root);
+
+    // Truncated
+    gfal2_dropbox_buffer_reset(buffer);
+    gfal2_dropbox_buffer_append(buffer, response, 10);
+    g_assert(gfal2_dropbox_buffer_json(buffer) == NULL);
+
+    gfal2_dropbox_buffer_release(pool, buffer);
+    gfal2_dropbox_buffer_pool_free(pool);
+    printf("Buffer JSON OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    test_buffer_growth();
+    test_buffer_reuse();
+    test_buffer_json();
+    return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the download cache, against the mock server
+// Each context stands for a new process
+
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "mock_dropbox.h"
+
+#define FILE_SIZE (100 * 1024)
+
+static MockDropbox* mock;
+static char* cache_dir;
+
+
+static gfal2_context_t cache_context()
+{
+    gfal2_context_t context = gfal2_context_new(NULL);
+    gfal2_set_opt_string(context, "DROPBOX", "CACHE_DIR", cache_dir, NULL);
+    // Room for two files
+    gfal2_set_opt_integer(context, "DROPBOX", "CACHE_SIZE", FILE_SIZE * 5 / 2, NULL);
+    return context;
+}
+
+
+static void free_plugin(gfal2_context_t context, gfal_plugin_interface* plugin)
+{
+    plugin->plugin_delete(plugin->plugin_data);
+    gfal2_context_free(context);
+}
+
+
+static char* make_content(int seed)
+{
+    char* data = g_malloc(FILE_SIZE);
+    int i;
+    for (i = 0; i < FILE_SIZE; ++i) {
+        data[i] = (char)(i * 31 + seed);
+    }
+    return data;
+}
+
+
+// Reads the whole file, then the middle of it again, and checks both
+static void read_file(gfal_plugin_interface* plugin, const char* url, const char* expected)
+{
+    GError* error = NULL;
+    gfal_file_handle fd = plugin->openG(plugin->plugin_data, url, O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+
+    char* data = g_malloc(FILE_SIZE);
+    size_t total = 0;
+    ssize_t n;
+    while ((n = plugin->readG(plugin->plugin_data, fd, data + total, FILE_SIZE - total, &error)) > 0) {
+        total += n;
+    }
+    g_assert(n == 0 && total == FILE_SIZE);
+    g_assert(memcmp(data, expected, FILE_SIZE) == 0);
+
+    g_assert(plugin->lseekG(plugin->plugin_data, fd, 1000, SEEK_SET, &error) == 0);
+    g_assert(plugin->readG(plugin->plugin_data, fd, data, 100, &error) == 100);
+    g_assert(memcmp(data, expected + 1000, 100) == 0);
+
+    g_assert(plugin->closeG(plugin->plugin_data, fd, &error) == 0);
+    g_free(data);
+}
+
+
+// Number of files in the cache
+static int cached_count()
+{
+    int count = 0;
+    GDir* top = g_dir_open(cache_dir, 0, NULL);
+    const char* shard;
+    while (top && (shard = g_dir_read_name(top)) != NULL) {
+        char* shard_path = g_build_filename(cache_dir, shard, NULL);
+        GDir* dir = g_dir_open(shard_path, 0, NULL);
+        while (dir && g_dir_read_name(dir) != NULL) {
+            ++count;
+        }
+        if (dir)
+            g_dir_close(dir);
+        g_free(shard_path);
+    }
+    if (top)
+        g_dir_close(top);
+    return count;
+}
+
+
+void test_cache_hit()
+{
+    char* content = make_content(1);
+    mock_dropbox_put_file(mock, "/conditions.db", content, FILE_SIZE);
+
+    gfal2_context_t context = cache_context();
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    unsigned requests = mock_dropbox_request_count(mock);
+    read_file(&plugin, "dropbox://dropbox.com/conditions.db", content);
+    // Metadata and download
+    g_assert(mock_dropbox_request_count(mock) == requests + 2);
+    free_plugin(context, &plugin);
+    g_assert(cached_count() == 1);
+
+    // Only the metadata for the next process
+    context = cache_context();
+    plugin = mock_dropbox_plugin_new(mock, context);
+    requests = mock_dropbox_request_count(mock);
+    read_file(&plugin, "dropbox://dropbox.com/conditions.db", content);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    // Another content is downloaded again
+    char* other = make_content(2);
+    mock_dropbox_put_file(mock, "/conditions.db", other, FILE_SIZE);
+    requests = mock_dropbox_request_count(mock);
+    read_file(&plugin, "dropbox://dropbox.com/conditions.db", other);
+    g_assert(mock_dropbox_request_count(mock) == requests + 2);
+    g_assert(cached_count() == 2);
+
+    free_plugin(context, &plugin);
+    g_free(content);
+    g_free(other);
+    printf("Cache hit OK\n");
+}
+
+
+void test_cache_evict()
+{
+    gfal2_context_t context = cache_context();
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    // The first content is the least recently used, so it goes
+    char* content = make_content(3);
+    mock_dropbox_put_file(mock, "/config.json", content, FILE_SIZE);
+    read_file(&plugin, "dropbox://dropbox.com/config.json", content);
+    g_assert(cached_count() == 2);
+
+    char* first = make_content(1);
+    mock_dropbox_put_file(mock, "/first", first, FILE_SIZE);
+    unsigned requests = mock_dropbox_request_count(mock);
+    read_file(&plugin, "dropbox://dropbox.com/first", first);
+    g_assert(mock_dropbox_request_count(mock) == requests + 2);
+
+    free_plugin(context, &plugin);
+    g_free(content);
+    g_free(first);
+    printf("Cache evict OK\n");
+}
+
+
+typedef struct {
+    const char* expected;
+} ReadArgs;
+
+
+static gpointer read_thread(gpointer data)
+{
+    ReadArgs* args = (ReadArgs*)data;
+    gfal2_context_t context = cache_context();
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    read_file(&plugin, "dropbox://dropbox.com/popular", args->expected);
+    free_plugin(context, &plugin);
+    return NULL;
+}
+
+
+void test_cache_concurrent()
+{
+    char* content = make_content(4);
+    mock_dropbox_put_file(mock, "/popular", content, FILE_SIZE);
+
+    // All of them get the metadata, only one downloads
+    GThread* threads[4];
+    ReadArgs args = {content};
+    unsigned requests = mock_dropbox_request_count(mock);
+    int i;
+    for (i = 0; i < 4; ++i) {
+        threads[i] = g_thread_new("read", read_thread, &args);
+    }
+    for (i = 0; i < 4; ++i) {
+        g_thread_join(threads[i]);
+    }
+    g_assert(mock_dropbox_request_count(mock) == requests + 4 + 1);
+
+    g_free(content);
+    printf("Cache concurrent OK\n");
+}
+
+
+// Reads are served while the file is downloaded into the cache
+void test_cache_first_byte()
+{
+    const size_t size = 4 * 1024 * 1024;
+    MockDropboxConfig config;
+    memset(&config, 0, sizeof(config));
+    // Two seconds for the whole file
+    config.bandwidth = size / 2;
+    MockDropbox* slow = mock_dropbox_start(&config);
+    char* content = g_malloc(size);
+    size_t i;
+    for (i = 0; i < size; ++i) {
+        content[i] = (char)(i * 13 + i / 4096);
+    }
+    mock_dropbox_put_file(slow, "/large", content, size);
+
+    gfal2_context_t context = cache_context();
+    gfal2_set_opt_integer(context, "DROPBOX", "CACHE_SIZE", size * 2, NULL);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(slow, context);
+    int cached = cached_count();
+
+    // Closed half way, nothing is kept
+    GError* error = NULL;
+    char* data = g_malloc(size);
+    gfal_file_handle fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/large", O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+    g_assert(plugin.readG(plugin.plugin_data, fd, data, 4096, &error) > 0);
+    g_assert(plugin.closeG(plugin.plugin_data, fd, &error) == 0);
+    g_assert(cached_count() == cached);
+
+    fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/large", O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+    gint64 start = g_get_monotonic_time();
+    ssize_t n = plugin.readG(plugin.plugin_data, fd, data, size, &error);
+    g_assert(n > 0 && (size_t)n < size);
+    g_assert(g_get_monotonic_time() - start < G_USEC_PER_SEC);
+    size_t total = n;
+    while ((n = plugin.readG(plugin.plugin_data, fd, data + total, size - total, &error)) > 0) {
+        total += n;
+    }
+    g_assert(n == 0 && total == size);
+    g_assert(memcmp(data, content, size) == 0);
+    g_assert(plugin.closeG(plugin.plugin_data, fd, &error) == 0);
+    g_assert(cached_count() == cached + 1);
+    free_plugin(context, &plugin);
+
+    // Then served from the cache
+    context = cache_context();
+    gfal2_set_opt_integer(context, "DROPBOX", "CACHE_SIZE", size * 2, NULL);
+    plugin = mock_dropbox_plugin_new(slow, context);
+    unsigned requests = mock_dropbox_request_count(slow);
+    fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/large", O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+    g_assert(plugin.readG(plugin.plugin_data, fd, data, size, &error) == (ssize_t)size);
+    g_assert(memcmp(data, content, size) == 0);
+    g_assert(plugin.closeG(plugin.plugin_data, fd, &error) == 0);
+    g_assert(mock_dropbox_request_count(slow) == requests + 1);
+    free_plugin(context, &plugin);
+
+    g_free(data);
+    g_free(content);
+    mock_dropbox_stop(slow);
+    printf("Cache first byte OK\n");
+}
+
+
+static void remove_tree(const char* path)
+{
+    GDir* dir = g_dir_open(path, 0, NULL);
+    const char* name;
+    while (dir && (name = g_dir_read_name(dir)) != NULL) {
+        char* child = g_build_filename(path, name, NULL);
+        remove_tree(child);
+        g_free(child);
+    }
+    if (dir)
+        g_dir_close(dir);
+    remove(path);
+}
+
+
+int main(int argc, char** argv)
+{
+    MockDropboxConfig config;
+    memset(&config, 0, sizeof(config));
+    // Slow enough for the readers to pile up on the download
+    config.rtt_ms = 20;
+    mock = mock_dropbox_start(&config);
+    cache_dir = g_dir_make_tmp("gfal2_dropbox_cache_XXXXXX", NULL);
+
+    test_cache_hit();
+    test_cache_evict();
+    test_cache_concurrent();
+    test_cache_first_byte();
+
+    remove_tree(cache_dir);
+    g_free(cache_dir);
+    mock_dropbox_stop(mock);
+    return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test timeouts and cancellation, against the mock server
+
+#include <fcntl.h>
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mock_dropbox.h"
+
+int gfal2_dropbox_mkdir_bulk(plugin_handle plugin_data, int nbfiles, const char* const* urls, GError** errors);
+
+static MockDropbox* mock;
+
+
+static gpointer cancel_thread(gpointer data)
+{
+    g_usleep(300000);
+    gfal2_cancel((gfal2_context_t)data);
+    return NULL;
+}
+
+
+void test_operation_timeout()
+{
+    GError* error = NULL;
+    gfal2_context_t context = gfal2_context_new(&error);
+    gfal2_set_opt_integer(context, CORE_CONFIG_GROUP, CORE_CONFIG_NAMESPACE_TIMEOUT, 1, NULL);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    mock_dropbox_delay(mock, "/2/files/get_metadata", 5000, 1);
+    gint64 start = g_get_monotonic_time();
+    struct stat st;
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/file", &st, &error) < 0);
+    g_assert(error != NULL && error->code == ETIMEDOUT);
+    g_assert(g_get_monotonic_time() - start < 3 * G_USEC_PER_SEC);
+    g_clear_error(&error);
+
+    // The next one goes through
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/file", &st, &error) == 0);
+
+    // So do the requests sent without going through the metadata ones
+    mock_dropbox_delay(mock, "/2/files/upload_session/start", 5000, 1);
+    start = g_get_monotonic_time();
+    g_assert(plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/upload", O_WRONLY | O_CREAT, 0644, &error) == NULL);
+    g_assert(error != NULL && error->code == ETIMEDOUT);
+    g_assert(g_get_monotonic_time() - start < 3 * G_USEC_PER_SEC);
+    g_clear_error(&error);
+
+    mock_dropbox_delay(mock, "/2/files/create_folder_batch", 5000, 1);
+    const char* urls[] = {"dropbox://dropbox.com/d1", "dropbox://dropbox.com/d2"};
+    GError* errors[2] = {NULL, NULL};
+    start = g_get_monotonic_time();
+    g_assert(gfal2_dropbox_mkdir_bulk(plugin.plugin_data, 2, urls, errors) < 0);
+    g_assert(errors[0] != NULL && errors[0]->code == ETIMEDOUT);
+    g_assert(g_get_monotonic_time() - start < 3 * G_USEC_PER_SEC);
+    g_clear_error(&errors[0]);
+    g_clear_error(&errors[1]);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("Operation timeout OK\n");
+}
+
+
+void test_cancel_stat()
+{
+    GError* error = NULL;
+    gfal2_context_t context = gfal2_context_new(&error);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    mock_dropbox_delay(mock, "/2/files/get_metadata", 5000, 1);
+    GThread* canceler = g_thread_new("cancel", cancel_thread, context);
+    gint64 start = g_get_monotonic_time();
+    struct stat st;
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/file", &st, &error) < 0);
+    g_assert(error != NULL && error->code == ECANCELED);
+    g_assert(g_get_monotonic_time() - start < 3 * G_USEC_PER_SEC);
+    g_clear_error(&error);
+    g_thread_join(canceler);
+
+    // Nothing new is sent once canceled
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/file", &st, &error) < 0);
+    g_assert(error != NULL && error->code == ECANCELED);
+    g_assert(mock_dropbox_request_count(mock) == requests);
+    g_clear_error(&error);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("Cancel stat OK\n");
+}
+
+
+void test_cancel_read()
+{
+    GError* error = NULL;
+    gfal2_context_t context = gfal2_context_new(&error);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    gfal_file_handle fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/file", O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+
+    // The download hangs, and is not retried once canceled
+    mock_dropbox_delay(mock, "/2/files/download", 5000, 1);
+    GThread* canceler = g_thread_new("cancel", cancel_thread, context);
+    gint64 start = g_get_monotonic_time();
+    char buffer[16];
+    g_assert(plugin.readG(plugin.plugin_data, fd, buffer, sizeof(buffer), &error) < 0);
+    g_assert(error != NULL && error->code == ECANCELED);
+    g_assert(g_get_monotonic_time() - start < 3 * G_USEC_PER_SEC);
+    g_clear_error(&error);
+    g_thread_join(canceler);
+
+    plugin.closeG(plugin.plugin_data, fd, &error);
+    g_clear_error(&error);
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("Cancel read OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    MockDropboxConfig config;
+    memset(&config, 0, sizeof(config));
+    mock = mock_dropbox_start(&config);
+    mock_dropbox_put_file(mock, "/file", "some content", 12);
+
+    test_operation_timeout();
+    test_cancel_stat();
+    test_cancel_read();
+
+    mock_dropbox_stop(mock);
+    return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test copies from local files, against the mock server
+
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mock_dropbox.h"
+
+#define FILE_SIZE (5 * 1024 * 1024 + 17)
+
+static MockDropbox* mock;
+static char local_path[] = "/tmp/gfal2_dropbox_copy_XXXXXX";
+static char* local_url;
+
+
+static char* write_local(int seed)
+{
+    char* data = g_malloc(FILE_SIZE);
+    int i;
+    for (i = 0; i < FILE_SIZE; ++i) {
+        data[i] = (char)(i * 7 + seed);
+    }
+    g_assert(g_file_set_contents(local_path, data, FILE_SIZE, NULL));
+    return data;
+}
+
+
+static void check_remote(const char* path, const char* expected)
+{
+    void* data;
+    size_t size;
+    g_assert(mock_dropbox_get_file(mock, path, &data, &size));
+    g_assert(size == FILE_SIZE);
+    g_assert(memcmp(data, expected, size) == 0);
+    g_free(data);
+}
+
+
+void test_copy_claims(gfal_plugin_interface* plugin, gfal2_context_t context)
+{
+    g_assert(plugin->check_plugin_url_transfer(plugin->plugin_data, context,
+        local_url, "dropbox://dropbox.com/results.root", GFAL_FILE_COPY));
+    g_assert(!plugin->check_plugin_url_transfer(plugin->plugin_data, context,
+        "https://example.com/results.root", "dropbox://dropbox.com/results.root", GFAL_FILE_COPY));
+    g_assert(!plugin->check_plugin_url_transfer(plugin->plugin_data, context,
+        "dropbox://dropbox.com/results.root", local_url, GFAL_FILE_COPY));
+    printf("Copy claims OK\n");
+}
+
+
+void test_copy_skip(gfal_plugin_interface* plugin, gfal2_context_t context)
+{
+    GError* error = NULL;
+    gfalt_params_t params = gfalt_params_handle_new(NULL);
+    char* data = write_local(1);
+
+    g_assert(plugin->copy_file(plugin->plugin_data, context, params,
+        local_url, "dropbox://dropbox.com/results.root", &error) == 0);
+    g_assert(error == NULL);
+    check_remote("/results.root", data);
+
+    // Once there, a copy costs the metadata only
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(plugin->copy_file(plugin->plugin_data, context, params,
+        local_url, "dropbox://dropbox.com/results.root", &error) == 0);
+    g_assert(error == NULL);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    gfalt_params_handle_delete(params, NULL);
+    g_free(data);
+    printf("Copy skip OK\n");
+}
+
+
+void test_copy_changed(gfal_plugin_interface* plugin, gfal2_context_t context)
+{
+    GError* error = NULL;
+    gfalt_params_t params = gfalt_params_handle_new(NULL);
+    char* previous = write_local(1);
+    char* data = write_local(2);
+
+    // Same size, another content
+    g_assert(plugin->copy_file(plugin->plugin_data, context, params,
+        local_url, "dropbox://dropbox.com/results.root", &error) < 0);
+    g_assert(error != NULL && error->code == EEXIST);
+    g_clear_error(&error);
+    check_remote("/results.root", previous);
+
+    // A replacement that fails leaves the previous content in place
+    gfalt_set_replace_existing_file(params, TRUE, NULL);
+    mock_dropbox_fail(mock, "/2/files/upload_session/finish", 409, 1);
+    g_assert(plugin->copy_file(plugin->plugin_data, context, params,
+        local_url, "dropbox://dropbox.com/results.root", &error) < 0);
+    g_assert(error != NULL);
+    g_clear_error(&error);
+    check_remote("/results.root", previous);
+
+    g_assert(plugin->copy_file(plugin->plugin_data, context, params,
+        local_url, "dropbox://dropbox.com/results.root", &error) == 0);
+    g_assert(error == NULL);
+    check_remote("/results.root", data);
+
+    gfalt_params_handle_delete(params, NULL);
+    g_free(previous);
+    g_free(data);
+    printf("Copy changed OK\n");
+}
+
+
+typedef struct {
+    int markers;
+    size_t last_bytes;
+    int transfer_enter, transfer_exit;
+} Monitored;
+
+
+static void monitor_callback(gfalt_transfer_status_t status, const char* src, const char* dst, gpointer data)
+{
+    Monitored* monitored = (Monitored*)data;
+    ++monitored->markers;
+    monitored->last_bytes = gfalt_copy_get_bytes_transferred(status, NULL);
+    g_assert(gfalt_copy_get_average_baudrate(status, NULL) > 0);
+}
+
+
+static void event_callback(const gfalt_event_t event, gpointer data)
+{
+    Monitored* monitored = (Monitored*)data;
+    if (event->stage == GFAL_EVENT_TRANSFER_ENTER)
+        ++monitored->transfer_enter;
+    else if (event->stage == GFAL_EVENT_TRANSFER_EXIT)
+        ++monitored->transfer_exit;
+}
+
+
+void test_copy_markers(gfal_plugin_interface* plugin, gfal2_context_t context)
+{
+    GError* error = NULL;
+    gfalt_params_t params = gfalt_params_handle_new(NULL);
+    Monitored monitored;
+    memset(&monitored, 0, sizeof(monitored));
+    gfalt_add_monitor_callback(params, monitor_callback, &monitored, NULL, NULL);
+    gfalt_add_event_callback(params, event_callback, &monitored, NULL, NULL);
+    char* data = write_local(3);
+
+    // The last marker has the totals
+    g_assert(plugin->copy_file(plugin->plugin_data, context, params,
+        local_url, "dropbox://dropbox.com/monitored.root", &error) == 0);
+    g_assert(monitored.markers >= 1);
+    g_assert(monitored.last_bytes == FILE_SIZE);
+    g_assert(monitored.transfer_enter == 1 && monitored.transfer_exit == 1);
+
+    // Nothing transferred, but still over
+    memset(&monitored, 0, sizeof(monitored));
+    g_assert(plugin->copy_file(plugin->plugin_data, context, params,
+        local_url, "dropbox://dropbox.com/monitored.root", &error) == 0);
+    g_assert(monitored.markers == 0);
+    g_assert(monitored.transfer_enter == 0 && monitored.transfer_exit == 1);
+
+    gfalt_params_handle_delete(params, NULL);
+    g_free(data);
+    printf("Copy markers OK\n");
+}
+
+
+void test_copy_disabled()
+{
+    // Without the option, copies are left to gfal2
+    gfal2_context_t context = gfal2_context_new(NULL);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    g_assert(!plugin.check_plugin_url_transfer(plugin.plugin_data, context,
+        local_url, "dropbox://dropbox.com/results.root", GFAL_FILE_COPY));
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("Copy disabled OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    MockDropboxConfig config;
+    memset(&config, 0, sizeof(config));
+    mock = mock_dropbox_start(&config);
+
+    int fd = mkstemp(local_path);
+    g_assert(fd >= 0);
+    close(fd);
+    local_url = g_strconcat("file://", local_path, NULL);
+
+    gfal2_context_t context = gfal2_context_new(NULL);
+    gfal2_set_opt_boolean(context, "DROPBOX", "SKIP_IDENTICAL", TRUE, NULL);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    test_copy_claims(&plugin, context);
+    test_copy_skip(&plugin, context);
+    test_copy_changed(&plugin, context);
+    test_copy_markers(&plugin, context);
+    test_copy_disabled();
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    unlink(local_path);
+    g_free(local_url);
+    mock_dropbox_stop(mock);
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the directory listings, against the mock server
+
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mock_dropbox.h"
+
+#define FILE_COUNT 12
+#define PAGE_SIZE 5
+
+static MockDropbox* mock;
+
+
+// Every page is read, one request each
+void test_list_pages()
+{
+    GError* error = NULL;
+    gfal2_context_t context = gfal2_context_new(&error);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    unsigned requests = mock_dropbox_request_count(mock);
+    gfal_file_handle dir = plugin.opendirG(plugin.plugin_data, "dropbox://dropbox.com/folder", &error);
+    g_assert(dir != NULL);
+
+    gboolean seen[FILE_COUNT] = {FALSE};
+    gboolean seen_sub = FALSE;
+    int count = 0;
+    struct dirent* entry;
+    struct stat st;
+    while ((entry = plugin.readdirppG(plugin.plugin_data, dir, &st, &error)) != NULL) {
+        int i;
+        if (strcmp(entry->d_name, "sub") == 0) {
+            g_assert(S_ISDIR(st.st_mode));
+            seen_sub = TRUE;
+        }
+        else {
+            g_assert(sscanf(entry->d_name, "Fichier é %d", &i) == 1 && i >= 0 && i < FILE_COUNT);
+            g_assert(!S_ISDIR(st.st_mode));
+            g_assert(st.st_size == i);
+            g_assert(!seen[i]);
+            seen[i] = TRUE;
+        }
+        ++count;
+    }
+    g_assert(error == NULL);
+    g_assert(count == FILE_COUNT + 1 && seen_sub);
+    g_assert(mock_dropbox_request_count(mock) - requests == (FILE_COUNT + 1 + PAGE_SIZE - 1) / PAGE_SIZE);
+
+    // Done is done
+    g_assert(plugin.readdirppG(plugin.plugin_data, dir, &st, &error) == NULL && error == NULL);
+    g_assert(plugin.closedirG(plugin.plugin_data, dir, &error) == 0);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("List pages OK\n");
+}
+
+
+void test_list_failure()
+{
+    GError* error = NULL;
+    gfal2_context_t context = gfal2_context_new(&error);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    gfal_file_handle dir = plugin.opendirG(plugin.plugin_data, "dropbox://dropbox.com/folder", &error);
+    g_assert(dir != NULL);
+
+    // Past the first page, the next one fails
+    mock_dropbox_fail(mock, "/2/files/list_folder/continue", 409, 1);
+    struct stat st;
+    int count = 0;
+    while (plugin.readdirppG(plugin.plugin_data, dir, &st, &error) != NULL)
+        ++count;
+    g_assert(count == PAGE_SIZE);
+    g_assert(error != NULL);
+    g_clear_error(&error);
+    g_assert(plugin.closedirG(plugin.plugin_data, dir, &error) == 0);
+
+    // Missing folders are reported by opendir
+    g_assert(plugin.opendirG(plugin.plugin_data, "dropbox://dropbox.com/missing", &error) == NULL);
+    g_assert(error != NULL && error->code == ENOENT);
+    g_clear_error(&error);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("List failure OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    MockDropboxConfig config;
+    memset(&config, 0, sizeof(config));
+    config.list_page_size = PAGE_SIZE;
+    mock = mock_dropbox_start(&config);
+
+    char data[FILE_COUNT] = {0};
+    int i;
+    for (i = 0; i < FILE_COUNT; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "/folder/Fichier é %d", i);
+        mock_dropbox_put_file(mock, path, data, i);
+    }
+    mock_dropbox_put_folder(mock, "/folder/sub");
+
+    test_list_pages();
+    test_list_failure();
+
+    mock_dropbox_stop(mock);
+    return 0;
+}
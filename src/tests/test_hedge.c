@@ -0,0 +1,154 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the hedged metadata requests, against the mock server
+
+#include "../gfal_dropbox_hedge.h"
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mock_dropbox.h"
+
+static MockDropbox* mock;
+
+
+static gfal2_context_t hedge_context(int budget)
+{
+    gfal2_context_t context = gfal2_context_new(NULL);
+    gfal2_set_opt_boolean(context, "DROPBOX", "HEDGE", TRUE, NULL);
+    gfal2_set_opt_integer(context, "DROPBOX", "HEDGE_DELAY", 50, NULL);
+    gfal2_set_opt_integer(context, "DROPBOX", "HEDGE_BUDGET", budget, NULL);
+    return context;
+}
+
+
+void test_hedge_delay()
+{
+    DropboxHedge* hedge = gfal2_dropbox_hedge_new(90, 100, 5);
+    g_assert(gfal2_dropbox_hedge_delay(hedge) == 100000);
+
+    // 90th percentile of 1..100 ms
+    int i;
+    for (i = 1; i <= 100; ++i) {
+        gfal2_dropbox_hedge_record(hedge, i * 1000);
+    }
+    g_assert(gfal2_dropbox_hedge_delay(hedge) >= 85000 && gfal2_dropbox_hedge_delay(hedge) <= 95000);
+
+    g_assert(gfal2_dropbox_hedge_idempotent("https://api.dropboxapi.com/2/files/get_metadata"));
+    g_assert(gfal2_dropbox_hedge_idempotent("https://api.dropboxapi.com/2/files/list_folder/continue"));
+    g_assert(!gfal2_dropbox_hedge_idempotent("https://api.dropboxapi.com/2/files/delete_v2"));
+
+    gfal2_dropbox_hedge_free(hedge);
+    printf("Hedge delay OK\n");
+}
+
+
+void test_hedge_budget()
+{
+    DropboxHedge* hedge = gfal2_dropbox_hedge_new(95, 100, 10);
+    // One to start with, then one every ten requests
+    g_assert(gfal2_dropbox_hedge_acquire(hedge));
+    g_assert(!gfal2_dropbox_hedge_acquire(hedge));
+    int i;
+    for (i = 0; i < 10; ++i) {
+        gfal2_dropbox_hedge_record(hedge, 1000);
+    }
+    g_assert(gfal2_dropbox_hedge_acquire(hedge));
+    g_assert(!gfal2_dropbox_hedge_acquire(hedge));
+    gfal2_dropbox_hedge_free(hedge);
+    printf("Hedge budget OK\n");
+}
+
+
+void test_hedge_slow_stat()
+{
+    GError* error = NULL;
+    gfal2_context_t context = hedge_context(5);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    mock_dropbox_put_file(mock, "/data/file.root", "content", 7);
+
+    // The first copy hangs, the duplicate answers
+    mock_dropbox_delay(mock, "/2/files/get_metadata", 5000, 1);
+    unsigned requests = mock_dropbox_request_count(mock);
+    gint64 start = g_get_monotonic_time();
+    struct stat st;
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/data/file.root", &st, &error) == 0);
+    g_assert(error == NULL);
+    g_assert(st.st_size == 7);
+    g_assert(g_get_monotonic_time() - start < 2 * G_USEC_PER_SEC);
+    g_assert(mock_dropbox_request_count(mock) == requests + 2);
+
+    // Answers from the duplicate are the same, errors included
+    mock_dropbox_delay(mock, "/2/files/get_metadata", 5000, 1);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/data/missing", &st, &error) < 0);
+    g_assert(error != NULL && error->code == ENOENT);
+    g_clear_error(&error);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("Hedge slow stat OK\n");
+}
+
+
+void test_hedge_exhausted()
+{
+    GError* error = NULL;
+    gfal2_context_t context = hedge_context(0);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    mock_dropbox_put_file(mock, "/data/file.root", "content", 7);
+    struct stat st;
+
+    // Uses up the only duplicate
+    mock_dropbox_delay(mock, "/2/files/get_metadata", 500, 1);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/data/file.root", &st, &error) == 0);
+
+    // No budget left, so this one waits
+    mock_dropbox_delay(mock, "/2/files/get_metadata", 500, 1);
+    unsigned requests = mock_dropbox_request_count(mock);
+    gint64 start = g_get_monotonic_time();
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/data/file.root", &st, &error) == 0);
+    g_assert(g_get_monotonic_time() - start >= 500000);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    // Nor are writes ever sent twice
+    mock_dropbox_delay(mock, "/2/files/create_folder_v2", 200, 1);
+    requests = mock_dropbox_request_count(mock);
+    g_assert(plugin.mkdirpG(plugin.plugin_data, "dropbox://dropbox.com/data/new", 0755, FALSE, &error) == 0);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("Hedge exhausted OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    MockDropboxConfig config;
+    memset(&config, 0, sizeof(config));
+    mock = mock_dropbox_start(&config);
+
+    test_hedge_delay();
+    test_hedge_budget();
+    test_hedge_slow_stat();
+    test_hedge_exhausted();
+
+    mock_dropbox_stop(mock);
+    return 0;
+}
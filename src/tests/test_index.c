@@ -0,0 +1,343 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the metadata index, against the mock server
+// Each context stands for a new process
+
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mock_dropbox.h"
+
+#define FILE_COUNT 10
+
+static MockDropbox* mock;
+static char* index_file;
+
+
+static gfal2_context_t index_context()
+{
+    gfal2_context_t context = gfal2_context_new(NULL);
+    gfal2_set_opt_string(context, "DROPBOX", "INDEX_FILE", index_file, NULL);
+    gfal2_set_opt_integer(context, "DROPBOX", "INDEX_SLOTS", 1024, NULL);
+    // Long enough not to be hit by a slow run
+    gfal2_set_opt_integer(context, "DROPBOX", "INDEX_MAX_AGE", 3600, NULL);
+    return context;
+}
+
+
+static void free_plugin(gfal2_context_t context, gfal_plugin_interface* plugin)
+{
+    plugin->plugin_delete(plugin->plugin_data);
+    gfal2_context_free(context);
+}
+
+
+// Returns how many entries the folder has, checking their sizes
+static int list_folder(gfal_plugin_interface* plugin, const char* url)
+{
+    GError* error = NULL;
+    gfal_file_handle dir = plugin->opendirG(plugin->plugin_data, url, &error);
+    g_assert(dir != NULL);
+
+    int count = 0;
+    struct dirent* entry;
+    struct stat st;
+    while ((entry = plugin->readdirppG(plugin->plugin_data, dir, &st, &error)) != NULL) {
+        int i;
+        if (sscanf(entry->d_name, "file%d", &i) == 1) {
+            g_assert(st.st_size == i && !S_ISDIR(st.st_mode));
+        }
+        ++count;
+    }
+    g_assert(error == NULL);
+    plugin->closedirG(plugin->plugin_data, dir, &error);
+    return count;
+}
+
+
+void test_index_stat()
+{
+    gfal2_context_t context = index_context();
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    GError* error = NULL;
+    struct stat st;
+
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/dir/file3", &st, &error) == 0);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+    free_plugin(context, &plugin);
+
+    // Another process finds it there
+    context = index_context();
+    plugin = mock_dropbox_plugin_new(mock, context);
+    requests = mock_dropbox_request_count(mock);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/DIR/File3", &st, &error) == 0);
+    g_assert(st.st_size == 3 && !S_ISDIR(st.st_mode));
+    g_assert(mock_dropbox_request_count(mock) == requests);
+
+    // The folder has not been listed, so nothing can be told about the rest
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/dir/missing", &st, &error) < 0);
+    g_assert(error->code == ENOENT);
+    g_clear_error(&error);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    free_plugin(context, &plugin);
+    printf("Index stat OK\n");
+}
+
+
+void test_index_list()
+{
+    gfal2_context_t context = index_context();
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    GError* error = NULL;
+    struct stat st;
+
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(list_folder(&plugin, "dropbox://dropbox.com/dir") == FILE_COUNT);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+    free_plugin(context, &plugin);
+
+    context = index_context();
+    plugin = mock_dropbox_plugin_new(mock, context);
+    requests = mock_dropbox_request_count(mock);
+    g_assert(list_folder(&plugin, "dropbox://dropbox.com/dir") == FILE_COUNT);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/dir/file7", &st, &error) == 0);
+    g_assert(st.st_size == 7);
+    // Listed, so a missing entry does not exist
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/dir/missing", &st, &error) < 0);
+    g_assert(error->code == ENOENT);
+    g_clear_error(&error);
+    g_assert(mock_dropbox_request_count(mock) == requests);
+
+    free_plugin(context, &plugin);
+    printf("Index list OK\n");
+}
+
+
+// A name made of count times the same character
+static char* long_name(const char* character, int count)
+{
+    GString* name = g_string_new(NULL);
+    int i;
+    for (i = 0; i < count; ++i)
+        g_string_append(name, character);
+    return g_string_free(name, FALSE);
+}
+
+
+void test_index_long_names()
+{
+    gfal2_context_t context = index_context();
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    GError* error = NULL;
+    struct stat st;
+    char* long_utf8 = long_name("\xc3\xa9", 200);
+    char* too_long = long_name("\xe2\x82\xac", 200);
+    char path[1024], url[1024];
+
+    snprintf(path, sizeof(path), "/long/%s", long_utf8);
+    mock_dropbox_put_file(mock, path, "", 0);
+    snprintf(path, sizeof(path), "/long/%s", too_long);
+    mock_dropbox_put_file(mock, path, "", 0);
+
+    // The second one has a path too long for the index
+    g_assert(list_folder(&plugin, "dropbox://dropbox.com/long") == 2);
+    free_plugin(context, &plugin);
+
+    // An entry did not fit, so the folder is not answered for by the index
+    context = index_context();
+    plugin = mock_dropbox_plugin_new(mock, context);
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(list_folder(&plugin, "dropbox://dropbox.com/long") == 2);
+    g_assert(mock_dropbox_request_count(mock) > requests);
+    snprintf(url, sizeof(url), "dropbox://dropbox.com/long/%s", too_long);
+    g_assert(plugin.statG(plugin.plugin_data, url, &st, &error) == 0);
+    snprintf(url, sizeof(url), "dropbox://dropbox.com/long/%s", long_utf8);
+    g_assert(plugin.statG(plugin.plugin_data, url, &st, &error) == 0);
+    g_assert(error == NULL);
+
+    free_plugin(context, &plugin);
+    g_free(long_utf8);
+    g_free(too_long);
+    printf("Index long names OK\n");
+}
+
+
+void test_index_refresh()
+{
+    gfal2_context_t context = index_context();
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    gfal2_context_t other_context = index_context();
+    gfal_plugin_interface other = mock_dropbox_plugin_new(mock, other_context);
+    GError* error = NULL;
+    struct stat st;
+
+    // Changed by someone else, unknown to the index
+    char data[32] = {0};
+    mock_dropbox_put_file(mock, "/dir/new", data, sizeof(data));
+
+    // Changed through the plugin, so the listing has to be refreshed
+    g_assert(plugin.unlinkG(plugin.plugin_data, "dropbox://dropbox.com/dir/file0", &error) == 0);
+
+    // Both are picked up from the cursor, with a single request
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(list_folder(&other, "dropbox://dropbox.com/dir") == FILE_COUNT);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    requests = mock_dropbox_request_count(mock);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/dir/new", &st, &error) == 0);
+    g_assert(st.st_size == sizeof(data));
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/dir/file0", &st, &error) < 0);
+    g_assert(error->code == ENOENT);
+    g_clear_error(&error);
+    g_assert(mock_dropbox_request_count(mock) == requests);
+
+    // Renaming a folder forgets what was below
+    g_assert(plugin.renameG(plugin.plugin_data, "dropbox://dropbox.com/dir",
+        "dropbox://dropbox.com/moved", &error) == 0);
+    g_assert(other.statG(other.plugin_data, "dropbox://dropbox.com/dir/file1", &st, &error) < 0);
+    g_assert(error->code == ENOENT);
+    g_clear_error(&error);
+    g_assert(other.statG(other.plugin_data, "dropbox://dropbox.com/moved/file1", &st, &error) == 0);
+    g_assert(st.st_size == 1);
+
+    free_plugin(other_context, &other);
+    free_plugin(context, &plugin);
+    printf("Index refresh OK\n");
+}
+
+
+void test_index_forget_below()
+{
+    gfal2_context_t context = index_context();
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    GError* error = NULL;
+    struct stat st;
+
+    // Stat'ed without any of the folders above being listed
+    mock_dropbox_put_file(mock, "/deep/a/b/file", "data", 4);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/deep/a/b/file", &st, &error) == 0);
+
+    // Still forgotten along with them
+    g_assert(plugin.renameG(plugin.plugin_data, "dropbox://dropbox.com/deep",
+        "dropbox://dropbox.com/deeper", &error) == 0);
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/deep/a/b/file", &st, &error) < 0);
+    g_assert(error->code == ENOENT);
+    g_clear_error(&error);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    free_plugin(context, &plugin);
+    printf("Index forget below OK\n");
+}
+
+
+// More entries than the index can take, half of its 1024 slots
+#define LARGE_COUNT 500
+#define LARGE_PAGE_SIZE 100
+
+void test_index_large()
+{
+    MockDropboxConfig config;
+    memset(&config, 0, sizeof(config));
+    config.list_page_size = LARGE_PAGE_SIZE;
+    MockDropbox* paged = mock_dropbox_start(&config);
+    int i;
+    for (i = 0; i < LARGE_COUNT; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "/large/entry%d", i);
+        mock_dropbox_put_file(paged, path, "", 0);
+    }
+    const unsigned pages = LARGE_COUNT / LARGE_PAGE_SIZE;
+
+    // The pages fetched for the index are not fetched again
+    gfal2_context_t context = index_context();
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(paged, context);
+    unsigned requests = mock_dropbox_request_count(paged);
+    g_assert(list_folder(&plugin, "dropbox://dropbox.com/large") == LARGE_COUNT);
+    g_assert(mock_dropbox_request_count(paged) == requests + pages);
+    free_plugin(context, &plugin);
+
+    // Nor tried for the index by the next process
+    context = index_context();
+    plugin = mock_dropbox_plugin_new(paged, context);
+    requests = mock_dropbox_request_count(paged);
+    g_assert(list_folder(&plugin, "dropbox://dropbox.com/large") == LARGE_COUNT);
+    g_assert(mock_dropbox_request_count(paged) == requests + pages);
+    free_plugin(context, &plugin);
+
+    mock_dropbox_stop(paged);
+    printf("Index large OK\n");
+}
+
+
+void test_index_format()
+{
+    // Anything else is started over
+    g_assert(g_file_set_contents(index_file, "not an index", -1, NULL));
+
+    gfal2_context_t context = index_context();
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    GError* error = NULL;
+    struct stat st;
+
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/moved/file2", &st, &error) == 0);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/moved/file2", &st, &error) == 0);
+    g_assert(st.st_size == 2);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    free_plugin(context, &plugin);
+    printf("Index format OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    mock = mock_dropbox_start(NULL);
+    char* dir = g_dir_make_tmp("gfal2_dropbox_index_XXXXXX", NULL);
+    index_file = g_build_filename(dir, "index", NULL);
+
+    char data[FILE_COUNT] = {0};
+    int i;
+    for (i = 0; i < FILE_COUNT; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "/dir/file%d", i);
+        mock_dropbox_put_file(mock, path, data, i);
+    }
+
+    test_index_stat();
+    test_index_list();
+    test_index_long_names();
+    test_index_refresh();
+    test_index_forget_below();
+    test_index_large();
+    test_index_format();
+
+    unlink(index_file);
+    rmdir(dir);
+    g_free(index_file);
+    g_free(dir);
+    mock_dropbox_stop(mock);
+    return 0;
+}
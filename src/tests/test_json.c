@@ -0,0 +1,107 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the JSON encoder of the request arguments
+
+#include "../gfal_dropbox_json.h"
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "test_help.h"
+
+
+void test_json_shape()
+{
+    DropboxBuffer buffer = {0};
+    DropboxJsonWriter writer;
+    gfal2_dropbox_json_init(&writer, &buffer, FALSE);
+    gfal2_dropbox_json_begin(&writer, NULL);
+    gfal2_dropbox_json_begin(&writer, "cursor");
+    gfal2_dropbox_json_string(&writer, "session_id", "abc");
+    gfal2_dropbox_json_int64(&writer, "offset", 4294967296LL);
+    gfal2_dropbox_json_end(&writer);
+    gfal2_dropbox_json_begin(&writer, "commit");
+    gfal2_dropbox_json_end(&writer);
+    gfal2_dropbox_json_string(&writer, "mode", "add");
+    gfal2_dropbox_json_end(&writer);
+
+    ASSERT_STR_EQ("{\"cursor\":{\"session_id\":\"abc\",\"offset\":4294967296},\"commit\":{},\"mode\":\"add\"}",
+        buffer.data);
+
+    // Whatever it writes must parse back
+    json_object* root = gfal2_dropbox_buffer_json(&buffer);
+    g_assert(root != NULL);
+    json_object_put(root);
+
+    g_free(buffer.data);
+    printf("JSON shape OK\n");
+}
+
+
+void test_json_escape()
+{
+    DropboxBuffer buffer = {0};
+    DropboxJsonWriter writer;
+    const char* value = "/a \"b\"\\c\n\t\x01\x7f/\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80";
+
+    // In a body, UTF-8 goes as it is
+    gfal2_dropbox_json_init(&writer, &buffer, FALSE);
+    gfal2_dropbox_json_begin(&writer, NULL);
+    gfal2_dropbox_json_string(&writer, "path", value);
+    gfal2_dropbox_json_end(&writer);
+    ASSERT_STR_EQ("{\"path\":\"/a \\\"b\\\"\\\\c\\n\\t\\u0001\x7f/\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\"}",
+        buffer.data);
+
+    json_object* root = gfal2_dropbox_buffer_json(&buffer);
+    json_object* path = NULL;
+    g_assert(root != NULL && json_object_object_get_ex(root, "path", &path));
+    ASSERT_STR_EQ(value, json_object_get_string(path));
+    json_object_put(root);
+
+    // In a header, only printable ASCII
+    gfal2_dropbox_buffer_reset(&buffer);
+    gfal2_dropbox_json_init(&writer, &buffer, TRUE);
+    gfal2_dropbox_json_begin(&writer, NULL);
+    gfal2_dropbox_json_string(&writer, "path", value);
+    gfal2_dropbox_json_end(&writer);
+    ASSERT_STR_EQ("{\"path\":\"/a \\\"b\\\"\\\\c\\n\\t\\u0001\\u007f/\\u00e9\\u20ac\\ud83d\\ude00\"}",
+        buffer.data);
+
+    root = gfal2_dropbox_buffer_json(&buffer);
+    g_assert(root != NULL && json_object_object_get_ex(root, "path", &path));
+    ASSERT_STR_EQ(value, json_object_get_string(path));
+    json_object_put(root);
+
+    // Not UTF-8
+    gfal2_dropbox_buffer_reset(&buffer);
+    gfal2_dropbox_json_init(&writer, &buffer, TRUE);
+    gfal2_dropbox_json_begin(&writer, NULL);
+    gfal2_dropbox_json_string(&writer, "path", "/\xff");
+    gfal2_dropbox_json_end(&writer);
+    ASSERT_STR_EQ("{\"path\":\"/\\ufffd\"}", buffer.data);
+
+    g_free(buffer.data);
+    printf("JSON escape OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    test_json_shape();
+    test_json_escape();
+    return 0;
+}
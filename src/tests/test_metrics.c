@@ -0,0 +1,163 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the metrics, against the mock server
+
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mock_dropbox.h"
+
+static MockDropbox* mock;
+
+
+// Value of the sample with exactly these name and labels, -1 if missing
+static long long metric_value(const char* text, const char* sample)
+{
+    size_t len = strlen(sample);
+    const char* line = text;
+    while (line && *line) {
+        if (strncmp(line, sample, len) == 0 && line[len] == ' ')
+            return atoll(line + len + 1);
+        line = strchr(line, '\n');
+        if (line)
+            ++line;
+    }
+    return -1;
+}
+
+
+static char* get_metrics(gfal_plugin_interface* plugin)
+{
+    GError* error = NULL;
+    ssize_t size = plugin->getxattrG(plugin->plugin_data, "dropbox://dropbox.com/", "dropbox.metrics", NULL, 0, &error);
+    g_assert(size > 0 && error == NULL);
+    // Room for what the size request itself may add
+    char* text = g_malloc0(size + 1024);
+    ssize_t length = plugin->getxattrG(plugin->plugin_data, "dropbox://dropbox.com/", "dropbox.metrics",
+        text, size + 1023, &error);
+    g_assert(length > 0 && error == NULL);
+    return text;
+}
+
+
+void test_counters()
+{
+    GError* error = NULL;
+    gfal2_context_t context = gfal2_context_new(&error);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    g_assert(plugin.check_plugin_url(plugin.plugin_data, "dropbox://dropbox.com/", GFAL_PLUGIN_GETXATTR, NULL));
+
+    struct stat st;
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/file", &st, &error) == 0);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/file", &st, &error) == 0);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/missing", &st, &error) < 0);
+    g_clear_error(&error);
+    mock_dropbox_fail(mock, "/2/files/get_metadata", 500, 1);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/file", &st, &error) < 0);
+    g_clear_error(&error);
+
+    char* text = get_metrics(&plugin);
+    g_assert(metric_value(text, "dropbox_requests_total{endpoint=\"/2/files/get_metadata\",outcome=\"2xx\"}") == 2);
+    g_assert(metric_value(text, "dropbox_requests_total{endpoint=\"/2/files/get_metadata\",outcome=\"409\"}") == 1);
+    g_assert(metric_value(text, "dropbox_requests_total{endpoint=\"/2/files/get_metadata\",outcome=\"5xx\"}") == 1);
+    g_assert(metric_value(text, "dropbox_request_duration_seconds_count{endpoint=\"/2/files/get_metadata\"}") == 4);
+    g_assert(metric_value(text, "dropbox_request_duration_seconds_bucket{endpoint=\"/2/files/get_metadata\",le=\"+Inf\"}") == 4);
+    g_assert(metric_value(text, "dropbox_sent_bytes_total{endpoint=\"/2/files/get_metadata\"}") > 0);
+    g_assert(metric_value(text, "dropbox_received_bytes_total{endpoint=\"/2/files/get_metadata\"}") > 0);
+    g_assert(metric_value(text, "dropbox_stats_total{source=\"request\"}") == 4);
+    g_assert(metric_value(text, "dropbox_active_transfers") == 0);
+    // Endpoints not used are left out
+    g_assert(strstr(text, "/2/files/download") == NULL);
+    g_free(text);
+
+    // Too small a buffer, or an unknown name
+    char small[8];
+    g_assert(plugin.getxattrG(plugin.plugin_data, "dropbox://dropbox.com/", "dropbox.metrics",
+        small, sizeof(small), &error) < 0);
+    g_assert(error != NULL && error->code == ERANGE);
+    g_clear_error(&error);
+    g_assert(plugin.getxattrG(plugin.plugin_data, "dropbox://dropbox.com/", "user.other",
+        small, sizeof(small), &error) < 0);
+    g_assert(error != NULL && error->code == ENODATA);
+    g_clear_error(&error);
+
+    char names[64];
+    ssize_t names_size = plugin.listxattrG(plugin.plugin_data, "dropbox://dropbox.com/", names, sizeof(names), &error);
+    g_assert(names_size == sizeof("dropbox.metrics") && strcmp(names, "dropbox.metrics") == 0);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("Counters OK\n");
+}
+
+
+void test_dump()
+{
+    GError* error = NULL;
+    char* dir = g_dir_make_tmp("gfal2_dropbox_metrics_XXXXXX", NULL);
+    char* path = g_build_filename(dir, "metrics.prom", NULL);
+
+    gfal2_context_t context = gfal2_context_new(&error);
+    gfal2_set_opt_string(context, "DROPBOX", "METRICS_FILE", path, NULL);
+    gfal2_set_opt_integer(context, "DROPBOX", "METRICS_INTERVAL", 1, NULL);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    struct stat st;
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/file", &st, &error) == 0);
+
+    // Written while running
+    char* text = NULL;
+    int i;
+    for (i = 0; i < 30 && !g_file_get_contents(path, &text, NULL, NULL); ++i)
+        g_usleep(100000);
+    g_assert(text != NULL);
+    g_free(text);
+
+    // And once more on the way out
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/file", &st, &error) == 0);
+    plugin.plugin_delete(plugin.plugin_data);
+    g_assert(g_file_get_contents(path, &text, NULL, NULL));
+    g_assert(metric_value(text, "dropbox_requests_total{endpoint=\"/2/files/get_metadata\",outcome=\"2xx\"}") == 2);
+    g_free(text);
+
+    gfal2_context_free(context);
+    unlink(path);
+    rmdir(dir);
+    g_free(path);
+    g_free(dir);
+    printf("Dump OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    MockDropboxConfig config;
+    memset(&config, 0, sizeof(config));
+    mock = mock_dropbox_start(&config);
+    mock_dropbox_put_file(mock, "/file", "some content", 12);
+
+    test_counters();
+    test_dump();
+
+    mock_dropbox_stop(mock);
+    return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the folder creation, single and in bulk, against the mock server
+
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mock_dropbox.h"
+
+gfal_plugin_interface gfal_plugin_init(gfal2_context_t handle, GError** err);
+int gfal2_dropbox_mkdir_bulk(plugin_handle plugin_data, int nbfiles, const char* const* urls, GError** errors);
+
+static MockDropbox* mock;
+static gfal2_context_t context;
+static gfal_plugin_interface plugin;
+
+
+void test_mkdir_recursive()
+{
+    GError* error = NULL;
+    struct stat st;
+
+    // Parents are created along, with a single request
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(plugin.mkdirpG(plugin.plugin_data, "dropbox://dropbox.com/a/b/c/d", 0755, TRUE, &error) == 0);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/a/b", &st, &error) == 0);
+    g_assert(S_ISDIR(st.st_mode));
+
+    // Already there is fine when recursive, still a single request
+    requests = mock_dropbox_request_count(mock);
+    g_assert(plugin.mkdirpG(plugin.plugin_data, "dropbox://dropbox.com/a/b/c/d", 0755, TRUE, &error) == 0);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    printf("Mkdir recursive OK\n");
+}
+
+
+void test_mkdir_exists()
+{
+    GError* error = NULL;
+
+    g_assert(plugin.mkdirpG(plugin.plugin_data, "dropbox://dropbox.com/a/b", 0755, FALSE, &error) < 0);
+    g_assert(error->code == EEXIST);
+    g_clear_error(&error);
+
+    // A file in the way is never fine
+    g_assert(plugin.mkdirpG(plugin.plugin_data, "dropbox://dropbox.com/file", 0755, TRUE, &error) < 0);
+    g_assert(error->code == EEXIST);
+    g_clear_error(&error);
+
+    printf("Mkdir exists OK\n");
+}
+
+
+static void test_mkdir_bulk_count(int count)
+{
+    char** urls = g_new0(char*, count + 3);
+    GError** errors = g_new0(GError*, count + 3);
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        urls[i] = g_strdup_printf("dropbox://dropbox.com/bulk%d/folder%d", count, i);
+    }
+    // A duplicate, differing in case, an existing folder and a file
+    urls[count] = g_strdup_printf("dropbox://dropbox.com/BULK%d/Folder0", count);
+    urls[count + 1] = g_strdup("dropbox://dropbox.com/a/b");
+    urls[count + 2] = g_strdup("dropbox://dropbox.com/file");
+
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(gfal2_dropbox_mkdir_bulk(plugin.plugin_data, count + 3, (const char* const*)urls, errors) < 0);
+    // Bigger batches are checked upon twice
+    g_assert(mock_dropbox_request_count(mock) == requests + (count + 2 > 4 ? 3 : 1));
+
+    for (i = 0; i < count + 2; ++i) {
+        g_assert(errors[i] == NULL);
+    }
+    g_assert(errors[count + 2] != NULL && errors[count + 2]->code == EEXIST);
+
+    for (i = 0; i < count; ++i) {
+        struct stat st;
+        GError* error = NULL;
+        g_assert(plugin.statG(plugin.plugin_data, urls[i], &st, &error) == 0);
+        g_assert(S_ISDIR(st.st_mode));
+    }
+
+    for (i = 0; i < count + 3; ++i) {
+        g_free(urls[i]);
+        g_clear_error(&errors[i]);
+    }
+    g_free(urls);
+    g_free(errors);
+}
+
+
+void test_mkdir_bulk()
+{
+    test_mkdir_bulk_count(1);
+    test_mkdir_bulk_count(100);
+    printf("Mkdir bulk OK\n");
+}
+
+
+// Duplicates of a path that failed fail too, even once its batch is gone
+void test_mkdir_bulk_duplicates()
+{
+    // A full batch, and a few in the next one
+    int count = 10000 + 2;
+    char** urls = g_new0(char*, count);
+    GError** errors = g_new0(GError*, count);
+    int i;
+
+    urls[0] = g_strdup("dropbox://dropbox.com/file");
+    urls[1] = g_strdup("dropbox://dropbox.com/FILE");
+    for (i = 2; i < count; ++i) {
+        urls[i] = g_strdup_printf("dropbox://dropbox.com/many/folder%d", i);
+    }
+
+    g_assert(gfal2_dropbox_mkdir_bulk(plugin.plugin_data, count, (const char* const*)urls, errors) < 0);
+    g_assert(errors[0] != NULL && errors[0]->code == EEXIST);
+    g_assert(errors[1] != NULL && errors[1]->code == EEXIST);
+    for (i = 2; i < count; ++i) {
+        g_assert(errors[i] == NULL);
+    }
+
+    for (i = 0; i < count; ++i) {
+        g_free(urls[i]);
+        g_clear_error(&errors[i]);
+    }
+    g_free(urls);
+    g_free(errors);
+    printf("Mkdir bulk duplicates OK\n");
+}
+
+
+// A batch that never gets done fails once the operation timeout is over
+void test_mkdir_bulk_timeout()
+{
+    MockDropboxConfig config;
+    memset(&config, 0, sizeof(config));
+    config.job_checks = G_MAXINT;
+    MockDropbox* stuck = mock_dropbox_start(&config);
+
+    GError* error = NULL;
+    gfal2_context_t stuck_context = gfal2_context_new(&error);
+    gfal2_set_opt_integer(stuck_context, "DROPBOX", "OPERATION_TIMEOUT", 1, NULL);
+    gfal_plugin_interface stuck_plugin = mock_dropbox_plugin_new(stuck, stuck_context);
+
+    const char* urls[] = {
+        "dropbox://dropbox.com/s1", "dropbox://dropbox.com/s2", "dropbox://dropbox.com/s3",
+        "dropbox://dropbox.com/s4", "dropbox://dropbox.com/s5"
+    };
+    GError* errors[5];
+    gint64 start = g_get_monotonic_time();
+    g_assert(gfal2_dropbox_mkdir_bulk(stuck_plugin.plugin_data, 5, urls, errors) < 0);
+    g_assert(g_get_monotonic_time() - start < 5 * G_USEC_PER_SEC);
+    int i;
+    for (i = 0; i < 5; ++i) {
+        g_assert(errors[i] != NULL && errors[i]->code == ETIMEDOUT);
+        g_clear_error(&errors[i]);
+    }
+
+    stuck_plugin.plugin_delete(stuck_plugin.plugin_data);
+    gfal2_context_free(stuck_context);
+    mock_dropbox_stop(stuck);
+    printf("Mkdir bulk timeout OK\n");
+}
+
+
+void test_mkdir_bulk_invalid()
+{
+    const char* urls[] = {"dropbox://dropbox.com/valid", "invalid"};
+    GError* errors[2];
+
+    g_assert(gfal2_dropbox_mkdir_bulk(plugin.plugin_data, 2, urls, errors) < 0);
+    g_assert(errors[0] == NULL);
+    g_assert(errors[1] != NULL && errors[1]->code == EINVAL);
+    g_clear_error(&errors[1]);
+
+    printf("Mkdir bulk invalid OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    mock = mock_dropbox_start(NULL);
+    mock_dropbox_put_file(mock, "/file", "data", 4);
+
+    context = gfal2_context_new(NULL);
+    plugin = mock_dropbox_plugin_new(mock, context);
+
+    test_mkdir_recursive();
+    test_mkdir_exists();
+    test_mkdir_bulk();
+    test_mkdir_bulk_duplicates();
+    test_mkdir_bulk_timeout();
+    test_mkdir_bulk_invalid();
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    mock_dropbox_stop(mock);
+    return 0;
+}
@@ -145,12 +145,71 @@ void test_twitter_example_url_normalizing()
     printf("Twitter multiple slashes signature OK\n");
 }
 
+// The Twitter example again, with its parameters in the query, signed into the header
+void test_twitter_example_header()
+{
+    OAuth oauth;
+    memset(&oauth, 0, sizeof(oauth));
+    oauth.version = 1;
+    oauth.access_token = "370773112-GmHxMAgYyLbNEtIKZeRNFsMKPR9EyMZeS9weJAEb";
+    oauth.access_token_secret = "LswwdoUaIvS8ltyTt5jkRh4J50vUPVVHtR2YPi5kE";
+    oauth.app_key = "xvz1evFS4wEEPTGEFPHBog";
+    oauth.app_secret = "kAcSOqF21Fu85e7zjz7ZN2U4ZRhfV3WpwPAoE3Z7kBw";
+    oauth.timestamp = "1318622958";
+    oauth.nonce = "kYjzVBB8Y0ZFabxSWbWovY3uYSQ2pTgmZeNu2VS4cg";
+
+    char header[1024];
+    // Twice, the second one with the signing key already computed
+    int i;
+    for (i = 0; i < 2; ++i) {
+        int r = oauth_get_header(header, sizeof(header), &oauth, "POST",
+            "https://api.twitter.com/1/statuses/update.json?include_entities=true"
+            "&status=Hello%20Ladies%20%2B%20Gentlemen%2C%20a%20signed%20OAuth%20request%21");
+        g_assert(r == (int)strlen(header));
+        g_assert(0 == strcmp(
+            "Authorization: OAuth oauth_consumer_key=\"xvz1evFS4wEEPTGEFPHBog\", "
+            "oauth_nonce=\"kYjzVBB8Y0ZFabxSWbWovY3uYSQ2pTgmZeNu2VS4cg\", "
+            "oauth_signature=\"tnnArxj06cWHq44gCs1OSKk%2FjLY%3D\", "
+            "oauth_signature_method=\"HMAC-SHA1\", oauth_timestamp=\"1318622958\", "
+            "oauth_token=\"370773112-GmHxMAgYyLbNEtIKZeRNFsMKPR9EyMZeS9weJAEb\", "
+            "oauth_version=\"1.0\"", header));
+    }
+
+    // Too small a buffer
+    g_assert(oauth_get_header(header, 64, &oauth, "POST", "https://api.twitter.com/1/statuses/update.json") < 0);
+
+    printf("Twitter header OK\n");
+}
+
+// Escaping of multi-byte characters and unreserved characters
+void test_escaping()
+{
+    OAuth oauth;
+    memset(&oauth, 0, sizeof(oauth));
+    oauth.access_token = "token";
+    oauth.app_key = "key";
+    oauth.nonce = "1*2";
+    oauth.timestamp = "1";
+
+    char params_buffer[1024] = {0};
+    oauth_normalized_parameters(params_buffer, sizeof(params_buffer), &oauth, 2,
+            "path", "/Données/a~b-c_d.e f", "path", "/a");
+
+    g_assert(0 == strcmp(
+            "oauth_consumer_key=key&oauth_nonce=1%2A2&oauth_signature_method=HMAC-SHA1&oauth_timestamp=1"
+            "&oauth_token=token&oauth_version=1.0&path=%2FDonn%C3%A9es%2Fa~b-c_d.e%20f&path=%2Fa", params_buffer));
+
+    printf("Escaping OK\n");
+}
+
 // Main
 int main(int argc, char **argv)
 {
     test_oauth_example();
     test_twitter_example();
     test_twitter_example_url_normalizing();
+    test_twitter_example_header();
+    test_escaping();
 
     return 0;
 }
@@ -0,0 +1,130 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the resources shared between plugin handles, against the mock server
+
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../gfal_dropbox_share.h"
+#include "mock_dropbox.h"
+
+static MockDropbox* mock;
+
+
+static gfal2_context_t new_context(gboolean preconnect)
+{
+    gfal2_context_t context = gfal2_context_new(NULL);
+    gfal2_set_opt_boolean(context, "DROPBOX", "PRECONNECT", preconnect, NULL);
+    return context;
+}
+
+
+static void wait_requests(unsigned count)
+{
+    gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+    while (mock_dropbox_request_count(mock) < count && g_get_monotonic_time() < deadline)
+        g_usleep(1000);
+    g_assert(mock_dropbox_request_count(mock) == count);
+}
+
+
+void test_share_refcount()
+{
+    CURLSH* first = gfal2_dropbox_share_acquire();
+    CURLSH* second = gfal2_dropbox_share_acquire();
+    g_assert(first != NULL && first == second);
+    gfal2_dropbox_share_release(second);
+    gfal2_dropbox_share_release(first);
+
+    // Created again once all are gone
+    CURLSH* again = gfal2_dropbox_share_acquire();
+    g_assert(again != NULL);
+    gfal2_dropbox_share_release(again);
+    printf("Share refcount OK\n");
+}
+
+
+void test_share_contexts()
+{
+    GError* error = NULL;
+    gfal2_context_t contexts[3];
+    gfal_plugin_interface plugins[3];
+    int i;
+
+    for (i = 0; i < 3; ++i) {
+        contexts[i] = new_context(FALSE);
+        plugins[i] = mock_dropbox_plugin_new(mock, contexts[i]);
+    }
+    // Each one works on its own, and keeps working once the others are gone
+    for (i = 0; i < 3; ++i) {
+        struct stat st;
+        g_assert(plugins[i].statG(plugins[i].plugin_data, "dropbox://dropbox.com/share/file", &st, &error) == 0);
+        g_assert(st.st_size == 5);
+    }
+    plugins[0].plugin_delete(plugins[0].plugin_data);
+    plugins[1].plugin_delete(plugins[1].plugin_data);
+    struct stat st;
+    g_assert(plugins[2].statG(plugins[2].plugin_data, "dropbox://dropbox.com/share/file", &st, &error) == 0);
+    plugins[2].plugin_delete(plugins[2].plugin_data);
+
+    for (i = 0; i < 3; ++i) {
+        gfal2_context_free(contexts[i]);
+    }
+    printf("Share contexts OK\n");
+}
+
+
+void test_share_preconnect()
+{
+    GError* error = NULL;
+    gfal2_context_t context = new_context(TRUE);
+
+    // API and content are the same host here, so a single connection
+    unsigned requests = mock_dropbox_request_count(mock);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+    wait_requests(requests + 1);
+
+    struct stat st;
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/share/file", &st, &error) == 0);
+    g_assert(mock_dropbox_request_count(mock) == requests + 2);
+    plugin.plugin_delete(plugin.plugin_data);
+
+    // Going away while still connecting
+    plugin = mock_dropbox_plugin_new(mock, context);
+    plugin.plugin_delete(plugin.plugin_data);
+
+    gfal2_context_free(context);
+    printf("Share preconnect OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    mock = mock_dropbox_start(NULL);
+    mock_dropbox_put_file(mock, "/share/file", "hello", 5);
+
+    test_share_refcount();
+    test_share_contexts();
+    test_share_preconnect();
+
+    mock_dropbox_stop(mock);
+    return 0;
+}
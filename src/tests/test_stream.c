@@ -0,0 +1,204 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the streaming reads, against the mock server
+
+#include <fcntl.h>
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mock_dropbox.h"
+
+#define FILE_SIZE (3 * 1024 * 1024 + 123)
+
+static MockDropbox* mock;
+static gfal2_context_t context;
+static gfal_plugin_interface plugin;
+static char* content;
+
+
+static void check_content(const char* buffer, off_t offset, size_t size)
+{
+    g_assert(memcmp(buffer, content + offset, size) == 0);
+}
+
+
+void test_stream_sequential()
+{
+    GError* error = NULL;
+    gfal_file_handle fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/stream/file", O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+
+    // The open does a stat, the reads a single download
+    unsigned requests = mock_dropbox_request_count(mock);
+    char buffer[10000];
+    off_t offset = 0;
+    ssize_t ret;
+    while ((ret = plugin.readG(plugin.plugin_data, fd, buffer, sizeof(buffer), &error)) > 0) {
+        check_content(buffer, offset, ret);
+        offset += ret;
+    }
+    g_assert(ret == 0 && error == NULL);
+    g_assert(offset == FILE_SIZE);
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    plugin.closeG(plugin.plugin_data, fd, &error);
+    g_assert(error == NULL);
+    printf("Stream sequential OK\n");
+}
+
+
+void test_stream_seek()
+{
+    GError* error = NULL;
+    gfal_file_handle fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/stream/file", O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+
+    unsigned requests = mock_dropbox_request_count(mock);
+    char buffer[4096];
+    g_assert(plugin.readG(plugin.plugin_data, fd, buffer, sizeof(buffer), &error) == sizeof(buffer));
+    check_content(buffer, 0, sizeof(buffer));
+
+    // Seeking to where the stream is does not need a new request
+    plugin.lseekG(plugin.plugin_data, fd, sizeof(buffer), SEEK_SET, &error);
+    g_assert(plugin.readG(plugin.plugin_data, fd, buffer, sizeof(buffer), &error) == sizeof(buffer));
+    check_content(buffer, sizeof(buffer), sizeof(buffer));
+    g_assert(mock_dropbox_request_count(mock) == requests + 1);
+
+    // Seeking away does
+    plugin.lseekG(plugin.plugin_data, fd, 2 * 1024 * 1024, SEEK_SET, &error);
+    g_assert(plugin.readG(plugin.plugin_data, fd, buffer, sizeof(buffer), &error) == sizeof(buffer));
+    check_content(buffer, 2 * 1024 * 1024, sizeof(buffer));
+    g_assert(mock_dropbox_request_count(mock) == requests + 2);
+
+    // Closing with the download half way through
+    plugin.closeG(plugin.plugin_data, fd, &error);
+    g_assert(error == NULL);
+    printf("Stream seek OK\n");
+}
+
+
+// Reads the whole file, and returns how many requests it took
+static unsigned read_all(void)
+{
+    GError* error = NULL;
+    gfal_file_handle fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/stream/file", O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+
+    unsigned requests = mock_dropbox_request_count(mock);
+    char buffer[10000];
+    off_t offset = 0;
+    ssize_t ret;
+    while ((ret = plugin.readG(plugin.plugin_data, fd, buffer, sizeof(buffer), &error)) > 0) {
+        check_content(buffer, offset, ret);
+        offset += ret;
+    }
+    g_assert(ret == 0 && error == NULL);
+    g_assert(offset == FILE_SIZE);
+    requests = mock_dropbox_request_count(mock) - requests;
+
+    plugin.closeG(plugin.plugin_data, fd, &error);
+    g_assert(error == NULL);
+    return requests;
+}
+
+
+void test_stream_resume()
+{
+    // The connection drops half way
+    mock_dropbox_cut(mock, "/2/files/download", 1024 * 1024, 0, 1);
+    g_assert(read_all() == 2);
+
+    // The connection stalls right away, for longer than the low speed time
+    gint64 start = g_get_monotonic_time();
+    mock_dropbox_cut(mock, "/2/files/download", 0, 10000, 1);
+    g_assert(read_all() == 2);
+    g_assert(g_get_monotonic_time() - start < 5 * G_USEC_PER_SEC);
+
+    printf("Stream resume OK\n");
+}
+
+
+void test_stream_error()
+{
+    GError* error = NULL;
+    gfal_file_handle fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/stream/file", O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+
+    // Reads stick to the revision seen on open, even if the file moves
+    void* data;
+    size_t size;
+    g_assert(mock_dropbox_get_file(mock, "/stream/file", &data, &size));
+    mock_dropbox_put_folder(mock, "/stream/folder");
+    plugin.renameG(plugin.plugin_data, "dropbox://dropbox.com/stream/file", "dropbox://dropbox.com/stream/folder/file", &error);
+    g_assert(error == NULL);
+
+    char buffer[4096];
+    g_assert(plugin.readG(plugin.plugin_data, fd, buffer, sizeof(buffer), &error) == sizeof(buffer));
+    check_content(buffer, 0, sizeof(buffer));
+    plugin.closeG(plugin.plugin_data, fd, &error);
+    g_assert(error == NULL);
+
+    // But fail once it is gone
+    fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/stream/folder/file", O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+    plugin.unlinkG(plugin.plugin_data, "dropbox://dropbox.com/stream/folder/file", &error);
+    g_assert(error == NULL);
+
+    g_assert(plugin.readG(plugin.plugin_data, fd, buffer, sizeof(buffer), &error) < 0);
+    g_assert(error != NULL && error->code == ENOENT);
+    g_clear_error(&error);
+
+    plugin.closeG(plugin.plugin_data, fd, &error);
+    mock_dropbox_put_file(mock, "/stream/file", data, size);
+    g_free(data);
+    printf("Stream error OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    GError* error = NULL;
+    int i;
+
+    mock = mock_dropbox_start(NULL);
+    content = g_malloc(FILE_SIZE);
+    for (i = 0; i < FILE_SIZE; ++i) {
+        content[i] = (char)(i * 7 + i / 4096);
+    }
+    mock_dropbox_put_file(mock, "/stream/file", content, FILE_SIZE);
+
+    context = gfal2_context_new(&error);
+    // Small, so the download is paused and resumed many times
+    gfal2_set_opt_integer(context, "DROPBOX", "STREAM_BUFFER_SIZE", 64 * 1024, NULL);
+    // Give up quickly on stalls
+    gfal2_set_opt_integer(context, "DROPBOX", "LOW_SPEED_TIME", 1, NULL);
+    plugin = mock_dropbox_plugin_new(mock, context);
+
+    test_stream_sequential();
+    test_stream_seek();
+    test_stream_resume();
+    test_stream_error();
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    mock_dropbox_stop(mock);
+    g_free(content);
+    return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the access token refresh, against a local stand-in token endpoint
+
+#include "../gfal_dropbox_token.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <glib.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "test_help.h"
+
+
+static int server_fd;
+static int server_port;
+static volatile int server_hits = 0;
+static volatile int server_expires_in = 3600;
+// Answered instead of a token if not 200
+static volatile int server_status = 200;
+
+
+// Answers each connection with a new token, slowly enough for concurrent callers to pile up
+static gpointer token_endpoint(gpointer data)
+{
+    while (1) {
+        int client = accept(server_fd, NULL, NULL);
+        if (client < 0)
+            break;
+
+        char request[4096];
+        ssize_t received = 0, r;
+        while ((r = recv(client, request + received, sizeof(request) - received - 1, 0)) > 0) {
+            received += r;
+            request[received] = '\0';
+            char *body = strstr(request, "\r\n\r\n");
+            if (body && strstr(request, "grant_type=refresh_token"))
+                break;
+        }
+
+        int hit = g_atomic_int_add(&server_hits, 1) + 1;
+        g_usleep(200000);
+
+        char body[256], response[512];
+        int status = server_status;
+        if (status == 200) {
+            snprintf(body, sizeof(body), "{\"access_token\": \"token-%d\", \"token_type\": \"bearer\", \"expires_in\": %d}",
+                hit, server_expires_in);
+        }
+        else {
+            snprintf(body, sizeof(body), "{\"error\": \"server_error\"}");
+        }
+        snprintf(response, sizeof(response),
+            "HTTP/1.1 %d Status\r\nContent-Type: application/json\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s",
+            status, strlen(body), body);
+        send(client, response, strlen(response), 0);
+        close(client);
+    }
+    return NULL;
+}
+
+
+static void start_token_endpoint()
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    g_assert(listen(server_fd, 64) == 0);
+    getsockname(server_fd, (struct sockaddr*)&addr, &addr_len);
+    server_port = ntohs(addr.sin_port);
+
+    g_thread_new("token_endpoint", token_endpoint, NULL);
+}
+
+
+static void setup_config(DropboxTokenConfig* config, char* url, size_t url_size, const char* refresh_token)
+{
+    snprintf(url, url_size, "http://127.0.0.1:%d/oauth2/token", server_port);
+    config->token_url = url;
+    config->app_key = "key";
+    config->app_secret = "secret";
+    config->refresh_token = refresh_token;
+    config->refresh_margin = 60;
+}
+
+
+void test_token_cached()
+{
+    GError* error = NULL;
+    char url[128];
+    DropboxTokenConfig config;
+    setup_config(&config, url, sizeof(url), "cached");
+
+    int hits = server_hits;
+    char* first = gfal2_dropbox_token_get(&config, &error);
+    g_assert(first != NULL && error == NULL);
+    char* second = gfal2_dropbox_token_get(&config, &error);
+    g_assert(second != NULL && error == NULL);
+
+    ASSERT_STR_EQ(first, second);
+    g_assert(server_hits == hits + 1);
+
+    g_free(first);
+    g_free(second);
+    printf("Token cached OK\n");
+}
+
+
+void test_token_invalidate()
+{
+    GError* error = NULL;
+    char url[128];
+    DropboxTokenConfig config;
+    setup_config(&config, url, sizeof(url), "invalidate");
+
+    char* first = gfal2_dropbox_token_get(&config, &error);
+    g_assert(first != NULL);
+
+    // Invalidating an old token must not trigger a refresh
+    gfal2_dropbox_token_invalidate(&config, "something-else");
+    char* second = gfal2_dropbox_token_get(&config, &error);
+    ASSERT_STR_EQ(first, second);
+
+    gfal2_dropbox_token_invalidate(&config, first);
+    char* third = gfal2_dropbox_token_get(&config, &error);
+    g_assert(third != NULL && strcmp(first, third) != 0);
+
+    g_free(first);
+    g_free(second);
+    g_free(third);
+    printf("Token invalidate OK\n");
+}
+
+
+void test_token_proactive()
+{
+    GError* error = NULL;
+    char url[128];
+    DropboxTokenConfig config;
+    setup_config(&config, url, sizeof(url), "proactive");
+
+    // Tokens expiring within the margin are replaced before they expire
+    server_expires_in = 30;
+    char* first = gfal2_dropbox_token_get(&config, &error);
+    char* second = gfal2_dropbox_token_get(&config, &error);
+    server_expires_in = 3600;
+    char* third = gfal2_dropbox_token_get(&config, &error);
+    char* fourth = gfal2_dropbox_token_get(&config, &error);
+
+    g_assert(strcmp(first, second) != 0);
+    g_assert(strcmp(second, third) != 0);
+    ASSERT_STR_EQ(third, fourth);
+
+    g_free(first);
+    g_free(second);
+    g_free(third);
+    g_free(fourth);
+    printf("Token proactive refresh OK\n");
+}
+
+
+static gpointer concurrent_get(gpointer data)
+{
+    GError* error = NULL;
+    char* token = gfal2_dropbox_token_get((DropboxTokenConfig*)data, &error);
+    g_assert(token != NULL && error == NULL);
+    return token;
+}
+
+
+void test_token_single_flight()
+{
+    GError* error = NULL;
+    char url[128];
+    DropboxTokenConfig config;
+    setup_config(&config, url, sizeof(url), "single-flight");
+
+    char* initial = gfal2_dropbox_token_get(&config, &error);
+    gfal2_dropbox_token_invalidate(&config, initial);
+
+    int hits = server_hits;
+    GThread* threads[16];
+    char* tokens[16];
+    int i;
+    for (i = 0; i < 16; ++i) {
+        threads[i] = g_thread_new("getter", concurrent_get, &config);
+    }
+    for (i = 0; i < 16; ++i) {
+        tokens[i] = g_thread_join(threads[i]);
+    }
+
+    g_assert(server_hits == hits + 1);
+    for (i = 0; i < 16; ++i) {
+        ASSERT_STR_EQ(tokens[0], tokens[i]);
+    }
+    g_assert(strcmp(initial, tokens[0]) != 0);
+
+    for (i = 0; i < 16; ++i) {
+        g_free(tokens[i]);
+    }
+    g_free(initial);
+    printf("Token single flight OK\n");
+}
+
+
+static gpointer concurrent_get_failing(gpointer data)
+{
+    GError* error = NULL;
+    char* token = gfal2_dropbox_token_get((DropboxTokenConfig*)data, &error);
+    g_assert(token == NULL && error != NULL && error->code == EIO);
+    g_error_free(error);
+    return NULL;
+}
+
+
+void test_token_single_flight_failure()
+{
+    GError* error = NULL;
+    char url[128];
+    DropboxTokenConfig config;
+    setup_config(&config, url, sizeof(url), "single-flight-failure");
+
+    char* initial = gfal2_dropbox_token_get(&config, &error);
+    gfal2_dropbox_token_invalidate(&config, initial);
+
+    // All of them get the error of the one refresh
+    server_status = 500;
+    int hits = server_hits;
+    GThread* threads[16];
+    int i;
+    for (i = 0; i < 16; ++i) {
+        threads[i] = g_thread_new("getter", concurrent_get_failing, &config);
+    }
+    for (i = 0; i < 16; ++i) {
+        g_thread_join(threads[i]);
+    }
+    g_assert(server_hits == hits + 1);
+
+    // And so do those coming right after
+    concurrent_get_failing(&config);
+    g_assert(server_hits == hits + 1);
+    server_status = 200;
+
+    g_free(initial);
+    printf("Token single flight failure OK\n");
+}
+
+
+void test_token_endpoint_down()
+{
+    GError* error = NULL;
+    DropboxTokenConfig config = {
+        "http://127.0.0.1:1/oauth2/token", "key", "secret", "down", 60
+    };
+
+    char* token = gfal2_dropbox_token_get(&config, &error);
+    g_assert(token == NULL && error != NULL);
+    g_error_free(error);
+
+    printf("Token endpoint down OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    start_token_endpoint();
+    test_token_cached();
+    test_token_invalidate();
+    test_token_proactive();
+    test_token_single_flight();
+    test_token_single_flight_failure();
+    test_token_endpoint_down();
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the request tracing, against the mock server
+
+#include "../gfal_dropbox_trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <json.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mock_dropbox.h"
+#include "test_help.h"
+
+static MockDropbox* mock;
+static char* trace_path;
+
+
+// Parses the records of the trace file, each a whole line
+// There must be expected of them, unless it is negative
+// Returns the records, to be freed with json_object_put
+static json_object* read_records(int expected)
+{
+    char* text = NULL;
+    size_t length = 0;
+    g_assert(g_file_get_contents(trace_path, &text, &length, NULL));
+    g_assert(length > 0 && text[length - 1] == '\n');
+
+    json_object* records = json_object_new_array();
+    char** lines = g_strsplit(text, "\n", -1);
+    int i;
+    for (i = 0; lines[i] && lines[i][0]; ++i) {
+        json_object* record = json_tokener_parse(lines[i]);
+        g_assert(record != NULL && json_object_is_type(record, json_type_object));
+        json_object_array_add(records, record);
+    }
+    g_assert(expected < 0 || json_object_array_length(records) == (size_t)expected);
+
+    g_strfreev(lines);
+    g_free(text);
+    unlink(trace_path);
+    return records;
+}
+
+
+static const char* record_string(json_object* record, const char* key)
+{
+    json_object* value = NULL;
+    g_assert(json_object_object_get_ex(record, key, &value));
+    return json_object_get_string(value);
+}
+
+
+static gint64 record_int(json_object* record, const char* key)
+{
+    json_object* value = NULL;
+    g_assert(json_object_object_get_ex(record, key, &value));
+    return json_object_get_int64(value);
+}
+
+
+// Each request done by the plugin is a record
+void test_trace_requests()
+{
+    GError* error = NULL;
+    gfal2_context_t context = gfal2_context_new(&error);
+    gfal2_set_opt_string(context, "DROPBOX", "TRACE_FILE", trace_path, NULL);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    struct stat st;
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/traced/file", &st, &error) == 0);
+    g_assert(plugin.statG(plugin.plugin_data, "dropbox://dropbox.com/traced/missing", &st, &error) < 0);
+    g_assert(error->code == ENOENT);
+    g_clear_error(&error);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+
+    json_object* records = read_records(2);
+    json_object* found = json_object_array_get_idx(records, 0);
+    json_object* missing = json_object_array_get_idx(records, 1);
+
+    ASSERT_STR_EQ(record_string(found, "method"), "POST");
+    g_assert(g_str_has_suffix(record_string(found, "endpoint"), "/2/files/get_metadata"));
+    g_assert(record_int(found, "status") == 200);
+    g_assert(record_int(found, "errno") == 0);
+    g_assert(record_int(found, "bytes_down") > 0);
+    g_assert(record_int(found, "total") >= record_int(found, "starttransfer"));
+
+    g_assert(record_int(missing, "status") == 409);
+    g_assert(record_int(missing, "errno") == ENOENT);
+
+    json_object_put(records);
+    printf("Trace requests OK\n");
+}
+
+
+// Returns the highest retry count among the records of requests to endpoint
+static gint64 max_retries(json_object* records, const char* endpoint)
+{
+    gint64 retries = -1;
+    size_t i;
+    for (i = 0; i < json_object_array_length(records); ++i) {
+        json_object* record = json_object_array_get_idx(records, i);
+        if (g_str_has_suffix(record_string(record, "endpoint"), endpoint))
+            retries = MAX(retries, record_int(record, "retries"));
+    }
+    return retries;
+}
+
+
+// Requests sent again by the upload and download retries count as such
+void test_trace_retries()
+{
+    GError* error = NULL;
+    gfal2_context_t context = gfal2_context_new(&error);
+    gfal2_set_opt_string(context, "DROPBOX", "TRACE_FILE", trace_path, NULL);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    mock_dropbox_fail(mock, "/2/files/upload_session/finish", 500, 1);
+    gfal_file_handle fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/traced/upload",
+        O_WRONLY | O_CREAT, 0644, &error);
+    g_assert(fd != NULL);
+    g_assert(plugin.writeG(plugin.plugin_data, fd, "data", 4, &error) == 4);
+    g_assert(plugin.closeG(plugin.plugin_data, fd, &error) == 0);
+
+    char content[64 * 1024];
+    memset(content, 'x', sizeof(content));
+    mock_dropbox_put_file(mock, "/traced/download", content, sizeof(content));
+    mock_dropbox_cut(mock, "/2/files/download", 1024, 0, 1);
+    fd = plugin.openG(plugin.plugin_data, "dropbox://dropbox.com/traced/download", O_RDONLY, 0, &error);
+    g_assert(fd != NULL);
+    size_t total = 0;
+    ssize_t n;
+    while ((n = plugin.readG(plugin.plugin_data, fd, content, sizeof(content), &error)) > 0)
+        total += n;
+    g_assert(n == 0 && total == sizeof(content));
+    g_assert(plugin.closeG(plugin.plugin_data, fd, &error) == 0);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+
+    json_object* records = read_records(-1);
+    g_assert(max_retries(records, "/2/files/upload_session/finish") == 1);
+    g_assert(max_retries(records, "/2/files/download") == 1);
+    g_assert(max_retries(records, "/2/files/get_metadata") == 0);
+
+    json_object_put(records);
+    printf("Trace retries OK\n");
+}
+
+
+static size_t discard(char* data, size_t size, size_t nmemb, void* user_data)
+{
+    return size * nmemb;
+}
+
+
+// The query is left out, and what would break the JSON string is escaped
+void test_trace_endpoint()
+{
+    GError* error = NULL;
+    DropboxTrace* trace = gfal2_dropbox_trace_open(trace_path, &error);
+    g_assert(trace != NULL && error == NULL);
+
+    char url[256];
+    snprintf(url, sizeof(url), "%s/2/files/\"quoted\"?access_token=secret", mock_dropbox_url(mock));
+    CURL* easy = curl_easy_init();
+    curl_easy_setopt(easy, CURLOPT_URL, url);
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDS, "");
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, discard);
+    g_assert(curl_easy_perform(easy) == CURLE_OK);
+
+    gfal2_dropbox_trace_request(trace, easy, "POST", 2, EIO);
+    curl_easy_cleanup(easy);
+    gfal2_dropbox_trace_close(trace);
+
+    json_object* records = read_records(1);
+    json_object* record = json_object_array_get_idx(records, 0);
+    const char* endpoint = record_string(record, "endpoint");
+    g_assert(g_str_has_suffix(endpoint, "/2/files/\"quoted\""));
+    g_assert(strstr(endpoint, "secret") == NULL);
+    g_assert(record_int(record, "status") == 404);
+    g_assert(record_int(record, "retries") == 2);
+    g_assert(record_int(record, "errno") == EIO);
+
+    json_object_put(records);
+    printf("Trace endpoint OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    mock = mock_dropbox_start(NULL);
+    mock_dropbox_put_file(mock, "/traced/file", "data", 4);
+    char* dir = g_dir_make_tmp("gfal2_dropbox_trace_XXXXXX", NULL);
+    trace_path = g_build_filename(dir, "trace", NULL);
+
+    test_trace_requests();
+    test_trace_endpoint();
+    test_trace_retries();
+
+    rmdir(dir);
+    g_free(trace_path);
+    g_free(dir);
+    mock_dropbox_stop(mock);
+    return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ *  Copyright 2014 CERN
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+**/
+
+// Code to test the upload staging and retries, against the mock server
+
+#include "../gfal_dropbox_staging.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <gfal_api.h>
+#include <gfal_plugins_api.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mock_dropbox.h"
+
+#define FILE_SIZE (9 * 1024 * 1024 + 321)
+
+static MockDropbox* mock;
+static char* content;
+
+
+static gfal2_context_t upload_context(int chunk_size)
+{
+    gfal2_context_t context = gfal2_context_new(NULL);
+    gfal2_set_opt_integer(context, "DROPBOX", "UPLOAD_CHUNK_SIZE", chunk_size, NULL);
+    // Force the spill to disk
+    gfal2_set_opt_integer(context, "DROPBOX", "STAGING_MEMORY", 1024 * 1024, NULL);
+    return context;
+}
+
+
+// Returns the result of the close
+static int upload(gfal_plugin_interface* plugin, const char* url, const char* data, size_t block_size)
+{
+    GError* error = NULL;
+    gfal_file_handle fd = plugin->openG(plugin->plugin_data, url, O_WRONLY | O_CREAT, 0644, &error);
+    g_assert(fd != NULL);
+
+    size_t offset = 0;
+    while (offset < FILE_SIZE) {
+        size_t count = MIN(block_size, FILE_SIZE - offset);
+        g_assert(plugin->writeG(plugin->plugin_data, fd, data + offset, count, &error) == (ssize_t)count);
+        offset += count;
+    }
+    int ret = plugin->closeG(plugin->plugin_data, fd, &error);
+    g_assert((ret == 0) == (error == NULL));
+    g_clear_error(&error);
+    return ret;
+}
+
+
+static void check_uploaded(const char* path, const char* content)
+{
+    void* data;
+    size_t size;
+    g_assert(mock_dropbox_get_file(mock, path, &data, &size));
+    g_assert(size == FILE_SIZE);
+    g_assert(memcmp(data, content, size) == 0);
+    g_free(data);
+}
+
+
+void test_staging_spill()
+{
+    GError* error = NULL;
+    DropboxStaging* staging = gfal2_dropbox_staging_new(1000, 100, NULL);
+
+    int round;
+    for (round = 0; round < 2; ++round) {
+        size_t total = 0;
+        while (!gfal2_dropbox_staging_full(staging)) {
+            ssize_t n = gfal2_dropbox_staging_append(staging, content + total, 30, &error);
+            g_assert(n > 0 && error == NULL);
+            total += n;
+        }
+        g_assert(total == 1000);
+        g_assert(gfal2_dropbox_staging_append(staging, content, 30, &error) == 0);
+        g_assert(gfal2_dropbox_staging_length(staging) == 1000);
+        g_assert(memcmp(gfal2_dropbox_staging_data(staging), content, 1000) == 0);
+        gfal2_dropbox_staging_reset(staging);
+        g_assert(gfal2_dropbox_staging_length(staging) == 0);
+    }
+
+    gfal2_dropbox_staging_free(staging);
+    printf("Staging spill OK\n");
+}
+
+
+void test_upload_staged_retry()
+{
+    gfal2_context_t context = upload_context(1);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    // One chunk fails, and the response to another one gets lost
+    mock_dropbox_fail(mock, "/2/files/upload_session/append_v2", 500, 1);
+    g_assert(upload(&plugin, "dropbox://dropbox.com/upload/staged", content, 100 * 1024) == 0);
+    check_uploaded("/upload/staged", content);
+
+    mock_dropbox_fail(mock, "/2/files/upload_session/append_v2", 0, 1);
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(upload(&plugin, "dropbox://dropbox.com/upload/lost", content, 1024 * 1024 + 7) == 0);
+    check_uploaded("/upload/lost", content);
+    // stat, start, two chunks, the lost one being resent, and finish
+    g_assert(mock_dropbox_request_count(mock) == requests + 6);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("Upload staged retry OK\n");
+}
+
+
+void test_upload_direct_retry()
+{
+    gfal2_context_t context = upload_context(0);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    mock_dropbox_fail(mock, "/2/files/upload_session/append_v2", 429, 2);
+    g_assert(upload(&plugin, "dropbox://dropbox.com/upload/direct", content, 3 * 1024 * 1024) == 0);
+    check_uploaded("/upload/direct", content);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    printf("Upload direct retry OK\n");
+}
+
+
+static int count_journals(const char* dir)
+{
+    int count = 0;
+    DIR* dirp = opendir(dir);
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != NULL) {
+        if (entry->d_name[0] != '.')
+            ++count;
+    }
+    closedir(dirp);
+    return count;
+}
+
+
+void test_upload_resume()
+{
+    char journal_dir[] = "/tmp/test_upload_journal_XXXXXX";
+    g_assert(mkdtemp(journal_dir) != NULL);
+
+    // Same data, but for the first byte
+    char* other = g_malloc(FILE_SIZE);
+    memcpy(other, content, FILE_SIZE);
+    other[0] = ~other[0];
+
+    gfal2_context_t context = upload_context(1);
+    gfal2_set_opt_string(context, "DROPBOX", "JOURNAL_DIR", journal_dir, NULL);
+    gfal2_set_opt_integer(context, "DROPBOX", "UPLOAD_RETRIES", 0, NULL);
+    gfal_plugin_interface plugin = mock_dropbox_plugin_new(mock, context);
+
+    // Interrupted before the last chunk, so only that one is sent again
+    mock_dropbox_fail(mock, "/2/files/upload_session/finish", 500, 1);
+    g_assert(upload(&plugin, "dropbox://dropbox.com/upload/resumed", content, 1024 * 1024) < 0);
+    g_assert(count_journals(journal_dir) == 1);
+
+    unsigned requests = mock_dropbox_request_count(mock);
+    g_assert(upload(&plugin, "dropbox://dropbox.com/upload/resumed", content, 1024 * 1024) == 0);
+    check_uploaded("/upload/resumed", content);
+    // stat, the check of the session, and finish
+    g_assert(mock_dropbox_request_count(mock) == requests + 3);
+    g_assert(count_journals(journal_dir) == 0);
+
+    // Something else written to the same destination starts over
+    mock_dropbox_fail(mock, "/2/files/upload_session/finish", 500, 1);
+    g_assert(upload(&plugin, "dropbox://dropbox.com/upload/replaced", content, 1024 * 1024) < 0);
+    g_assert(upload(&plugin, "dropbox://dropbox.com/upload/replaced", other, 3 * 1024 * 1024) == 0);
+    check_uploaded("/upload/replaced", other);
+    g_assert(count_journals(journal_dir) == 0);
+
+    plugin.plugin_delete(plugin.plugin_data);
+    gfal2_context_free(context);
+    rmdir(journal_dir);
+    g_free(other);
+    printf("Upload resume OK\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    int i;
+
+    mock = mock_dropbox_start(NULL);
+    content = g_malloc(FILE_SIZE);
+    for (i = 0; i < FILE_SIZE; ++i) {
+        content[i] = (char)(i * 13 + i / 1000);
+    }
+    // Files are committed in "add" mode, so they must be new, or the same
+    mock_dropbox_put_folder(mock, "/upload");
+
+    test_staging_spill();
+    test_upload_staged_retry();
+    test_upload_direct_retry();
+    test_upload_resume();
+
+    mock_dropbox_stop(mock);
+    g_free(content);
+    return 0;
+}